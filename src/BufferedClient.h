@@ -0,0 +1,105 @@
+#ifndef BUFFERED_CLIENT_H
+#define BUFFERED_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include "Scheduler.h"
+
+#define bufferedClientSize 1436 // One TCP segment at the usual MSS
+#define bufferedClientDelay 5   // Longest a write may wait, in ms
+
+// Write-combining client. PubSubClient writes the header and payload of every
+// packet separately, so a burst of publishes would otherwise go out as many
+// tiny segments. Writes are collected here and sent when the buffer fills,
+// when the first buffered byte has waited bufferedClientDelay, before any
+// read (so a request is never stuck behind its own response) or on flush(),
+// which StandardFeatures calls at the end of every loop().
+//
+// flush() only sends what is buffered. It deliberately doesn't forward to
+// WiFiClient::flush(), which discards unread input.
+class BufferedClient : public Client
+{
+public:
+    BufferedClient(Client &client) : _client(client)
+    {
+        _flushTimer.setCallback(Timer::method<BufferedClient, &BufferedClient::flush>, this);
+    }
+
+    int connect(IPAddress ip, uint16_t port) { discard(); return _client.connect(ip, port); }
+    int connect(const char *host, uint16_t port) { discard(); return _client.connect(host, port); }
+    void stop() { flush(); _client.stop(); }  // Lets a final DISCONNECT out
+    uint8_t connected() { return _client.connected(); }
+    operator bool() { return (bool)_client; }
+
+    size_t write(uint8_t b) { return write(&b, 1); }
+
+    size_t write(const uint8_t *buf, size_t size)
+    {
+        if (_length + size > sizeof(_buffer))
+            flush();
+
+        // Too big to be worth copying
+        if (size > sizeof(_buffer))
+            return send(buf, size) ? size : 0;
+
+        memcpy(&_buffer[_length], buf, size);
+        _length += size;
+
+        if (_length == sizeof(_buffer))
+            flush();
+        else if (!_flushTimer.isPending())
+            _flushTimer.start(bufferedClientDelay);
+
+        return size;
+    }
+
+    void flush()
+    {
+        _flushTimer.stop();
+
+        if (_length == 0)
+            return;
+
+        send(_buffer, _length);
+        _length = 0;
+    }
+
+    int available() { flush(); return _client.available(); }
+    int read() { flush(); return _client.read(); }
+    int read(uint8_t *buf, size_t size) { flush(); return _client.read(buf, size); }
+    int peek() { flush(); return _client.peek(); }
+
+    uint32_t segments() { return _segments; }
+    uint32_t bytes() { return _bytes; }
+
+private:
+    Client &_client;
+    Timer _flushTimer;
+    uint8_t _buffer[bufferedClientSize];
+    size_t _length = 0;
+    uint32_t _segments = 0;
+    uint32_t _bytes = 0;
+
+    bool send(const uint8_t *buf, size_t size)
+    {
+        _segments++;
+        _bytes += size;
+
+        // PubSubClient already got its bytes accepted, so a failed send can
+        // only be reported by dropping the connection for it to notice
+        if (_client.write(buf, size) != size)
+        {
+            _client.stop();
+            return false;
+        }
+        return true;
+    }
+
+    void discard()
+    {
+        _flushTimer.stop();
+        _length = 0;
+    }
+};
+
+#endif // BUFFERED_CLIENT_H
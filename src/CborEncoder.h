@@ -0,0 +1,77 @@
+#ifndef CBOR_ENCODER_H
+#define CBOR_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal RFC 8949 encoder writing into a caller supplied buffer. The event
+// payloads are maps of unsigned integers, so those are the only types it
+// writes. Nothing is allocated; if the buffer runs out the encoder stops
+// writing and ok() returns false.
+class CborEncoder
+{
+public:
+    CborEncoder(uint8_t *buffer, size_t size) : _buffer(buffer), _size(size) {}
+
+    void beginMap(uint8_t pairs) { writeHead(MAJOR_MAP, pairs); }
+    void writeUInt(uint64_t value) { writeHead(MAJOR_UINT, value); }
+
+    bool ok() { return !_overflow; }
+    size_t length() { return _position; }
+
+private:
+    static const uint8_t MAJOR_UINT = 0 << 5;
+    static const uint8_t MAJOR_MAP = 5 << 5;
+
+    uint8_t *_buffer;
+    size_t _size;
+    size_t _position = 0;
+    bool _overflow = false;
+
+    void writeByte(uint8_t b)
+    {
+        if (_position >= _size)
+        {
+            _overflow = true;
+            return;
+        }
+        _buffer[_position++] = b;
+    }
+
+    // Major type plus argument, using the shortest encoding that fits
+    void writeHead(uint8_t major, uint64_t value)
+    {
+        uint8_t bytes;
+
+        if (value < 24)
+        {
+            writeByte(major | value);
+            return;
+        }
+        else if (value <= 0xFF)
+        {
+            writeByte(major | 24);
+            bytes = 1;
+        }
+        else if (value <= 0xFFFF)
+        {
+            writeByte(major | 25);
+            bytes = 2;
+        }
+        else if (value <= 0xFFFFFFFF)
+        {
+            writeByte(major | 26);
+            bytes = 4;
+        }
+        else
+        {
+            writeByte(major | 27);
+            bytes = 8;
+        }
+
+        while (bytes-- > 0)
+            writeByte(value >> (bytes * 8));
+    }
+};
+
+#endif // CBOR_ENCODER_H
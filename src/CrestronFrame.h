@@ -0,0 +1,142 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __CRESTRON_FRAME_H_
+#define __CRESTRON_FRAME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// A literal and its length, for the pattern table
+#define CRESTRON_PREFIX(text) text, sizeof(text) - 1
+
+// Recognises the frames a Texecom panel sends on its Crestron port. Kept free
+// of Arduino headers so captured serial streams and syslog files can be run
+// through the same parser on the host, see tools/logscan.
+//
+// Frames are given without their CRLF and needn't be terminated.
+class CrestronFrame {
+public:
+  // Same bits as Texecom::ZONE_FLAGS
+  static const uint8_t ZONE_ACTIVE = 1 << 0;
+  static const uint8_t ZONE_TAMPER = 1 << 1;
+
+  typedef enum {
+      UNKNOWN = 0,
+      ZONE_UPDATE,            // "Z0zzzs
+      ARM_UPDATE,             // "A0, into whichever mode the last question asked
+      DISARM_UPDATE,
+      ENTRY_UPDATE,
+      ARMING_UPDATE,
+      INTRUDER_UPDATE,
+      USER_PIN_LOGIN,         // "U0 and "T0, user number at [4]
+      USER_TAG_LOGIN,
+      REPLY_DISARMED,         // Replies to ASTATUS
+      REPLY_ARMED,
+      SCREEN_ARMED_PART,      // Part, night or idle part armed screens
+      SCREEN_ARMED_FULL,
+      SCREEN_IDLE,
+      SCREEN_WELCOME_BACK,
+      QUESTION_ARM,
+      QUESTION_PART_ARM,
+      QUESTION_NIGHT_ARM,
+      QUESTION_DISARM,
+      SCREEN_AREA_IN_ENTRY,
+      SCREEN_AREA_IN_EXIT,
+      TYPE_COUNT
+  } TYPE;
+
+  typedef struct {
+      TYPE type;
+      uint16_t zone;          // Panel zone number, ZONE_UPDATE only
+      uint8_t zoneState;      // 0 healthy, 1 active, 2 tamper
+      uint8_t user;           // USER_PIN_LOGIN and USER_TAG_LOGIN only
+  } FRAME;
+
+  static FRAME parse(const char *message, size_t length)
+  {
+      FRAME frame = {UNKNOWN, 0, 0, 0};
+
+      if (length < 2 || message[0] != '"')
+          return frame;
+
+      // Checked in order, the first match wins
+      static const PATTERN patterns[] = {
+          {CRESTRON_PREFIX("\"Z0"), 6, 6, ZONE_UPDATE},
+          {CRESTRON_PREFIX("\"A0"), 6, 255, ARM_UPDATE},
+          {CRESTRON_PREFIX("\"D0"), 6, 255, DISARM_UPDATE},
+          {CRESTRON_PREFIX("\"E0"), 6, 6, ENTRY_UPDATE},
+          {CRESTRON_PREFIX("\"X0"), 6, 6, ARMING_UPDATE},
+          {CRESTRON_PREFIX("\"L0"), 6, 6, INTRUDER_UPDATE},
+          {CRESTRON_PREFIX("\"U0"), 6, 6, USER_PIN_LOGIN},
+          {CRESTRON_PREFIX("\"T0"), 6, 6, USER_TAG_LOGIN},
+          {CRESTRON_PREFIX("\"N"), 5, 5, REPLY_DISARMED},
+          {CRESTRON_PREFIX("\"Y"), 5, 5, REPLY_ARMED},
+          {CRESTRON_PREFIX("\"Part"), 0, 255, SCREEN_ARMED_PART},
+          {CRESTRON_PREFIX("\"Night"), 0, 255, SCREEN_ARMED_PART},
+          {CRESTRON_PREFIX("\" * PART ARMED *"), 0, 255, SCREEN_ARMED_PART},
+          {CRESTRON_PREFIX("\"Area FULL ARMED"), 0, 255, SCREEN_ARMED_FULL},
+          {CRESTRON_PREFIX("\"  The Cooper's"), 0, 255, SCREEN_IDLE},
+          {CRESTRON_PREFIX("\"  Welcome Back"), 16, 255, SCREEN_WELCOME_BACK},
+          {CRESTRON_PREFIX("\"Do you want to  Arm System?"), 0, 255, QUESTION_ARM},
+          {CRESTRON_PREFIX("\"Do you want to  Part Arm System?"), 0, 255, QUESTION_PART_ARM},
+          {CRESTRON_PREFIX("\"Do you want:-   Night Arm"), 0, 255, QUESTION_NIGHT_ARM},
+          {CRESTRON_PREFIX("\"Do you want to  Disarm System?"), 0, 255, QUESTION_DISARM},
+          {CRESTRON_PREFIX("\"Area in Entry"), 0, 255, SCREEN_AREA_IN_ENTRY},
+          {CRESTRON_PREFIX("\"Area in Exit >"), 0, 255, SCREEN_AREA_IN_EXIT},
+      };
+
+      for (const PATTERN &pattern : patterns)
+      {
+          if (length < pattern.prefixLength || length < pattern.minLength || length > pattern.maxLength ||
+              memcmp(message, pattern.prefix, pattern.prefixLength) != 0)
+              continue;
+
+          frame.type = pattern.type;
+          break;
+      }
+
+      if (frame.type == ZONE_UPDATE)
+      {
+          // Three digits, read like atoi() would
+          for (size_t i = 2; i < 5 && message[i] >= '0' && message[i] <= '9'; i++)
+              frame.zone = frame.zone * 10 + (message[i] - '0');
+          frame.zoneState = message[5] - '0';
+      }
+      else if (frame.type == USER_PIN_LOGIN || frame.type == USER_TAG_LOGIN)
+      {
+          frame.user = message[4] - '0';
+      }
+
+      return frame;
+  }
+
+  // The zone flags after a zone update, unknown states leave them alone
+  static uint8_t applyZoneState(uint8_t flags, uint8_t zoneState)
+  {
+      switch (zoneState)
+      {
+      case 0: // Healthy
+          return flags & ~(ZONE_ACTIVE | ZONE_TAMPER);
+      case 1: // Active
+          return (flags | ZONE_ACTIVE) & ~ZONE_TAMPER;
+      case 2: // Tamper
+          return (flags | ZONE_TAMPER) & ~ZONE_ACTIVE;
+      default:
+          return flags;
+      }
+  }
+
+private:
+  typedef struct {
+      const char *prefix;
+      uint8_t prefixLength;
+      uint8_t minLength;      // Whole frame, the prefix length always applies
+      uint8_t maxLength;
+      TYPE type;
+  } PATTERN;
+};
+
+#undef CRESTRON_PREFIX
+
+#endif  // __CRESTRON_FRAME_H_
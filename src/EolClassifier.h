@@ -0,0 +1,82 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __EOL_CLASSIFIER_H_
+#define __EOL_CLASSIFIER_H_
+
+#include <stdint.h>
+
+// Classifies the voltage across an end-of-line resistor zone. Kept free of
+// Arduino headers so recorded sample streams can be replayed on the host,
+// see tools/eolreplay.
+//
+// The default bands suit a 4k7 pull-up to 3.3V with a 4k7 EOL resistor and a
+// 4k7 alarm resistor across the contact: about 1650mV healthy and 2200mV
+// active. A short reads near 0V and a cut wire near the supply, both are
+// tamper. Anything else between the bands is a fault.
+class EolClassifier {
+public:
+  // Same bits as Texecom::ZONE_FLAGS
+  static const uint8_t ZONE_ACTIVE = 1 << 0;
+  static const uint8_t ZONE_TAMPER = 1 << 1;
+  static const uint8_t ZONE_FAULT = 1 << 2;
+
+  typedef struct {
+      uint16_t shortBelow;      // mV
+      uint16_t healthyBelow;
+      uint16_t activeBelow;
+      uint16_t openAbove;
+  } THRESHOLDS;
+
+  static constexpr THRESHOLDS defaultThresholds = {600, 1925, 2600, 3000};
+
+  EolClassifier(const THRESHOLDS &thresholds = defaultThresholds, uint8_t stableSamples = 3)
+      : thresholds(thresholds), stableSamples(stableSamples) {}
+
+  static uint8_t classify(const THRESHOLDS &thresholds, uint16_t millivolts)
+  {
+      if (millivolts < thresholds.shortBelow)
+          return ZONE_TAMPER;
+      if (millivolts < thresholds.healthyBelow)
+          return 0;
+      if (millivolts < thresholds.activeBelow)
+          return ZONE_ACTIVE;
+      if (millivolts < thresholds.openAbove)
+          return ZONE_FAULT;
+      return ZONE_TAMPER;
+  }
+
+  // Feeds one averaged sample, returns true when the debounced state changes
+  bool update(uint16_t millivolts)
+  {
+      uint8_t sample = classify(thresholds, millivolts);
+
+      if (sample != candidate)
+      {
+          candidate = sample;
+          candidateCount = 0;
+      }
+
+      if (candidateCount < stableSamples)
+          candidateCount++;
+
+      if (candidateCount >= stableSamples && (candidate != current || !known))
+      {
+          current = candidate;
+          known = true;
+          return true;
+      }
+      return false;
+  }
+
+  uint8_t state() { return current; }
+
+private:
+  THRESHOLDS thresholds;
+  uint8_t stableSamples;
+  uint8_t candidate = 0;
+  uint8_t candidateCount = 0;
+  uint8_t current = 0;
+  bool known = false;   // Reports the first stable state too, so it gets published
+};
+
+#endif  // __EOL_CLASSIFIER_H_
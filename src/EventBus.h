@@ -0,0 +1,62 @@
+#ifndef EVENT_BUS_H
+#define EVENT_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Fixed capacity publish/subscribe dispatcher for small POD events.
+// Subscribers are plain function pointers with an optional context pointer,
+// stored in a static table, so publishing never allocates. Handlers run
+// synchronously in the publisher's task; a sink that needs to do slow work
+// should hand the event on to its own queue.
+template <typename EVENT, uint8_t MAX_SUBSCRIBERS>
+class EventBus
+{
+public:
+    typedef void (*Handler)(const EVENT &event, void *context);
+
+    bool subscribe(Handler handler, void *context = NULL)
+    {
+        if (_count >= MAX_SUBSCRIBERS)
+            return false;
+
+        _subscribers[_count].handler = handler;
+        _subscribers[_count].context = context;
+        _count++;
+        return true;
+    }
+
+    bool unsubscribe(Handler handler, void *context = NULL)
+    {
+        for (uint8_t i = 0; i < _count; i++)
+        {
+            if (_subscribers[i].handler == handler && _subscribers[i].context == context)
+            {
+                _count--;
+                for (uint8_t j = i; j < _count; j++)
+                    _subscribers[j] = _subscribers[j+1];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void publish(const EVENT &event)
+    {
+        for (uint8_t i = 0; i < _count; i++)
+            _subscribers[i].handler(event, _subscribers[i].context);
+    }
+
+    uint8_t subscriberCount() { return _count; }
+
+private:
+    typedef struct {
+        Handler handler;
+        void *context;
+    } Subscriber;
+
+    Subscriber _subscribers[MAX_SUBSCRIBERS];
+    uint8_t _count = 0;
+};
+
+#endif // EVENT_BUS_H
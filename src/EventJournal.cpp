@@ -0,0 +1,290 @@
+// Copyright 2021 Kevin Cooper
+
+#include "EventJournal.h"
+
+bool EventJournal::begin()
+{
+    if (!LittleFS.begin(true))
+    {
+        Log.println("Journal: failed to mount LittleFS");
+        return false;
+    }
+
+    if (!LittleFS.exists(journalPath))
+        LittleFS.mkdir(journalPath);
+
+    recover();
+
+    _queue = xQueueCreate(journalQueueLength, sizeof(Record));
+    xTaskCreate(taskEntry, "journal", 4096, this, 1, NULL);
+
+    Log.printf("Journal: %d segments, next sequence %lu\n", _segmentCount, _nextSequence);
+    return true;
+}
+
+bool EventJournal::append(EVENT_TYPE type, uint8_t panel, uint8_t id, uint8_t state, uint8_t flags)
+{
+    if (_queue == NULL)
+        return false;
+
+    Record record;
+    record.sequence = _nextSequence;
+    time_t now = time(NULL);
+    record.timestamp = now > 1600000000 ? now : millis() / 1000;
+    record.type = type;
+    record.panel = panel;
+    record.id = id;
+    record.state = state;
+    record.flags = flags;
+    record.reserved = 0;
+    record.crc = crc16((uint8_t *)&record, offsetof(Record, crc));
+
+    if (xQueueSend(_queue, &record, 0) != pdTRUE)
+    {
+        _dropped++;
+        return false;
+    }
+
+    _nextSequence++;
+    return true;
+}
+
+void EventJournal::requestSince(uint32_t sequence)
+{
+    portENTER_CRITICAL(&_queryMux);
+    _batchReady = false;
+    _querySequence = sequence;
+    _queryGeneration++;
+    _queryActive = true;
+    portEXIT_CRITICAL(&_queryMux);
+}
+
+// The batch stays ready, and is returned again, until it's released
+bool EventJournal::getBatch(Record *records, uint8_t *count, bool *more)
+{
+    portENTER_CRITICAL(&_queryMux);
+    bool ready = _batchReady;
+    portEXIT_CRITICAL(&_queryMux);
+
+    if (!ready)
+        return false;
+
+    memcpy(records, _batch, _batchCount * sizeof(Record));
+    *count = _batchCount;
+    *more = _batchMore;
+    return true;
+}
+
+// Done with the batch, the task moves on to the next one
+void EventJournal::releaseBatch()
+{
+    portENTER_CRITICAL(&_queryMux);
+    if (_batchReady)
+    {
+        if (!_batchMore)
+            _queryActive = false;
+        _batchReady = false;
+    }
+    portEXIT_CRITICAL(&_queryMux);
+}
+
+void EventJournal::taskEntry(void *journal)
+{
+    ((EventJournal *)journal)->task();
+}
+
+void EventJournal::task()
+{
+    Record record;
+
+    while (true)
+    {
+        if (xQueueReceive(_queue, &record, pdMS_TO_TICKS(100)) == pdTRUE)
+        {
+            uint8_t written = 0;
+            do
+            {
+                writeRecord(&record);
+            } while (++written < journalBatchSize && xQueueReceive(_queue, &record, 0) == pdTRUE);
+
+            _activeSegment.flush();
+        }
+
+        portENTER_CRITICAL(&_queryMux);
+        bool wanted = _queryActive && !_batchReady;
+        uint32_t generation = _queryGeneration;
+        uint32_t sequence = _querySequence;
+        portEXIT_CRITICAL(&_queryMux);
+
+        if (wanted)
+            readBatch(generation, sequence);
+    }
+}
+
+void EventJournal::segmentName(char *name, uint32_t firstSequence)
+{
+    snprintf(name, 24, "%s/%08lx.log", journalPath, (unsigned long)firstSequence);
+}
+
+void EventJournal::recover()
+{
+    File dir = LittleFS.open(journalPath);
+    File file = dir.openNextFile();
+
+    while (file)
+    {
+        uint32_t firstSequence = strtoul(file.name(), NULL, 16);
+        file.close();
+
+        // Insertion sort, the list is at most journalMaxSegments long
+        if (_segmentCount < journalMaxSegments)
+        {
+            uint8_t i = _segmentCount++;
+            while (i > 0 && _segments[i-1] > firstSequence)
+            {
+                _segments[i] = _segments[i-1];
+                i--;
+            }
+            _segments[i] = firstSequence;
+        }
+        else
+        {
+            char name[24];
+            segmentName(name, firstSequence);
+            LittleFS.remove(name);
+        }
+
+        file = dir.openNextFile();
+    }
+    dir.close();
+
+    if (_segmentCount == 0)
+        return;
+
+    // Only the newest segment can have been interrupted mid write
+    char name[24];
+    uint32_t firstSequence = _segments[_segmentCount-1];
+    segmentName(name, firstSequence);
+    file = LittleFS.open(name, "r");
+
+    Record record;
+    uint16_t validRecords = 0;
+    while (file.read((uint8_t *)&record, sizeof(Record)) == sizeof(Record) &&
+           record.crc == crc16((uint8_t *)&record, offsetof(Record, crc)) &&
+           record.sequence == firstSequence + validRecords)
+    {
+        validRecords++;
+    }
+    bool cleanTail = file.size() == validRecords * sizeof(Record);
+    file.close();
+
+    _nextSequence = firstSequence + validRecords;
+    _writtenSequence = _nextSequence;
+
+    if (cleanTail)
+    {
+        _activeSegment = LittleFS.open(name, "a");
+        _activeSegmentRecords = validRecords;
+    }
+    else
+    {
+        // Leave the damaged tail alone and start a fresh segment on the next write
+        Log.printf("Journal: discarded torn record after sequence %lu\n", _nextSequence);
+        _activeSegmentRecords = journalSegmentRecords;
+    }
+}
+
+void EventJournal::openSegment(uint32_t firstSequence)
+{
+    if (_activeSegment)
+        _activeSegment.close();
+
+    if (_segmentCount >= journalMaxSegments)
+    {
+        char oldest[24];
+        segmentName(oldest, _segments[0]);
+        LittleFS.remove(oldest);
+        memmove(&_segments[0], &_segments[1], (_segmentCount - 1) * sizeof(uint32_t));
+        _segmentCount--;
+    }
+
+    char name[24];
+    segmentName(name, firstSequence);
+    _activeSegment = LittleFS.open(name, "a");
+    _segments[_segmentCount++] = firstSequence;
+    _activeSegmentRecords = 0;
+}
+
+void EventJournal::writeRecord(Record *record)
+{
+    if (!_activeSegment || _activeSegmentRecords >= journalSegmentRecords)
+        openSegment(record->sequence);
+
+    _activeSegment.write((uint8_t *)record, sizeof(Record));
+    _activeSegmentRecords++;
+    _writtenSequence = record->sequence + 1;
+}
+
+void EventJournal::readBatch(uint32_t generation, uint32_t sequence)
+{
+    _batchCount = 0;
+
+    // Anything older than the oldest segment has already been rotated out
+    if (_segmentCount > 0 && sequence < _segments[0])
+        sequence = _segments[0];
+
+    uint8_t segment = _segmentCount;
+    while (segment > 0 && _segments[segment-1] > sequence)
+        segment--;
+
+    if (segment > 0 && sequence < _writtenSequence)
+    {
+        uint32_t firstSequence = _segments[segment-1];
+        char name[24];
+        segmentName(name, firstSequence);
+
+        File file = LittleFS.open(name, "r");
+        if (file && file.seek((sequence - firstSequence) * sizeof(Record)))
+        {
+            Record record;
+            while (_batchCount < journalBatchSize &&
+                   file.read((uint8_t *)&record, sizeof(Record)) == sizeof(Record))
+            {
+                if (record.crc == crc16((uint8_t *)&record, offsetof(Record, crc)))
+                    _batch[_batchCount++] = record;
+
+                // By position, a corrupt record's own sequence can't be trusted
+                sequence++;
+            }
+        }
+        file.close();
+
+        // Reached the end of a segment that was cut short, move on to the next
+        if (_batchCount == 0 && segment < _segmentCount)
+            sequence = _segments[segment];
+    }
+
+    // A new request came in while this one was being read
+    portENTER_CRITICAL(&_queryMux);
+    if (generation == _queryGeneration)
+    {
+        _querySequence = sequence;
+        _batchMore = sequence < _writtenSequence;
+        _batchReady = true;
+    }
+    portEXIT_CRITICAL(&_queryMux);
+}
+
+uint16_t EventJournal::crc16(const uint8_t *data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
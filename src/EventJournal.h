@@ -0,0 +1,83 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __EVENT_JOURNAL_H_
+#define __EVENT_JOURNAL_H_
+
+#include "Arduino.h"
+#include "LittleFS.h"
+#include "Logging.h"
+
+#define journalPath "/journal"
+#define journalSegmentRecords 256 // 4KB segments, one flash sector
+#define journalMaxSegments 16
+#define journalQueueLength 64
+#define journalBatchSize 16
+
+// Append-only log of panel events kept on LittleFS.
+//
+// Records are fixed size and numbered by a sequence that never goes backwards,
+// so the only index needed is the first sequence number of each segment file.
+// append() only queues the record; a background task does the flash writes and
+// reads back batches for range queries so the panel loop is never blocked.
+class EventJournal {
+public:
+  typedef enum {
+      EVENT_ALARM = 0,
+      EVENT_ZONE = 1,
+      EVENT_USER_PIN = 2,
+      EVENT_USER_TAG = 3,
+  } EVENT_TYPE;
+
+  typedef struct {
+      uint32_t sequence;
+      uint32_t timestamp; // Unix time if the clock is set, otherwise seconds since boot
+      uint8_t type;
+      uint8_t panel;
+      uint8_t id;         // Zone or user number
+      uint8_t state;
+      uint8_t flags;
+      uint8_t reserved;
+      uint16_t crc;
+  } Record;
+
+  bool begin();
+  bool append(EVENT_TYPE type, uint8_t panel, uint8_t id, uint8_t state, uint8_t flags);
+  void requestSince(uint32_t sequence);
+  bool getBatch(Record *records, uint8_t *count, bool *more);
+  void releaseBatch();
+  uint32_t nextSequence() { return _nextSequence; }
+  uint32_t droppedCount() { return _dropped; }
+
+private:
+  QueueHandle_t _queue = NULL;
+  uint32_t _segments[journalMaxSegments]; // First sequence of each segment, oldest first
+  uint8_t _segmentCount = 0;
+  uint32_t _nextSequence = 0;    // Owned by the caller of append()
+  uint32_t _writtenSequence = 0; // Owned by the journal task
+  uint32_t _dropped = 0;
+  File _activeSegment;
+  uint16_t _activeSegmentRecords = 0;
+
+  // Range query handoff between the main loop and the journal task, the
+  // flags only change under _queryMux. The batch itself belongs to the task
+  // until _batchReady is set and to the main loop until it's released.
+  portMUX_TYPE _queryMux = portMUX_INITIALIZER_UNLOCKED;
+  bool _queryActive = false;
+  bool _batchReady = false;
+  uint32_t _querySequence = 0;
+  uint32_t _queryGeneration = 0;
+  Record _batch[journalBatchSize];
+  uint8_t _batchCount = 0;
+  bool _batchMore = false;
+
+  static void taskEntry(void *journal);
+  void task();
+  void recover();
+  void openSegment(uint32_t firstSequence);
+  void writeRecord(Record *record);
+  void readBatch(uint32_t generation, uint32_t sequence);
+  void segmentName(char *name, uint32_t firstSequence);
+  static uint16_t crc16(const uint8_t *data, size_t length);
+};
+
+#endif  // __EVENT_JOURNAL_H_
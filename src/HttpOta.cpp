@@ -0,0 +1,203 @@
+#include "HttpOta.h"
+#include "esp32/rom/miniz.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/md.h"
+
+const char *HttpOta::resultString(RESULT result)
+{
+    static const char *strings[] = {"ok", "http_error", "no_memory", "begin_failed", "download_failed",
+                                    "inflate_failed", "write_failed", "hash_mismatch", "end_failed"};
+    return strings[result];
+}
+
+// hmac is the hex HMAC-SHA256 of "<url> <sha256>" keyed by the OTA password
+bool HttpOta::authorised(const char *url, const char *sha256, const char *hmac, const char *key)
+{
+    if (key == NULL || *key == '\0')
+        return false;
+
+    char message[200];
+    int length = snprintf(message, sizeof(message), "%s %s", url, sha256);
+    if (length < 0 || length >= (int)sizeof(message))
+        return false;
+
+    uint8_t expected[32];
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t *)key, strlen(key),
+                        (const uint8_t *)message, length, expected) != 0)
+        return false;
+
+    return hexMatches(expected, hmac, sizeof(expected));
+}
+
+HttpOta::REPORT HttpOta::run(const char *url, const char *sha256)
+{
+    REPORT report = {OTA_OK, 0, 0, 0};
+    uint32_t start = millis();
+
+    HTTPClient http;
+    http.begin(url);
+    int code = http.GET();
+
+    if (code != HTTP_CODE_OK)
+    {
+        http.end();
+        report.result = OTA_HTTP_ERROR;
+        return report;
+    }
+
+    uint8_t *dictionary = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+    if (dictionary == NULL)
+    {
+        http.end();
+        report.result = OTA_NO_MEMORY;
+        return report;
+    }
+
+    if (!Update.begin(UPDATE_SIZE_UNKNOWN))
+    {
+        free(dictionary);
+        http.end();
+        report.result = OTA_BEGIN_FAILED;
+        return report;
+    }
+
+    uint8_t digest[32];
+    report.result = download(http.getStreamPtr(), http.getSize(), dictionary, digest, &report);
+    free(dictionary);
+    http.end();
+
+    if (report.result == OTA_OK && !digestMatches(digest, sha256))
+        report.result = OTA_HASH_MISMATCH;
+
+    if (report.result == OTA_OK && !Update.end(true))
+        report.result = OTA_END_FAILED;
+
+    if (report.result != OTA_OK)
+        Update.abort();
+
+    report.durationMs = millis() - start;
+    return report;
+}
+
+HttpOta::RESULT HttpOta::download(Stream *stream, int32_t contentLength, uint8_t *dictionary, uint8_t *digest, REPORT *report)
+{
+    tinfl_decompressor *inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+    if (inflator == NULL)
+        return OTA_NO_MEMORY;
+
+    tinfl_init(inflator);
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    uint8_t input[httpOtaReadSize];
+    size_t inputOffset = 0;
+    size_t inputAvailable = 0;
+    size_t dictionaryOffset = 0;
+    uint32_t lastData = millis();
+    RESULT result = OTA_OK;
+
+    while (true)
+    {
+        bool moreInput = contentLength < 0 || report->downloadedBytes < (uint32_t)contentLength;
+
+        if (inputAvailable == 0 && moreInput)
+        {
+            int available = stream->available();
+            if (available <= 0)
+            {
+                if (millis() - lastData > readTimeout)
+                {
+                    result = OTA_DOWNLOAD_FAILED;
+                    break;
+                }
+                delay(1);
+                continue;
+            }
+
+            inputAvailable = stream->readBytes(input, available < (int)sizeof(input) ? available : sizeof(input));
+            inputOffset = 0;
+            report->downloadedBytes += inputAvailable;
+            lastData = millis();
+            moreInput = contentLength < 0 || report->downloadedBytes < (uint32_t)contentLength;
+        }
+
+        size_t inBytes = inputAvailable;
+        size_t outBytes = TINFL_LZ_DICT_SIZE - dictionaryOffset;
+        tinfl_status status = tinfl_decompress(inflator,
+            &input[inputOffset], &inBytes,
+            dictionary, &dictionary[dictionaryOffset], &outBytes,
+            TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 | (moreInput ? TINFL_FLAG_HAS_MORE_INPUT : 0));
+
+        inputOffset += inBytes;
+        inputAvailable -= inBytes;
+
+        if (outBytes > 0)
+        {
+            mbedtls_sha256_update(&sha, &dictionary[dictionaryOffset], outBytes);
+            if (!writeChunked(&dictionary[dictionaryOffset], outBytes))
+            {
+                result = OTA_WRITE_FAILED;
+                break;
+            }
+            report->imageBytes += outBytes;
+            dictionaryOffset = (dictionaryOffset + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status == TINFL_STATUS_DONE)
+            break;
+
+        if (status < TINFL_STATUS_DONE || (status == TINFL_STATUS_NEEDS_MORE_INPUT && !moreInput))
+        {
+            result = OTA_INFLATE_FAILED;
+            break;
+        }
+    }
+
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    free(inflator);
+    return result;
+}
+
+// Each flash write stalls the cache on both cores, so hand Update at most one
+// sector at a time and give other tasks a tick in between
+bool HttpOta::writeChunked(uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t chunk = length < httpOtaWriteSize ? length : httpOtaWriteSize;
+        if (Update.write(data, chunk) != chunk)
+            return false;
+
+        data += chunk;
+        length -= chunk;
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+bool HttpOta::digestMatches(const uint8_t *digest, const char *sha256)
+{
+    return hexMatches(digest, sha256, 32);
+}
+
+// Looks at every byte whatever the first difference, so the time taken
+// doesn't tell a forger how much of an HMAC was right
+bool HttpOta::hexMatches(const uint8_t *bytes, const char *hex, size_t length)
+{
+    if (strlen(hex) != length * 2)
+        return false;
+
+    uint8_t difference = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (!isxdigit(hex[i*2]) || !isxdigit(hex[i*2+1]))
+            return false;
+        char pair[3] = {hex[i*2], hex[i*2+1], '\0'};
+        difference |= (uint8_t)strtoul(pair, NULL, 16) ^ bytes[i];
+    }
+
+    return difference == 0;
+}
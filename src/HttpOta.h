@@ -0,0 +1,63 @@
+#ifndef __HTTP_OTA_H_
+#define __HTTP_OTA_H_
+
+#include "Arduino.h"
+#include <HTTPClient.h>
+#include <Update.h>
+#include "Logging.h"
+
+#define httpOtaReadSize 1024
+#define httpOtaWriteSize 4096 // One flash sector
+
+// Pull based OTA. Downloads a zlib compressed firmware image over HTTP and
+// inflates it straight into the OTA partition with the ROM copy of miniz,
+// hashing the inflated image as it goes. Nothing is buffered beyond the
+// 32KB inflate dictionary, so images larger than free RAM are fine. run()
+// blocks for the whole download and is meant to be called from a background
+// task; it does not log.
+//
+// The SHA-256 only proves the image is the one the request named. The
+// request itself has to prove it came from someone holding the OTA password,
+// with an HMAC-SHA256 keyed by it over "<url> <sha256>", see authorised().
+// That still lets a captured request be replayed, which can only reinstall
+// an image that was once signed.
+//
+// Images are prepared and requests signed with e.g.
+//   python3 -c "import sys,zlib; sys.stdout.buffer.write(zlib.compress(open(sys.argv[1],'rb').read(), 9))" firmware.bin > firmware.bin.zz
+//   sha256sum firmware.bin
+//   printf '%s %s' "$url" "$sha256" | openssl dgst -sha256 -hmac "$otaPassword"
+class HttpOta {
+public:
+  typedef enum {
+      OTA_OK = 0,
+      OTA_HTTP_ERROR = 1,
+      OTA_NO_MEMORY = 2,
+      OTA_BEGIN_FAILED = 3,
+      OTA_DOWNLOAD_FAILED = 4,
+      OTA_INFLATE_FAILED = 5,
+      OTA_WRITE_FAILED = 6,
+      OTA_HASH_MISMATCH = 7,
+      OTA_END_FAILED = 8,
+  } RESULT;
+
+  typedef struct {
+      RESULT result;
+      uint32_t downloadedBytes;
+      uint32_t imageBytes;
+      uint32_t durationMs;
+  } REPORT;
+
+  static const char *resultString(RESULT result);
+  static bool authorised(const char *url, const char *sha256, const char *hmac, const char *key);
+  REPORT run(const char *url, const char *sha256);
+
+private:
+  const uint16_t readTimeout = 10000;
+
+  RESULT download(Stream *stream, int32_t contentLength, uint8_t *dictionary, uint8_t *digest, REPORT *report);
+  static bool writeChunked(uint8_t *data, size_t length);
+  static bool digestMatches(const uint8_t *digest, const char *sha256);
+  static bool hexMatches(const uint8_t *bytes, const char *hex, size_t length);
+};
+
+#endif  // __HTTP_OTA_H_
@@ -0,0 +1,267 @@
+// Copyright 2021 Kevin Cooper
+
+#include "LocalEventServer.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+#include "lwip/sockets.h"
+
+void LocalEventServer::begin(size_t (*stateCallback)(char *, size_t))
+{
+    this->stateCallback = stateCallback;
+    server.begin();
+    server.setNoDelay(true);
+    started = true;
+}
+
+uint8_t LocalEventServer::clientCount()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < localServerMaxClients; i++)
+    {
+        if (connections[i].state == CLIENT_WEBSOCKET)
+            count++;
+    }
+    return count;
+}
+
+void LocalEventServer::loop()
+{
+    if (!started || !WiFi.isConnected())
+        return;
+
+    acceptClients();
+
+    for (uint8_t i = 0; i < localServerMaxClients; i++)
+    {
+        Connection *connection = &connections[i];
+
+        if (connection->state == CLIENT_FREE)
+            continue;
+
+        if (!connection->client.connected())
+        {
+            closeConnection(connection);
+        }
+        else if (connection->state == CLIENT_HTTP)
+        {
+            readRequest(connection);
+        }
+        else
+        {
+            readWebSocket(connection);
+        }
+    }
+}
+
+void LocalEventServer::acceptClients()
+{
+    while (server.hasClient())
+    {
+        WiFiClient client = server.accept();
+        Connection *connection = NULL;
+
+        for (uint8_t i = 0; i < localServerMaxClients; i++)
+        {
+            if (connections[i].state == CLIENT_FREE)
+            {
+                connection = &connections[i];
+                break;
+            }
+        }
+
+        if (connection == NULL)
+        {
+            const char *busy = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+            sendWithoutBlocking(client, busy, strlen(busy));
+            client.stop();
+            continue;
+        }
+
+        connection->client = client;
+        connection->state = CLIENT_HTTP;
+        connection->connectedAt = millis();
+        connection->requestLength = 0;
+        connection->skipLength = 0;
+    }
+}
+
+void LocalEventServer::readRequest(Connection *connection)
+{
+    while (connection->client.available() > 0)
+    {
+        if (connection->requestLength >= localServerRequestSize - 1)
+        {
+            closeConnection(connection);
+            return;
+        }
+
+        connection->request[connection->requestLength++] = connection->client.read();
+        connection->request[connection->requestLength] = '\0';
+
+        if (connection->requestLength >= 4 &&
+            strcmp(&connection->request[connection->requestLength-4], "\r\n\r\n") == 0)
+        {
+            handleRequest(connection);
+            return;
+        }
+    }
+
+    if (millis() - connection->connectedAt > requestTimeout)
+        closeConnection(connection);
+}
+
+void LocalEventServer::handleRequest(Connection *connection)
+{
+    if (strncmp(connection->request, "GET /state ", 11) == 0)
+    {
+        if (!sendState(connection))
+            Log.println("Local state client can't take the response, closing");
+        closeConnection(connection);
+    }
+    else if (strncmp(connection->request, "GET /events ", 12) == 0 && upgradeToWebSocket(connection))
+    {
+        connection->state = CLIENT_WEBSOCKET;
+        Log.printf("WebSocket client connected: %s\n", connection->client.remoteIP().toString().c_str());
+    }
+    else
+    {
+        const char *notFound = "HTTP/1.1 404 Not Found\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+        sendWithoutBlocking(connection->client, notFound, strlen(notFound));
+        closeConnection(connection);
+    }
+}
+
+// The whole response goes in one go into a new connection's empty send
+// buffer, a client that can't take it is closed rather than waited on
+bool LocalEventServer::sendState(Connection *connection)
+{
+    char response[localServerStateSize + 128];
+    const size_t headerSpace = 128;
+    size_t length = stateCallback != NULL ? stateCallback(&response[headerSpace], localServerStateSize) : 0;
+
+    char header[headerSpace];
+    int headerLength = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+        length);
+
+    // Header straight in front of the body, so it's a single send
+    char *start = &response[headerSpace - headerLength];
+    memcpy(start, header, headerLength);
+    return sendWithoutBlocking(connection->client, start, headerLength + length);
+}
+
+bool LocalEventServer::sendWithoutBlocking(WiFiClient &client, const char *data, size_t length)
+{
+    return ::send(client.fd(), data, length, MSG_DONTWAIT) == (int)length;
+}
+
+bool LocalEventServer::upgradeToWebSocket(Connection *connection)
+{
+    const char *keyHeader = "Sec-WebSocket-Key: ";
+    char *key = strstr(connection->request, keyHeader);
+    if (key == NULL)
+        return false;
+
+    key += strlen(keyHeader);
+    char *keyEnd = strstr(key, "\r\n");
+    if (keyEnd == NULL || keyEnd - key > 32)
+        return false;
+
+    char acceptSource[72];
+    size_t keyLength = keyEnd - key;
+    memcpy(acceptSource, key, keyLength);
+    strcpy(&acceptSource[keyLength], wsGuid);
+
+    unsigned char digest[20];
+    mbedtls_sha1((const unsigned char *)acceptSource, strlen(acceptSource), digest);
+
+    unsigned char acceptKey[32];
+    size_t acceptKeyLength;
+    mbedtls_base64_encode(acceptKey, sizeof(acceptKey), &acceptKeyLength, digest, sizeof(digest));
+    acceptKey[acceptKeyLength] = '\0';
+
+    char response[160];
+    snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+        acceptKey);
+    return sendWithoutBlocking(connection->client, response, strlen(response));
+}
+
+void LocalEventServer::readWebSocket(Connection *connection)
+{
+    // Clients never need to send anything, so frames are skipped over and
+    // only a close frame is acted on
+    while (connection->client.available() > 0)
+    {
+        if (connection->skipLength > 0)
+        {
+            connection->client.read();
+            connection->skipLength--;
+            continue;
+        }
+
+        if (connection->client.available() < 2)
+            return;
+
+        uint8_t opcode = connection->client.read() & 0x0F;
+        uint8_t length = connection->client.read() & 0x7F;
+
+        // Nothing a dashboard sends should need an extended length
+        if (opcode == 0x08 || length >= 126)
+        {
+            closeConnection(connection);
+            return;
+        }
+
+        connection->skipLength = 4 + length; // Client frames are always masked
+    }
+}
+
+void LocalEventServer::broadcast(const char *payload, size_t length)
+{
+    if (length > localServerMaxFrame)
+        return;
+
+    // Unmasked, single fragment text frame
+    size_t headerLength = 2;
+    frame[0] = 0x81;
+    if (length < 126)
+    {
+        frame[1] = length;
+    }
+    else
+    {
+        frame[1] = 126;
+        frame[2] = length >> 8;
+        frame[3] = length & 0xFF;
+        headerLength = 4;
+    }
+    memcpy(&frame[headerLength], payload, length);
+
+    for (uint8_t i = 0; i < localServerMaxClients; i++)
+    {
+        Connection *connection = &connections[i];
+        if (connection->state != CLIENT_WEBSOCKET)
+            continue;
+
+        // Called from the panel's event bus, so a client that can't keep up
+        // is dropped rather than waited on. A frame that only partly went
+        // would leave the stream broken anyway; the dashboard reconnects and
+        // catches up from /state.
+        if (!sendWithoutBlocking(connection->client, (const char *)frame, headerLength + length))
+        {
+            Log.println("WebSocket client can't keep up, closing");
+            closeConnection(connection);
+        }
+    }
+}
+
+void LocalEventServer::closeConnection(Connection *connection)
+{
+    if (connection->state == CLIENT_WEBSOCKET)
+        Log.println("WebSocket client disconnected");
+
+    connection->client.stop();
+    connection->state = CLIENT_FREE;
+    connection->requestLength = 0;
+}
@@ -0,0 +1,65 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __LOCAL_EVENT_SERVER_H_
+#define __LOCAL_EVENT_SERVER_H_
+
+#include "Arduino.h"
+#include <WiFi.h>
+#include "Logging.h"
+
+#define localServerMaxClients 4
+#define localServerRequestSize 512
+#define localServerMaxFrame 256
+#define localServerStateSize 2048
+
+// Minimal HTTP server for the LAN so panel state is visible without the MQTT
+// broker. GET /state returns a JSON snapshot, GET /events upgrades to a
+// WebSocket that receives every event as a text frame. Each event is framed
+// once into a shared buffer and that buffer is written to every client
+// without blocking, a client that would block is closed. Nothing else
+// blocks either, the /state response and handshake included.
+class LocalEventServer {
+public:
+  LocalEventServer(uint16_t port = 80) : server(port) {}
+
+  void begin(size_t (*stateCallback)(char *, size_t));
+  void loop();
+  void broadcast(const char *payload, size_t length);
+  uint8_t clientCount();
+
+private:
+  typedef enum {
+      CLIENT_FREE = 0,
+      CLIENT_HTTP = 1,
+      CLIENT_WEBSOCKET = 2,
+  } CLIENT_STATE;
+
+  typedef struct {
+      WiFiClient client;
+      CLIENT_STATE state = CLIENT_FREE;
+      uint32_t connectedAt;
+      uint16_t requestLength;
+      uint8_t skipLength = 0;
+      char request[localServerRequestSize];
+  } Connection;
+
+  const uint16_t requestTimeout = 2000;
+  const char *wsGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+  WiFiServer server;
+  bool started = false;
+  size_t (*stateCallback)(char *, size_t) = NULL;
+  Connection connections[localServerMaxClients];
+  uint8_t frame[localServerMaxFrame + 4];
+
+  void acceptClients();
+  void readRequest(Connection *connection);
+  void handleRequest(Connection *connection);
+  bool sendState(Connection *connection);
+  bool sendWithoutBlocking(WiFiClient &client, const char *data, size_t length);
+  bool upgradeToWebSocket(Connection *connection);
+  void readWebSocket(Connection *connection);
+  void closeConnection(Connection *connection);
+};
+
+#endif  // __LOCAL_EVENT_SERVER_H_
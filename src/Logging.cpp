@@ -1,3 +1,4 @@
 #include "Logging.h"
 
-TLog Log;
\ No newline at end of file
+TLog Log;
+TLogLimit *TLogLimit::_first = NULL;
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <WiFi.h>
 #include <ESPmDNS.h>
 #endif
+#include "StallMonitor.h"
 
 /*
     User-Level Severity
@@ -30,6 +31,15 @@ public:
     void enableSerial(bool enable) { _enableSerial = enable; };
     void enableSyslog(bool enable) { _enableSyslog = enable; };
 
+    // Reports a run of repeated lines once nothing has broken it for a while
+    void loop()
+    {
+        if (_repeats > 0 && millis() - _lastLineAt >= _repeatWindow)
+            flushRepeats();
+    }
+
+    uint32_t foldedLines() { return _foldedLines; }
+
     size_t write(byte a)
     {
         if (_enableSyslog)
@@ -55,6 +65,53 @@ private:
     WiFiUDP syslog;
     bool _macAddressSet = false;
 
+    // Identical consecutive lines inside the window are only counted, like
+    // syslogd's "last message repeated N times"
+    const uint32_t _repeatWindow = 30000;
+    uint32_t _lastLineHash = 0;
+    uint32_t _lastLineAt = 0;
+    uint8_t _lastLineSeverity = _defaultSeverity;
+    uint32_t _repeats = 0;
+    uint32_t _foldedLines = 0;
+
+    static uint32_t hashLine(const char *line)
+    {
+        uint32_t hash = 2166136261u;
+        while (*line)
+            hash = (hash ^ (uint8_t)*line++) * 16777619u;
+        return hash;
+    }
+
+    void flushRepeats()
+    {
+        if (_repeats == 0)
+            return;
+
+        char notice[48];
+        snprintf(notice, sizeof(notice), "last message repeated %lu times", _repeats);
+        _repeats = 0;
+        sendSyslog(notice, _lastLineSeverity);
+    }
+
+    void sendSyslog(const char *line, uint8_t s)
+    {
+        if (!WiFi.isConnected())
+            return;
+
+        if (!_macAddressSet)
+        {
+            String macString = WiFi.macAddress();
+            macString.toLowerCase();
+            sprintf(_macAddress, "%s", macString.c_str());
+            _macAddressSet = true;
+        }
+
+        StallSection section("syslog");
+        syslog.beginPacket(_syslogServer, _syslogPort);
+        syslog.printf("<%d>1 - %s %s - - - %s", s, _macAddress, _appName, line);
+        syslog.endPacket();
+    }
+
     size_t syslogwrite(uint8_t c, uint8_t s = 14)
     {
         if (at >= sizeof(logbuff) - 1)
@@ -72,24 +129,100 @@ private:
             logbuff[at++] = 0;
             at = 0;
 
-            if (WiFi.isConnected())
+            uint32_t hash = hashLine(logbuff);
+            if (hash == _lastLineHash && s == _lastLineSeverity && millis() - _lastLineAt < _repeatWindow)
             {
-                if (!_macAddressSet)
-                {
-                    String macString = WiFi.macAddress();
-                    macString.toLowerCase();
-                    sprintf(_macAddress, "%s", macString.c_str());
-                    _macAddressSet = true;
-                }
-
-                syslog.beginPacket(_syslogServer, _syslogPort);
-                syslog.printf("<%d>1 - %s %s - - - %s", s, _macAddress, _appName, logbuff);
-                syslog.endPacket();
+                _repeats++;
+                _foldedLines++;
+                return 1;
             }
+
+            flushRepeats();
+            _lastLineHash = hash;
+            _lastLineSeverity = s;
+            _lastLineAt = millis();
+            sendSyslog(logbuff, s);
         };
         return 1;
     };
 
 };
 extern TLog Log;
+
+// Token bucket for one logging call site, use through logAllowed()
+class TLogLimit
+{
+public:
+    TLogLimit(const char *file, uint16_t line, uint16_t perMinute, uint16_t burst)
+        : _line(line), _perMinute(perMinute), _burst(burst), _tokens(burst), _refilledAt(millis())
+    {
+        const char *base = strrchr(file, '/');
+        _file = base != NULL ? base + 1 : file;
+
+        // Sites register the first time they log, so only ones in use are listed
+        _next = _first;
+        _first = this;
+    }
+
+    bool allow()
+    {
+        uint32_t now = millis();
+        uint32_t earned = (uint64_t)(now - _refilledAt) * _perMinute / 60000;
+
+        if (earned > 0)
+        {
+            _refilledAt += (uint64_t)earned * 60000 / _perMinute;
+            if (_tokens + earned >= _burst)
+            {
+                _tokens = _burst;
+                _refilledAt = now;
+            }
+            else
+            {
+                _tokens += earned;
+            }
+        }
+
+        if (_tokens == 0)
+        {
+            _suppressed++;
+            _pending++;
+            return false;
+        }
+
+        _tokens--;
+        if (_pending > 0)
+        {
+            Log.printf("%s:%u suppressed %lu lines\n", _file, _line, _pending);
+            _pending = 0;
+        }
+        return true;
+    }
+
+    const char *file() { return _file; }
+    uint16_t line() { return _line; }
+    uint32_t suppressed() { return _suppressed; }
+    TLogLimit *next() { return _next; }
+    static TLogLimit *first() { return _first; }
+
+private:
+    const char *_file;
+    uint16_t _line;
+    uint16_t _perMinute;
+    uint16_t _burst;
+    uint16_t _tokens;
+    uint32_t _refilledAt;
+    uint32_t _suppressed = 0;   // Since boot
+    uint32_t _pending = 0;      // Since this site last logged
+    TLogLimit *_next;
+    static TLogLimit *_first;
+};
+
+// True while this call site is within perMinute lines, with bursts of up to
+// burst. Each use gets its own bucket, e.g.
+//   if (logAllowed(60, 10))
+//       Log.println(message);
+#define logAllowed(perMinute, burst) \
+    ([]() { static TLogLimit limit(__FILE__, __LINE__, perMinute, burst); return limit.allow(); }())
+
 #endif
\ No newline at end of file
@@ -0,0 +1,112 @@
+#ifndef MQTT_ACK_CLIENT_H
+#define MQTT_ACK_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+// Sits between PubSubClient and the network client and watches the inbound
+// MQTT byte stream for PUBACK packets. PubSubClient silently discards them,
+// so this is the only place QoS 1 acknowledgements can be observed.
+class MqttAckClient : public Client
+{
+public:
+    MqttAckClient(Client &client) : _client(client) {}
+
+    void setPubAckCallback(void (*callback)(void *, uint16_t), void *context)
+    {
+        _onPubAck = callback;
+        _onPubAckContext = context;
+    }
+
+    int connect(IPAddress ip, uint16_t port) { resetParser(); return _client.connect(ip, port); }
+    int connect(const char *host, uint16_t port) { resetParser(); return _client.connect(host, port); }
+    size_t write(uint8_t b) { return _client.write(b); }
+    size_t write(const uint8_t *buf, size_t size) { return _client.write(buf, size); }
+    int available() { return _client.available(); }
+    int peek() { return _client.peek(); }
+    void flush() { _client.flush(); }
+    void stop() { _client.stop(); }
+    uint8_t connected() { return _client.connected(); }
+    operator bool() { return (bool)_client; }
+
+    int read()
+    {
+        int b = _client.read();
+        if (b >= 0)
+            parse(b);
+        return b;
+    }
+
+    int read(uint8_t *buf, size_t size)
+    {
+        int count = _client.read(buf, size);
+        for (int i = 0; i < count; i++)
+            parse(buf[i]);
+        return count;
+    }
+
+private:
+    typedef enum {
+        PARSE_HEADER,
+        PARSE_LENGTH,
+        PARSE_BODY,
+    } PARSE_STATE;
+
+    static const uint8_t MQTT_PUBACK = 0x40;
+
+    Client &_client;
+    void (*_onPubAck)(void *, uint16_t) = NULL;
+    void *_onPubAckContext = NULL;
+
+    PARSE_STATE _state = PARSE_HEADER;
+    uint8_t _header = 0;
+    uint32_t _remaining = 0;
+    uint32_t _multiplier = 1;
+    uint32_t _bodyPosition = 0;
+    uint16_t _packetId = 0;
+
+    void resetParser()
+    {
+        _state = PARSE_HEADER;
+    }
+
+    void parse(uint8_t b)
+    {
+        if (_state == PARSE_HEADER)
+        {
+            _header = b;
+            _remaining = 0;
+            _multiplier = 1;
+            _state = PARSE_LENGTH;
+        }
+        else if (_state == PARSE_LENGTH)
+        {
+            _remaining += (b & 127) * _multiplier;
+            _multiplier *= 128;
+
+            if ((b & 128) == 0)
+            {
+                _bodyPosition = 0;
+                _packetId = 0;
+                _state = _remaining == 0 ? PARSE_HEADER : PARSE_BODY;
+            }
+        }
+        else
+        {
+            if (_bodyPosition < 2)
+                _packetId = (_packetId << 8) | b;
+
+            _bodyPosition++;
+
+            if (_bodyPosition >= _remaining)
+            {
+                if ((_header & 0xF0) == MQTT_PUBACK && _remaining == 2 && _onPubAck)
+                    _onPubAck(_onPubAckContext, _packetId);
+
+                _state = PARSE_HEADER;
+            }
+        }
+    }
+};
+
+#endif // MQTT_ACK_CLIENT_H
@@ -0,0 +1,333 @@
+#ifndef MQTT_RELIABLE_PUBLISHER_H
+#define MQTT_RELIABLE_PUBLISHER_H
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include "Logging.h"
+
+// Number of messages that can be queued, in flight or waiting for a window slot
+#define MQTT_QOS1_QUEUE_SIZE 16
+// Upper bound for setWindow()
+#define MQTT_QOS1_MAX_WINDOW 8
+// Largest encoded PUBLISH packet that can be queued
+#define MQTT_QOS1_MAX_PACKET 256
+// Broker connections one publisher can deliver to
+#define MQTT_MAX_BROKERS 2
+
+// QoS 1 publishing on top of PubSubClient, which itself only supports QoS 0.
+// PUBLISH packets are encoded once into fixed slots and the same slot is
+// written to every broker's client, up to `window` of them unacknowledged at
+// once on each. PUBACKs are fed back through onPubAck() from each broker's
+// MqttAckClient. Unacknowledged packets are resent with the DUP flag after a
+// timeout and after every reconnect of that broker.
+//
+// A slot is freed once every broker has acknowledged it. When the queue is
+// full the newest message always gets in, so an alarm is never lost behind a
+// backlog of zone updates during an outage. An older retained message on the
+// same topic is given up on first, as the new one replaces it on the broker
+// anyway, otherwise the oldest message is. Either counts as dropped for every
+// broker that hadn't acknowledged it.
+class MqttReliablePublisher
+{
+public:
+    uint8_t addClient(PubSubClient *client);
+    bool publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained);
+    void onPubAck(uint8_t broker, uint16_t packetId);
+    void onConnect(uint8_t broker);
+    void loop();
+
+    void setWindow(uint8_t window) { _window = constrain(window, 1, MQTT_QOS1_MAX_WINDOW); }
+    void setRetryInterval(uint16_t interval) { _retryInterval = interval; }
+
+    uint8_t queued() { return _count; }
+    uint8_t inFlight(uint8_t broker) { return _brokers[broker].inFlight; }
+    uint32_t retransmits(uint8_t broker) { return _brokers[broker].retransmits; }
+    uint32_t dropped(uint8_t broker) { return _brokers[broker].dropped; }
+    uint32_t retransmits();
+    uint32_t dropped();
+
+    // Context for MqttAckClient::setPubAckCallback(), one per broker
+    typedef struct {
+        MqttReliablePublisher *publisher;
+        uint8_t broker;
+    } AckContext;
+
+    AckContext *ackContext(uint8_t broker) { return &_brokers[broker].ackContext; }
+
+    static void pubAckCallback(void *context, uint16_t packetId)
+    {
+        AckContext *ack = (AckContext *)context;
+        ack->publisher->onPubAck(ack->broker, packetId);
+    }
+
+private:
+    typedef struct {
+        uint16_t packetId;
+        uint16_t length;
+        uint8_t pending;    // Brokers that haven't acknowledged it, one bit each
+        uint8_t sent;       // Brokers it has been written to at least once
+        uint32_t sentAt[MQTT_MAX_BROKERS];
+        uint8_t packet[MQTT_QOS1_MAX_PACKET];
+    } Slot;
+
+    typedef struct {
+        PubSubClient *client;
+        AckContext ackContext;
+        uint8_t inFlight;
+        uint32_t retransmits;
+        uint32_t dropped;
+    } Broker;
+
+    static const uint8_t MQTT_PUBLISH_QOS1 = 0x32;
+    static const uint8_t MQTT_FLAG_DUP = 0x08;
+    static const uint8_t MQTT_FLAG_RETAIN = 0x01;
+
+    Broker _brokers[MQTT_MAX_BROKERS];
+    uint8_t _brokerCount = 0;
+    Slot _slots[MQTT_QOS1_QUEUE_SIZE];
+    uint8_t _head = 0;  // Oldest queued message
+    uint8_t _count = 0;
+    uint8_t _window = 4;
+    uint16_t _retryInterval = 5000;
+    uint16_t _nextPacketId = 1;
+    uint32_t _rejected = 0;
+
+    uint8_t allBrokers() { return (1 << _brokerCount) - 1; }
+    void release(Slot *slot, uint8_t broker);
+    void reclaim();
+    void remove(uint8_t index);
+    const uint8_t *topicOf(const Slot *slot, size_t *length);
+    void loop(uint8_t broker);
+    bool send(Slot *slot, uint8_t broker);
+};
+
+uint8_t MqttReliablePublisher::addClient(PubSubClient *client)
+{
+    if (_brokerCount >= MQTT_MAX_BROKERS)
+        return _brokerCount - 1;
+
+    Broker *broker = &_brokers[_brokerCount];
+    broker->client = client;
+    broker->ackContext = {this, _brokerCount};
+    broker->inFlight = 0;
+    broker->retransmits = 0;
+    broker->dropped = 0;
+    return _brokerCount++;
+}
+
+uint32_t MqttReliablePublisher::retransmits()
+{
+    uint32_t total = 0;
+    for (uint8_t b = 0; b < _brokerCount; b++)
+        total += _brokers[b].retransmits;
+    return total;
+}
+
+uint32_t MqttReliablePublisher::dropped()
+{
+    uint32_t total = _rejected;
+    for (uint8_t b = 0; b < _brokerCount; b++)
+        total += _brokers[b].dropped;
+    return total;
+}
+
+bool MqttReliablePublisher::publish(const char *topic, const uint8_t *payload, unsigned int length, bool retained)
+{
+    size_t topicLength = strlen(topic);
+    size_t remainingLength = 2 + topicLength + 2 + length;
+
+    // Fixed header, up to two remaining length bytes, then the variable header and payload
+    if (remainingLength > 16383 || 3 + remainingLength > MQTT_QOS1_MAX_PACKET)
+    {
+        Log.printf("QoS1 message too large for %s\n", topic);
+        _rejected++;
+        return false;
+    }
+
+    if (_count >= MQTT_QOS1_QUEUE_SIZE)
+    {
+        uint8_t victim = 0;
+        for (uint8_t i = 0; retained && i < _count; i++)
+        {
+            Slot *queued = &_slots[(_head + i) % MQTT_QOS1_QUEUE_SIZE];
+            size_t queuedLength;
+            const uint8_t *queuedTopic = topicOf(queued, &queuedLength);
+
+            if ((queued->packet[0] & MQTT_FLAG_RETAIN) && queuedLength == topicLength &&
+                memcmp(queuedTopic, topic, topicLength) == 0)
+            {
+                victim = i;
+                break;
+            }
+        }
+        remove(victim);
+    }
+
+    Slot *slot = &_slots[(_head + _count) % MQTT_QOS1_QUEUE_SIZE];
+    _count++;
+
+    // One id for every broker, so the encoded packet can be shared
+    slot->packetId = _nextPacketId++;
+    if (_nextPacketId == 0)
+        _nextPacketId = 1;
+
+    uint8_t *p = slot->packet;
+    *p++ = MQTT_PUBLISH_QOS1 | (retained ? MQTT_FLAG_RETAIN : 0);
+    if (remainingLength > 127)
+    {
+        *p++ = (remainingLength % 128) | 128;
+        *p++ = remainingLength / 128;
+    }
+    else
+    {
+        *p++ = remainingLength;
+    }
+    *p++ = topicLength >> 8;
+    *p++ = topicLength & 0xFF;
+    memcpy(p, topic, topicLength);
+    p += topicLength;
+    *p++ = slot->packetId >> 8;
+    *p++ = slot->packetId & 0xFF;
+    memcpy(p, payload, length);
+    p += length;
+
+    slot->length = p - slot->packet;
+    slot->pending = allBrokers();
+    slot->sent = 0;
+
+    loop();
+    return true;
+}
+
+bool MqttReliablePublisher::send(Slot *slot, uint8_t broker)
+{
+    Broker *b = &_brokers[broker];
+    uint8_t bit = 1 << broker;
+
+    // The packet is shared, so DUP goes in a copy of the first byte
+    uint8_t header = slot->packet[0];
+    if (slot->sent & bit)
+    {
+        header |= MQTT_FLAG_DUP;
+        b->retransmits++;
+    }
+    else
+    {
+        b->inFlight++;
+    }
+
+    slot->sent |= bit;
+    slot->sentAt[broker] = millis();
+    size_t rest = slot->length - 1;
+    return b->client->write(&header, 1) == 1 && b->client->write(&slot->packet[1], rest) == rest;
+}
+
+// Stops tracking a slot for one broker, whether acknowledged or given up on
+void MqttReliablePublisher::release(Slot *slot, uint8_t broker)
+{
+    uint8_t bit = 1 << broker;
+
+    if (slot->sent & bit)
+        _brokers[broker].inFlight--;
+
+    slot->pending &= ~bit;
+    slot->sent &= ~bit;
+}
+
+// Slots every broker is done with are reclaimed once they reach the head
+void MqttReliablePublisher::reclaim()
+{
+    while (_count > 0 && _slots[_head].pending == 0)
+    {
+        _head = (_head + 1) % MQTT_QOS1_QUEUE_SIZE;
+        _count--;
+    }
+}
+
+// Gives up on a queued message for every broker still waiting on it
+void MqttReliablePublisher::remove(uint8_t index)
+{
+    Slot *slot = &_slots[(_head + index) % MQTT_QOS1_QUEUE_SIZE];
+    for (uint8_t b = 0; b < _brokerCount; b++)
+    {
+        if (slot->pending & (1 << b))
+        {
+            release(slot, b);
+            _brokers[b].dropped++;
+        }
+    }
+
+    // Close the gap so the rest keep their order
+    for (uint8_t i = index; i + 1 < _count; i++)
+        _slots[(_head + i) % MQTT_QOS1_QUEUE_SIZE] = _slots[(_head + i + 1) % MQTT_QOS1_QUEUE_SIZE];
+    _count--;
+}
+
+const uint8_t *MqttReliablePublisher::topicOf(const Slot *slot, size_t *length)
+{
+    // Remaining length is one or two bytes, see publish()
+    const uint8_t *p = &slot->packet[(slot->packet[1] & 128) ? 3 : 2];
+    *length = (p[0] << 8) | p[1];
+    return p + 2;
+}
+
+void MqttReliablePublisher::onPubAck(uint8_t broker, uint16_t packetId)
+{
+    uint8_t bit = 1 << broker;
+
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        Slot *slot = &_slots[(_head + i) % MQTT_QOS1_QUEUE_SIZE];
+        if ((slot->sent & bit) && slot->packetId == packetId)
+        {
+            release(slot, broker);
+            break;
+        }
+    }
+
+    reclaim();
+}
+
+void MqttReliablePublisher::onConnect(uint8_t broker)
+{
+    // The broker session is clean, so everything unacknowledged has to go again
+    for (uint8_t i = 0; i < _count; i++)
+    {
+        Slot *slot = &_slots[(_head + i) % MQTT_QOS1_QUEUE_SIZE];
+        if (slot->sent & (1 << broker))
+            slot->sentAt[broker] = millis() - _retryInterval;
+    }
+    loop(broker);
+}
+
+void MqttReliablePublisher::loop()
+{
+    for (uint8_t b = 0; b < _brokerCount; b++)
+        loop(b);
+}
+
+// Each broker has its own window over the slots it still needs
+void MqttReliablePublisher::loop(uint8_t broker)
+{
+    if (!_brokers[broker].client->connected())
+        return;
+
+    uint8_t bit = 1 << broker;
+    uint8_t windowUsed = 0;
+    for (uint8_t i = 0; i < _count && windowUsed < _window; i++)
+    {
+        Slot *slot = &_slots[(_head + i) % MQTT_QOS1_QUEUE_SIZE];
+        if ((slot->pending & bit) == 0)
+            continue;
+
+        windowUsed++;
+
+        if ((slot->sent & bit) == 0 || millis() - slot->sentAt[broker] >= _retryInterval)
+        {
+            if (!send(slot, broker))
+                break;
+        }
+    }
+}
+
+#endif // MQTT_RELIABLE_PUBLISHER_H
@@ -0,0 +1,233 @@
+#ifndef MQTT_TOPIC_ROUTER_H
+#define MQTT_TOPIC_ROUTER_H
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include "Logging.h"
+
+// Topic filters that can be routed
+#define MQTT_ROUTER_MAX_ROUTES 16
+// Trie nodes, one per distinct filter level
+#define MQTT_ROUTER_MAX_NODES 48
+// Copies of the filters, the nodes point into these
+#define MQTT_ROUTER_POOL_SIZE 768
+// Nodes a topic can be matching at once through + wildcards
+#define MQTT_ROUTER_MAX_ACTIVE 8
+
+// Routes inbound messages to handlers by topic filter, with the usual + and #
+// wildcards. The filters are held in a trie of topic levels, so a message is
+// matched in one walk along its topic however many routes there are. Handlers
+// get the topic and payload straight from PubSubClient's buffer, they are
+// only valid during the call. Every filter is subscribed again by
+// subscribeAll() after each connect.
+class MqttTopicRouter
+{
+public:
+    typedef void (*HANDLER)(const char *topic, const uint8_t *payload, unsigned int length, void *context);
+
+    MqttTopicRouter() { _nodes[0].level = ""; _nodes[0].levelLength = 0; }
+
+    bool add(const char *filter, HANDLER handler, void *context);
+    uint8_t dispatch(const char *topic, const uint8_t *payload, unsigned int length);
+    void subscribeAll(PubSubClient *client);
+
+private:
+    static const uint8_t NONE = 0xFF;
+
+    typedef struct {
+        const char *level;          // Points into the filter pool, not terminated
+        uint8_t levelLength;
+        uint8_t firstChild = NONE;
+        uint8_t nextSibling = NONE;
+        uint8_t firstRoute = NONE;
+    } Node;
+
+    typedef struct {
+        const char *filter;
+        HANDLER handler;
+        void *context;
+        uint8_t nextRoute;          // Next route on the same node
+    } Route;
+
+    Node _nodes[MQTT_ROUTER_MAX_NODES];
+    uint8_t _nodeCount = 1;         // Node 0 is the root
+    Route _routes[MQTT_ROUTER_MAX_ROUTES];
+    uint8_t _routeCount = 0;
+    char _pool[MQTT_ROUTER_POOL_SIZE];
+    size_t _poolUsed = 0;
+
+    bool isLevel(const Node *node, char wildcard) { return node->levelLength == 1 && node->level[0] == wildcard; }
+    uint8_t child(uint8_t parent, const char *level, size_t length);
+    uint8_t callRoutes(uint8_t node, const char *topic, const uint8_t *payload, unsigned int length);
+};
+
+bool MqttTopicRouter::add(const char *filter, HANDLER handler, void *context)
+{
+    size_t filterLength = strlen(filter);
+
+    if (_routeCount >= MQTT_ROUTER_MAX_ROUTES || _poolUsed + filterLength + 1 > MQTT_ROUTER_POOL_SIZE)
+    {
+        Log.printf("MQTT router full, can't route %s\n", filter);
+        return false;
+    }
+
+    // + and # must be whole levels, and # only the last one
+    for (const char *c = filter; *c; c++)
+    {
+        bool wholeLevel = (c == filter || c[-1] == '/') && (c[1] == '\0' || c[1] == '/');
+        if ((*c == '+' && !wholeLevel) || (*c == '#' && (!wholeLevel || c[1] != '\0')))
+        {
+            Log.printf("Invalid MQTT topic filter %s\n", filter);
+            return false;
+        }
+    }
+
+    char *copy = &_pool[_poolUsed];
+    memcpy(copy, filter, filterLength + 1);
+    _poolUsed += filterLength + 1;
+
+    uint8_t node = 0;
+    const char *level = copy;
+    while (true)
+    {
+        const char *end = strchr(level, '/');
+        size_t levelLength = end != NULL ? end - level : strlen(level);
+
+        uint8_t next = child(node, level, levelLength);
+        if (next == NONE)
+        {
+            if (_nodeCount >= MQTT_ROUTER_MAX_NODES || levelLength > 255)
+            {
+                Log.printf("MQTT router full, can't route %s\n", filter);
+                return false;
+            }
+
+            next = _nodeCount++;
+            _nodes[next].level = level;
+            _nodes[next].levelLength = levelLength;
+            _nodes[next].nextSibling = _nodes[node].firstChild;
+            _nodes[node].firstChild = next;
+        }
+        node = next;
+
+        if (end == NULL)
+            break;
+        level = end + 1;
+    }
+
+    Route *route = &_routes[_routeCount];
+    route->filter = copy;
+    route->handler = handler;
+    route->context = context;
+    route->nextRoute = _nodes[node].firstRoute;
+    _nodes[node].firstRoute = _routeCount++;
+    return true;
+}
+
+uint8_t MqttTopicRouter::child(uint8_t parent, const char *level, size_t length)
+{
+    for (uint8_t i = _nodes[parent].firstChild; i != NONE; i = _nodes[i].nextSibling)
+    {
+        if (_nodes[i].levelLength == length && memcmp(_nodes[i].level, level, length) == 0)
+            return i;
+    }
+    return NONE;
+}
+
+uint8_t MqttTopicRouter::callRoutes(uint8_t node, const char *topic, const uint8_t *payload, unsigned int length)
+{
+    uint8_t called = 0;
+    for (uint8_t i = _nodes[node].firstRoute; i != NONE; i = _routes[i].nextRoute)
+    {
+        _routes[i].handler(topic, payload, length, _routes[i].context);
+        called++;
+    }
+    return called;
+}
+
+// Returns how many handlers were called
+uint8_t MqttTopicRouter::dispatch(const char *topic, const uint8_t *payload, unsigned int length)
+{
+    uint8_t active[MQTT_ROUTER_MAX_ACTIVE] = {0};
+    uint8_t activeCount = 1;
+    uint8_t called = 0;
+
+    // Wildcards at the first level don't match $SYS and the like
+    bool wildcards = topic[0] != '$';
+    const char *level = topic;
+
+    while (activeCount > 0)
+    {
+        const char *end = strchr(level, '/');
+        size_t levelLength = end != NULL ? end - level : strlen(level);
+
+        uint8_t next[MQTT_ROUTER_MAX_ACTIVE];
+        uint8_t nextCount = 0;
+
+        for (uint8_t a = 0; a < activeCount; a++)
+        {
+            for (uint8_t i = _nodes[active[a]].firstChild; i != NONE; i = _nodes[i].nextSibling)
+            {
+                Node *node = &_nodes[i];
+                bool matches;
+
+                if (isLevel(node, '#'))
+                {
+                    // Matches everything from here down, nothing further to follow
+                    if (wildcards)
+                        called += callRoutes(i, topic, payload, length);
+                    continue;
+                }
+                else if (isLevel(node, '+'))
+                {
+                    matches = wildcards;
+                }
+                else
+                {
+                    matches = node->levelLength == levelLength && memcmp(node->level, level, levelLength) == 0;
+                }
+
+                if (matches && nextCount < MQTT_ROUTER_MAX_ACTIVE)
+                    next[nextCount++] = i;
+            }
+        }
+
+        memcpy(active, next, nextCount);
+        activeCount = nextCount;
+        wildcards = true;
+
+        if (end == NULL)
+            break;
+        level = end + 1;
+    }
+
+    // Whole topic matched, "a/#" also covers "a" itself
+    for (uint8_t a = 0; a < activeCount; a++)
+    {
+        called += callRoutes(active[a], topic, payload, length);
+
+        for (uint8_t i = _nodes[active[a]].firstChild; i != NONE; i = _nodes[i].nextSibling)
+        {
+            if (isLevel(&_nodes[i], '#'))
+                called += callRoutes(i, topic, payload, length);
+        }
+    }
+
+    return called;
+}
+
+void MqttTopicRouter::subscribeAll(PubSubClient *client)
+{
+    for (uint8_t i = 0; i < _routeCount; i++)
+    {
+        // Several handlers on one filter only need it subscribed once
+        bool duplicate = false;
+        for (uint8_t j = 0; j < i && !duplicate; j++)
+            duplicate = strcmp(_routes[i].filter, _routes[j].filter) == 0;
+
+        if (!duplicate)
+            client->subscribe(_routes[i].filter);
+    }
+}
+
+#endif // MQTT_TOPIC_ROUTER_H
@@ -0,0 +1,127 @@
+#ifndef NON_BLOCKING_CLIENT_H
+#define NON_BLOCKING_CLIENT_H
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "lwip/sockets.h"
+
+#define nonBlockingConnectTimeout 5000  // Longest a TCP handshake may take, in ms
+
+// Connects a WiFiClient without waiting on the TCP handshake. The first
+// connect() starts it and returns 0 straight away, later calls return 0 while
+// connecting() and 1 once the socket is up, when it is handed to the
+// WiFiClient. Everything else passes straight through. PubSubClient only
+// connects its network client when it isn't connected already, so calling
+// its connect() on each loop polls the handshake, and a broker that is down
+// or unreachable never holds up the caller.
+//
+// Only the handshake is non-blocking. Name lookups still wait, as does
+// PubSubClient for the CONNACK once the socket is up, bounded by its socket
+// timeout.
+class NonBlockingClient : public Client
+{
+public:
+    NonBlockingClient(WiFiClient &client) : _client(client) {}
+    ~NonBlockingClient() { abandon(); }
+
+    int connect(IPAddress ip, uint16_t port)
+    {
+        if (_fd < 0 && !start(ip, port))
+            return 0;
+        return poll();
+    }
+
+    int connect(const char *host, uint16_t port)
+    {
+        IPAddress ip;
+        if (!WiFi.hostByName(host, ip))
+            return 0;
+        return connect(ip, port);
+    }
+
+    bool connecting() { return _fd >= 0; }
+
+    size_t write(uint8_t b) { return _client.write(b); }
+    size_t write(const uint8_t *buf, size_t size) { return _client.write(buf, size); }
+    int available() { return _client.available(); }
+    int read() { return _client.read(); }
+    int read(uint8_t *buf, size_t size) { return _client.read(buf, size); }
+    int peek() { return _client.peek(); }
+    void flush() { _client.flush(); }
+    void stop() { abandon(); _client.stop(); }
+    uint8_t connected() { return _client.connected(); }
+    operator bool() { return (bool)_client; }
+
+private:
+    WiFiClient &_client;
+    int _fd = -1;               // Socket still handshaking
+    uint32_t _startedAt = 0;
+
+    bool start(IPAddress ip, uint16_t port)
+    {
+        _client.stop();
+
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd < 0)
+            return false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = (uint32_t)ip;
+        address.sin_port = htons(port);
+
+        if (::connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)
+        {
+            close(fd);
+            return false;
+        }
+
+        _fd = fd;
+        _startedAt = millis();
+        return true;
+    }
+
+    int poll()
+    {
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(_fd, &writable);
+        struct timeval now = {0, 0};
+
+        if (select(_fd + 1, NULL, &writable, NULL, &now) <= 0)
+        {
+            if (millis() - _startedAt >= nonBlockingConnectTimeout)
+                abandon();
+            return 0;
+        }
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+        {
+            abandon();
+            return 0;
+        }
+
+        // Blocking again, with the options WiFiClient::connect() would set
+        int enable = 1;
+        fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL, 0) & ~O_NONBLOCK);
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        setsockopt(_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+
+        _client = WiFiClient(_fd);
+        _fd = -1;
+        return 1;
+    }
+
+    void abandon()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        _fd = -1;
+    }
+};
+
+#endif // NON_BLOCKING_CLIENT_H
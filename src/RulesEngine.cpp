@@ -0,0 +1,377 @@
+// Copyright 2021 Kevin Cooper
+
+#include "RulesEngine.h"
+
+static const char *alarmStateNames[] = {"disarmed", "armed_home", "armed_away", "entry", "exit", "triggered"};
+static const char *zoneEdgeNames[] = {"active", "inactive", "tamper", "fault"};
+
+RulesEngine::RulesEngine(Texecom *panel, const uint8_t *outputPins, uint8_t outputPinCount)
+    : panel(panel), outputPins(outputPins), outputPinCount(outputPinCount)
+{
+    memset(&table, 0, sizeof(table));
+    memset(lastZoneState, 0, sizeof(lastZoneState));
+
+    for (uint8_t i = 0; i < rulesMaxRules; i++)
+    {
+        pulses[i].engine = this;
+        pulses[i].timer.setCallback(pulseEnded, &pulses[i]);
+    }
+}
+
+bool RulesEngine::begin(bool (*publish)(const char *topic, const char *payload))
+{
+    this->publish = publish;
+
+    // Half subscribed would run zone rules but never alarm ones
+    if (!Texecom::zoneEvents.subscribe(zoneEvent, this) || !Texecom::alarmEvents.subscribe(alarmEvent, this))
+    {
+        Texecom::zoneEvents.unsubscribe(zoneEvent, this);
+        Log.println("Rules: no room on the panel event buses, rules won't run");
+        return false;
+    }
+    return true;
+}
+
+bool RulesEngine::compile(const char *text, size_t length)
+{
+    static TABLE compiled;
+    static char source[2048];
+
+    if (length >= sizeof(source))
+    {
+        Log.println("Rules: config too large");
+        return false;
+    }
+
+    memcpy(source, text, length);
+    source[length] = '\0';
+    memset(&compiled, 0, sizeof(compiled));
+    compiled.stringsLength = 1; // Offset 0 is the empty string
+
+    uint16_t lineNumber = 0;
+    char *save;
+    for (char *line = strtok_r(source, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+        lineNumber++;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (*line == '\0' || *line == '#' || *line == '\r')
+            continue;
+
+        if (compiled.count >= rulesMaxRules || !parseRule(line, &compiled))
+        {
+            Log.printf("Rules: line %d not understood, keeping the previous %d rules\n", lineNumber, table.count);
+            return false;
+        }
+    }
+
+    // The rules topic is retained and comes again on every reconnect, which
+    // mustn't turn off an output a rule has latched
+    if (memcmp(&compiled, &table, sizeof(table)) == 0)
+        return true;
+
+    // Pins still driven by a rule keep their level and any pulse runs out,
+    // only pins nothing drives any more are turned off
+    for (uint8_t i = 0; i < rulesMaxRules; i++)
+    {
+        if (pulses[i].timer.isPending() && !usesPin(compiled, pulses[i].pin))
+        {
+            pulses[i].timer.stop();
+            digitalWrite(pulses[i].pin, LOW);
+        }
+    }
+
+    for (uint8_t i = 0; i < table.count; i++)
+        if (table.rules[i].action != ACTION_PUBLISH && !usesPin(compiled, table.rules[i].pin))
+            digitalWrite(table.rules[i].pin, LOW);
+
+    for (uint8_t i = 0; i < compiled.count; i++)
+    {
+        if (compiled.rules[i].action != ACTION_PUBLISH && !usesPin(table, compiled.rules[i].pin))
+        {
+            pinMode(compiled.rules[i].pin, OUTPUT);
+            digitalWrite(compiled.rules[i].pin, LOW);
+        }
+    }
+
+    memcpy(&table, &compiled, sizeof(table));
+
+    Log.printf("Rules: %d compiled\n", table.count);
+    return true;
+}
+
+bool RulesEngine::usesPin(const TABLE &rules, uint8_t pin)
+{
+    for (uint8_t i = 0; i < rules.count; i++)
+        if (rules.rules[i].action != ACTION_PUBLISH && rules.rules[i].pin == pin)
+            return true;
+    return false;
+}
+
+uint16_t RulesEngine::addString(TABLE *compiled, const char *text)
+{
+    size_t length = strlen(text) + 1;
+    if (compiled->stringsLength + length > sizeof(compiled->strings))
+        return 0xFFFF;
+
+    uint16_t offset = compiled->stringsLength;
+    memcpy(&compiled->strings[offset], text, length);
+    compiled->stringsLength += length;
+    return offset;
+}
+
+// <trigger> [when <state>[,<state>...]] -> <action>
+bool RulesEngine::parseRule(char *line, TABLE *compiled)
+{
+    RULE rule;
+    int zone = -1;
+    char *save;
+    memset(&rule, 0, sizeof(rule));  // Padding too, compile() compares tables whole
+
+    // The publish payload is free text, split it off before tokenising
+    char *arrow = strstr(line, "->");
+    if (arrow == NULL)
+        return false;
+    *arrow = '\0';
+    char *action = arrow + 2;
+
+    char *word = strtok_r(line, " \t\r", &save);
+    if (word == NULL)
+        return false;
+
+    if (strcmp(word, "zone") == 0)
+    {
+        rule.trigger = TRIGGER_ZONE;
+
+        word = strtok_r(NULL, " \t\r", &save);
+        if (word == NULL)
+            return false;
+        if (strcmp(word, "*") == 0)
+        {
+            zone = 0;
+        }
+        else
+        {
+            zone = atoi(word);
+            if (zone <= 0 || zone >= rulesMaxZones)
+                return false;
+        }
+
+        word = strtok_r(NULL, " \t\r", &save);
+        int edge = -1;
+        for (uint8_t i = 0; word != NULL && i < sizeof(zoneEdgeNames) / sizeof(zoneEdgeNames[0]); i++)
+            if (strcmp(word, zoneEdgeNames[i]) == 0)
+                edge = i;
+        if (edge < 0)
+            return false;
+        rule.edge = edge;
+    }
+    else if (strcmp(word, "alarm") == 0)
+    {
+        rule.trigger = TRIGGER_ALARM;
+        int state = parseAlarmState(strtok_r(NULL, " \t\r", &save));
+        if (state < 0)
+            return false;
+        rule.edge = state;
+    }
+    else
+    {
+        return false;
+    }
+
+    word = strtok_r(NULL, " \t\r", &save);
+    if (word != NULL)
+    {
+        if (strcmp(word, "when") != 0)
+            return false;
+
+        char *states = strtok_r(NULL, " \t\r", &save);
+        char *stateSave;
+        for (char *state = states ? strtok_r(states, ",", &stateSave) : NULL; state != NULL; state = strtok_r(NULL, ",", &stateSave))
+        {
+            int value = parseAlarmState(state);
+            if (value < 0)
+                return false;
+            rule.alarmStates |= 1 << value;
+        }
+        if (rule.alarmStates == 0 || strtok_r(NULL, " \t\r", &save) != NULL)
+            return false;
+    }
+
+    word = strtok_r(action, " \t\r", &save);
+    if (word == NULL)
+        return false;
+
+    if (strcmp(word, "publish") == 0)
+    {
+        char *topic = strtok_r(NULL, " \t\r", &save);
+        if (topic == NULL)
+            return false;
+
+        char *payload = strtok_r(NULL, "\r", &save);
+        while (payload != NULL && (*payload == ' ' || *payload == '\t'))
+            payload++;
+
+        rule.action = ACTION_PUBLISH;
+        rule.topic = addString(compiled, topic);
+        rule.payload = payload != NULL && *payload != '\0' ? addString(compiled, payload) : 0;
+        if (rule.topic == 0xFFFF || rule.payload == 0xFFFF)
+            return false;
+    }
+    else if (strcmp(word, "gpio") == 0)
+    {
+        char *pin = strtok_r(NULL, " \t\r", &save);
+        char *mode = strtok_r(NULL, " \t\r", &save);
+        if (pin == NULL || mode == NULL || !isOutputPin(atoi(pin)))
+            return false;
+        rule.pin = atoi(pin);
+
+        if (strcmp(mode, "on") == 0)
+        {
+            rule.action = ACTION_GPIO_ON;
+        }
+        else if (strcmp(mode, "off") == 0)
+        {
+            rule.action = ACTION_GPIO_OFF;
+        }
+        else if (strcmp(mode, "pulse") == 0)
+        {
+            char *duration = strtok_r(NULL, " \t\r", &save);
+            if (duration == NULL || atoi(duration) <= 0 || atoi(duration) > 65535)
+                return false;
+            rule.action = ACTION_GPIO_PULSE;
+            rule.pulseMs = atoi(duration);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    RULE_MASK bit = (RULE_MASK)1 << compiled->count;
+    if (rule.trigger == TRIGGER_ALARM)
+        compiled->alarmRules[rule.edge] |= bit;
+    else if (zone == 0)
+        compiled->anyZoneRules |= bit;
+    else
+        compiled->zoneRules[zone] |= bit;
+
+    memcpy(&compiled->rules[compiled->count++], &rule, sizeof(rule));
+    return true;
+}
+
+// Only pins set aside for rules, a config must never be able to drive the
+// panel inputs
+bool RulesEngine::isOutputPin(int pin)
+{
+    for (uint8_t i = 0; i < outputPinCount; i++)
+        if (outputPins[i] == pin)
+            return true;
+    return false;
+}
+
+int RulesEngine::parseAlarmState(const char *word)
+{
+    for (uint8_t i = 0; word != NULL && i < sizeof(alarmStateNames) / sizeof(alarmStateNames[0]); i++)
+        if (strcmp(word, alarmStateNames[i]) == 0)
+            return i;
+    return -1;
+}
+
+void RulesEngine::zoneEvent(const Texecom::ZONE_EVENT &event, void *engine)
+{
+    RulesEngine *rules = (RulesEngine *)engine;
+    if (event.panel != rules->panel)
+        return;
+
+    uint8_t previous = rules->lastZoneState[event.zone];
+    rules->lastZoneState[event.zone] = event.state;
+
+    RULE_MASK candidates = rules->table.zoneRules[event.zone] | rules->table.anyZoneRules;
+    RULE_MASK matched = 0;
+
+    for (uint8_t i = 0; candidates != 0; i++, candidates >>= 1)
+        if ((candidates & 1) && rules->matchesEdge(rules->table.rules[i], previous, event.state))
+            matched |= (RULE_MASK)1 << i;
+
+    rules->run(matched);
+}
+
+void RulesEngine::alarmEvent(const Texecom::ALARM_EVENT &event, void *engine)
+{
+    RulesEngine *rules = (RulesEngine *)engine;
+    if (event.panel != rules->panel)
+        return;
+
+    // Flag changes such as READY come through too, only a new state runs rules
+    if (event.state == rules->lastAlarmState)
+        return;
+    rules->lastAlarmState = event.state;
+
+    rules->run(rules->table.alarmRules[event.state]);
+}
+
+bool RulesEngine::matchesEdge(const RULE &rule, uint8_t previous, uint8_t state)
+{
+    switch (rule.edge)
+    {
+    case ZONE_EDGE_ACTIVE:
+        return !(previous & Texecom::ZONE_ACTIVE) && (state & Texecom::ZONE_ACTIVE);
+    case ZONE_EDGE_INACTIVE:
+        return (previous & Texecom::ZONE_ACTIVE) && !(state & Texecom::ZONE_ACTIVE);
+    case ZONE_EDGE_TAMPER:
+        return !(previous & Texecom::ZONE_TAMPER) && (state & Texecom::ZONE_TAMPER);
+    case ZONE_EDGE_FAULT:
+        return !(previous & Texecom::ZONE_FAULT) && (state & Texecom::ZONE_FAULT);
+    }
+    return false;
+}
+
+void RulesEngine::run(RULE_MASK mask)
+{
+    uint8_t alarmState = 1 << panel->getAlarmState();
+
+    for (uint8_t i = 0; mask != 0; i++, mask >>= 1)
+    {
+        if (!(mask & 1))
+            continue;
+
+        const RULE &rule = table.rules[i];
+        if (rule.alarmStates != 0 && !(rule.alarmStates & alarmState))
+            continue;
+
+        fired++;
+
+        switch (rule.action)
+        {
+        case ACTION_PUBLISH:
+            if (publish != NULL)
+                publish(&table.strings[rule.topic], rule.payload != 0 ? &table.strings[rule.payload] : "1");
+            break;
+        case ACTION_GPIO_ON:
+            digitalWrite(rule.pin, HIGH);
+            break;
+        case ACTION_GPIO_OFF:
+            digitalWrite(rule.pin, LOW);
+            break;
+        case ACTION_GPIO_PULSE:
+            // A pulse left running by the previous rules may be on another pin
+            if (pulses[i].timer.isPending() && pulses[i].pin != rule.pin)
+                digitalWrite(pulses[i].pin, LOW);
+            pulses[i].pin = rule.pin;
+            digitalWrite(rule.pin, HIGH);
+            pulses[i].timer.start(rule.pulseMs);
+            break;
+        }
+    }
+}
+
+void RulesEngine::pulseEnded(void *pulse)
+{
+    digitalWrite(((PULSE *)pulse)->pin, LOW);
+}
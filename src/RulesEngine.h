@@ -0,0 +1,109 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __RULES_ENGINE_H_
+#define __RULES_ENGINE_H_
+
+#include "Arduino.h"
+#include "Logging.h"
+#include "Scheduler.h"
+#include "texecom.h"
+
+#define rulesMaxRules 32
+#define rulesStringPoolSize 1024
+#define rulesMaxZones 256
+
+// Local reactions to panel events that keep working when the backend is down.
+//
+// Rules arrive as text, one per line, and are compiled into a fixed table:
+//   zone 9 active when armed_away -> publish home/security/alert Front door opened
+//   zone * tamper -> gpio 13 pulse 5000
+//   alarm triggered -> gpio 13 on
+//   alarm disarmed -> gpio 13 off
+//
+// Zone triggers are active, inactive, tamper and fault and fire on the edge
+// into that state. "when" takes a comma separated list of alarm states.
+// Each zone and alarm state has a bitmask of the rules it can trigger, so an
+// event only ever looks at its own rules.
+class RulesEngine {
+public:
+  RulesEngine(Texecom *panel, const uint8_t *outputPins, uint8_t outputPinCount);
+  bool begin(bool (*publish)(const char *topic, const char *payload));
+  bool compile(const char *text, size_t length);
+  uint8_t ruleCount() { return table.count; }
+  uint32_t firedCount() { return fired; }
+
+private:
+  typedef enum {
+      TRIGGER_ZONE = 0,
+      TRIGGER_ALARM = 1,
+  } TRIGGER;
+
+  typedef enum {
+      ZONE_EDGE_ACTIVE = 0,
+      ZONE_EDGE_INACTIVE = 1,
+      ZONE_EDGE_TAMPER = 2,
+      ZONE_EDGE_FAULT = 3,
+  } ZONE_EDGE;
+
+  typedef enum {
+      ACTION_PUBLISH = 0,
+      ACTION_GPIO_ON = 1,
+      ACTION_GPIO_OFF = 2,
+      ACTION_GPIO_PULSE = 3,
+  } ACTION;
+
+  typedef struct {
+      uint8_t trigger;       // TRIGGER
+      uint8_t edge;          // ZONE_EDGE, or the ALARM_STATE for alarm rules
+      uint8_t alarmStates;   // Bitmask of ALARM_STATE the panel must be in, 0 for any
+      uint8_t action;        // ACTION
+      uint8_t pin;
+      uint16_t pulseMs;
+      uint16_t topic;        // Offsets into the string pool
+      uint16_t payload;
+  } RULE;
+
+  typedef uint32_t RULE_MASK;
+
+  typedef struct {
+      RulesEngine *engine;
+      uint8_t pin;
+      Timer timer;
+  } PULSE;
+
+  // Everything compile() produces, built aside and swapped in whole so a bad
+  // config leaves the previous rules running
+  typedef struct {
+      RULE rules[rulesMaxRules];
+      uint8_t count;
+      char strings[rulesStringPoolSize];
+      uint16_t stringsLength;
+      RULE_MASK anyZoneRules;
+      RULE_MASK zoneRules[rulesMaxZones];
+      RULE_MASK alarmRules[6];
+  } TABLE;
+
+  Texecom *panel;
+  const uint8_t *outputPins;
+  uint8_t outputPinCount;
+  bool (*publish)(const char *topic, const char *payload) = NULL;
+
+  TABLE table;
+  PULSE pulses[rulesMaxRules];
+  uint8_t lastZoneState[rulesMaxZones];
+  Texecom::ALARM_STATE lastAlarmState = Texecom::DISARMED;  // As Texecom starts
+  uint32_t fired = 0;
+
+  static void zoneEvent(const Texecom::ZONE_EVENT &event, void *engine);
+  static void alarmEvent(const Texecom::ALARM_EVENT &event, void *engine);
+  static void pulseEnded(void *pulse);
+  void run(RULE_MASK mask);
+  bool matchesEdge(const RULE &rule, uint8_t previous, uint8_t state);
+  bool parseRule(char *line, TABLE *compiled);
+  static uint16_t addString(TABLE *compiled, const char *text);
+  static bool usesPin(const TABLE &rules, uint8_t pin);
+  bool isOutputPin(int pin);
+  static int parseAlarmState(const char *word);
+};
+
+#endif  // __RULES_ENGINE_H_
@@ -0,0 +1,167 @@
+#include "Scheduler.h"
+
+Scheduler scheduler;
+
+void Timer::start(uint32_t delay)
+{
+    stop();
+    period = 0;
+    deadline = Scheduler::now() + delay;
+    scheduler.add(this);
+}
+
+void Timer::startPeriodic(uint32_t period)
+{
+    stop();
+    this->period = period;
+    deadline = Scheduler::now() + period;
+    scheduler.add(this);
+}
+
+void Timer::stop()
+{
+    if (pending)
+        scheduler.remove(this);
+}
+
+void Scheduler::begin()
+{
+    task = xTaskGetCurrentTaskHandle();
+}
+
+void Scheduler::wake()
+{
+    if (task != NULL)
+        xTaskNotifyGive(task);
+}
+
+void Scheduler::add(Timer *timer)
+{
+    if (currentTick == 0)
+        currentTick = now();
+
+    if (timer->deadline < currentTick)
+        timer->deadline = currentTick;
+
+    uint64_t delta = timer->deadline - currentTick;
+    Timer **slot;
+
+    if (delta < level0Size)
+        slot = &level0[timer->deadline & (level0Size - 1)];
+    else if (delta < (uint64_t)level0Size << levelBits)
+        slot = &levels[0][(timer->deadline >> level0Bits) & (levelSize - 1)];
+    else if (delta < (uint64_t)level0Size << (levelBits * 2))
+        slot = &levels[1][(timer->deadline >> (level0Bits + levelBits)) & (levelSize - 1)];
+    else
+        slot = &overflow;
+
+    timer->next = *slot;
+    if (timer->next != NULL)
+        timer->next->link = &timer->next;
+    timer->link = slot;
+    *slot = timer;
+    timer->pending = true;
+}
+
+void Scheduler::remove(Timer *timer)
+{
+    *timer->link = timer->next;
+    if (timer->next != NULL)
+        timer->next->link = timer->link;
+
+    timer->next = NULL;
+    timer->link = NULL;
+    timer->pending = false;
+}
+
+// Moves every timer in a higher level slot down to wherever it now belongs
+void Scheduler::cascade(Timer **slot)
+{
+    Timer *timer = *slot;
+    *slot = NULL;
+
+    while (timer != NULL)
+    {
+        Timer *next = timer->next;
+        add(timer);
+        timer = next;
+    }
+}
+
+void Scheduler::fire(Timer *timer)
+{
+    remove(timer);
+
+    if (timer->period > 0)
+    {
+        timer->deadline += timer->period;
+        // Skip missed periods rather than firing them back to back
+        if (timer->deadline <= currentTick)
+            timer->deadline = currentTick + timer->period;
+        add(timer);
+    }
+
+    if (timer->callback != NULL)
+        timer->callback(timer->context);
+}
+
+void Scheduler::advance(uint64_t until)
+{
+    if (currentTick == 0)
+        currentTick = until;
+
+    while (currentTick <= until)
+    {
+        if ((currentTick & (level0Size - 1)) == 0)
+        {
+            uint8_t index1 = (currentTick >> level0Bits) & (levelSize - 1);
+            if (index1 == 0)
+            {
+                uint8_t index2 = (currentTick >> (level0Bits + levelBits)) & (levelSize - 1);
+                if (index2 == 0)
+                    cascade(&overflow);
+                cascade(&levels[1][index2]);
+            }
+            cascade(&levels[0][index1]);
+        }
+
+        Timer **slot = &level0[currentTick & (level0Size - 1)];
+        while (*slot != NULL)
+            fire(*slot);
+
+        currentTick++;
+    }
+}
+
+uint64_t Scheduler::nextDeadline()
+{
+    // Only level 0 needs scanning, anything further out first has to be
+    // cascaded at the next level 0 boundary. That may be the tick about to
+    // run, whose cascade hasn't happened yet.
+    if ((currentTick & (level0Size - 1)) == 0)
+        return currentTick;
+
+    uint64_t boundary = (currentTick | (level0Size - 1)) + 1;
+
+    for (uint64_t tick = currentTick; tick < boundary; tick++)
+    {
+        if (level0[tick & (level0Size - 1)] != NULL)
+            return tick;
+    }
+
+    return boundary;
+}
+
+void Scheduler::run(uint32_t maxIdle)
+{
+    uint64_t next = nextDeadline();
+    uint64_t current = now();
+
+    if (next > current)
+    {
+        uint64_t wait = next - current;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait < maxIdle ? wait : maxIdle));
+    }
+
+    advance(now());
+}
@@ -0,0 +1,74 @@
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include "Arduino.h"
+
+// A one-shot or periodic timer. Timers are owned by the caller and linked
+// straight into the wheel, so starting and stopping them never allocates.
+class Timer {
+public:
+  Timer() {}
+  Timer(void (*callback)(void *), void *context) : callback(callback), context(context) {}
+
+  // Adapts a member function so it can be used as a timer callback
+  template <typename T, void (T::*METHOD)()>
+  static void method(void *context) { (((T *)context)->*METHOD)(); }
+
+  void setCallback(void (*callback)(void *), void *context) { this->callback = callback; this->context = context; }
+  void start(uint32_t delay);
+  void startPeriodic(uint32_t period);
+  void stop();
+  bool isPending() { return pending; }
+
+private:
+  friend class Scheduler;
+
+  void (*callback)(void *) = NULL;
+  void *context = NULL;
+  uint64_t deadline = 0; // Milliseconds since boot, 64 bit so it never wraps
+  uint32_t period = 0;
+  bool pending = false;
+  Timer *next = NULL;
+  Timer **link = NULL; // Whatever points at this timer, the slot head or the previous timer's next
+};
+
+// Hierarchical timer wheel driving the main loop.
+//
+// Level 0 has one slot per millisecond for the next 256ms, each further level
+// covers 64 slots of the level below and anything beyond that waits on an
+// overflow list. run() sleeps on a task notification until the next deadline
+// or until wake() is called, for example when serial data arrives, and then
+// fires everything that has become due.
+class Scheduler {
+public:
+  void begin();
+  void run(uint32_t maxIdle = 20);
+  void wake();
+  static uint64_t now() { return esp_timer_get_time() / 1000; }
+
+private:
+  friend class Timer;
+
+  static const uint8_t level0Bits = 8;
+  static const uint8_t levelBits = 6;
+  static const uint16_t level0Size = 1 << level0Bits;
+  static const uint8_t levelSize = 1 << levelBits;
+  static const uint8_t levelCount = 2; // Levels above level 0
+
+  TaskHandle_t task = NULL;
+  uint64_t currentTick = 0;
+  Timer *level0[level0Size] = {};
+  Timer *levels[levelCount][levelSize] = {};
+  Timer *overflow = NULL;
+
+  void add(Timer *timer);
+  void remove(Timer *timer);
+  void cascade(Timer **slot);
+  void fire(Timer *timer);
+  void advance(uint64_t until);
+  uint64_t nextDeadline();
+};
+
+extern Scheduler scheduler;
+
+#endif  // __SCHEDULER_H_
@@ -0,0 +1,152 @@
+// Copyright 2021 Kevin Cooper
+
+#include "SerialBridge.h"
+#include "lwip/sockets.h"
+
+static_assert((serialBridgeBufferSize & (serialBridgeBufferSize - 1)) == 0,
+              "serialBridgeBufferSize must be a power of two");
+
+void SerialBridge::begin()
+{
+    server.begin();
+    server.setNoDelay(true);
+    started = true;
+}
+
+uint8_t SerialBridge::clientCount()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < serialBridgeMaxClients; i++)
+    {
+        if (connections[i].connected)
+            count++;
+    }
+    return count;
+}
+
+void SerialBridge::tap(const uint8_t *data, size_t length, void *serialBridge)
+{
+    ((SerialBridge *)serialBridge)->append(data, length);
+}
+
+// Called while the panel is being read, so only copies into the ring
+void SerialBridge::append(const uint8_t *data, size_t length)
+{
+    if (clientCount() == 0)
+    {
+        head += length;
+        return;
+    }
+
+    while (length > 0)
+    {
+        uint32_t offset = head & (serialBridgeBufferSize - 1);
+        size_t chunk = serialBridgeBufferSize - offset;
+        if (chunk > length)
+            chunk = length;
+
+        memcpy(&ring[offset], data, chunk);
+        head += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void SerialBridge::loop()
+{
+    if (!started || !WiFi.isConnected())
+        return;
+
+    acceptClients();
+
+    for (uint8_t i = 0; i < serialBridgeMaxClients; i++)
+    {
+        Connection *connection = &connections[i];
+
+        if (!connection->connected)
+            continue;
+
+        if (!connection->client.connected())
+        {
+            closeConnection(connection);
+            continue;
+        }
+
+        while (connection->client.available() > 0)
+            connection->client.read();
+
+        if (!send(connection))
+            closeConnection(connection);
+    }
+}
+
+void SerialBridge::acceptClients()
+{
+    while (server.hasClient())
+    {
+        WiFiClient client = server.accept();
+        Connection *connection = NULL;
+
+        for (uint8_t i = 0; i < serialBridgeMaxClients; i++)
+        {
+            if (!connections[i].connected)
+            {
+                connection = &connections[i];
+                break;
+            }
+        }
+
+        if (connection == NULL)
+        {
+            client.stop();
+            continue;
+        }
+
+        // Starts with the live stream, not whatever is left in the ring
+        connection->client = client;
+        connection->connected = true;
+        connection->cursor = head;
+        Log.printf("Serial bridge client connected: %s\n", client.remoteIP().toString().c_str());
+    }
+}
+
+// Writes what the socket will take without waiting, false if it has failed
+bool SerialBridge::send(Connection *connection)
+{
+    uint32_t pending = head - connection->cursor;
+
+    if (pending > serialBridgeBufferSize)
+    {
+        dropped += pending - serialBridgeBufferSize;
+        connection->cursor = head - serialBridgeBufferSize;
+        pending = serialBridgeBufferSize;
+    }
+
+    // At most two writes, either side of the end of the ring
+    while (pending > 0)
+    {
+        uint32_t offset = connection->cursor & (serialBridgeBufferSize - 1);
+        size_t chunk = serialBridgeBufferSize - offset;
+        if (chunk > pending)
+            chunk = pending;
+
+        int sent = ::send(connection->client.fd(), &ring[offset], chunk, MSG_DONTWAIT);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+
+        connection->cursor += sent;
+        pending -= sent;
+
+        if ((size_t)sent < chunk)
+            break;
+    }
+
+    return true;
+}
+
+void SerialBridge::closeConnection(Connection *connection)
+{
+    Log.println("Serial bridge client disconnected");
+    connection->client.stop();
+    connection->connected = false;
+}
@@ -0,0 +1,52 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __SERIAL_BRIDGE_H_
+#define __SERIAL_BRIDGE_H_
+
+#include "Arduino.h"
+#include <WiFi.h>
+#include "Logging.h"
+
+#define serialBridgeMaxClients 4
+#define serialBridgeBufferSize 4096  // Must be a power of two
+
+// Read-only ser2net style tap of one panel's raw Crestron stream. Anything a
+// client sends is discarded.
+//
+// Bytes are copied once, into a ring shared by every client, and each client
+// only keeps a cursor into it, so an extra client costs no memory or copying.
+// The panel never waits for a client. Clients are written without blocking,
+// as much as their socket will take, and one that falls more than the ring
+// behind skips the overwritten bytes, which are counted as dropped.
+class SerialBridge {
+public:
+  SerialBridge(uint16_t port) : server(port) {}
+
+  void begin();
+  void loop();
+  void append(const uint8_t *data, size_t length);
+  static void tap(const uint8_t *data, size_t length, void *serialBridge);
+
+  uint8_t clientCount();
+  uint32_t droppedBytes() { return dropped; }
+
+private:
+  typedef struct {
+      WiFiClient client;
+      bool connected = false;
+      uint32_t cursor;        // Position in the stream of the next byte to send
+  } Connection;
+
+  WiFiServer server;
+  bool started = false;
+  uint8_t ring[serialBridgeBufferSize];
+  uint32_t head = 0;          // Bytes appended since boot, wraps with the ring
+  uint32_t dropped = 0;
+  Connection connections[serialBridgeMaxClients];
+
+  void acceptClients();
+  bool send(Connection *connection);
+  void closeConnection(Connection *connection);
+};
+
+#endif  // __SERIAL_BRIDGE_H_
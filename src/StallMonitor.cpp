@@ -0,0 +1,213 @@
+#include "StallMonitor.h"
+#include "esp_timer.h"
+#include "esp_debug_helpers.h"
+
+#define stallMonitorMagic 0x5354414c
+
+StallMonitor stallMonitor;
+
+// Left alone by the bootloader, so the record outlives a watchdog or panic
+// reset but not a power cycle
+static RTC_NOINIT_ATTR struct {
+    uint32_t magic;
+    uint16_t boot;
+    uint8_t count;
+    StallMonitor::STALL stalls[stallMonitorMaxStalls];
+    uint32_t checksum;
+} persisted;
+
+static portMUX_TYPE stallMux = portMUX_INITIALIZER_UNLOCKED;
+
+thread_local StallMonitor::SECTION_STACK StallMonitor::taskSections;
+
+static uint32_t persistedChecksum()
+{
+    // FNV-1a over everything but the checksum itself
+    const uint8_t *bytes = (const uint8_t *)&persisted;
+    uint32_t hash = 2166136261UL;
+    for (size_t i = 0; i < offsetof(typeof(persisted), checksum); i++)
+        hash = (hash ^ bytes[i]) * 16777619UL;
+    return hash;
+}
+
+void StallMonitor::begin(uint32_t deadline)
+{
+    this->deadline = deadline;
+
+    if (persisted.magic != stallMonitorMagic || persisted.checksum != persistedChecksum() ||
+        persisted.count > stallMonitorMaxStalls)
+    {
+        memset(&persisted, 0, sizeof(persisted));
+        persisted.magic = stallMonitorMagic;
+    }
+
+    // Anything still marked ongoing ended in a reset
+    for (uint8_t i = 0; i < persisted.count; i++)
+        persisted.stalls[i].ongoing = false;
+
+    persisted.boot++;
+    newStalls = persisted.count > 0;
+    updateChecksum();
+
+    lastFeed = esp_timer_get_time();
+    watched = &taskSections;
+
+    esp_timer_create_args_t args = {};
+    args.callback = check;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "stall";
+
+    esp_timer_handle_t timer;
+    if (esp_timer_create(&args, &timer) == ESP_OK)
+        esp_timer_start_periodic(timer, (uint64_t)deadline * 250);
+}
+
+void StallMonitor::feed()
+{
+    portENTER_CRITICAL(&stallMux);
+    lastFeed = esp_timer_get_time();
+    if (stalled && currentStall >= 0)
+    {
+        persisted.stalls[currentStall].ongoing = false;
+        updateChecksum();
+    }
+    stalled = false;
+    currentStall = -1;
+    portEXIT_CRITICAL(&stallMux);
+}
+
+void StallMonitor::enterSection(const char *name, bool backtrace)
+{
+    SECTION section = {name, {}};
+
+    // Taken at entry rather than at detection, since the timer runs on its
+    // own task and cannot unwind the loop's stack
+    if (backtrace)
+    {
+        esp_backtrace_frame_t frame;
+        esp_backtrace_get_start(&frame.pc, &frame.sp, &frame.next_pc);
+        esp_backtrace_get_next_frame(&frame); // Skip enterSection itself
+        for (uint8_t i = 0; i < stallMonitorBacktraceDepth; i++)
+        {
+            if (!esp_backtrace_get_next_frame(&frame))
+                break;
+            // Xtensa keeps the window size in the top bits of a return address
+            section.backtrace[i] = ((frame.pc & 0x3fffffff) | 0x40000000) - 3;
+        }
+    }
+
+    // The timer reads this stack when it's the watched task's
+    portENTER_CRITICAL(&stallMux);
+    if (taskSections.depth < stallMonitorMaxDepth)
+        taskSections.sections[taskSections.depth] = section;
+    taskSections.depth++;
+    portEXIT_CRITICAL(&stallMux);
+}
+
+void StallMonitor::exitSection()
+{
+    portENTER_CRITICAL(&stallMux);
+    if (taskSections.depth > 0)
+        taskSections.depth--;
+    portEXIT_CRITICAL(&stallMux);
+}
+
+void StallMonitor::check(void *monitor)
+{
+    ((StallMonitor *)monitor)->checkDeadline();
+}
+
+void StallMonitor::checkDeadline()
+{
+    portENTER_CRITICAL(&stallMux);
+
+    int64_t start = lastFeed;
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    if (elapsed >= (int64_t)deadline * 1000)
+    {
+        if (!stalled)
+        {
+            stalled = true;
+            startStall(start);
+        }
+        pending.durationMs = elapsed / 1000;
+        placeStall();
+    }
+
+    portEXIT_CRITICAL(&stallMux);
+}
+
+void StallMonitor::startStall(int64_t start)
+{
+    memset(&pending, 0, sizeof(pending));
+
+    uint8_t depth = watched != NULL ? watched->depth : 0;
+
+    if (depth > 0)
+    {
+        const SECTION *section = &watched->sections[(depth > stallMonitorMaxDepth ? stallMonitorMaxDepth : depth) - 1];
+        strncpy(pending.section, section->name, sizeof(pending.section) - 1);
+        memcpy(pending.backtrace, section->backtrace, sizeof(pending.backtrace));
+    }
+    else
+    {
+        strcpy(pending.section, "loop");
+    }
+
+    pending.uptime = start / 1000000;
+    pending.boot = persisted.boot;
+    pending.ongoing = true;
+    currentStall = -1;
+}
+
+// Keeps the worst stalls seen. Once full, the stall in progress only takes
+// the shortest one's place after it has run longer
+void StallMonitor::placeStall()
+{
+    if (currentStall < 0)
+    {
+        if (persisted.count < stallMonitorMaxStalls)
+        {
+            currentStall = persisted.count++;
+        }
+        else
+        {
+            int8_t shortest = 0;
+            for (uint8_t i = 1; i < stallMonitorMaxStalls; i++)
+                if (persisted.stalls[i].durationMs < persisted.stalls[shortest].durationMs)
+                    shortest = i;
+
+            if (pending.durationMs <= persisted.stalls[shortest].durationMs)
+                return;
+            currentStall = shortest;
+        }
+        newStalls = true;
+    }
+
+    persisted.stalls[currentStall] = pending;
+    updateChecksum();
+}
+
+void StallMonitor::updateChecksum()
+{
+    persisted.checksum = persistedChecksum();
+}
+
+uint8_t StallMonitor::stallCount()
+{
+    return persisted.count;
+}
+
+const StallMonitor::STALL *StallMonitor::getStall(uint8_t index)
+{
+    if (index >= persisted.count)
+        return NULL;
+    return &persisted.stalls[index];
+}
+
+uint16_t StallMonitor::bootCount()
+{
+    return persisted.boot;
+}
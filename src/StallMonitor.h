@@ -0,0 +1,82 @@
+#ifndef __STALL_MONITOR_H_
+#define __STALL_MONITOR_H_
+
+#include "Arduino.h"
+
+#define stallMonitorMaxStalls 8
+#define stallMonitorMaxDepth 4
+#define stallMonitorBacktraceDepth 4
+
+// Watches for the main loop failing to come round within a deadline and
+// records which instrumented section it was stuck in, for how long, and for
+// sections that ask for one the backtrace taken when it was entered. The
+// worst stalls are kept in RTC memory so they survive a software or watchdog
+// reset.
+//
+// Sections are marked with a StallSection on the stack, passing true to
+// take the backtrace. Unwinding costs too much for sections entered on every
+// pass of the loop, so only the rare, slow ones do:
+//   StallSection section("mqtt_connect", true);
+//
+// Each task keeps its own stack of sections, so one entered on another task
+// never shows up as where the loop was stuck. begin() must be called from
+// the task that calls feed().
+class StallMonitor {
+public:
+  typedef struct {
+      char section[16];
+      uint32_t durationMs;
+      uint32_t uptime;     // Seconds since boot when the stall began
+      uint16_t boot;       // Boot it happened in, see bootCount()
+      bool ongoing;
+      uint32_t backtrace[stallMonitorBacktraceDepth];
+  } STALL;
+
+  void begin(uint32_t deadline = 500);
+  void feed();
+  void enterSection(const char *name, bool backtrace = false);
+  void exitSection();
+
+  uint8_t stallCount();
+  const STALL *getStall(uint8_t index);
+  uint16_t bootCount();
+  bool hasNewStalls() { return newStalls; }
+  void clearNewStalls() { newStalls = false; }
+
+private:
+  typedef struct {
+      const char *name;
+      uint32_t backtrace[stallMonitorBacktraceDepth];
+  } SECTION;
+
+  uint32_t deadline = 500;
+  volatile int64_t lastFeed = 0;
+  volatile bool stalled = false;
+  volatile bool newStalls = false;
+  int8_t currentStall = -1; // Slot the stall in progress occupies, if any
+  STALL pending;
+
+  typedef struct {
+      SECTION sections[stallMonitorMaxDepth];
+      uint8_t depth;
+  } SECTION_STACK;
+
+  static thread_local SECTION_STACK taskSections;
+  SECTION_STACK *watched = NULL; // The feeding task's, read by the timer
+
+  static void check(void *monitor);
+  void checkDeadline();
+  void startStall(int64_t start);
+  void placeStall();
+  void updateChecksum();
+};
+
+extern StallMonitor stallMonitor;
+
+class StallSection {
+public:
+  StallSection(const char *name, bool backtrace = false) { stallMonitor.enterSection(name, backtrace); }
+  ~StallSection() { stallMonitor.exitSection(); }
+};
+
+#endif  // __STALL_MONITOR_H_
@@ -7,10 +7,19 @@
 #include <Arduino.h>
 #include <functional>
 #include <ArduinoOTA.h>
+#include "HttpOta.h"
 #include "Logging.h"
+#include "Scheduler.h"
+#include "StallMonitor.h"
 #include "Preferences.h"
 #include <WiFi.h>
 #include <PubSubClient.h>
+#include "BufferedClient.h"
+#include "MqttAckClient.h"
+#include "TlsClient.h"
+#include "NonBlockingClient.h"
+#include "MqttReliablePublisher.h"
+#include "MqttTopicRouter.h"
 
 #ifdef DIAGNOSTIC_PIXEL
 #include <Adafruit_NeoPixel.h>
@@ -31,10 +40,16 @@ public:
     void enableDiagnosticLed(uint8_t pin);
     void enableWiFi(const char *wifiSSID, const char *wifiPassword, const char *deviceName);
     void disableWiFi();
+    void setWiFiStaticIP(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns);
+    void setWiFiReuseLease(bool reuse) { _wifiReuseLease = reuse; }
     void enableMQTT(const uint8_t *mqttServer, const char *mqttUsername, const char *mqttPassword, const char *mqttDeviceName);
     void disableMQTT();
+    void enableMQTTTls(const char *caCert, const char *serverName);
+    void addMQTTBroker(const char *name, const uint8_t *server, const char *username, const char *password, uint16_t port = 1883);
     void enableOTA(const char *hostname, const char *otaPassword);
     void disableOTA();
+    void requestPullOTA(const char *url, const char *sha256, const char *hmac);
+    void enableStallMonitor(uint32_t deadline);
     bool isOTARunning() { return otaRunning; }
     bool isWiFiEnabled() { return _wifiEnabled; }
     bool isOTAEnabled() { return _otaEnabled; }
@@ -44,7 +59,12 @@ public:
     void setMqttOnConnectCallback(void (*callback)());
     void setMqttCallback(std::function<void(char*, uint8_t*, unsigned int)> callback);
     bool mqttPublish(const char* topic, const char* payload, boolean retained);
+    bool mqttPublishReliable(const char* topic, const char* payload, boolean retained);
+    bool mqttPublishReliable(const char* topic, const uint8_t* payload, unsigned int length, boolean retained);
+    void setMqttInflightWindow(uint8_t window);
+    void mqttFlush();
     bool mqttSubscribe(const char* topic);
+    bool mqttSubscribe(const char* filter, MqttTopicRouter::HANDLER handler, void *context = NULL);
 
     static const uint32_t NEOPIXEL_BLACK =     0;
     static const uint32_t NEOPIXEL_RED =       16711680;
@@ -63,13 +83,27 @@ protected:
     void manageDiagnosticPixel();
     void manageDiagnosticLed();
     void connectToNetwork();
+    bool connectToCachedNetwork();
+    void cacheNetwork();
+    void publishWiFiReconnect();
     void manageWiFi();
-    void connectToMQTT();
+    void wifiReconnected();
+    struct MQTT_BROKER;
+    MQTT_BROKER *setupMQTTBroker(const char *name, Client *networkClient, const uint8_t *server, uint16_t port,
+                                 const char *username, const char *password);
+    void connectToMQTT(MQTT_BROKER *broker);
     void manageMQTT();
     void manageSafeMode();
     void sendTelegrafMetrics();
+    void publishLogMetrics();
+    void publishBrokerMetrics();
     void setDiagnosticLEDUpdateTime(uint16_t pause);
     void mqttCallback(char* topic, byte* payload, unsigned int length);
+    void startOTATask();
+    static void otaTaskEntry(void *standardFeatures);
+    void otaTask();
+    void manageOTA();
+    void publishStalls();
 
 #ifdef DIAGNOSTIC_PIXEL
     uint8_t diagnosticPixelMaxBrightness = 64;
@@ -78,14 +112,14 @@ protected:
     uint32_t diagnosticPixelColor1 = NEOPIXEL_BLUE;
     uint32_t diagnosticPixelColor2 = NEOPIXEL_BLACK;
     uint32_t currentDiagnosticPixelColor = diagnosticPixelColor1;
-    uint32_t nextDiagnosticPixelUpdate = 0;
+    Timer diagnosticPixelTimer;
     uint32_t diagnosticPixelUpdateGap = 40;
     uint8_t _diagnosticPixelPin = 0;
     Adafruit_NeoPixel *_diagnosticPixel;
 #endif
 
 #ifdef DIAGNOSTIC_LED
-    uint32_t _nextDiagnosticLedUpdate = 0;
+    Timer _diagnosticLedTimer;
     uint16_t _diagnosticLedUpdateTime = 1000;
     uint8_t _diagnosticLedPin;
     bool _diagnosticLedState = false;
@@ -98,40 +132,108 @@ protected:
     bool _safeModeEnabled = false;
     bool _metricsEnabled = false;
     bool _otaEnabled = false;
+    bool _stallMonitorEnabled = false;
 
+    const char *_otaPassword = NULL;    // Also the key pull OTA requests are signed with
     const char *_wifiSSID = "";
     const char *_wifiPassword = "";
     const char *_deviceName = "";
     const char *_appVersion = "";
 
-    WiFiClient espClient;
-    unsigned long wifiReconnectPreviousMillis = 0;
-    unsigned long wifiReconnectInterval = 30000;
+    Timer wifiReconnectTimer; // Pending while waiting to retry
+    const uint32_t wifiReconnectMinInterval = 1000;
+    const uint32_t wifiReconnectMaxInterval = 30000;
+    uint32_t wifiReconnectInterval = wifiReconnectMinInterval;
     uint8_t wifiReconnectCount = 0;
+    const uint16_t wifiFastConnectTimeout = 3000;
+    const uint16_t wifiConnectTimeout = 10000;
+
+    // Last good access point and lease, kept in NVS so they survive power
+    // loss and are tried before a full scan
+    typedef struct {
+        uint8_t bssid[6];
+        int32_t channel;
+        uint32_t ip;
+        uint32_t gateway;
+        uint32_t subnet;
+        uint32_t dns;
+    } WIFI_CACHE;
+
+    WIFI_CACHE _wifiCache;
+    bool _wifiCacheValid = false;
+    bool _wifiReuseLease = false;   // Use the cached lease as a static IP on the fast path
+    bool _wifiStaticIP = false;
+    IPAddress _wifiIP, _wifiGateway, _wifiSubnet, _wifiDns;
+
+    int64_t _wifiDownSince = 0;     // esp_timer_get_time() when the drop was noticed, 0 while up
+    uint32_t _wifiReconnectMs = 0;
+    bool _wifiReconnectFast = false;
+    uint8_t _wifiReconnectAttempts = 0;
+    bool _wifiReconnectReportPending = false;
 
-    uint32_t nextMqttConnectAttempt = 0;
     const uint32_t mqttReconnectInterval = 10000;
-    uint32_t nextMetricsUpdate = 0;
-
-    PubSubClient *_mqttClient;
-    const uint8_t *_mqttServer; // MQTT Server IP Address
-    const char *_mqttUsername = "";
-    const char *_mqttPassword = "";
+    const uint32_t mqttReconnectMaxInterval = 60000; // Secondary brokers only
+    const uint16_t mqttSecondarySocketTimeout = 1;  // Seconds a secondary may take to answer CONNECT
+    Timer metricsTimer;
+    const uint32_t metricsInterval = 30000;
+
+    // One broker connection, each with its own client stack and reconnect
+    // state. The first is the primary, which alone carries subscriptions and
+    // diagnostics. Reliable publishes go to every broker.
+    struct MQTT_BROKER {
+        const char *name;
+        uint8_t index;              // Also its index in the reliable publisher
+        WiFiClient socket;
+        NonBlockingClient *connector = NULL;  // Secondaries only, connects the socket in the background
+        BufferedClient *bufferedClient;
+        MqttAckClient *ackClient;
+        PubSubClient *client;
+        Timer reconnectTimer;       // Pending while waiting to retry
+        uint32_t reconnectInterval;
+        uint32_t connects;
+        const char *username;
+        const char *password;
+    };
+
+    MQTT_BROKER _mqttBrokers[MQTT_MAX_BROKERS];
+    uint8_t _mqttBrokerCount = 0;
+    PubSubClient *_mqttClient = NULL;           // The primary's
+    BufferedClient *_mqttBufferedClient = NULL; // The primary's
+    TlsClient *_mqttTlsClient = NULL;
+    const char *_mqttTlsCaCert = NULL;
+    const char *_mqttTlsServerName = NULL;
+    MqttReliablePublisher *_mqttReliablePublisher;
+    uint8_t _mqttInflightWindow = 4;
     const char *_mqttDeviceName = "";
     std::function<void()> _onMQTTConnectCallback;
+    std::function<void(char*, uint8_t*, unsigned int)> _mqttUnroutedCallback;
+    MqttTopicRouter _mqttRouter;
 
     Preferences *standardPreferences;
     const char *prefBadBootCount = "bad_boot_count";
     const char *prefAppVersion = "app_version";
     const char *prefBootSuccess = "boot_success";
+    const char *prefWiFiCache = "wifi_cache";
 
     uint16_t safeModeGoodBootAfterTime = 30000;
-    uint32_t safeModeSafeTime = 0;
+    Timer safeModeTimer;
     const uint8_t  safeModeBadBootTrigger = 3;
     bool safeModeBootIsGood = false;
     uint8_t safeModeBadBootCount = 0;
 
-    bool otaRunning = false;
+    // Shared with the OTA task
+    volatile bool otaRunning = false;
+    volatile int _otaError = -1;
+    volatile bool _pullOTARequested = false;
+    volatile bool _pullOTAFinished = false;
+    char _pullOTAUrl[128];
+    char _pullOTASha256[65];
+    HttpOta::REPORT _pullOTAReport;
+
+    TaskHandle_t _otaTask = NULL;
+    bool _otaWasRunning = false;
+    uint32_t _lastLoopMicros = 0;
+    uint32_t _otaMaxLoopGap = 0;
 };
 
 
@@ -185,6 +287,7 @@ void StandardFeatures::enableSafeMode(const char *appVersion)
             setDiagnosticLEDUpdateTime(250);
             while(true)
             {
+                scheduler.run();
                 loop();
             }
         }
@@ -197,12 +300,13 @@ void StandardFeatures::enableSafeMode(const char *appVersion)
     // Write it's a bad boot and we'll say it's good after a defined period of time.
     standardPreferences->putBool(prefBootSuccess, false);
 
-    safeModeSafeTime = millis() + safeModeGoodBootAfterTime;
+    safeModeTimer.setCallback(Timer::method<StandardFeatures, &StandardFeatures::manageSafeMode>, this);
+    safeModeTimer.start(safeModeGoodBootAfterTime);
 }
 
 void StandardFeatures::manageSafeMode()
 {
-    if (!safeModeBootIsGood && safeModeBadBootCount < safeModeBadBootTrigger && millis() > safeModeSafeTime)
+    if (!safeModeBootIsGood && safeModeBadBootCount < safeModeBadBootTrigger)
     {
         safeModeBootIsGood = true;
         standardPreferences->putBool(prefBootSuccess, true);
@@ -221,9 +325,22 @@ void StandardFeatures::enableWiFi(const char *wifiSSID, const char *wifiPassword
     _wifiSSID = wifiSSID;
     _wifiPassword = wifiPassword;
     _deviceName = deviceName;
+
+    _wifiCacheValid = standardPreferences->getBytes(prefWiFiCache, &_wifiCache, sizeof(_wifiCache)) == sizeof(_wifiCache);
+
     connectToNetwork();
 }
 
+// Used on every connect instead of DHCP, must be called before enableWiFi
+void StandardFeatures::setWiFiStaticIP(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns)
+{
+    _wifiStaticIP = true;
+    _wifiIP = ip;
+    _wifiGateway = gateway;
+    _wifiSubnet = subnet;
+    _wifiDns = dns;
+}
+
 void StandardFeatures::disableWiFi()
 {
     if (_otaEnabled)
@@ -239,63 +356,244 @@ void StandardFeatures::disableWiFi()
 
 void StandardFeatures::connectToNetwork()
 {
+    StallSection section("wifi_connect", true);
+
     WiFi.mode(WIFI_STA);
-    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
     WiFi.setHostname(_deviceName);
-    WiFi.begin(_wifiSSID, _wifiPassword);
 
-    if (WiFi.waitForConnectResult() == WL_CONNECTED && wifiReconnectCount == 0)
-        Log.println("Connected to WiFi");
+    if (connectToCachedNetwork())
+    {
+        _wifiReconnectFast = true;
+    }
+    else
+    {
+        // Full scan, picking whichever access point is best now
+        _wifiReconnectFast = false;
+        if (_wifiStaticIP)
+            WiFi.config(_wifiIP, _wifiGateway, _wifiSubnet, _wifiDns);
+        else
+            WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
+        WiFi.begin(_wifiSSID, _wifiPassword);
+        WiFi.waitForConnectResult(wifiConnectTimeout);
+    }
+
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        cacheNetwork();
+        if (wifiReconnectCount == 0)
+            Log.printf("Connected to WiFi%s\n", _wifiReconnectFast ? " using cached access point" : "");
+    }
+}
+
+// Skips the scan by going straight to the last access point and channel
+bool StandardFeatures::connectToCachedNetwork()
+{
+    if (!_wifiCacheValid)
+        return false;
+
+    if (_wifiStaticIP)
+        WiFi.config(_wifiIP, _wifiGateway, _wifiSubnet, _wifiDns);
+    else if (_wifiReuseLease && _wifiCache.ip != 0)
+        WiFi.config(IPAddress(_wifiCache.ip), IPAddress(_wifiCache.gateway), IPAddress(_wifiCache.subnet), IPAddress(_wifiCache.dns));
+    else
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
+
+    WiFi.begin(_wifiSSID, _wifiPassword, _wifiCache.channel, _wifiCache.bssid);
+    if (WiFi.waitForConnectResult(wifiFastConnectTimeout) == WL_CONNECTED)
+        return true;
+
+    WiFi.disconnect();
+    return false;
+}
+
+// Only written when something changed, to spare the flash
+void StandardFeatures::cacheNetwork()
+{
+    WIFI_CACHE cache = {};
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.channel = WiFi.channel();
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.subnet = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+
+    if (_wifiCacheValid && memcmp(&cache, &_wifiCache, sizeof(cache)) == 0)
+        return;
+
+    _wifiCache = cache;
+    _wifiCacheValid = true;
+    standardPreferences->putBytes(prefWiFiCache, &_wifiCache, sizeof(_wifiCache));
 }
 
 void StandardFeatures::manageWiFi()
 {
-    // if WiFi is down, try reconnecting
-    if ((WiFi.status() != WL_CONNECTED) && (millis() - wifiReconnectPreviousMillis >= wifiReconnectInterval))
+    if (WiFi.status() == WL_CONNECTED)
+    {
+        // The driver's own auto-reconnect can get there between our retries
+        if (_wifiDownSince != 0)
+            wifiReconnected();
+        return;
+    }
+
+    if (_wifiDownSince == 0)
+    {
+        _wifiDownSince = esp_timer_get_time();
+        _wifiReconnectAttempts = 0;
+        wifiReconnectInterval = wifiReconnectMinInterval;
+    }
+
+    // if WiFi is down, try reconnecting, backing off up to wifiReconnectMaxInterval
+    if (!wifiReconnectTimer.isPending())
     {
         if (wifiReconnectCount >= 10)
         {
             ESP.restart();
         }
-        
+
         wifiReconnectCount++;
+        _wifiReconnectAttempts++;
 
         connectToNetwork();
 
         if (WiFi.status() == WL_CONNECTED)
         {
-            wifiReconnectCount = 0;
-            wifiReconnectPreviousMillis = 0;
-            Log.println("Reconnected to WiFi");
+            wifiReconnected();
         }
         else
         {
-            wifiReconnectPreviousMillis = millis();
+            wifiReconnectTimer.start(wifiReconnectInterval);
+            wifiReconnectInterval = min(wifiReconnectInterval * 2, wifiReconnectMaxInterval);
         }
     }
 }
 
+// Records how long the link was down and clears the retry state, so the
+// next drop starts from scratch
+void StandardFeatures::wifiReconnected()
+{
+    wifiReconnectTimer.stop();
+    wifiReconnectCount = 0;
+    wifiReconnectInterval = wifiReconnectMinInterval;
+    _wifiReconnectMs = (esp_timer_get_time() - _wifiDownSince) / 1000;
+    _wifiDownSince = 0;
+    _wifiReconnectReportPending = true;
+    Log.printf("Reconnected to WiFi in %lums\n", _wifiReconnectMs);
+}
+
+// Time offline is time alarm events couldn't be delivered, so report it
+// once MQTT is back
+void StandardFeatures::publishWiFiReconnect()
+{
+    char buffer[160];
+    snprintf(buffer, sizeof(buffer),
+        "wifi,device=%s reconnectMs=%lu,fastPath=%d,attempts=%d,rssi=%d",
+        _mqttDeviceName,
+        _wifiReconnectMs,
+        _wifiReconnectFast,
+        _wifiReconnectAttempts,
+        WiFi.RSSI());
+
+    if (_mqttClient->publish("telegraf/particle", buffer))
+        _wifiReconnectReportPending = false;
+}
+
 void StandardFeatures::enableMQTT(const uint8_t *mqttServer, const char *mqttUsername, const char *mqttPassword, const char *mqttDeviceName)
 {
     if (!_wifiEnabled)
         return;
 
     _mqttEnabled = true;
-    _mqttClient = new PubSubClient(espClient);
-    _mqttServer = mqttServer;
-    _mqttUsername = mqttUsername;
-    _mqttPassword = mqttPassword;
+    // Writes are combined before encryption so each flush is one TLS record
+    Client *networkClient = &_mqttBrokers[0].socket;
+    uint16_t port = 1883;
+
+    if (_mqttTlsCaCert != NULL)
+    {
+        _mqttTlsClient = new TlsClient(_mqttBrokers[0].socket);
+        if (_mqttTlsClient->begin(_mqttTlsCaCert, _mqttTlsServerName))
+        {
+            networkClient = _mqttTlsClient;
+            port = 8883;
+        }
+        else
+        {
+            Log.printf("MQTT TLS setup failed: -0x%04x\n", -_mqttTlsClient->lastError());
+            _mqttEnabled = false;
+            return;
+        }
+    }
+
+    _mqttReliablePublisher = new MqttReliablePublisher();
+    _mqttReliablePublisher->setWindow(_mqttInflightWindow);
     _mqttDeviceName = mqttDeviceName;
 
-    _mqttClient->setBufferSize(4096);
-    _mqttClient->setServer(_mqttServer, 1883);
-    connectToMQTT();
+    MQTT_BROKER *primary = setupMQTTBroker("primary", networkClient, mqttServer, port, mqttUsername, mqttPassword);
+    _mqttClient = primary->client;
+    _mqttBufferedClient = primary->bufferedClient;
+    _mqttClient->setCallback([this](char *topic, uint8_t *payload, unsigned int length) { mqttCallback(topic, payload, length); });
+
+    metricsTimer.setCallback(Timer::method<StandardFeatures, &StandardFeatures::sendTelegrafMetrics>, this);
+    metricsTimer.startPeriodic(metricsInterval);
+    connectToMQTT(primary);
+}
+
+StandardFeatures::MQTT_BROKER *StandardFeatures::setupMQTTBroker(const char *name, Client *networkClient, const uint8_t *server,
+                                                                 uint16_t port, const char *username, const char *password)
+{
+    MQTT_BROKER *broker = &_mqttBrokers[_mqttBrokerCount++];
+    broker->name = name;
+    broker->bufferedClient = new BufferedClient(*networkClient);
+    broker->ackClient = new MqttAckClient(*broker->bufferedClient);
+    broker->client = new PubSubClient(*broker->ackClient);
+    broker->index = _mqttReliablePublisher->addClient(broker->client);
+    broker->ackClient->setPubAckCallback(MqttReliablePublisher::pubAckCallback, _mqttReliablePublisher->ackContext(broker->index));
+    broker->reconnectInterval = mqttReconnectInterval;
+    broker->connects = 0;
+    broker->username = username;
+    broker->password = password;
+
+    broker->client->setBufferSize(4096);
+    broker->client->setServer(server, port);
+    return broker;
+}
+
+// Another broker that gets every reliable publish and QoS 0 message, for
+// example one on the site's own network. Call after enableMQTT. Nothing is
+// subscribed on it, and it never waits on the primary. Its TCP connect runs
+// in the background, polled from manageMQTT, so one that is down doesn't
+// hold up the loop.
+void StandardFeatures::addMQTTBroker(const char *name, const uint8_t *server, const char *username, const char *password, uint16_t port)
+{
+    if (!_mqttEnabled || _mqttBrokerCount >= MQTT_MAX_BROKERS)
+    {
+        Log.printf("Can't add MQTT broker %s\n", name);
+        return;
+    }
+
+    MQTT_BROKER *broker = &_mqttBrokers[_mqttBrokerCount];
+    broker->connector = new NonBlockingClient(broker->socket);
+    MQTT_BROKER *secondary = setupMQTTBroker(name, broker->connector, server, port, username, password);
+    secondary->client->setSocketTimeout(mqttSecondarySocketTimeout);
+    connectToMQTT(secondary);
+}
+
+// Must be called before enableMQTT. The TLS session is kept in RAM so
+// reconnects can resume it rather than repeat the full handshake.
+void StandardFeatures::enableMQTTTls(const char *caCert, const char *serverName)
+{
+    _mqttTlsCaCert = caCert;
+    _mqttTlsServerName = serverName;
 }
 
 void StandardFeatures::disableMQTT()
 {
     _mqttEnabled = false;
-    _mqttClient->disconnect();
+    metricsTimer.stop();
+    for (uint8_t i = 0; i < _mqttBrokerCount; i++)
+    {
+        _mqttBrokers[i].reconnectTimer.stop();
+        _mqttBrokers[i].client->disconnect();
+    }
     _mqttClient = NULL;
 }
 
@@ -309,35 +607,112 @@ void StandardFeatures::setMqttOnConnectCallback(void (*callback)())
         _onMQTTConnectCallback();
 }
 
-void StandardFeatures::connectToMQTT()
+void StandardFeatures::connectToMQTT(MQTT_BROKER *broker)
 {
-    Log.println("Connecting to MQTT");
+    StallSection section("mqtt_connect", true);
+    bool primary = broker->index == 0;
+    // Calls while a background connect is underway just poll it
+    bool polling = broker->connector != NULL && broker->connector->connecting();
+    bool logAttempt = !polling && logAllowed(10, 3);
+    if (logAttempt)
+        Log.printf("Connecting to MQTT %s\n", broker->name);
     // Attempt to connect
-    if (WiFi.isConnected() && _mqttClient->connect(_deviceName, _mqttUsername, _mqttPassword))
+    if (WiFi.isConnected() && broker->client->connect(_deviceName, broker->username, broker->password))
     {
-        Log.println("Connected to MQTT");
-        nextMqttConnectAttempt = 0;
-        
-        if (_onMQTTConnectCallback)
-            _onMQTTConnectCallback();
+        Log.printf("Connected to MQTT %s\n", broker->name);
+        broker->reconnectTimer.stop();
+        broker->reconnectInterval = mqttReconnectInterval;
+        broker->connects++;
+
+        if (primary)
+        {
+            if (_mqttTlsClient != NULL)
+                Log.printf("TLS handshake %s in %lums\n",
+                    _mqttTlsClient->lastHandshakeResumed() ? "resumed" : "full",
+                    _mqttTlsClient->lastHandshakeMs());
+            _mqttRouter.subscribeAll(_mqttClient);
+
+            if (_onMQTTConnectCallback)
+                _onMQTTConnectCallback();
+        }
+
+        _mqttReliablePublisher->onConnect(broker->index);
+    }
+    else if (broker->connector != NULL && broker->connector->connecting())
+    {
+        // Still handshaking, manageMQTT polls again on the next loop
     }
     else
     {
-        Log.println("Failed to connect to MQTT");
-        nextMqttConnectAttempt = millis() + mqttReconnectInterval;
+        if (logAttempt)
+            Log.printf("Failed to connect to MQTT %s\n", broker->name);
+        broker->reconnectTimer.start(broker->reconnectInterval);
+
+        // A secondary that stays away is tried less and less often
+        if (!primary)
+            broker->reconnectInterval = min(broker->reconnectInterval * 2, mqttReconnectMaxInterval);
     }
 }
 
+// Sent to every connected broker. Only the header is built for each, the
+// payload is written from the caller's buffer.
 bool StandardFeatures::mqttPublish(const char* topic, const char* payload, boolean retained = false)
 {
-    if (_mqttEnabled && _mqttClient->connected())
+    if (!_mqttEnabled)
+        return false;
+
+    size_t length = strlen(payload);
+    bool published = false;
+
+    for (uint8_t i = 0; i < _mqttBrokerCount; i++)
     {
-        return _mqttClient->publish(topic, payload, retained);
+        PubSubClient *client = _mqttBrokers[i].client;
+        if (!client->connected())
+            continue;
+
+        if (client->beginPublish(topic, length, retained) &&
+            client->write((const uint8_t *)payload, length) == length &&
+            client->endPublish())
+            published = true;
+    }
+
+    return published;
+}
+
+bool StandardFeatures::mqttPublishReliable(const char* topic, const char* payload, boolean retained = false)
+{
+    return mqttPublishReliable(topic, (const uint8_t*)payload, strlen(payload), retained);
+}
+
+bool StandardFeatures::mqttPublishReliable(const char* topic, const uint8_t* payload, unsigned int length, boolean retained = false)
+{
+    // Queued even while disconnected, the backlog is sent once MQTT reconnects
+    if (_mqttEnabled)
+    {
+        return _mqttReliablePublisher->publish(topic, payload, length, retained);
     }
 
     return false;
 }
 
+void StandardFeatures::setMqttInflightWindow(uint8_t window)
+{
+    _mqttInflightWindow = window;
+
+    if (_mqttEnabled)
+        _mqttReliablePublisher->setWindow(window);
+}
+
+// Sends anything the write-combining clients are still holding
+void StandardFeatures::mqttFlush()
+{
+    if (!_mqttEnabled)
+        return;
+
+    for (uint8_t i = 0; i < _mqttBrokerCount; i++)
+        _mqttBrokers[i].bufferedClient->flush();
+}
+
 bool StandardFeatures::mqttSubscribe(const char* topic)
 {
     if (_mqttEnabled && _mqttClient->connected())
@@ -347,51 +722,190 @@ bool StandardFeatures::mqttSubscribe(const char* topic)
     return false;
 }
 
-void StandardFeatures::setMqttCallback(std::function<void(char*, uint8_t*, unsigned int)> callback)
+// Routed, the subscription is made again after every reconnect
+bool StandardFeatures::mqttSubscribe(const char* filter, MqttTopicRouter::HANDLER handler, void *context)
 {
+    if (!_mqttRouter.add(filter, handler, context))
+        return false;
+
     if (_mqttEnabled && _mqttClient->connected())
-    {
-        _mqttClient->setCallback(callback);
-    }
+        return _mqttClient->subscribe(filter);
+    return true;
+}
+
+// Receives whatever no route matched, such as topics subscribed without a handler
+void StandardFeatures::setMqttCallback(std::function<void(char*, uint8_t*, unsigned int)> callback)
+{
+    _mqttUnroutedCallback = callback;
+}
+
+void StandardFeatures::mqttCallback(char* topic, byte* payload, unsigned int length)
+{
+    if (_mqttRouter.dispatch(topic, payload, length) == 0 && _mqttUnroutedCallback)
+        _mqttUnroutedCallback(topic, payload, length);
 }
 
 void StandardFeatures::sendTelegrafMetrics()
 {
-    if (millis() > nextMetricsUpdate)
+    if (_mqttEnabled && _mqttClient->connected())
     {
-        nextMetricsUpdate = millis() + 30000;
         uint32_t uptime = esp_timer_get_time() / 1000000;
 
-        char buffer[200];
-        snprintf(buffer, sizeof(buffer),
-            "status,device=%s uptime=%d,resetReason=%d,firmware=\"%s\",appVersion=\"%s\",memUsed=%ld,memTotal=%ld",
+        char buffer[400];
+        size_t length = snprintf(buffer, sizeof(buffer),
+            "status,device=%s uptime=%d,resetReason=%d,firmware=\"%s\",appVersion=\"%s\",memUsed=%ld,memTotal=%ld,qos1Queued=%d,qos1Retransmits=%ld,qos1Dropped=%ld,tcpSegments=%ld,bytesPerSegment=%ld",
             _mqttDeviceName,
             uptime,
             esp_reset_reason(),
             esp_get_idf_version(),
             _appVersion,
             (ESP.getHeapSize()-ESP.getFreeHeap()),
-            ESP.getHeapSize());
+            ESP.getHeapSize(),
+            _mqttReliablePublisher->queued(),
+            _mqttReliablePublisher->retransmits(),
+            _mqttReliablePublisher->dropped(),
+            _mqttBufferedClient->segments(),
+            _mqttBufferedClient->segments() > 0 ? _mqttBufferedClient->bytes() / _mqttBufferedClient->segments() : 0);
+
+        if (_mqttTlsClient != NULL && length < sizeof(buffer))
+            snprintf(&buffer[length], sizeof(buffer) - length,
+                ",tlsFullHandshakes=%ld,tlsResumedHandshakes=%ld,tlsFailedHandshakes=%ld,tlsHandshakeMs=%ld",
+                _mqttTlsClient->fullHandshakes(),
+                _mqttTlsClient->resumedHandshakes(),
+                _mqttTlsClient->failedHandshakes(),
+                _mqttTlsClient->lastHandshakeMs());
+
+        _mqttClient->publish("telegraf/particle", buffer);
+
+        publishLogMetrics();
+        publishBrokerMetrics();
+    }
+}
+
+// How each broker connection is keeping up, published to the primary
+void StandardFeatures::publishBrokerMetrics()
+{
+    char buffer[400];
+    size_t length = 0;
+
+    for (uint8_t i = 0; i < _mqttBrokerCount && length < sizeof(buffer); i++)
+    {
+        MQTT_BROKER *broker = &_mqttBrokers[i];
+        length += snprintf(&buffer[length], sizeof(buffer) - length,
+            "mqtt,device=%s,broker=%s connected=%d,connects=%lu,inFlight=%d,retransmits=%lu,dropped=%lu\n",
+            _mqttDeviceName,
+            broker->name,
+            broker->client->connected(),
+            broker->connects,
+            _mqttReliablePublisher->inFlight(broker->index),
+            _mqttReliablePublisher->retransmits(broker->index),
+            _mqttReliablePublisher->dropped(broker->index));
+    }
+
+    if (length < sizeof(buffer))
         _mqttClient->publish("telegraf/particle", buffer);
+}
+
+// Lines dropped by the rate limits and folded as repeats, with a line for
+// every call site that has had anything suppressed
+void StandardFeatures::publishLogMetrics()
+{
+    char buffer[512];
+    uint32_t suppressed = 0;
+    for (TLogLimit *limit = TLogLimit::first(); limit != NULL; limit = limit->next())
+        suppressed += limit->suppressed();
+
+    size_t length = snprintf(buffer, sizeof(buffer), "log,device=%s suppressed=%lu,folded=%lu\n",
+        _mqttDeviceName, suppressed, Log.foldedLines());
+
+    for (TLogLimit *limit = TLogLimit::first(); limit != NULL; limit = limit->next())
+    {
+        if (limit->suppressed() == 0)
+            continue;
+
+        char line[96];
+        size_t lineLength = snprintf(line, sizeof(line), "log,device=%s,site=%s:%u suppressed=%lu\n",
+            _mqttDeviceName, limit->file(), limit->line(), limit->suppressed());
+
+        if (length + lineLength >= sizeof(buffer))
+        {
+            _mqttClient->publish("telegraf/particle", buffer);
+            length = 0;
+        }
+
+        memcpy(&buffer[length], line, lineLength + 1);
+        length += lineLength;
     }
+
+    if (length > 0)
+        _mqttClient->publish("telegraf/particle", buffer);
+}
+
+void StandardFeatures::enableStallMonitor(uint32_t deadline)
+{
+    _stallMonitorEnabled = true;
+    stallMonitor.begin(deadline);
 }
 
+// Publishes the worst stalls recorded, including any from before the last
+// reset. The backtraces, zero for sections that don't take one, can be
+// resolved with xtensa-esp32-elf-addr2line.
+void StandardFeatures::publishStalls()
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), "diagnostics/%s/stalls", _mqttDeviceName);
+
+    char buffer[1536];
+    size_t length = snprintf(buffer, sizeof(buffer), "{\"boot\":%u,\"stalls\":[", stallMonitor.bootCount());
+
+    for (uint8_t i = 0; i < stallMonitor.stallCount() && length < sizeof(buffer); i++)
+    {
+        const StallMonitor::STALL *stall = stallMonitor.getStall(i);
+        length += snprintf(&buffer[length], sizeof(buffer) - length,
+            "%s{\"section\":\"%s\",\"durationMs\":%lu,\"boot\":%u,\"uptime\":%lu,\"ongoing\":%s,\"backtrace\":\"0x%08lx 0x%08lx 0x%08lx 0x%08lx\"}",
+            i > 0 ? "," : "",
+            stall->section,
+            stall->durationMs,
+            stall->boot,
+            stall->uptime,
+            stall->ongoing ? "true" : "false",
+            stall->backtrace[0], stall->backtrace[1], stall->backtrace[2], stall->backtrace[3]);
+    }
+
+    if (length < sizeof(buffer))
+        snprintf(&buffer[length], sizeof(buffer) - length, "]}");
+
+    if (_mqttClient->publish(topic, buffer, true))
+        stallMonitor.clearNewStalls();
+}
+
+// Each broker reconnects on its own, one being down doesn't stop the others
 void StandardFeatures::manageMQTT()
 {
-    if (_mqttClient->connected())
+    for (uint8_t i = 0; i < _mqttBrokerCount; i++)
     {
-        _mqttClient->loop();
+        MQTT_BROKER *broker = &_mqttBrokers[i];
 
-        if (millis() > nextMetricsUpdate)
+        if (broker->client->connected())
         {
-            sendTelegrafMetrics();
-            nextMetricsUpdate = millis() + 30000;
+            StallSection section("mqtt_loop");
+            broker->client->loop();
+        }
+        else if (!broker->reconnectTimer.isPending() && WiFi.isConnected())
+        {
+            connectToMQTT(broker);
         }
     }
-    else if (millis() > nextMqttConnectAttempt)
+
+    _mqttReliablePublisher->loop();
+
+    if (_mqttClient->connected())
     {
-        if (WiFi.isConnected())
-            connectToMQTT();
+        if (_wifiReconnectReportPending)
+            publishWiFiReconnect();
+
+        if (_stallMonitorEnabled && stallMonitor.hasNewStalls())
+            publishStalls();
     }
 }
 
@@ -414,9 +928,6 @@ void setMaxDiagnosticPixelBrightness(uint8_t brightness)
 
 void StandardFeatures::manageDiagnosticPixel()
 {
-    if (millis() < nextDiagnosticPixelUpdate)
-        return;
-
     if (_mqttClient != NULL && _mqttClient->connected())
         diagnosticPixelColor1 = NEOPIXEL_GREEN;
     else if (WiFi.status() == WL_CONNECTED)
@@ -441,8 +952,6 @@ void StandardFeatures::manageDiagnosticPixel()
     _diagnosticPixel->setPixelColor(0, currentDiagnosticPixelColor);
     _diagnosticPixel->setBrightness(diagnosticPixelBrightness);
     _diagnosticPixel->show();
-
-    nextDiagnosticPixelUpdate = millis() + diagnosticPixelUpdateGap;
 }
 
 void StandardFeatures::setDiagnosticPixelColor(uint32_t color)
@@ -456,6 +965,8 @@ void StandardFeatures::enableDiagnosticPixel(uint8_t pin)
     _diagnosticPixelPin = pin;
     _diagnosticPixel = new Adafruit_NeoPixel(1, _diagnosticPixelPin, NEO_GRB + NEO_KHZ800);
     setupDiagnosticPixel();
+    diagnosticPixelTimer.setCallback(Timer::method<StandardFeatures, &StandardFeatures::manageDiagnosticPixel>, this);
+    diagnosticPixelTimer.startPeriodic(diagnosticPixelUpdateGap);
 }
 #else
 void StandardFeatures::setupDiagnosticPixel() {}
@@ -471,14 +982,12 @@ void StandardFeatures::enableDiagnosticLed(uint8_t ledPin)
     _diagnosticLedPin = ledPin;
     pinMode(_diagnosticLedPin, OUTPUT);
     digitalWrite(_diagnosticLedPin, HIGH);
+    _diagnosticLedTimer.setCallback(Timer::method<StandardFeatures, &StandardFeatures::manageDiagnosticLed>, this);
+    _diagnosticLedTimer.startPeriodic(_diagnosticLedUpdateTime);
 }
 
 void StandardFeatures::manageDiagnosticLed()
 {
-    if (millis() < _nextDiagnosticLedUpdate)
-        return;
-
-    _nextDiagnosticLedUpdate = millis() + _diagnosticLedUpdateTime;
     _diagnosticLedState = !_diagnosticLedState;
     digitalWrite(_diagnosticLedPin, _diagnosticLedState ? HIGH : LOW);
 }
@@ -486,6 +995,8 @@ void StandardFeatures::manageDiagnosticLed()
 void StandardFeatures::setDiagnosticLEDUpdateTime(uint16_t pause)
 {
     _diagnosticLedUpdateTime = pause;
+    if (_diagnosticLedEnabled)
+        _diagnosticLedTimer.startPeriodic(_diagnosticLedUpdateTime);
 }
 
 #else
@@ -500,23 +1011,19 @@ void StandardFeatures::enableOTA(const char *hostname, const char *otaPassword)
         return;
 
     _otaEnabled = true;
+    _otaPassword = otaPassword;
     ArduinoOTA.setHostname(hostname);
     ArduinoOTA.setPassword(otaPassword);
 
+    // These run in the OTA task, so only record what happened and leave
+    // logging and the diagnostic pixel to manageOTA() on the main loop
     ArduinoOTA.onStart([this]()
     {
-        Log.println("OTA Start");
         otaRunning = true;
-        #ifdef DIAGNOSTIC_PIXEL
-        _diagnosticPixel->setPixelColor(0, NEOPIXEL_WHITE);
-        _diagnosticPixel->setBrightness(diagnosticPixelMaxBrightness);
-        _diagnosticPixel->show();
-        #endif
     });
 
     ArduinoOTA.onEnd([this]()
     {
-        Log.println("OTA End");
         otaRunning = false;
     });
 
@@ -526,55 +1033,163 @@ void StandardFeatures::enableOTA(const char *hostname, const char *otaPassword)
 
     ArduinoOTA.onError([this](ota_error_t error)
     {
-        Serial.printf("Error[%u]: ", error);
-        if (error == OTA_AUTH_ERROR)
-        {
-            Log.println("Auth Failed");
-        }
-        else if (error == OTA_BEGIN_ERROR)
-        {
-            Log.println("Begin Failed");
-        }
-        else if (error == OTA_CONNECT_ERROR)
-        {
-            Log.println("Connect Failed");
-        }
-        else if (error == OTA_RECEIVE_ERROR)
-        {
-            Log.println("Receive Failed");
-        }
-        else if (error == OTA_END_ERROR)
-        {
-            Log.println("End Failed");
-        }
+        _otaError = error;
         otaRunning = false;
     });
     
     ArduinoOTA.begin();
+    startOTATask();
 }
 
 void StandardFeatures::disableOTA()
 {
+    // ArduinoOTA belongs to the OTA task, which ends it on its next pass
     _otaEnabled = false;
-    ArduinoOTA.end();
 }
 
-void StandardFeatures::loop()
+void StandardFeatures::startOTATask()
 {
-    if (_diagnosticPixelEnabled)
+    if (_otaTask != NULL)
+        return;
+
+    // Core 0 and below the loop task's priority, receiving and flashing an
+    // image must never hold up the panel
+    xTaskCreatePinnedToCore(otaTaskEntry, "ota", 8192, this, 0, &_otaTask, 0);
+}
+
+void StandardFeatures::otaTaskEntry(void *standardFeatures)
+{
+    ((StandardFeatures *)standardFeatures)->otaTask();
+}
+
+void StandardFeatures::otaTask()
+{
+    bool arduinoOTAStarted = _otaEnabled;
+
+    while (true)
+    {
+        if (_otaEnabled && WiFi.isConnected())
+        {
+            ArduinoOTA.handle();
+        }
+        else if (!_otaEnabled && arduinoOTAStarted)
+        {
+            ArduinoOTA.end();
+            arduinoOTAStarted = false;
+        }
+
+        if (_pullOTARequested)
+        {
+            otaRunning = true;
+            HttpOta ota;
+            _pullOTAReport = ota.run(_pullOTAUrl, _pullOTASha256);
+            otaRunning = false;
+            _pullOTARequested = false;
+            _pullOTAFinished = true;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+// Queues a pull OTA for the OTA task, if it was signed with the OTA password
+void StandardFeatures::requestPullOTA(const char *url, const char *sha256, const char *hmac)
+{
+    if (!_wifiEnabled || otaRunning || _pullOTARequested || strlen(url) >= sizeof(_pullOTAUrl) || strlen(sha256) != 64)
     {
-        manageDiagnosticPixel();
+        Log.println("Pull OTA request rejected");
+        return;
     }
 
-    if (_diagnosticLedEnabled)
+    if (!HttpOta::authorised(url, sha256, hmac, _otaPassword))
+    {
+        Log.println("Pull OTA request not signed with the OTA password, rejected");
+        return;
+    }
+
+    strcpy(_pullOTAUrl, url);
+    strcpy(_pullOTASha256, sha256);
+    Log.printf("Pull OTA from %s\n", _pullOTAUrl);
+    startOTATask();
+    _pullOTARequested = true;
+}
+
+void StandardFeatures::manageOTA()
+{
+    StallSection section("ota", true);
+    uint32_t now = micros();
+
+    if (otaRunning && !_otaWasRunning)
+    {
+        Log.println("OTA Start");
+        _otaMaxLoopGap = 0;
+        #ifdef DIAGNOSTIC_PIXEL
+        _diagnosticPixel->setPixelColor(0, NEOPIXEL_WHITE);
+        _diagnosticPixel->setBrightness(diagnosticPixelMaxBrightness);
+        _diagnosticPixel->show();
+        #endif
+    }
+    else if (otaRunning && now - _lastLoopMicros > _otaMaxLoopGap)
+    {
+        // Worst case wait a panel frame could have seen during the update
+        _otaMaxLoopGap = now - _lastLoopMicros;
+    }
+    else if (!otaRunning && _otaWasRunning)
+    {
+        Log.printf("OTA End, longest main loop gap %lums\n", _otaMaxLoopGap / 1000);
+    }
+
+    _otaWasRunning = otaRunning;
+    _lastLoopMicros = now;
+
+    if (_otaError >= 0)
     {
-        manageDiagnosticLed();
+        const char *errors[] = {"Auth Failed", "Begin Failed", "Connect Failed", "Receive Failed", "End Failed"};
+        if (_otaError <= OTA_END_ERROR)
+            Log.println(errors[_otaError]);
+        _otaError = -1;
     }
 
-    if (_safeModeEnabled)
+    if (_pullOTAFinished)
     {
-        manageSafeMode();
+        _pullOTAFinished = false;
+        HttpOta::REPORT report = _pullOTAReport;
+
+        Log.printf("Pull OTA %s: %lu bytes downloaded, %lu bytes written in %lums (%lu KB/s)\n",
+            HttpOta::resultString(report.result),
+            report.downloadedBytes,
+            report.imageBytes,
+            report.durationMs,
+            report.durationMs > 0 ? report.downloadedBytes / report.durationMs : 0);
+
+        if (_mqttEnabled && _mqttClient->connected())
+        {
+            char buffer[200];
+            snprintf(buffer, sizeof(buffer),
+                "ota,device=%s result=\"%s\",downloadedBytes=%lu,imageBytes=%lu,durationMs=%lu,maxLoopGapMs=%lu",
+                _mqttDeviceName,
+                HttpOta::resultString(report.result),
+                report.downloadedBytes,
+                report.imageBytes,
+                report.durationMs,
+                _otaMaxLoopGap / 1000);
+            _mqttClient->publish("telegraf/particle", buffer);
+            _mqttClient->loop();
+        }
+
+        if (report.result == HttpOta::OTA_OK)
+        {
+            Log.println("Pull OTA complete, restarting");
+            delay(1000);
+            ESP.restart();
+        }
     }
+}
+
+// Diagnostic LED/pixel updates and the safe mode check run from timers
+void StandardFeatures::loop()
+{
+    Log.loop();
 
     if (_wifiEnabled)
     {
@@ -584,13 +1199,11 @@ void StandardFeatures::loop()
         if (_mqttEnabled)
         {
             manageMQTT();
+            mqttFlush();
         }
 
-        if (_otaEnabled)
-        {
-            ArduinoOTA.handle();
-        }
+        manageOTA();
     }
 }
 
-#endif // STANDARD_FEATURES_H
\ No newline at end of file
+#endif // STANDARD_FEATURES_H
@@ -0,0 +1,96 @@
+// Copyright 2021 Kevin Cooper
+
+#include "SupervisedZones.h"
+
+static_assert(EolClassifier::ZONE_ACTIVE == Texecom::ZONE_ACTIVE &&
+              EolClassifier::ZONE_TAMPER == Texecom::ZONE_TAMPER &&
+              EolClassifier::ZONE_FAULT == Texecom::ZONE_FAULT,
+              "EolClassifier flags must match Texecom::ZONE_FLAGS");
+
+TaskHandle_t SupervisedZones::task = NULL;
+
+SupervisedZones::SupervisedZones(Texecom *panel, const ZONE *zones, uint8_t zoneCount,
+                                 const EolClassifier::THRESHOLDS &thresholds)
+    : panel(panel), zones(zones), zoneCount(zoneCount < supervisedMaxZones ? zoneCount : supervisedMaxZones)
+{
+    classifiers = new EolClassifier[this->zoneCount];
+    for (uint8_t i = 0; i < this->zoneCount; i++)
+        classifiers[i] = EolClassifier(thresholds);
+}
+
+bool SupervisedZones::begin()
+{
+    uint8_t pins[supervisedMaxZones];
+    for (uint8_t i = 0; i < zoneCount; i++)
+        pins[i] = zones[i].pin;
+
+    queue = xQueueCreate(supervisedQueueLength, sizeof(CHANGE));
+    xTaskCreate(taskEntry, "adczones", 3072, this, 2, &task);
+
+    // Full scale about 3.1V, enough for a cut wire to read as open
+    analogContinuousSetAtten(ADC_11db);
+    if (!analogContinuous(pins, zoneCount, supervisedConversionsPerPin, supervisedSampleRate, conversionDone) ||
+        !analogContinuousStart())
+    {
+        Log.println("Supervised zones: failed to start ADC");
+        return false;
+    }
+
+    Log.printf("Supervised zones: %d zones sampled continuously\n", zoneCount);
+    return true;
+}
+
+// Called from the ADC interrupt once every pin has a new averaged frame
+void IRAM_ATTR SupervisedZones::conversionDone()
+{
+    BaseType_t woken = pdFALSE;
+    if (task != NULL)
+        vTaskNotifyGiveFromISR(task, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+void SupervisedZones::taskEntry(void *supervisedZones)
+{
+    ((SupervisedZones *)supervisedZones)->sampleTask();
+}
+
+void SupervisedZones::sampleTask()
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        adc_continuous_data_t *frame = NULL;
+        if (!analogContinuousRead(&frame, 0))
+            continue;
+
+        bool changed = false;
+        for (uint8_t i = 0; i < zoneCount; i++)
+        {
+            if (!classifiers[i].update(frame[i].avg_read_mvolts))
+                continue;
+
+            CHANGE change = {zones[i].zone, classifiers[i].state(), esp_timer_get_time()};
+            if (xQueueSend(queue, &change, 0) == pdTRUE)
+                changed = true;
+            else
+                dropped++;
+        }
+
+        // Otherwise the main loop could sleep until its next timer
+        if (changed)
+            scheduler.wake();
+    }
+}
+
+// Publishing stays on the main task, the bus subscribers aren't thread safe
+void SupervisedZones::loop()
+{
+    CHANGE change;
+
+    while (queue != NULL && xQueueReceive(queue, &change, 0) == pdTRUE)
+    {
+        Texecom::ZONE_EVENT event = {panel, change.zone, change.state, change.timestamp};
+        Texecom::zoneEvents.publish(event);
+    }
+}
@@ -0,0 +1,54 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __SUPERVISED_ZONES_H_
+#define __SUPERVISED_ZONES_H_
+
+#include "Arduino.h"
+#include "Logging.h"
+#include "texecom.h"
+#include "EolClassifier.h"
+
+#define supervisedMaxZones 6           // ADC1 pins, ADC2 can't be used alongside WiFi
+#define supervisedConversionsPerPin 500
+#define supervisedSampleRate 20000     // Hz, the lowest continuous mode allows
+#define supervisedQueueLength 16
+
+// End-of-line resistor zones wired straight to the ESP32 rather than the
+// panel. The ADC samples them by DMA in continuous mode and a small task
+// classifies each averaged frame, so the main loop only sees the state
+// changes. Those are published on the panel's zone bus, under zone numbers
+// outside the panel's own range, and go out on the same zone topics.
+class SupervisedZones {
+public:
+  typedef struct {
+      uint8_t pin;
+      uint8_t zone;
+  } ZONE;
+
+  SupervisedZones(Texecom *panel, const ZONE *zones, uint8_t zoneCount,
+                  const EolClassifier::THRESHOLDS &thresholds = EolClassifier::defaultThresholds);
+  bool begin();
+  void loop();
+  uint32_t droppedCount() { return dropped; }
+
+private:
+  typedef struct {
+      uint8_t zone;
+      uint8_t state;
+      int64_t timestamp;
+  } CHANGE;
+
+  Texecom *panel;
+  const ZONE *zones;
+  uint8_t zoneCount;
+  EolClassifier *classifiers;
+  QueueHandle_t queue = NULL;
+  volatile uint32_t dropped = 0;
+
+  static TaskHandle_t task;
+  static void IRAM_ATTR conversionDone();
+  static void taskEntry(void *supervisedZones);
+  void sampleTask();
+};
+
+#endif  // __SUPERVISED_ZONES_H_
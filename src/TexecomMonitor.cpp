@@ -1,66 +1,468 @@
 #include "TexecomMonitor.h"
 
-// Stubs
-void zoneCallback(uint8_t zone, uint8_t state);
-void alarmCallback(Texecom::ALARM_STATE state, uint8_t flags);
+Texecom texecom(mainPanel);
 
-Texecom texecom(alarmCallback, zoneCallback);
+// Add further Texecom instances here to monitor more than one panel
+Texecom *panels[] = {&texecom};
+const uint8_t panelCount = sizeof(panels) / sizeof(panels[0]);
 
-void zoneCallback(uint8_t zone, uint8_t state)
-{
-    char attributesTopic[34];
-    snprintf(attributesTopic, sizeof(attributesTopic), "home/security/zone/%03d", zone);
-    char attributesMsg[46];
+Timer panelMetricsTimer;
+const uint32_t panelMetricsInterval = 60000;
+
+// Everything subscribed to the panel event buses, the sinks in
+// subscribeSinks() plus a ZoneStatistics and a RulesEngine for each panel
+#ifdef CBOR_EVENTS
+const uint8_t cborSinks = 1;
+#else
+const uint8_t cborSinks = 0;
+#endif
+const uint8_t zoneEventSubscribers = 3 + cborSinks + 2 * panelCount;
+const uint8_t alarmEventSubscribers = 3 + cborSinks + panelCount;
+const uint8_t userEventSubscribers = 1;
+static_assert(zoneEventSubscribers <= texecomMaxSubscribers, "Zone event bus too small, raise texecomMaxSubscribers");
+static_assert(alarmEventSubscribers <= texecomMaxSubscribers, "Alarm event bus too small, raise texecomMaxSubscribers");
+
+ZoneStatistics *zoneStatistics[panelCount];
+RulesEngine *rulesEngines[panelCount];
+SerialBridge *serialBridges[panelCount];
+Timer zoneStatisticsTimer;
+const uint32_t zoneStatisticsInterval = 300000;
+
+#ifdef SUPERVISED_ZONES
+SupervisedZones supervised(&texecom, supervisedZones, sizeof(supervisedZones) / sizeof(supervisedZones[0]));
+#endif
 
-    snprintf(attributesMsg,
-            sizeof(attributesMsg),
+void formatZoneAttributes(char *buffer, size_t size, uint8_t state)
+{
+    snprintf(buffer,
+            size,
             "{\"active\":%d,\"tamper\":%d,\"fault\":%d,\"alarmed\":%d}",
             (state & Texecom::ZONE_ACTIVE) != 0,
             (state & Texecom::ZONE_TAMPER) != 0,
             (state & Texecom::ZONE_FAULT) != 0,
             (state & Texecom::ZONE_ALARMED) != 0);
-
-    if (standardFeatures.isMQTTConnected())
-    {
-        standardFeatures.mqttPublish(attributesTopic, attributesMsg, true);
-    }
 }
 
-void alarmCallback(Texecom::ALARM_STATE state, uint8_t flags)
+void formatAlarmAttributes(char *buffer, size_t size, Texecom::ALARM_STATE state, uint8_t flags)
 {
-    Log.printf("Alarm: %s\n", alarmStateStrings[state]);
-    char message[58];
-    snprintf(message,
-                sizeof(message),
+    snprintf(buffer,
+                size,
                 "{\"state\":\"%s\",\"ready\":%d,\"fault\":%d,\"arm_failed\":%d}",
                 alarmStateStrings[state],
                 (flags & Texecom::ALARM_READY) != 0,
                 (flags & Texecom::ALARM_FAULT) != 0,
                 (flags & Texecom::ALARM_ARM_FAILED) != 0);
-    standardFeatures.mqttPublish("home/security/alarm", message, true);
 }
-/*
-void setupLocalMQTT()
+
+void mqttZoneSink(const Texecom::ZONE_EVENT &event, void *context)
+{
+    char attributesTopic[64];
+    snprintf(attributesTopic, sizeof(attributesTopic), "%s/zone/%03d", event.panel->getTopicPrefix(), event.zone);
+    char attributesMsg[46];
+    formatZoneAttributes(attributesMsg, sizeof(attributesMsg), event.state);
+    standardFeatures.mqttPublishReliable(attributesTopic, attributesMsg, true);
+}
+
+void mqttAlarmSink(const Texecom::ALARM_EVENT &event, void *context)
+{
+    Log.printf("Alarm: %s %s\n", event.panel->getTopicPrefix(), alarmStateStrings[event.state]);
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), "%s/alarm", event.panel->getTopicPrefix());
+    char message[58];
+    formatAlarmAttributes(message, sizeof(message), event.state, event.flags);
+    standardFeatures.mqttPublishReliable(topic, message, true);
+}
+
+void localZoneSink(const Texecom::ZONE_EVENT &event, void *context)
+{
+    char attributesMsg[46];
+    formatZoneAttributes(attributesMsg, sizeof(attributesMsg), event.state);
+    char localMsg[72];
+    size_t localMsgLength = snprintf(localMsg, sizeof(localMsg), "{\"panel\":%d,\"zone\":%d,%s",
+        event.panel->getPanelId(), event.zone, &attributesMsg[1]);
+    localServer.broadcast(localMsg, localMsgLength);
+}
+
+void localAlarmSink(const Texecom::ALARM_EVENT &event, void *context)
+{
+    char message[58];
+    formatAlarmAttributes(message, sizeof(message), event.state, event.flags);
+    char localMsg[72];
+    size_t localMsgLength = snprintf(localMsg, sizeof(localMsg), "{\"panel\":%d,%s", event.panel->getPanelId(), &message[1]);
+    localServer.broadcast(localMsg, localMsgLength);
+}
+
+void journalZoneSink(const Texecom::ZONE_EVENT &event, void *context)
+{
+    journal.append(EventJournal::EVENT_ZONE, event.panel->getPanelId(), event.zone, event.state, 0);
+}
+
+void journalAlarmSink(const Texecom::ALARM_EVENT &event, void *context)
+{
+    journal.append(EventJournal::EVENT_ALARM, event.panel->getPanelId(), 0, event.state, event.flags);
+}
+
+void journalUserSink(const Texecom::USER_EVENT &event, void *context)
+{
+    journal.append(event.tag ? EventJournal::EVENT_USER_TAG : EventJournal::EVENT_USER_PIN, event.panel->getPanelId(), event.user, 0, 0);
+}
+
+#ifdef CBOR_EVENTS
+void cborZoneSink(const Texecom::ZONE_EVENT &event, void *context)
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), "%s/cbor/zone/%03d", event.panel->getTopicPrefix(), event.zone);
+    uint8_t payload[32];
+    CborEncoder cbor(payload, sizeof(payload));
+    cbor.beginMap(4);
+    cbor.writeUInt(CBOR_KEY_SEQUENCE);
+    cbor.writeUInt(cborSequence++);
+    cbor.writeUInt(CBOR_KEY_TIMESTAMP);
+    cbor.writeUInt(event.timestamp);
+    cbor.writeUInt(CBOR_KEY_ZONE);
+    cbor.writeUInt(event.zone);
+    cbor.writeUInt(CBOR_KEY_FLAGS);
+    cbor.writeUInt(event.state);
+
+    if (cbor.ok())
+        standardFeatures.mqttPublishReliable(topic, payload, cbor.length(), true);
+}
+
+void cborAlarmSink(const Texecom::ALARM_EVENT &event, void *context)
+{
+    char topic[64];
+    snprintf(topic, sizeof(topic), "%s/cbor/alarm", event.panel->getTopicPrefix());
+    uint8_t payload[32];
+    CborEncoder cbor(payload, sizeof(payload));
+    cbor.beginMap(4);
+    cbor.writeUInt(CBOR_KEY_SEQUENCE);
+    cbor.writeUInt(cborSequence++);
+    cbor.writeUInt(CBOR_KEY_TIMESTAMP);
+    cbor.writeUInt(event.timestamp);
+    cbor.writeUInt(CBOR_KEY_STATE);
+    cbor.writeUInt(event.state);
+    cbor.writeUInt(CBOR_KEY_FLAGS);
+    cbor.writeUInt(event.flags);
+
+    if (cbor.ok())
+        standardFeatures.mqttPublishReliable(topic, payload, cbor.length(), true);
+}
+#endif
+
+void checkSubscribed(bool subscribed, const char *sink)
+{
+    if (!subscribed)
+        Log.printf("No room on the event bus for the %s sink, it won't see any events\n", sink);
+}
+
+void subscribeSinks()
+{
+    checkSubscribed(Texecom::zoneEvents.subscribe(journalZoneSink), "journal zone");
+    checkSubscribed(Texecom::alarmEvents.subscribe(journalAlarmSink), "journal alarm");
+    checkSubscribed(Texecom::userEvents.subscribe(journalUserSink), "journal user");
+
+    checkSubscribed(Texecom::zoneEvents.subscribe(mqttZoneSink), "MQTT zone");
+    checkSubscribed(Texecom::alarmEvents.subscribe(mqttAlarmSink), "MQTT alarm");
+
+    checkSubscribed(Texecom::zoneEvents.subscribe(localZoneSink), "local zone");
+    checkSubscribed(Texecom::alarmEvents.subscribe(localAlarmSink), "local alarm");
+
+#ifdef CBOR_EVENTS
+    checkSubscribed(Texecom::zoneEvents.subscribe(cborZoneSink), "CBOR zone");
+    checkSubscribed(Texecom::alarmEvents.subscribe(cborAlarmSink), "CBOR alarm");
+#endif
+}
+
+size_t writeLocalState(char *buffer, size_t size)
+{
+    size_t length = snprintf(buffer, size, "{\"panels\":[");
+
+    for (uint8_t p = 0; p < panelCount && length < size; p++)
+    {
+        Texecom *panel = panels[p];
+        uint8_t flags = panel->getAlarmStateFlags();
+
+        length += snprintf(&buffer[length], size - length,
+            "%s{\"panel\":%d,\"prefix\":\"%s\",\"alarm\":{\"state\":\"%s\",\"ready\":%d,\"fault\":%d,\"arm_failed\":%d},\"zones\":{",
+            p > 0 ? "," : "",
+            panel->getPanelId(),
+            panel->getTopicPrefix(),
+            alarmStateStrings[panel->getAlarmState()],
+            (flags & Texecom::ALARM_READY) != 0,
+            (flags & Texecom::ALARM_FAULT) != 0,
+            (flags & Texecom::ALARM_ARM_FAILED) != 0);
+
+        for (uint8_t zone = panel->getFirstZone(); zone < panel->getFirstZone() + panel->getZoneCount() && length < size; zone++)
+        {
+            uint8_t state = panel->getZoneState(zone);
+            length += snprintf(&buffer[length], size - length,
+                "%s\"%03d\":{\"active\":%d,\"tamper\":%d,\"fault\":%d,\"alarmed\":%d}",
+                zone > panel->getFirstZone() ? "," : "",
+                zone,
+                (state & Texecom::ZONE_ACTIVE) != 0,
+                (state & Texecom::ZONE_TAMPER) != 0,
+                (state & Texecom::ZONE_FAULT) != 0,
+                (state & Texecom::ZONE_ALARMED) != 0);
+        }
+
+        if (length < size)
+            length += snprintf(&buffer[length], size - length, "}}");
+    }
+
+    if (length < size)
+        length += snprintf(&buffer[length], size - length, "]}");
+
+    return length < size ? length : size - 1;
+}
+
+bool rulesPublish(const char *topic, const char *payload)
+{
+    return standardFeatures.mqttPublishReliable(topic, payload, false);
+}
+
+void rulesHandler(const char *topic, const uint8_t *payload, unsigned int length, void *context)
+{
+    ((RulesEngine *)context)->compile((const char *)payload, length);
+}
+
+void journalRequestHandler(const char *topic, const uint8_t *payload, unsigned int length, void *context)
+{
+    char sequence[11];
+    if (length >= sizeof(sequence))
+        length = sizeof(sequence) - 1;
+    memcpy(sequence, payload, length);
+    sequence[length] = '\0';
+    journal.requestSince(strtoul(sequence, NULL, 10));
+}
+
+void otaRequestHandler(const char *topic, const uint8_t *payload, unsigned int length, void *context)
 {
+    // "<url> <sha256 of the uncompressed image> <hmac>", see HttpOta.h
+    char request[300];
+    if (length >= sizeof(request))
+        return;
+    memcpy(request, payload, length);
+    request[length] = '\0';
+
+    char *sha256 = strchr(request, ' ');
+    if (sha256 == NULL)
+        return;
+    *sha256++ = '\0';
+
+    char *hmac = strchr(sha256, ' ');
+    if (hmac == NULL)
+        return;
+    *hmac++ = '\0';
+    standardFeatures.requestPullOTA(request, sha256, hmac);
+}
+
+// StandardFeatures subscribes these again whenever MQTT reconnects
+void subscribeRoutes()
+{
+    standardFeatures.mqttSubscribe("home/security/journal/request", journalRequestHandler);
+    standardFeatures.mqttSubscribe(otaTopic, otaRequestHandler);
+
+    // Retained, so the rules come straight back after a restart
+    for (uint8_t i = 0; i < panelCount; i++)
+    {
+        char rulesTopic[64];
+        snprintf(rulesTopic, sizeof(rulesTopic), "%s/rules", panels[i]->getTopicPrefix());
+        standardFeatures.mqttSubscribe(rulesTopic, rulesHandler, rulesEngines[i]);
+    }
 }
-*/
+
+// Streams the answer to a journal request, one batch per call. A batch
+// that doesn't go out is kept and tried again on the next call.
+void publishJournal()
+{
+    EventJournal::Record records[journalBatchSize];
+    uint8_t count;
+    bool more;
+
+    if (!journal.getBatch(records, &count, &more))
+        return;
+
+    if (count == 0 && more)
+    {
+        journal.releaseBatch();
+        return;
+    }
+
+    // ,[4294967295,4294967295,255,255,255,255,255] is the longest record
+    const size_t recordLength = 44;
+    char message[32 + journalBatchSize * recordLength];
+    size_t length = snprintf(message, sizeof(message), "{\"more\":%d,\"events\":[", more);
+    for (uint8_t i = 0; i < count && length < sizeof(message); i++)
+    {
+        length += snprintf(&message[length], sizeof(message) - length,
+            "%s[%lu,%lu,%d,%d,%d,%d,%d]",
+            i > 0 ? "," : "",
+            records[i].sequence,
+            records[i].timestamp,
+            records[i].type,
+            records[i].panel,
+            records[i].id,
+            records[i].state,
+            records[i].flags);
+    }
+    if (length + 3 > sizeof(message))
+    {
+        Log.println("Journal batch too long to publish");
+        journal.releaseBatch();
+        return;
+    }
+    snprintf(&message[length], sizeof(message) - length, "]}");
+
+    if (standardFeatures.mqttPublish("home/security/journal/events", message, false))
+        journal.releaseBatch();
+}
+
+// Zone frames dropped by change suppression, one line per zone
+void publishZoneMetrics(Texecom *panel)
+{
+    char buffer[512];
+    size_t length = 0;
+
+    for (uint8_t zone = panel->getFirstZone(); zone < panel->getFirstZone() + panel->getZoneCount(); zone++)
+    {
+        char line[96];
+        size_t lineLength = snprintf(line, sizeof(line), "zone,device=%s,panel=%d,zone=%03d suppressed=%lu\n",
+            deviceName, panel->getPanelId(), zone, panel->getZoneSuppressed(zone));
+
+        if (length + lineLength >= sizeof(buffer))
+        {
+            standardFeatures.mqttPublish("telegraf/particle", buffer, false);
+            length = 0;
+        }
+
+        memcpy(&buffer[length], line, lineLength + 1);
+        length += lineLength;
+    }
+
+    if (length > 0)
+        standardFeatures.mqttPublish("telegraf/particle", buffer, false);
+}
+
+// How the keypad derived alarm state is doing against the GPIO outputs
+void publishPanelMetrics(void *context)
+{
+    for (uint8_t i = 0; i < panelCount; i++)
+    {
+        char buffer[200];
+        snprintf(buffer, sizeof(buffer),
+            "panel,device=%s,panel=%d frameStateUpdates=%lu,stateDisagreements=%lu,frameLeadMs=%lu,bridgeClients=%d,bridgeDroppedBytes=%lu",
+            deviceName,
+            panels[i]->getPanelId(),
+            panels[i]->getFrameStateUpdates(),
+            panels[i]->getStateDisagreements(),
+            panels[i]->getFrameLeadMs(),
+            serialBridges[i]->clientCount(),
+            serialBridges[i]->droppedBytes());
+        standardFeatures.mqttPublish("telegraf/particle", buffer, false);
+
+        publishZoneMetrics(panels[i]);
+    }
+}
+
+// All of a panel's zone aggregates in one message
+void publishZoneStatistics(void *context)
+{
+    static char buffer[3072];
+
+    for (uint8_t i = 0; i < panelCount; i++)
+    {
+        size_t length = zoneStatistics[i]->write(buffer, sizeof(buffer));
+        if (length >= sizeof(buffer) - 1)
+        {
+            Log.println("Zone statistics too large to publish");
+            continue;
+        }
+
+        char topic[64];
+        snprintf(topic, sizeof(topic), "%s/statistics/zones", panels[i]->getTopicPrefix());
+        standardFeatures.mqttPublish(topic, buffer, false);
+    }
+}
+
 void setup()
 {
+    scheduler.begin();
+    snprintf(otaTopic, sizeof(otaTopic), "ota/%s/pull", deviceName);
     standardFeatures.enableLogging(deviceName, syslogServer, syslogPort);
     standardFeatures.enableWiFi(wifiSSID, wifiPassword, deviceName);
     standardFeatures.enableOTA(deviceName, otaPassword);
     standardFeatures.enableSafeMode(appVersion);
+#ifdef MQTT_TLS
+    standardFeatures.enableMQTTTls(mqttCaCert, mqttServerName);
+#endif
     standardFeatures.enableMQTT(mqttServer, mqttUsername, mqttPassword, deviceName);
+#ifdef LOCAL_MQTT
+    standardFeatures.addMQTTBroker("local", localMqttServer, localMqttUsername, localMqttPassword);
+#endif
+    configTzTime(timeZone, ntpServer);
+
+    journal.begin();
+    subscribeSinks();
+
+    for (uint8_t i = 0; i < panelCount; i++)
+    {
+        panels[i]->setup();
+        zoneStatistics[i] = new ZoneStatistics(panels[i]);
+        zoneStatistics[i]->begin();
+        rulesEngines[i] = new RulesEngine(panels[i], rulesOutputPins, sizeof(rulesOutputPins));
+        rulesEngines[i]->begin(rulesPublish);
+        serialBridges[i] = new SerialBridge(serialBridgePort + panels[i]->getPanelId());
+        serialBridges[i]->begin();
+        panels[i]->setSerialTap(SerialBridge::tap, serialBridges[i]);
+    }
+    subscribeRoutes();
 
-    //setupLocalMQTT();
+    // Catches a subscriber added without updating the counts above
+    if (Texecom::zoneEvents.subscriberCount() != zoneEventSubscribers ||
+        Texecom::alarmEvents.subscriberCount() != alarmEventSubscribers ||
+        Texecom::userEvents.subscriberCount() != userEventSubscribers)
+    {
+        Log.printf("Event buses have %d zone, %d alarm and %d user subscribers, expected %d, %d and %d\n",
+            Texecom::zoneEvents.subscriberCount(), Texecom::alarmEvents.subscriberCount(),
+            Texecom::userEvents.subscriberCount(), zoneEventSubscribers, alarmEventSubscribers,
+            userEventSubscribers);
+    }
+
+#ifdef SUPERVISED_ZONES
+    supervised.begin();
+#endif
+
+    zoneStatisticsTimer.setCallback(publishZoneStatistics, NULL);
+    zoneStatisticsTimer.startPeriodic(zoneStatisticsInterval);
 
-    texecom.setup();
+    localServer.begin(writeLocalState);
+
+    panelMetricsTimer.setCallback(publishPanelMetrics, NULL);
+    panelMetricsTimer.startPeriodic(panelMetricsInterval);
+
+    // Started last so connecting during setup isn't counted as a stall
+    standardFeatures.enableStallMonitor(stallDeadline);
 
     Log.println("Setup complete");
 }
 
 void loop()
 {
+    // Sleeps until the next timer is due or panel data arrives
+    scheduler.run();
+    stallMonitor.feed();
     standardFeatures.loop();
-    texecom.loop();
+    for (uint8_t i = 0; i < panelCount; i++)
+    {
+        StallSection section("panel");
+        panels[i]->loop();
+        serialBridges[i]->loop();
+    }
+#ifdef SUPERVISED_ZONES
+    supervised.loop();
+#endif
+    publishJournal();
+    localServer.loop();
+    standardFeatures.mqttFlush();
 }
\ No newline at end of file
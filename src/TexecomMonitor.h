@@ -1,12 +1,109 @@
 #ifndef TEXECOM_MONITOR_H
 #define TEXECOM_MONITOR_H
 
+// Also publish events as CBOR under <topic prefix>/cbor/
+//#define CBOR_EVENTS
+
+// Connect to MQTT over TLS on 8883, needs mqttCaCert and mqttServerName in secrets.h
+//#define MQTT_TLS
+
+// Also deliver every event to a broker on the site network, needs
+// localMqttServer, localMqttUsername and localMqttPassword in secrets.h
+//#define LOCAL_MQTT
+
+// End-of-line resistor zones wired directly to the ESP32's ADC
+//#define SUPERVISED_ZONES
+
 #include "StandardFeatures.h"
 #include "secrets.h"
 #include "texecom.h"
+#include "EventJournal.h"
+#include "LocalEventServer.h"
+#include "ZoneStatistics.h"
+#include "RulesEngine.h"
+#include "SerialBridge.h"
+
+#ifdef CBOR_EVENTS
+#include "CborEncoder.h"
+#endif
+
+#ifdef SUPERVISED_ZONES
+#include "SupervisedZones.h"
+#endif
 
 StandardFeatures standardFeatures;
+EventJournal journal;
+LocalEventServer localServer;
+
+//  Digi Output - Argon Pin - Texecom Configuration
+//  1 ----------------- 18 - 22 Full Armed
+//  2 ----------------- 39 - 23 Part Armed
+//  3 ----------------- 5  - 19 Exit
+//  4 ----------------- 34 - 17 Entry
+//  5 ----------------- 4  - 00 Alarm
+//  6 ----------------- 25 - 27 Arm Failed
+//  7 ----------------- 36 - 66 Fault Present
+//  8 ----------------- 26 - 16 Area Ready
+
+const Texecom::CONFIG mainPanel = {
+    .panelId = 0,
+    .topicPrefix = "home/security",
+    .serial = &Serial2,
+    .rxPin = 16,
+    .txPin = 17,
+    .pins = {
+        .fullArmed = 18,
+        .partArmed = 39,
+        .exit = 5,
+        .entry = 34,
+        .triggered = 4,
+        .armFailed = 25,
+        .faultPresent = 36,
+        .areaReady = 26,
+    },
+    .firstZone = 9,
+    .zoneCount = 11,
+    .zoneHoldOff = 2000,
+};
+
+char otaTopic[64];
+
+// Free pins that rules received on <topic prefix>/rules may drive
+const uint8_t rulesOutputPins[] = {13, 14, 27};
+
+#ifdef SUPERVISED_ZONES
+// Published as zones of the main panel, numbered clear of its own zones.
+// Only ADC1 pins, and 34 is already taken by a Digi output.
+const SupervisedZones::ZONE supervisedZones[] = {
+    {.pin = 32, .zone = 101},
+    {.pin = 33, .zone = 102},
+    {.pin = 35, .zone = 103},
+};
+#endif
+
+// Raw panel stream for LAN tools, panel N listens on serialBridgePort + N
+const uint16_t serialBridgePort = 2000;
+
+// Local time is only used to bucket zone activity by hour of day
+const char *timeZone = "GMT0BST,M3.5.0/1,M10.5.0";
+const char *ntpServer = "pool.ntp.org";
+
+// Longest the main loop may take to come round before it is recorded as a stall
+const uint32_t stallDeadline = 500;
 
 const char *alarmStateStrings[6] = {"disarmed", "armed_home", "armed_away", "pending", "pending", "triggered"};
 
+#ifdef CBOR_EVENTS
+// Integer map keys used by the CBOR event payloads
+typedef enum {
+    CBOR_KEY_SEQUENCE = 0,
+    CBOR_KEY_TIMESTAMP = 1, // Microseconds since boot
+    CBOR_KEY_ZONE = 2,
+    CBOR_KEY_STATE = 3,     // ALARM_STATE for alarm events
+    CBOR_KEY_FLAGS = 4,     // ZONE_FLAGS or ALARM_FLAGS bitfield
+} CBOR_EVENT_KEY;
+
+uint32_t cborSequence = 0;
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "TlsClient.h"
+#include "mbedtls/net_sockets.h"
+
+TlsClient::~TlsClient()
+{
+    if (!_initialised)
+        return;
+
+    mbedtls_ssl_session_free(&_session);
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_config_free(&_config);
+    mbedtls_x509_crt_free(&_ca);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+// caCert is PEM and must stay valid, serverName is checked against the
+// broker's certificate since MQTT connects by IP address
+bool TlsClient::begin(const char *caCert, const char *serverName)
+{
+    _serverName = serverName;
+
+    mbedtls_ssl_init(&_ssl);
+    mbedtls_ssl_config_init(&_config);
+    mbedtls_x509_crt_init(&_ca);
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_ssl_session_init(&_session);
+    _initialised = true;
+
+    if ((_lastError = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, NULL, 0)) != 0)
+        return false;
+
+    if ((_lastError = mbedtls_x509_crt_parse(&_ca, (const unsigned char *)caCert, strlen(caCert) + 1)) != 0)
+        return false;
+
+    if ((_lastError = mbedtls_ssl_config_defaults(&_config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+        return false;
+
+    mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&_config, &_ca, NULL);
+    mbedtls_ssl_conf_rng(&_config, mbedtls_ctr_drbg_random, &_drbg);
+    mbedtls_ssl_conf_session_tickets(&_config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+    mbedtls_ssl_conf_max_tls_version(&_config, MBEDTLS_SSL_VERSION_TLS1_2);
+
+    if ((_lastError = mbedtls_ssl_setup(&_ssl, &_config)) != 0)
+        return false;
+
+    mbedtls_ssl_set_bio(&_ssl, this, sendCallback, receiveCallback, NULL);
+    _ready = true;
+    return true;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port)
+{
+    if (!_ready || !_client.connect(ip, port))
+        return 0;
+    return handshake();
+}
+
+int TlsClient::connect(const char *host, uint16_t port)
+{
+    if (!_ready || !_client.connect(host, port))
+        return 0;
+    return handshake();
+}
+
+int TlsClient::handshake()
+{
+    uint32_t start = millis();
+    _peeked = -1;
+
+    mbedtls_ssl_session_reset(&_ssl);
+    mbedtls_ssl_set_hostname(&_ssl, _serverName);
+
+    if (_sessionValid)
+        mbedtls_ssl_set_session(&_ssl, &_session);
+
+    int result;
+    while ((result = mbedtls_ssl_handshake(&_ssl)) != 0)
+    {
+        if ((result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) ||
+            millis() - start > tlsClientHandshakeTimeout)
+        {
+            _lastError = result;
+            _failedHandshakes++;
+            // A stale session is a common cause, don't offer it again
+            forgetSession();
+            _client.stop();
+            return 0;
+        }
+        delay(1);
+    }
+
+    _lastHandshakeMs = millis() - start;
+
+    // Servers echo the offered session ID when they resume, for tickets as
+    // well since the client sends a fresh ID alongside the ticket
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    mbedtls_ssl_get_session(&_ssl, &session);
+
+    _lastHandshakeResumed = _sessionValid &&
+        session.MBEDTLS_PRIVATE(id_len) > 0 &&
+        session.MBEDTLS_PRIVATE(id_len) == _session.MBEDTLS_PRIVATE(id_len) &&
+        memcmp(session.MBEDTLS_PRIVATE(id), _session.MBEDTLS_PRIVATE(id), session.MBEDTLS_PRIVATE(id_len)) == 0;
+
+    if (_lastHandshakeResumed)
+        _resumedHandshakes++;
+    else
+        _fullHandshakes++;
+
+    mbedtls_ssl_session_free(&_session);
+    _session = session;
+    _sessionValid = true;
+    _connected = true;
+    return 1;
+}
+
+void TlsClient::forgetSession()
+{
+    if (_sessionValid)
+    {
+        mbedtls_ssl_session_free(&_session);
+        mbedtls_ssl_session_init(&_session);
+        _sessionValid = false;
+    }
+}
+
+size_t TlsClient::write(const uint8_t *buf, size_t size)
+{
+    if (!_connected)
+        return 0;
+
+    // A peer that stops reading fills the socket and every write would wait
+    // on it, so give up on the connection as WiFiClient does
+    uint32_t start = millis();
+    size_t written = 0;
+    while (written < size)
+    {
+        int result = mbedtls_ssl_write(&_ssl, &buf[written], size - written);
+        if (result > 0)
+        {
+            written += result;
+        }
+        else if (result != MBEDTLS_ERR_SSL_WANT_WRITE && result != MBEDTLS_ERR_SSL_WANT_READ)
+        {
+            _lastError = result;
+            break;
+        }
+        else if (millis() - start > tlsClientWriteTimeout)
+        {
+            _lastError = MBEDTLS_ERR_SSL_TIMEOUT;
+            stop();
+            break;
+        }
+        else
+        {
+            delay(1);
+        }
+    }
+    return written;
+}
+
+int TlsClient::available()
+{
+    if (!_connected)
+        return 0;
+
+    int count = _peeked >= 0 ? 1 : 0;
+
+    // Decrypt the next record if one has arrived
+    if (mbedtls_ssl_get_bytes_avail(&_ssl) == 0 && _client.available() > 0)
+    {
+        int result = mbedtls_ssl_read(&_ssl, NULL, 0);
+        if (result < 0 && result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            _lastError = result;
+            _connected = false;
+            return count;
+        }
+    }
+
+    return count + mbedtls_ssl_get_bytes_avail(&_ssl);
+}
+
+int TlsClient::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int TlsClient::read(uint8_t *buf, size_t size)
+{
+    if (!_connected || size == 0)
+        return -1;
+
+    size_t offset = 0;
+    if (_peeked >= 0)
+    {
+        buf[offset++] = _peeked;
+        _peeked = -1;
+        if (offset == size)
+            return offset;
+    }
+
+    int result = mbedtls_ssl_read(&_ssl, &buf[offset], size - offset);
+    if (result > 0)
+        return offset + result;
+
+    if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+        _lastError = result;
+        _connected = false;
+    }
+    return offset > 0 ? (int)offset : -1;
+}
+
+int TlsClient::peek()
+{
+    if (_peeked < 0)
+        _peeked = read();
+    return _peeked;
+}
+
+void TlsClient::stop()
+{
+    if (_connected)
+        mbedtls_ssl_close_notify(&_ssl);
+
+    _connected = false;
+    _peeked = -1;
+    _client.stop();
+}
+
+int TlsClient::sendCallback(void *context, const unsigned char *buf, size_t length)
+{
+    TlsClient *tls = (TlsClient *)context;
+
+    if (!tls->_client.connected())
+        return MBEDTLS_ERR_NET_CONN_RESET;
+
+    size_t written = tls->_client.write(buf, length);
+    return written > 0 ? (int)written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::receiveCallback(void *context, unsigned char *buf, size_t length)
+{
+    TlsClient *tls = (TlsClient *)context;
+
+    if (tls->_client.available() <= 0)
+        return tls->_client.connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_CONN_EOF;
+
+    int count = tls->_client.read(buf, length);
+    return count > 0 ? count : MBEDTLS_ERR_SSL_WANT_READ;
+}
@@ -0,0 +1,78 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+
+#define tlsClientHandshakeTimeout 5000  // Longest a handshake may take, in ms
+#define tlsClientWriteTimeout 5000      // Longest a write may wait on the peer, in ms
+
+// TLS over any Client, using mbedtls directly rather than WiFiClientSecure
+// so the negotiated session can be kept in RAM and offered again on the next
+// connect. A server that accepts it, by session ID or session ticket, skips
+// the certificate exchange and key agreement, turning a multi-second
+// handshake into a round trip.
+//
+// Limited to TLS 1.2, where resumption is a plain client side cache.
+class TlsClient : public Client
+{
+public:
+    TlsClient(Client &client) : _client(client) {}
+    ~TlsClient();
+
+    bool begin(const char *caCert, const char *serverName);
+
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char *host, uint16_t port);
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t size);
+    int available();
+    int read();
+    int read(uint8_t *buf, size_t size);
+    int peek();
+    void flush() {}
+    void stop();
+    uint8_t connected() { return _connected && (_client.connected() || available() > 0); }
+    operator bool() { return connected(); }
+
+    uint32_t fullHandshakes() { return _fullHandshakes; }
+    uint32_t resumedHandshakes() { return _resumedHandshakes; }
+    uint32_t failedHandshakes() { return _failedHandshakes; }
+    uint32_t lastHandshakeMs() { return _lastHandshakeMs; }
+    bool lastHandshakeResumed() { return _lastHandshakeResumed; }
+    int lastError() { return _lastError; }
+    void forgetSession();
+
+private:
+    Client &_client;
+    const char *_serverName = NULL;
+    bool _initialised = false;  // Contexts need freeing
+    bool _ready = false;        // begin() succeeded
+    bool _connected = false;
+    int _peeked = -1;
+
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _config;
+    mbedtls_x509_crt _ca;
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_ssl_session _session;
+    bool _sessionValid = false;
+
+    uint32_t _fullHandshakes = 0;
+    uint32_t _resumedHandshakes = 0;
+    uint32_t _failedHandshakes = 0;
+    uint32_t _lastHandshakeMs = 0;
+    bool _lastHandshakeResumed = false;
+    int _lastError = 0;
+
+    int handshake();
+    static int sendCallback(void *context, const unsigned char *buf, size_t length);
+    static int receiveCallback(void *context, unsigned char *buf, size_t length);
+};
+
+#endif // TLS_CLIENT_H
@@ -0,0 +1,105 @@
+// Copyright 2021 Kevin Cooper
+
+#include "ZoneStatistics.h"
+
+ZoneStatistics::ZoneStatistics(Texecom *panel) : panel(panel)
+{
+    stats = new STATS[panel->getZoneCount()]();
+}
+
+bool ZoneStatistics::begin()
+{
+    if (!Texecom::zoneEvents.subscribe(zoneEvent, this))
+    {
+        Log.println("Zone statistics: no room on the zone event bus, nothing will be counted");
+        return false;
+    }
+    return true;
+}
+
+void ZoneStatistics::zoneEvent(const Texecom::ZONE_EVENT &event, void *statistics)
+{
+    ZoneStatistics *zoneStatistics = (ZoneStatistics *)statistics;
+    if (event.panel == zoneStatistics->panel)
+        zoneStatistics->update(event);
+}
+
+void ZoneStatistics::update(const Texecom::ZONE_EVENT &event)
+{
+    uint8_t index = event.zone - panel->getFirstZone();
+    if (index >= panel->getZoneCount())
+        return;
+
+    STATS *zone = &stats[index];
+    bool active = event.state & Texecom::ZONE_ACTIVE;
+    bool tampered = event.state & Texecom::ZONE_TAMPER;
+
+    if (active && zone->activeSince == 0)
+    {
+        zone->activations++;
+        zone->activeSince = event.timestamp;
+
+        // Only bucket once the clock has been set by NTP
+        time_t now = time(NULL);
+        if (now > 1600000000)
+        {
+            struct tm local;
+            localtime_r(&now, &local);
+            zone->histogram[local.tm_hour]++;
+        }
+    }
+    else if (!active && zone->activeSince != 0)
+    {
+        uint32_t duration = (event.timestamp - zone->activeSince) / 1000;
+        zone->activeMs += duration;
+        if (duration > zone->longestMs)
+            zone->longestMs = duration;
+        zone->activeSince = 0;
+    }
+
+    if (tampered && !zone->tampered)
+        zone->tampers++;
+    zone->tampered = tampered;
+}
+
+// {"uptime":123,"zones":{"009":{"activations":..,"activeMs":..,"longestMs":..,"tampers":..,"hours":[..24..]},...}}
+size_t ZoneStatistics::write(char *buffer, size_t size)
+{
+    int64_t now = esp_timer_get_time();
+    size_t length = snprintf(buffer, size, "{\"uptime\":%lu,\"zones\":{", (uint32_t)(now / 1000000));
+
+    for (uint8_t i = 0; i < panel->getZoneCount() && length < size; i++)
+    {
+        STATS *zone = &stats[i];
+        uint32_t activeMs = zone->activeMs;
+        uint32_t longestMs = zone->longestMs;
+
+        if (zone->activeSince != 0)
+        {
+            uint32_t current = (now - zone->activeSince) / 1000;
+            activeMs += current;
+            if (current > longestMs)
+                longestMs = current;
+        }
+
+        length += snprintf(&buffer[length], size - length,
+            "%s\"%03d\":{\"activations\":%lu,\"activeMs\":%lu,\"longestMs\":%lu,\"tampers\":%lu,\"hours\":[",
+            i > 0 ? "," : "",
+            i + panel->getFirstZone(),
+            zone->activations,
+            activeMs,
+            longestMs,
+            zone->tampers);
+
+        for (uint8_t hour = 0; hour < zoneStatisticsBuckets && length < size; hour++)
+            length += snprintf(&buffer[length], size - length, "%s%u", hour > 0 ? "," : "", zone->histogram[hour]);
+
+        if (length < size)
+            length += snprintf(&buffer[length], size - length, "]}");
+    }
+
+    if (length < size)
+        length += snprintf(&buffer[length], size - length, "}}");
+
+    return length < size ? length : size - 1;
+}
@@ -0,0 +1,38 @@
+// Copyright 2021 Kevin Cooper
+
+#ifndef __ZONE_STATISTICS_H_
+#define __ZONE_STATISTICS_H_
+
+#include "Arduino.h"
+#include "texecom.h"
+
+#define zoneStatisticsBuckets 24 // One per hour of the day
+
+// Running per-zone aggregates kept on the device for occupancy analytics,
+// so the backend doesn't have to rebuild them from the raw event stream.
+// Totals count from boot; consumers can tell a reset by uptime going back.
+class ZoneStatistics {
+public:
+  ZoneStatistics(Texecom *panel);
+  bool begin();
+  size_t write(char *buffer, size_t size);
+
+private:
+  typedef struct {
+      uint32_t activations;
+      uint32_t activeMs;        // Completed activations only, write() adds any in progress
+      uint32_t longestMs;
+      uint32_t tampers;
+      int64_t activeSince;      // Microseconds since boot, 0 while inactive
+      bool tampered;
+      uint16_t histogram[zoneStatisticsBuckets]; // Activations by local hour
+  } STATS;
+
+  Texecom *panel;
+  STATS *stats;
+
+  static void zoneEvent(const Texecom::ZONE_EVENT &event, void *statistics);
+  void update(const Texecom::ZONE_EVENT &event);
+};
+
+#endif  // __ZONE_STATISTICS_H_
@@ -2,47 +2,131 @@
 
 #include "texecom.h"
 
-Texecom::Texecom(void (*alarmCallback)(ALARM_STATE, uint8_t), void (*zoneCallback)(uint8_t, uint8_t))
+static_assert(CrestronFrame::ZONE_ACTIVE == Texecom::ZONE_ACTIVE &&
+              CrestronFrame::ZONE_TAMPER == Texecom::ZONE_TAMPER,
+              "CrestronFrame flags must match Texecom::ZONE_FLAGS");
+
+EventBus<Texecom::ALARM_EVENT, texecomMaxSubscribers> Texecom::alarmEvents;
+EventBus<Texecom::ZONE_EVENT, texecomMaxSubscribers> Texecom::zoneEvents;
+EventBus<Texecom::USER_EVENT, texecomMaxSubscribers> Texecom::userEvents;
+
+Texecom::Texecom(const CONFIG &config) : config(config)
+{
+    zoneStates = new uint8_t[config.zoneCount]();
+    zoneChanges = new ZONE_CHANGE[config.zoneCount]();
+
+    for (uint8_t i = 0; i < config.zoneCount; i++)
+    {
+        zoneChanges[i].panel = this;
+        zoneChanges[i].index = i;
+        zoneChanges[i].published = zoneNeverPublished;
+        zoneChanges[i].holdOff = config.zoneHoldOff;
+        zoneChanges[i].timer.setCallback(zoneHoldOffExpired, &zoneChanges[i]);
+    }
+}
+
+void Texecom::setZoneHoldOff(uint8_t zone, uint16_t holdOff)
 {
-    this->alarmCallback = alarmCallback;
-    this->zoneCallback = zoneCallback;
+    uint8_t index = zone - config.firstZone;
+
+    if (index < config.zoneCount)
+        zoneChanges[index].holdOff = holdOff;
 }
 
 void Texecom::setup()
 {
-    texSerial.begin(19200, SERIAL_8N2, RXD2, TXD2);  // open serial communications
-
-    pinMode(pinFullArmed, INPUT);
-    pinMode(pinPartArmed, INPUT);
-    pinMode(pinEntry, INPUT);
-    pinMode(pinExit, INPUT);
-    pinMode(pinTriggered, INPUT);
-    pinMode(pinArmFailed, INPUT);
-    pinMode(pinFaultPresent, INPUT);
-    pinMode(pinAreaReady, INPUT);
+    config.serial->begin(19200, SERIAL_8N2, config.rxPin, config.txPin);  // open serial communications
+
+    pinMode(config.pins.fullArmed, INPUT);
+    pinMode(config.pins.partArmed, INPUT);
+    pinMode(config.pins.entry, INPUT);
+    pinMode(config.pins.exit, INPUT);
+    pinMode(config.pins.triggered, INPUT);
+    pinMode(config.pins.armFailed, INPUT);
+    pinMode(config.pins.faultPresent, INPUT);
+    pinMode(config.pins.areaReady, INPUT);
+
+    // Wake the main loop as soon as panel data arrives rather than on the next timer
+    config.serial->onReceive([]() { scheduler.wake(); });
+
+    alarmStateTimer.setCallback(Timer::method<Texecom, &Texecom::publishAlarmState>, this);
+    messageTimeoutTimer.setCallback(Timer::method<Texecom, &Texecom::messageTimedOut>, this);
+    pinCheckTimer.setCallback(Timer::method<Texecom, &Texecom::checkDigiOutputs>, this);
+    pinCheckTimer.startPeriodic(pinCheckFrequency);
 }
 
 void Texecom::loop()
 {
-    if (millis() > nextPinCheck)
-    {
-        nextPinCheck = millis() + pinCheckFrequency;
-        checkDigiOutputs();
-    }
     checkSerial();
 
-    if (lastAlarmStateChange != 0 && millis() > (lastAlarmStateChange + alarmStateChangeBuffer))
+    // Only one message is handled per pass, don't let the loop sleep on the rest
+    if (config.serial->available() > 0)
+        scheduler.wake();
+}
+
+// Called once the GPIO outputs have settled, and from the pin check while
+// the pins don't back up the keypad
+void Texecom::publishAlarmState()
+{
+    if (frameAlarmStateValid && newAlarmState != frameAlarmState)
     {
-        lastAlarmStateChange = 0;
-        alarmState = newAlarmState;
-        alarmCallback(alarmState, alarmStateFlags);
+        // Most likely the pins haven't caught up yet, only the flags can go out
+        if (frameInGrace())
+        {
+            if (alarmStateFlags != publishedAlarmStateFlags)
+                sendAlarmState();
+            return;
+        }
+
+        stateDisagreements++;
+        Log.printf("Alarm state from pins (%d) disagrees with keypad (%d), using pins\n", newAlarmState, frameAlarmState);
+        frameAlarmState = newAlarmState;
     }
+
+    // Nothing to send if a keypad frame already reported this state
+    if (newAlarmState == alarmState && alarmStateFlags == publishedAlarmStateFlags)
+        return;
+
+    alarmState = newAlarmState;
+    sendAlarmState();
+}
+
+void Texecom::sendAlarmState()
+{
+    publishedAlarmStateFlags = alarmStateFlags;
+    ALARM_EVENT event = {this, alarmState, alarmStateFlags, esp_timer_get_time()};
+    alarmEvents.publish(event);
+}
+
+// Keypad frames arrive well before the outputs change, so act on them straight away
+void Texecom::updateFrameAlarmState(ALARM_STATE state)
+{
+    if (frameAlarmStateValid && state == frameAlarmState)
+        return;
+
+    frameAlarmState = state;
+    frameAlarmStateValid = true;
+    frameAlarmStateTime = esp_timer_get_time();
+
+    if (state == alarmState)
+        return;
+
+    frameStateUpdates++;
+    alarmState = state;
+    sendAlarmState();
+}
+
+bool Texecom::frameInGrace()
+{
+    uint32_t grace = constrain(frameLeadMs + frameLeadMs / 2, frameGraceMinimum, frameGraceMaximum);
+    return esp_timer_get_time() - frameAlarmStateTime < (int64_t)grace * 1000;
 }
 
 void Texecom::checkDigiOutputs()
 {
-    bool changeDetected = false;
-    bool _state = digitalRead(pinFullArmed);
+    bool stateChanged = false;
+    bool flagsChanged = false;
+    bool _state = digitalRead(config.pins.fullArmed);
 
     if (_state != statePinFullArmed)
     {
@@ -50,12 +134,12 @@ void Texecom::checkDigiOutputs()
         if (_state == LOW)
         {
             // Log.info("Pin Full Armed");
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = ARMED_AWAY;
         }
     }
 
-    _state = digitalRead(pinPartArmed);
+    _state = digitalRead(config.pins.partArmed);
 
     if (_state != statePinPartArmed)
     {
@@ -63,12 +147,12 @@ void Texecom::checkDigiOutputs()
         if (_state == LOW)
         {
             // Log.info("Pin Part Armed");
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = ARMED_HOME;
         }
     }
 
-    _state = digitalRead(pinEntry);
+    _state = digitalRead(config.pins.entry);
 
     if (_state != statePinEntry)
     {
@@ -76,12 +160,12 @@ void Texecom::checkDigiOutputs()
         if (_state == LOW)
         {
             // Log.info("Pin Entry");
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = ENTRY;
         }
     }
 
-    _state = digitalRead(pinExit);
+    _state = digitalRead(config.pins.exit);
 
     if (_state != statePinExit)
     {
@@ -89,12 +173,12 @@ void Texecom::checkDigiOutputs()
         if (_state == LOW)
         {
             // Log.info("Pin Exit");
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = EXIT;
         }
     }
 
-    _state = digitalRead(pinTriggered);
+    _state = digitalRead(config.pins.triggered);
 
     if (_state != statePinTriggered)
     {
@@ -102,17 +186,17 @@ void Texecom::checkDigiOutputs()
         if (_state == LOW)
         {
             // Log.info("Pin Triggered");
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = TRIGGERED;
         }
     }
 
-    _state = digitalRead(pinAreaReady);
+    _state = digitalRead(config.pins.areaReady);
 
     if (_state != statePinAreaReady)
     {
         // Log.info("Pin Ready");
-        changeDetected = true;
+        flagsChanged = true;
         statePinAreaReady = _state;
 
         if (statePinAreaReady == LOW)
@@ -125,12 +209,12 @@ void Texecom::checkDigiOutputs()
         }
     }
 
-    _state = digitalRead(pinFaultPresent);
+    _state = digitalRead(config.pins.faultPresent);
 
     if (_state != statePinFaultPresent)
     {
         // Log.info("Pin Fault");
-        changeDetected = true;
+        flagsChanged = true;
         statePinFaultPresent = _state;
 
         if (statePinFaultPresent == LOW)
@@ -145,12 +229,12 @@ void Texecom::checkDigiOutputs()
         }
     }
 
-    _state = digitalRead(pinArmFailed);
+    _state = digitalRead(config.pins.armFailed);
 
     if (_state != statePinArmFailed)
     {
         // Log.info("Pin Arm Failed");
-        changeDetected = true;
+        flagsChanged = true;
         statePinArmFailed = _state;
 
         if (statePinArmFailed == LOW)
@@ -175,183 +259,186 @@ void Texecom::checkDigiOutputs()
         statePinTriggered == HIGH)
     {
 
-            changeDetected = true;
+            stateChanged = true;
             newAlarmState = DISARMED;
     }
 
-    if (changeDetected)
+    if (stateChanged && frameAlarmStateValid && newAlarmState == frameAlarmState)
+        frameLeadMs = (esp_timer_get_time() - frameAlarmStateTime) / 1000;
+
+    if (stateChanged || flagsChanged)
+    {
+        alarmStateTimer.start(alarmStateChangeBuffer);
+    }
+    // Pins that never move can't correct a wrong frame on their own
+    else if (frameAlarmStateValid && newAlarmState != frameAlarmState && !alarmStateTimer.isPending())
     {
-        lastAlarmStateChange = millis();
+        publishAlarmState();
     }
 
 }
 
-void Texecom::decodeZoneState(char *message)
+void Texecom::decodeZoneState(const CrestronFrame::FRAME &frame)
 {
-    uint8_t zone;
-    uint8_t state;
+    uint8_t zone = frame.zone - config.firstZone;
 
-    char zoneChar[4];
-    memcpy(zoneChar, &message[2], 3);
-    zoneChar[3] = '\0';
-    zone = atoi(zoneChar) - firstZone;
+    if (zone >= config.zoneCount)
+        return;
 
-    state = message[5] - '0';
+    uint8_t state = CrestronFrame::applyZoneState(zoneStates[zone], frame.zoneState);
+    ZONE_CHANGE *change = &zoneChanges[zone];
 
-    if (state == 0) // Healthy
+    // Repeated frames mustn't move the time of the real transition, the
+    // first frame for a zone stands as one
+    if (state != zoneStates[zone] || change->published == zoneNeverPublished)
     {
-        zoneStates[zone] &= ~Texecom::ZONE_ACTIVE;
-        zoneStates[zone] &= ~Texecom::ZONE_TAMPER;
+        zoneStates[zone] = state;
+        change->changedAt = esp_timer_get_time();
     }
-    else if (state == 1) // Active
+
+    if (zoneStates[zone] == change->published)
     {
-        zoneStates[zone] |= Texecom::ZONE_ACTIVE;
-        zoneStates[zone] &= ~Texecom::ZONE_TAMPER;
+        change->suppressed++;
+
+        // Changed and changed back inside the hold-off, nothing to send
+        if (change->timer.isPending())
+        {
+            change->timer.stop();
+            change->suppressed++;
+        }
+        return;
     }
-    else if (state == 2) // Tamper
+
+    // Already waiting on the hold-off, the newer state replaces the held one
+    if (change->timer.isPending())
     {
-        zoneStates[zone] &= ~Texecom::ZONE_ACTIVE;
-        zoneStates[zone] |= Texecom::ZONE_TAMPER;
+        change->suppressed++;
+        return;
     }
 
-    zoneCallback(zone+firstZone, zoneStates[zone]);
+    uint64_t sincePublished = Scheduler::now() - change->publishedAt;
+
+    if (change->published == zoneNeverPublished || sincePublished >= change->holdOff)
+        publishZoneState(zone);
+    else
+        change->timer.start(change->holdOff - sincePublished);
+}
+
+void Texecom::publishZoneState(uint8_t index)
+{
+    ZONE_CHANGE *change = &zoneChanges[index];
+    change->published = zoneStates[index];
+    change->publishedAt = Scheduler::now();
+
+    ZONE_EVENT event = {this, (uint8_t)(index+config.firstZone), zoneStates[index], change->changedAt};
+    zoneEvents.publish(event);
+}
+
+// Trailing edge of the hold-off, sends whatever the zone settled on
+void Texecom::zoneHoldOffExpired(void *zoneChange)
+{
+    ZONE_CHANGE *change = (ZONE_CHANGE *)zoneChange;
+    change->panel->publishZoneState(change->index);
 }
 
 bool Texecom::processCrestronMessage(char *message, uint8_t messageLength)
 {
-    // Zone state changed
-    if (messageLength == 6 &&
-        strncmp(message, msgZoneUpdate, strlen(msgZoneUpdate)) == 0)
+    CrestronFrame::FRAME frame = CrestronFrame::parse(message, messageLength);
+
+    switch (frame.type)
     {
-        decodeZoneState(message);
-        return true;
-    }
+    // Zone state changed
+    case CrestronFrame::ZONE_UPDATE:
+        decodeZoneState(frame);
+        break;
     // System Armed
-    else if (messageLength >= 6 &&
-             strncmp(message, msgArmUpdate, strlen(msgArmUpdate)) == 0)
-    {
-        return true;
-    }
+    case CrestronFrame::ARM_UPDATE:
+        if (alarmState != ARMED_AWAY && alarmState != ARMED_HOME)
+            updateFrameAlarmState(frameArmMode);
+        break;
     // System Disarmed
-    else if (messageLength >= 6 &&
-             strncmp(message, msgDisarmUpdate, strlen(msgDisarmUpdate)) == 0)
-    {
-        return true;
-    }
+    case CrestronFrame::DISARM_UPDATE:
+        updateFrameAlarmState(DISARMED);
+        break;
     // Entry while armed
-    else if (messageLength == 6 &&
-             strncmp(message, msgEntryUpdate, strlen(msgEntryUpdate)) == 0)
-    {
-        return true;
-    }
+    case CrestronFrame::ENTRY_UPDATE:
+    case CrestronFrame::SCREEN_AREA_IN_ENTRY:
+        updateFrameAlarmState(ENTRY);
+        break;
     // System arming
-    else if (messageLength == 6 &&
-             strncmp(message, msgArmingUpdate, strlen(msgArmingUpdate)) == 0)
-    {
-        return true;
-    }
+    case CrestronFrame::ARMING_UPDATE:
+    case CrestronFrame::SCREEN_AREA_IN_EXIT:
+        updateFrameAlarmState(EXIT);
+        break;
     // Intruder
-    else if (messageLength == 6 &&
-             strncmp(message, msgIntruderUpdate, strlen(msgIntruderUpdate)) == 0)
-    {
-        return true;
-    }
+    case CrestronFrame::INTRUDER_UPDATE:
+        updateFrameAlarmState(TRIGGERED);
+        break;
     // User logged in with code or tag
-    else if (messageLength == 6 &&
-            (strncmp(message, msgUserPinLogin, strlen(msgUserPinLogin)) == 0 ||
-            strncmp(message, msgUserTagLogin, strlen(msgUserTagLogin)) == 0))
+    case CrestronFrame::USER_PIN_LOGIN:
+    case CrestronFrame::USER_TAG_LOGIN:
     {
-        int user = message[4] - '0';
-        if (user < userCount)
-            Log.printf("User logged in: %s\n", users[user]);
+        if (frame.user < userCount)
+            Log.printf("User logged in: %s\n", users[frame.user]);
         else
             Log.println("User logged in: Outside of user array size");
-        return true;
-    }
-    // Reply to ASTATUS request that the system is disarmed
-    else if (messageLength == 5 &&
-             strncmp(message, msgReplyDisarmed, strlen(msgReplyDisarmed)) == 0)
-    {
-        return true;
-    }
-    // Reply to ASTATUS request that the system is armed
-    else if (messageLength == 5 &&
-             strncmp(message, msgReplyArmed, strlen(msgReplyArmed)) == 0) 
-    {
-        return true;
-    }
-    else if ((messageLength >= strlen(msgScreenArmedPart) &&
-              strncmp(message, msgScreenArmedPart, strlen(msgScreenArmedPart)) == 0) ||
-             (messageLength >= strlen(msgScreenArmedNight) &&
-              strncmp(message, msgScreenArmedNight, strlen(msgScreenArmedNight)) == 0) ||
-             (messageLength >= strlen(msgScreenIdlePartArmed) &&
-              strncmp(message, msgScreenIdlePartArmed, strlen(msgScreenIdlePartArmed)) == 0))
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenArmedFull) &&
-             strncmp(message, msgScreenArmedFull, strlen(msgScreenArmedFull)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenIdle) &&
-             strncmp(message, msgScreenIdle, strlen(msgScreenIdle)) == 0)
-    {
-        return true;
-    }
-    // Shown directly after user logs in
-    else if (messageLength > strlen(msgWelcomeBack) &&
-             strncmp(message, msgWelcomeBack, strlen(msgWelcomeBack)) == 0)
-    {
-        return true;
+
+        USER_EVENT event = {this, frame.user, frame.type == CrestronFrame::USER_TAG_LOGIN, esp_timer_get_time()};
+        userEvents.publish(event);
+        break;
     }
+    case CrestronFrame::SCREEN_ARMED_PART:
+        updateFrameAlarmState(ARMED_HOME);
+        break;
+    case CrestronFrame::SCREEN_ARMED_FULL:
+        updateFrameAlarmState(ARMED_AWAY);
+        break;
     // Shown shortly after user logs in
-    else if (messageLength >= strlen(msgScreenQuestionArm) &&
-             strncmp(message, msgScreenQuestionArm, strlen(msgScreenQuestionArm)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenQuestionPartArm) &&
-             strncmp(message, msgScreenQuestionPartArm, strlen(msgScreenQuestionPartArm)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenQuestionNightArm) &&
-             strncmp(message, msgScreenQuestionNightArm, strlen(msgScreenQuestionNightArm)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenQuestionDisarm) &&
-             strncmp(message, msgScreenQuestionDisarm, strlen(msgScreenQuestionDisarm)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenAreainEntry) &&
-             strncmp(message, msgScreenAreainEntry, strlen(msgScreenAreainEntry)) == 0)
-    {
-        return true;
-    }
-    else if (messageLength >= strlen(msgScreenAreainExit) &&
-             strncmp(message, msgScreenAreainExit, strlen(msgScreenAreainExit)) == 0)
-    {
-        return true;
-    }
-    return false;
+    case CrestronFrame::QUESTION_ARM:
+        frameArmMode = ARMED_AWAY;
+        break;
+    case CrestronFrame::QUESTION_PART_ARM:
+    case CrestronFrame::QUESTION_NIGHT_ARM:
+        frameArmMode = ARMED_HOME;
+        break;
+    // ASTATUS replies, idle and welcome screens, nothing to do
+    case CrestronFrame::REPLY_DISARMED:
+    case CrestronFrame::REPLY_ARMED:
+    case CrestronFrame::SCREEN_IDLE:
+    case CrestronFrame::SCREEN_WELCOME_BACK:
+    case CrestronFrame::QUESTION_DISARM:
+        break;
+    default:
+        return false;
+    }
+    return true;
 }
 
 void Texecom::checkSerial()
 {
     bool messageReady = false;
     uint8_t messageLength = 0;
+    uint8_t raw[64];
+    uint8_t rawLength = 0;
 
     // Read incoming serial data if available and copy to TCP port
-    while (texSerial.available() > 0)
+    while (config.serial->available() > 0)
     {
-        int incomingByte = texSerial.read();
+        int incomingByte = config.serial->read();
+
+        // Handed over in batches, the tap never blocks
+        raw[rawLength++] = incomingByte;
+        if (rawLength == sizeof(raw))
+        {
+            if (serialTap != NULL)
+                serialTap(raw, rawLength, serialTapContext);
+            rawLength = 0;
+        }
+
         // Log.info("S %d", incomingByte);
         if (bufferPosition == 0)
         {
-            messageStart = millis();
+            messageTimeoutTimer.start(messageTimeout);
         }
 
         // Will never happen but just in case
@@ -386,39 +473,54 @@ void Texecom::checkSerial()
         {
             buffer[bufferPosition++] = incomingByte;
         }
-    } // while (texSerial.available() > 0)
+    } // while (config.serial->available() > 0)
 
-    if (bufferPosition > 0 && millis() > (messageStart+50))
-    {
-        Log.println("Message failed to receive within 50ms");
-        memcpy(message, buffer, bufferPosition);
-        message[bufferPosition] = '\0';
-        messageReady = true;
-        messageLength = bufferPosition;
-        bufferPosition = 0;
-    }
+    if (rawLength > 0 && serialTap != NULL)
+        serialTap(raw, rawLength, serialTapContext);
 
     if (messageReady)
     {
+        messageTimeoutTimer.stop();
+        processMessage(messageLength);
+    }
+}
+
+void Texecom::messageTimedOut()
+{
+    if (bufferPosition == 0)
+        return;
+
+    if (logAllowed(60, 10))
+        Log.printf("Message failed to receive within %dms\n", messageTimeout);
+    memcpy(message, buffer, bufferPosition);
+    message[bufferPosition] = '\0';
+    uint8_t messageLength = bufferPosition;
+    bufferPosition = 0;
+    processMessage(messageLength);
+}
+
+void Texecom::processMessage(uint8_t messageLength)
+{
+    // Every frame is logged, but a storm mustn't flood syslog
+    if (logAllowed(1200, 100))
         Log.println(message);
 
-        bool processedSuccessfully = false;
-        processedSuccessfully = processCrestronMessage(message, messageLength);
+    bool processedSuccessfully = false;
+    processedSuccessfully = processCrestronMessage(message, messageLength);
 
-        if (!processedSuccessfully)
+    if (!processedSuccessfully && logAllowed(60, 10))
+    {
+        if (message[0] == '"')
         {
-            if (message[0] == '"')
-            {
-                Log.printf("Unknown Crestron command - %s\n", message);
-            }
-            else
+            Log.printf("Unknown Crestron command - %s\n", message);
+        }
+        else
+        {
+            Log.printf("Unknown non-Crestron command - %s\n", message);
+            for (uint8_t i = 0; i < messageLength; i++)
             {
-                Log.printf("Unknown non-Crestron command - %s\n", message);
-                for (uint8_t i = 0; i < messageLength; i++)
-                {
-                    Log.printf("%d\n", message[i]);
-                }
+                Log.printf("%d\n", message[i]);
             }
         }
     }
-}
\ No newline at end of file
+}
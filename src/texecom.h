@@ -5,16 +5,41 @@
 
 #include "Arduino.h"
 #include "Logging.h"
+#include "EventBus.h"
+#include "Scheduler.h"
+#include "CrestronFrame.h"
 
-#define texSerial Serial2
-#define RXD2 16
-#define TXD2 17
-
-#define firstZone 9 // Zone 1 = 1
-#define zoneCount 11 // 1 == 1
+// Subscribers per event bus. The application checks its own sinks fit, a
+// build with more panels or sinks can raise it with -DtexecomMaxSubscribers
+#ifndef texecomMaxSubscribers
+#define texecomMaxSubscribers 8
+#endif
 
 class Texecom {
 public:
+  typedef struct {
+      int fullArmed;
+      int partArmed;
+      int exit;
+      int entry;
+      int triggered;
+      int armFailed;
+      int faultPresent;
+      int areaReady;
+  } DIGI_OUTPUT_PINS;
+
+  typedef struct {
+      uint8_t panelId;          // Identifies the panel in the journal and local events
+      const char *topicPrefix;  // e.g. "home/security"
+      HardwareSerial *serial;
+      int8_t rxPin;
+      int8_t txPin;
+      DIGI_OUTPUT_PINS pins;
+      uint8_t firstZone;        // Zone 1 = 1
+      uint8_t zoneCount;        // 1 == 1
+      uint16_t zoneHoldOff;     // Minimum ms between events for one zone, the last state is always sent
+  } CONFIG;
+
   typedef enum {
       DISARMED = 0,
       ARMED_HOME = 1,
@@ -41,21 +66,96 @@ public:
       ALARM_ARM_FAILED = 1 << 2,
   } ALARM_FLAGS;
 
-  Texecom(void (*alarmCallback)(Texecom::ALARM_STATE, uint8_t), void (*zoneCallback)(uint8_t, uint8_t));
+  typedef struct {
+      Texecom *panel;
+      ALARM_STATE state;
+      uint8_t flags;       // ALARM_FLAGS
+      int64_t timestamp;   // Microseconds since boot
+  } ALARM_EVENT;
+
+  typedef struct {
+      Texecom *panel;
+      uint8_t zone;
+      uint8_t state;       // ZONE_FLAGS
+      int64_t timestamp;
+  } ZONE_EVENT;
+
+  typedef struct {
+      Texecom *panel;
+      uint8_t user;
+      bool tag;            // Logged in with a tag rather than a PIN
+      int64_t timestamp;
+  } USER_EVENT;
+
+  // Shared by every panel, subscribers tell panels apart with event.panel
+  static EventBus<ALARM_EVENT, texecomMaxSubscribers> alarmEvents;
+  static EventBus<ZONE_EVENT, texecomMaxSubscribers> zoneEvents;
+  static EventBus<USER_EVENT, texecomMaxSubscribers> userEvents;
+
+  // Sees every byte read from the panel, before it is parsed
+  typedef void (*SERIAL_TAP)(const uint8_t *data, size_t length, void *context);
+
+  Texecom(const CONFIG &config);
   void setup();
   void loop();
 
-private:
+  uint8_t getPanelId() { return config.panelId; }
+  const char *getTopicPrefix() { return config.topicPrefix; }
+  uint8_t getFirstZone() { return config.firstZone; }
+  uint8_t getZoneCount() { return config.zoneCount; }
+  uint8_t getZoneState(uint8_t zone) { return zoneStates[zone - config.firstZone]; }
+  uint32_t getZoneSuppressed(uint8_t zone) { return zoneChanges[zone - config.firstZone].suppressed; }
+  void setZoneHoldOff(uint8_t zone, uint16_t holdOff);
+  void setSerialTap(SERIAL_TAP tap, void *context) { serialTap = tap; serialTapContext = context; }
+  ALARM_STATE getAlarmState() { return alarmState; }
+  uint8_t getAlarmStateFlags() { return alarmStateFlags; }
+  uint32_t getFrameStateUpdates() { return frameStateUpdates; }
+  uint32_t getStateDisagreements() { return stateDisagreements; }
+  uint32_t getFrameLeadMs() { return frameLeadMs; }
 
-  void (*zoneCallback)(uint8_t, uint8_t);
-  void (*alarmCallback)(Texecom::ALARM_STATE, uint8_t);
+private:
 
-  uint8_t zoneStates[zoneCount];
-  ALARM_STATE alarmState;
-  ALARM_STATE newAlarmState;
-  uint32_t lastAlarmStateChange = 0;
+  const CONFIG config;
+
+  uint8_t *zoneStates;
+
+  // Change suppression for each zone. Frames that repeat the published state
+  // are dropped and changes inside the hold-off are held on a timer so only
+  // the latest one goes out when it expires.
+  typedef struct {
+      Texecom *panel;
+      uint8_t index;
+      uint8_t published;      // Last state sent, zoneNeverPublished until the first
+      uint16_t holdOff;
+      uint64_t publishedAt;   // Scheduler::now() of the last event
+      int64_t changedAt;      // When the state last actually changed
+      uint32_t suppressed;    // Frames that never became an event
+      Timer timer;
+  } ZONE_CHANGE;
+
+  static const uint8_t zoneNeverPublished = ZONE_ALWAYS_ZERO;
+  ZONE_CHANGE *zoneChanges;
+  ALARM_STATE alarmState = DISARMED;
+  ALARM_STATE newAlarmState = DISARMED;
+  Timer alarmStateTimer;
   const uint16_t alarmStateChangeBuffer = 1000;
-  uint8_t alarmStateFlags;
+  uint8_t alarmStateFlags = 0;
+  uint8_t publishedAlarmStateFlags = 0;
+
+  // Alarm state estimated from keypad frames, published as soon as a frame
+  // arrives. The debounced GPIO outputs are kept as a cross-check.
+  ALARM_STATE frameAlarmState = DISARMED;
+  bool frameAlarmStateValid = false;
+  ALARM_STATE frameArmMode = ARMED_AWAY;  // Mode "A0 arms into, from the last arm question shown
+  int64_t frameAlarmStateTime = 0;
+  uint32_t frameStateUpdates = 0;
+  uint32_t stateDisagreements = 0;
+  uint32_t frameLeadMs = 0;               // How far the last agreeing frame beat the pins
+
+  // How long the pins get to catch up with a frame before they disagree,
+  // half as long again as the measured lead, within these bounds
+  const uint16_t frameGraceMinimum = 3000;
+  const uint16_t frameGraceMaximum = 10000;
 
   static const uint8_t userCount = 4;
   const char *users[userCount] = {"root", "Kevin", "Nicki", "Mumma"};
@@ -63,30 +163,14 @@ private:
   const uint8_t maxMessageSize = 100;
   char message[101];
   char buffer[101];
-  uint8_t bufferPosition;
-  uint32_t messageStart;
+  uint8_t bufferPosition = 0;
+  SERIAL_TAP serialTap = NULL;
+  void *serialTapContext = NULL;
+  Timer messageTimeoutTimer;
+  const uint16_t messageTimeout = 50;
 
   const uint16_t pinCheckFrequency = 1000;
-  uint32_t nextPinCheck = 0;
-
-//  Digi Output - Argon Pin - Texecom Configuration
-//  1 ----------------- 18 - 22 Full Armed
-//  2 ----------------- 39 - 23 Part Armed
-//  3 ----------------- 5  - 19 Exit
-//  4 ----------------- 34 - 17 Entry
-//  5 ----------------- 4  - 00 Alarm
-//  6 ----------------- 25 - 27 Arm Failed
-//  7 ----------------- 36 - 66 Fault Present
-//  8 ----------------- 26 - 16 Area Ready
-
-  const int pinFullArmed = 18;
-  const int pinPartArmed = 39;
-  const int pinExit = 5;
-  const int pinEntry = 34;
-  const int pinTriggered = 4;
-  const int pinArmFailed = 25;
-  const int pinFaultPresent = 36;
-  const int pinAreaReady = 26;
+  Timer pinCheckTimer;
 
   bool statePinFullArmed = HIGH;
   bool statePinPartArmed = HIGH;
@@ -97,36 +181,18 @@ private:
   bool statePinFaultPresent = HIGH;
   bool statePinAreaReady = LOW;
 
-  const char *msgZoneUpdate = "\"Z0";
-  const char *msgArmUpdate = "\"A0";
-  const char *msgDisarmUpdate = "\"D0";
-  const char *msgEntryUpdate = "\"E0";
-  const char *msgArmingUpdate = "\"X0";
-  const char *msgIntruderUpdate = "\"L0";
-  const char *msgUserPinLogin = "\"U0";
-  const char *msgUserTagLogin = "\"T0";
-
-  const char *msgReplyDisarmed = "\"N";
-  const char *msgReplyArmed = "\"Y";
-  const char *msgWelcomeBack = "\"  Welcome Back";
-  const char *msgScreenIdle = "\"  The Cooper's";
-  const char *msgScreenIdlePartArmed = "\" * PART ARMED *";
-  const char *msgScreenArmedPart = "\"Part";
-  const char *msgScreenArmedNight = "\"Night";
-  const char *msgScreenArmedFull = "\"Area FULL ARMED";
-
-  const char *msgScreenQuestionArm = "\"Do you want to  Arm System?";
-  const char *msgScreenQuestionPartArm = "\"Do you want to  Part Arm System?";
-  const char *msgScreenQuestionNightArm = "\"Do you want:-   Night Arm";
-  const char *msgScreenQuestionDisarm = "\"Do you want to  Disarm System?";
-
-  const char *msgScreenAreainEntry = "\"Area in Entry";
-  const char *msgScreenAreainExit = "\"Area in Exit >";
-
   void checkDigiOutputs();
+  void publishAlarmState();
+  void sendAlarmState();
+  void updateFrameAlarmState(ALARM_STATE state);
+  bool frameInGrace();
   bool processCrestronMessage(char *message, uint8_t messageLength);
   void checkSerial();
-  void decodeZoneState(char *message);
+  void processMessage(uint8_t messageLength);
+  void messageTimedOut();
+  void decodeZoneState(const CrestronFrame::FRAME &frame);
+  void publishZoneState(uint8_t index);
+  static void zoneHoldOffExpired(void *zoneChange);
 };
 
 #endif  // __TEXECOM_H_
\ No newline at end of file
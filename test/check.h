@@ -0,0 +1,45 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Just enough of a test framework for the host tests. Each test binary runs
+// its tests with RUN_TEST() and returns checkFailures() from main(), so
+// ctest fails it if any check did.
+
+static unsigned checkFailureCount = 0;
+
+#define CHECK(condition)                                                          \
+    do                                                                            \
+    {                                                                             \
+        if (!(condition))                                                         \
+        {                                                                         \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);  \
+            checkFailureCount++;                                                  \
+        }                                                                         \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual)                                             \
+    do                                                                            \
+    {                                                                             \
+        long long e = (long long)(expected), a = (long long)(actual);            \
+        if (e != a)                                                               \
+        {                                                                         \
+            printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__,      \
+                   #actual, a, e);                                                \
+            checkFailureCount++;                                                  \
+        }                                                                         \
+    } while (0)
+
+#define RUN_TEST(test)                                                            \
+    do                                                                            \
+    {                                                                             \
+        unsigned before = checkFailureCount;                                      \
+        test();                                                                   \
+        printf("%s %s\n", checkFailureCount == before ? "PASS" : "FAIL", #test);  \
+    } while (0)
+
+inline int checkFailures() { return checkFailureCount == 0 ? 0 : 1; }
+
+#endif // CHECK_H
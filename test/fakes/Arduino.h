@@ -0,0 +1,153 @@
+#ifndef FAKE_ARDUINO_H
+#define FAKE_ARDUINO_H
+
+// Host stand-in for the parts of the Arduino core and ESP-IDF the firmware
+// uses, just enough to run units of it under test. Time only moves when a
+// test moves it, or when the firmware sleeps through ulTaskNotifyTake().
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <functional>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define SERIAL_8N1 0x800001c
+#define SERIAL_8N2 0x800003c
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+// Microseconds since boot, behind millis(), micros() and esp_timer_get_time()
+extern int64_t fakeTime;
+inline void fakeAdvance(uint32_t ms) { fakeTime += (int64_t)ms * 1000; }
+
+inline unsigned long millis() { return fakeTime / 1000; }
+inline unsigned long micros() { return fakeTime; }
+inline int64_t esp_timer_get_time() { return fakeTime; }
+inline void delay(uint32_t ms) { fakeAdvance(ms); }
+inline void yield() {}
+
+// One task, which sleeps by moving the clock on unless it has been notified
+typedef void *TaskHandle_t;
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+extern uint32_t fakeNotifications;
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return &fakeNotifications; }
+inline void xTaskNotifyGive(TaskHandle_t task) { fakeNotifications++; }
+inline void vTaskDelay(TickType_t ticks) { fakeAdvance(ticks); }
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticksToWait)
+{
+    uint32_t notifications = fakeNotifications;
+    if (notifications == 0)
+        fakeAdvance(ticksToWait);
+    else
+        fakeNotifications = clearOnExit ? 0 : notifications - 1;
+    return notifications;
+}
+
+// Last level written to each pin
+#define FAKE_PIN_COUNT 40
+extern uint8_t fakePinLevels[FAKE_PIN_COUNT];
+inline void pinMode(uint8_t pin, uint8_t mode) {}
+inline void digitalWrite(uint8_t pin, uint8_t value) { fakePinLevels[pin] = value; }
+inline int digitalRead(uint8_t pin) { return fakePinLevels[pin]; }
+
+class String
+{
+public:
+    String(const char *text = "") : _text(text) {}
+    void toLowerCase() {}
+    const char *c_str() const { return _text.c_str(); }
+
+private:
+    std::string _text;
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    size_t print(const char *text) { return write(text); }
+    size_t println(const char *text = "") { return write(text) + write("\r\n"); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    virtual size_t readBytes(uint8_t *buffer, size_t length)
+    {
+        size_t count = 0;
+        int c;
+        while (count < length && (c = read()) >= 0)
+            buffer[count++] = c;
+        return count;
+    }
+};
+
+class IPAddress
+{
+public:
+    IPAddress() : _address(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+    IPAddress(uint32_t address) : _address(address) {}
+    operator uint32_t() const { return _address; }
+
+    String toString() const
+    {
+        char text[16];
+        snprintf(text, sizeof(text), "%u.%u.%u.%u",
+                 _address & 0xFF, (_address >> 8) & 0xFF, (_address >> 16) & 0xFF, _address >> 24);
+        return String(text);
+    }
+
+private:
+    uint32_t _address;
+};
+
+// Discards whatever the firmware writes to it, reads come from input
+class HardwareSerial : public Stream
+{
+public:
+    std::string input;
+
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1) {}
+    void onReceive(std::function<void(void)> function, bool onlyOnTimeout = false) {}
+    size_t write(uint8_t c) { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { return size; }
+    int available() { return input.size(); }
+    int peek() { return input.empty() ? -1 : (uint8_t)input[0]; }
+
+    int read()
+    {
+        int c = peek();
+        if (c >= 0)
+            input.erase(0, 1);
+        return c;
+    }
+};
+
+extern HardwareSerial Serial;
+
+#endif // FAKE_ARDUINO_H
@@ -0,0 +1,6 @@
+#ifndef FAKE_ESPMDNS_H
+#define FAKE_ESPMDNS_H
+
+// Nothing the units under test use
+
+#endif // FAKE_ESPMDNS_H
@@ -0,0 +1,109 @@
+#ifndef FAKE_HTTPCLIENT_H
+#define FAKE_HTTPCLIENT_H
+
+#include <Arduino.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HTTP_CODE_OK 200
+
+// A plain HTTP/1.0 GET over a real socket, enough to run the firmware
+// against a server the test starts on the loopback interface. Only
+// http://<dotted quad>:<port>/<path> URLs.
+class HTTPClient
+{
+public:
+    ~HTTPClient() { end(); }
+
+    bool begin(const char *url)
+    {
+        unsigned a, b, c, d, port;
+        int pathAt = 0;
+        if (sscanf(url, "http://%u.%u.%u.%u:%u%n", &a, &b, &c, &d, &port, &pathAt) != 5)
+            return false;
+        _address = (a << 24) | (b << 16) | (c << 8) | d;
+        _port = port;
+        _path = url[pathAt] == '/' ? &url[pathAt] : "/";
+        return true;
+    }
+
+    int GET()
+    {
+        _stream.fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(_port);
+        address.sin_addr.s_addr = htonl(_address);
+        if (_stream.fd < 0 || connect(_stream.fd, (sockaddr *)&address, sizeof(address)) < 0)
+            return -1;
+
+        std::string request = "GET " + _path + " HTTP/1.0\r\n\r\n";
+        if (send(_stream.fd, request.data(), request.size(), 0) != (ssize_t)request.size())
+            return -1;
+
+        // Headers a byte at a time, so the body is left for the stream
+        std::string headers;
+        char c;
+        while (headers.find("\r\n\r\n") == std::string::npos && recv(_stream.fd, &c, 1, 0) == 1)
+            headers += c;
+
+        int code = -1;
+        sscanf(headers.c_str(), "HTTP/1.%*d %d", &code);
+        size_t length = headers.find("Content-Length: ");
+        _size = length == std::string::npos ? -1 : atoi(headers.c_str() + length + 16);
+        return code;
+    }
+
+    int getSize() { return _size; }
+    Stream *getStreamPtr() { return &_stream; }
+
+    void end()
+    {
+        if (_stream.fd >= 0)
+            close(_stream.fd);
+        _stream.fd = -1;
+    }
+
+private:
+    // The response body, waits up to a second for more to arrive
+    class SocketStream : public Stream
+    {
+    public:
+        int fd = -1;
+
+        int available()
+        {
+            pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, 1000) <= 0)
+                return 0;
+            uint8_t buffer[4096];
+            ssize_t count = recv(fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+            return count > 0 ? count : 0;
+        }
+
+        int read()
+        {
+            uint8_t c;
+            return readBytes(&c, 1) == 1 ? c : -1;
+        }
+
+        int peek() { return -1; }
+        size_t write(uint8_t c) { return 0; }
+
+        size_t readBytes(uint8_t *buffer, size_t length)
+        {
+            ssize_t count = recv(fd, buffer, length, 0);
+            return count > 0 ? count : 0;
+        }
+    };
+
+    uint32_t _address = 0;
+    uint16_t _port = 0;
+    std::string _path;
+    int _size = -1;
+    SocketStream _stream;
+};
+
+#endif // FAKE_HTTPCLIENT_H
@@ -0,0 +1,36 @@
+#ifndef FAKE_PUBSUBCLIENT_H
+#define FAKE_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+
+// Records what goes to the broker rather than sending it
+class PubSubClient : public Print
+{
+public:
+    bool up = true;
+    size_t writeLimit = SIZE_MAX;       // Bytes the socket will take before writes fail
+    std::vector<uint8_t> written;
+    std::vector<std::string> subscribed;
+
+    boolean connected() { return up; }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        if (!up || written.size() + size > writeLimit)
+            return 0;
+        written.insert(written.end(), buffer, buffer + size);
+        return size;
+    }
+
+    boolean subscribe(const char *topic)
+    {
+        subscribed.push_back(topic);
+        return up;
+    }
+};
+
+#endif // FAKE_PUBSUBCLIENT_H
@@ -0,0 +1,43 @@
+#ifndef FAKE_UPDATE_H
+#define FAKE_UPDATE_H
+
+#include <Arduino.h>
+#include <string>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+// Keeps the image in memory instead of writing the OTA partition
+class UpdateClass
+{
+public:
+    std::string image;
+    bool begun = false;
+    bool ended = false;
+    bool aborted = false;
+
+    void reset() { *this = UpdateClass(); }
+
+    bool begin(size_t size)
+    {
+        begun = true;
+        return true;
+    }
+
+    size_t write(uint8_t *data, size_t length)
+    {
+        image.append((const char *)data, length);
+        return length;
+    }
+
+    bool end(bool evenIfRemaining = false)
+    {
+        ended = true;
+        return true;
+    }
+
+    void abort() { aborted = true; }
+};
+
+extern UpdateClass Update;
+
+#endif // FAKE_UPDATE_H
@@ -0,0 +1,167 @@
+#ifndef FAKE_WIFI_H
+#define FAKE_WIFI_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <memory>
+
+// Not connected unless a test says so, until then syslog lines go nowhere
+class WiFiClass
+{
+public:
+    bool connected = false;
+
+    bool isConnected() { return connected; }
+    String macAddress() { return String("00:00:00:00:00:00"); }
+};
+
+extern WiFiClass WiFi;
+
+class WiFiUDP : public Print
+{
+public:
+    int beginPacket(const char *host, uint16_t port) { return 1; }
+    int endPacket() { return 1; }
+    size_t write(uint8_t c) { return 1; }
+    size_t write(const uint8_t *buffer, size_t size) { return size; }
+};
+
+// A real host socket, shared between copies and closed with the last of
+// them as the core's is. Writes block, as the core's do.
+class WiFiClient : public Client
+{
+public:
+    WiFiClient() {}
+    WiFiClient(int fd) : _socket(std::make_shared<Socket>(fd)) {}
+
+    int fd() const { return _socket ? _socket->fd : -1; }
+
+    int connect(IPAddress ip, uint16_t port) { return 0; }
+    int connect(const char *host, uint16_t port) { return 0; }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        ssize_t count = _socket ? send(fd(), buffer, size, MSG_NOSIGNAL) : -1;
+        return count > 0 ? count : 0;
+    }
+
+    int available()
+    {
+        int count = 0;
+        return _socket && ioctl(fd(), FIONREAD, &count) == 0 ? count : 0;
+    }
+
+    int read()
+    {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+
+    int read(uint8_t *buffer, size_t size)
+    {
+        ssize_t count = _socket ? recv(fd(), buffer, size, MSG_DONTWAIT) : -1;
+        return count > 0 ? count : -1;
+    }
+
+    int peek()
+    {
+        uint8_t c;
+        return _socket && recv(fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1 ? c : -1;
+    }
+
+    void flush() {}
+    void stop() { _socket.reset(); }
+
+    // Gone once the peer has closed and everything it sent has been read
+    uint8_t connected()
+    {
+        if (!_socket)
+            return false;
+        uint8_t c;
+        ssize_t count = recv(fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return count > 0 || (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    operator bool() { return connected(); }
+
+    IPAddress remoteIP()
+    {
+        sockaddr_in address = {};
+        socklen_t length = sizeof(address);
+        getpeername(fd(), (sockaddr *)&address, &length);
+        return IPAddress(address.sin_addr.s_addr);
+    }
+
+private:
+    struct Socket
+    {
+        int fd;
+        Socket(int fd) : fd(fd) {}
+        ~Socket() { close(fd); }
+    };
+
+    std::shared_ptr<Socket> _socket;
+};
+
+// Listens on the loopback interface. Port 0 picks a free one, which
+// lastPort then reports, so tests can reach a server the firmware owns.
+class WiFiServer
+{
+public:
+    static inline uint16_t lastPort = 0;
+
+    WiFiServer(uint16_t port) : _port(port) {}
+    ~WiFiServer() { end(); }
+
+    void begin()
+    {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        int reuse = 1;
+        setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(_port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        bind(_fd, (sockaddr *)&address, sizeof(address));
+        listen(_fd, 8);
+        getsockname(_fd, (sockaddr *)&address, &length);
+        lastPort = ntohs(address.sin_port);
+    }
+
+    void end()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        _fd = -1;
+    }
+
+    void setNoDelay(bool noDelay) {}
+
+    bool hasClient()
+    {
+        pollfd p = {_fd, POLLIN, 0};
+        return _fd >= 0 && poll(&p, 1, 0) == 1;
+    }
+
+    WiFiClient accept()
+    {
+        int fd = ::accept(_fd, NULL, NULL);
+        return fd >= 0 ? WiFiClient(fd) : WiFiClient();
+    }
+
+private:
+    uint16_t _port;
+    int _fd = -1;
+};
+
+#endif // FAKE_WIFI_H
@@ -0,0 +1,23 @@
+#ifndef FAKE_MBEDTLS_BASE64_H
+#define FAKE_MBEDTLS_BASE64_H
+
+// mbedtls' base64 encoder on top of the host's OpenSSL, see sha256.h
+
+#include <openssl/evp.h>
+
+#define MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL -0x002A
+
+// Like mbedtls, needs room for the terminating NUL it writes
+inline int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+    size_t needed = 4 * ((slen + 2) / 3) + 1;
+    if (dlen < needed)
+    {
+        *olen = needed;
+        return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+    }
+    *olen = EVP_EncodeBlock(dst, src, slen);
+    return 0;
+}
+
+#endif // FAKE_MBEDTLS_BASE64_H
@@ -0,0 +1,26 @@
+#ifndef FAKE_MBEDTLS_MD_H
+#define FAKE_MBEDTLS_MD_H
+
+// mbedtls' HMAC on top of the host's OpenSSL, SHA-256 only
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+typedef enum {
+    MBEDTLS_MD_SHA256 = 9,
+} mbedtls_md_type_t;
+
+typedef EVP_MD mbedtls_md_info_t;
+
+inline const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type)
+{
+    return type == MBEDTLS_MD_SHA256 ? EVP_sha256() : NULL;
+}
+
+inline int mbedtls_md_hmac(const mbedtls_md_info_t *info, const unsigned char *key, size_t keyLength,
+                           const unsigned char *input, size_t length, unsigned char *output)
+{
+    return HMAC(info, key, keyLength, input, length, output, NULL) != NULL ? 0 : -1;
+}
+
+#endif // FAKE_MBEDTLS_MD_H
@@ -0,0 +1,13 @@
+#ifndef FAKE_MBEDTLS_SHA1_H
+#define FAKE_MBEDTLS_SHA1_H
+
+// mbedtls' one-shot SHA-1 on top of the host's OpenSSL, see sha256.h
+
+#include <openssl/evp.h>
+
+inline int mbedtls_sha1(const unsigned char *input, size_t length, unsigned char output[20])
+{
+    return EVP_Digest(input, length, output, NULL, EVP_sha1(), NULL) == 1 ? 0 : -1;
+}
+
+#endif // FAKE_MBEDTLS_SHA1_H
@@ -0,0 +1,31 @@
+#ifndef FAKE_MBEDTLS_SHA256_H
+#define FAKE_MBEDTLS_SHA256_H
+
+// mbedtls' SHA-256 on top of the host's OpenSSL. Kept apart from the other
+// fakes so it can't shadow a real mbedtls in the tests that link one.
+
+#include <openssl/evp.h>
+
+typedef struct {
+    EVP_MD_CTX *context;
+} mbedtls_sha256_context;
+
+inline void mbedtls_sha256_init(mbedtls_sha256_context *sha) { sha->context = EVP_MD_CTX_new(); }
+inline void mbedtls_sha256_free(mbedtls_sha256_context *sha) { EVP_MD_CTX_free(sha->context); }
+
+inline int mbedtls_sha256_starts(mbedtls_sha256_context *sha, int is224)
+{
+    return EVP_DigestInit_ex(sha->context, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+inline int mbedtls_sha256_update(mbedtls_sha256_context *sha, const unsigned char *input, size_t length)
+{
+    return EVP_DigestUpdate(sha->context, input, length) == 1 ? 0 : -1;
+}
+
+inline int mbedtls_sha256_finish(mbedtls_sha256_context *sha, unsigned char output[32])
+{
+    return EVP_DigestFinal_ex(sha->context, output, NULL) == 1 ? 0 : -1;
+}
+
+#endif // FAKE_MBEDTLS_SHA256_H
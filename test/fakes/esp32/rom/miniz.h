@@ -0,0 +1,69 @@
+#ifndef FAKE_MINIZ_H
+#define FAKE_MINIZ_H
+
+// The ROM's tinfl API on top of the host's zlib. zlib keeps its own window,
+// so the caller's wrapping dictionary is only where the output goes.
+
+#include <zlib.h>
+
+#define TINFL_LZ_DICT_SIZE 32768
+#define TINFL_FLAG_PARSE_ZLIB_HEADER 1
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+#define TINFL_FLAG_COMPUTE_ADLER32 8
+
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+    z_stream stream;
+    bool started;
+} tinfl_decompressor;
+
+inline void tinfl_init(tinfl_decompressor *inflator) { inflator->started = false; }
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor *inflator, const uint8_t *in, size_t *inBytes,
+                                     uint8_t *outStart, uint8_t *outNext, size_t *outBytes, uint32_t flags)
+{
+    z_stream *stream = &inflator->stream;
+    if (!inflator->started)
+    {
+        *stream = {};
+        if (inflateInit2(stream, (flags & TINFL_FLAG_PARSE_ZLIB_HEADER) ? 15 : -15) != Z_OK)
+            return TINFL_STATUS_FAILED;
+        inflator->started = true;
+    }
+
+    stream->next_in = (Bytef *)in;
+    stream->avail_in = *inBytes;
+    stream->next_out = outNext;
+    stream->avail_out = *outBytes;
+    int result = inflate(stream, Z_NO_FLUSH);
+    *inBytes -= stream->avail_in;
+    *outBytes -= stream->avail_out;
+
+    tinfl_status status;
+    if (result == Z_STREAM_END)
+        status = TINFL_STATUS_DONE;
+    else if (result != Z_OK && result != Z_BUF_ERROR)
+        status = TINFL_STATUS_FAILED;
+    else if (stream->avail_out == 0)
+        status = TINFL_STATUS_HAS_MORE_OUTPUT;
+    else if (flags & TINFL_FLAG_HAS_MORE_INPUT)
+        status = TINFL_STATUS_NEEDS_MORE_INPUT;
+    else
+        status = TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+
+    if (status <= TINFL_STATUS_DONE)
+    {
+        inflateEnd(stream);
+        inflator->started = false;
+    }
+    return status;
+}
+
+#endif // FAKE_MINIZ_H
@@ -0,0 +1,39 @@
+#include <stdarg.h>
+#include <Arduino.h>
+#include <WiFi.h>
+#include <Update.h>
+#include "StallMonitor.h"
+
+int64_t fakeTime = 1000000;
+uint8_t fakePinLevels[FAKE_PIN_COUNT];
+uint32_t fakeNotifications = 0;
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+UpdateClass Update;
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t written = 0;
+    while (size-- > 0)
+        written += write(*buffer++);
+    return written;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length < 0)
+        return 0;
+    return write((const uint8_t *)line, (size_t)length < sizeof(line) ? length : sizeof(line) - 1);
+}
+
+// Sections only matter to the stall watchdog, which doesn't run on the host
+StallMonitor stallMonitor;
+void StallMonitor::enterSection(const char *name, bool backtrace) {}
+void StallMonitor::exitSection() {}
@@ -0,0 +1,11 @@
+#ifndef FAKE_LWIP_SOCKETS_H
+#define FAKE_LWIP_SOCKETS_H
+
+// lwIP's BSD socket API is the host's own
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#endif // FAKE_LWIP_SOCKETS_H
@@ -0,0 +1,153 @@
+#include "check.h"
+#include "CborEncoder.h"
+#include <string.h>
+#include <string>
+
+// Hex of everything written, for comparing with the RFC 8949 appendix A vectors
+static std::string encodeUInt(uint64_t value)
+{
+    uint8_t buffer[16];
+    CborEncoder cbor(buffer, sizeof(buffer));
+    cbor.writeUInt(value);
+
+    std::string hex;
+    char digits[3];
+    for (size_t i = 0; i < cbor.length(); i++)
+    {
+        snprintf(digits, sizeof(digits), "%02x", buffer[i]);
+        hex += digits;
+    }
+    return hex;
+}
+
+// Reads back one head, the way a decoder would
+static bool decodeHead(const uint8_t *buffer, size_t length, size_t *at, uint8_t *major, uint64_t *value)
+{
+    if (*at >= length)
+        return false;
+
+    uint8_t initial = buffer[(*at)++];
+    *major = initial >> 5;
+    uint8_t info = initial & 31;
+
+    if (info < 24)
+    {
+        *value = info;
+        return true;
+    }
+    if (info > 27)
+        return false;
+
+    size_t bytes = 1 << (info - 24);
+    if (*at + bytes > length)
+        return false;
+
+    *value = 0;
+    while (bytes-- > 0)
+        *value = (*value << 8) | buffer[(*at)++];
+    return true;
+}
+
+static void test_unsigned_integers_match_rfc_vectors()
+{
+    CHECK(encodeUInt(0) == "00");
+    CHECK(encodeUInt(1) == "01");
+    CHECK(encodeUInt(10) == "0a");
+    CHECK(encodeUInt(23) == "17");
+    CHECK(encodeUInt(24) == "1818");
+    CHECK(encodeUInt(25) == "1819");
+    CHECK(encodeUInt(100) == "1864");
+    CHECK(encodeUInt(1000) == "1903e8");
+    CHECK(encodeUInt(1000000) == "1a000f4240");
+    CHECK(encodeUInt(1000000000000ULL) == "1b000000e8d4a51000");
+    CHECK(encodeUInt(18446744073709551615ULL) == "1bffffffffffffffff");
+}
+
+static void test_shortest_encoding_at_each_boundary()
+{
+    CHECK(encodeUInt(0xFF) == "18ff");
+    CHECK(encodeUInt(0x100) == "190100");
+    CHECK(encodeUInt(0xFFFF) == "19ffff");
+    CHECK(encodeUInt(0x10000) == "1a00010000");
+    CHECK(encodeUInt(0xFFFFFFFF) == "1affffffff");
+    CHECK(encodeUInt(0x100000000ULL) == "1b0000000100000000");
+}
+
+static void test_map_matches_rfc_vector()
+{
+    // {1: 2, 3: 4}
+    const uint8_t expected[] = {0xa2, 0x01, 0x02, 0x03, 0x04};
+    uint8_t buffer[8];
+    CborEncoder cbor(buffer, sizeof(buffer));
+
+    cbor.beginMap(2);
+    cbor.writeUInt(1);
+    cbor.writeUInt(2);
+    cbor.writeUInt(3);
+    cbor.writeUInt(4);
+
+    CHECK(cbor.ok());
+    CHECK_EQUAL(sizeof(expected), cbor.length());
+    CHECK(memcmp(buffer, expected, sizeof(expected)) == 0);
+}
+
+static void test_event_payload_round_trips()
+{
+    // Shaped like the zone events TexecomMonitor sends
+    const uint64_t values[4][2] = {{0, 41}, {1, 1234567890123ULL}, {2, 9}, {3, 0x11}};
+    uint8_t buffer[32];
+    CborEncoder cbor(buffer, sizeof(buffer));
+
+    cbor.beginMap(4);
+    for (const uint64_t *pair : values)
+    {
+        cbor.writeUInt(pair[0]);
+        cbor.writeUInt(pair[1]);
+    }
+    CHECK(cbor.ok());
+
+    size_t at = 0;
+    uint8_t major;
+    uint64_t value;
+    CHECK(decodeHead(buffer, cbor.length(), &at, &major, &value));
+    CHECK_EQUAL(5, major);
+    CHECK_EQUAL(4, value);
+
+    for (const uint64_t *pair : values)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            CHECK(decodeHead(buffer, cbor.length(), &at, &major, &value));
+            CHECK_EQUAL(0, major);
+            CHECK(value == pair[i]);
+        }
+    }
+    CHECK_EQUAL(cbor.length(), at);
+}
+
+static void test_overflow_stops_writing()
+{
+    uint8_t buffer[4] = {0xAA, 0xAA, 0xAA, 0xAA};
+    CborEncoder cbor(buffer, 3);
+
+    cbor.writeUInt(1);
+    CHECK(cbor.ok());
+    cbor.writeUInt(1000);
+    CHECK(!cbor.ok());
+    CHECK(cbor.length() <= 3);
+    CHECK_EQUAL(0xAA, buffer[3]);
+
+    // Stays failed even if later values would fit
+    cbor.writeUInt(0);
+    CHECK(!cbor.ok());
+}
+
+int main()
+{
+    RUN_TEST(test_unsigned_integers_match_rfc_vectors);
+    RUN_TEST(test_shortest_encoding_at_each_boundary);
+    RUN_TEST(test_map_matches_rfc_vector);
+    RUN_TEST(test_event_payload_round_trips);
+    RUN_TEST(test_overflow_stops_writing);
+    return checkFailures();
+}
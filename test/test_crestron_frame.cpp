@@ -0,0 +1,129 @@
+#include "check.h"
+#include "CrestronFrame.h"
+
+static CrestronFrame::FRAME parse(const char *message)
+{
+    return CrestronFrame::parse(message, strlen(message));
+}
+
+static void test_zone_update()
+{
+    CrestronFrame::FRAME frame = parse("\"Z0091");
+    CHECK_EQUAL(CrestronFrame::ZONE_UPDATE, frame.type);
+    CHECK_EQUAL(9, frame.zone);
+    CHECK_EQUAL(1, frame.zoneState);
+
+    frame = parse("\"Z0122");
+    CHECK_EQUAL(CrestronFrame::ZONE_UPDATE, frame.type);
+    CHECK_EQUAL(12, frame.zone);
+    CHECK_EQUAL(2, frame.zoneState);
+
+    frame = parse("\"Z0010");
+    CHECK_EQUAL(1, frame.zone);
+    CHECK_EQUAL(0, frame.zoneState);
+}
+
+static void test_zone_update_must_be_six_characters()
+{
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"Z0").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"Z009").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"Z00911").type);
+}
+
+static void test_user_logins()
+{
+    CrestronFrame::FRAME frame = parse("\"U0010");
+    CHECK_EQUAL(CrestronFrame::USER_PIN_LOGIN, frame.type);
+    CHECK_EQUAL(1, frame.user);
+
+    frame = parse("\"T0030");
+    CHECK_EQUAL(CrestronFrame::USER_TAG_LOGIN, frame.type);
+    CHECK_EQUAL(3, frame.user);
+}
+
+static void test_arming_updates()
+{
+    CHECK_EQUAL(CrestronFrame::ARM_UPDATE, parse("\"A0001").type);
+    CHECK_EQUAL(CrestronFrame::ARM_UPDATE, parse("\"A0001 and more").type);
+    CHECK_EQUAL(CrestronFrame::DISARM_UPDATE, parse("\"D0001").type);
+    CHECK_EQUAL(CrestronFrame::ENTRY_UPDATE, parse("\"E0001").type);
+    CHECK_EQUAL(CrestronFrame::ARMING_UPDATE, parse("\"X0001").type);
+    CHECK_EQUAL(CrestronFrame::INTRUDER_UPDATE, parse("\"L0001").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"A00").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"E00011").type);
+}
+
+static void test_astatus_replies()
+{
+    CHECK_EQUAL(CrestronFrame::REPLY_DISARMED, parse("\"N000").type);
+    CHECK_EQUAL(CrestronFrame::REPLY_ARMED, parse("\"Y000").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"N00").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"Y0000").type);
+}
+
+static void test_keypad_screens()
+{
+    CHECK_EQUAL(CrestronFrame::SCREEN_ARMED_PART, parse("\"Part Armed").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_ARMED_PART, parse("\"Night Armed").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_ARMED_PART, parse("\" * PART ARMED * 12:00").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_ARMED_FULL, parse("\"Area FULL ARMED").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_IDLE, parse("\"  The Cooper's  12:00 Mon 01").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_WELCOME_BACK, parse("\"  Welcome Back  ").type);
+    CHECK_EQUAL(CrestronFrame::QUESTION_ARM, parse("\"Do you want to  Arm System?").type);
+    CHECK_EQUAL(CrestronFrame::QUESTION_PART_ARM, parse("\"Do you want to  Part Arm System?").type);
+    CHECK_EQUAL(CrestronFrame::QUESTION_NIGHT_ARM, parse("\"Do you want:-   Night Arm").type);
+    CHECK_EQUAL(CrestronFrame::QUESTION_DISARM, parse("\"Do you want to  Disarm System?").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_AREA_IN_ENTRY, parse("\"Area in Entry").type);
+    CHECK_EQUAL(CrestronFrame::SCREEN_AREA_IN_EXIT, parse("\"Area in Exit > 30").type);
+
+    // Welcome Back needs the whole line, not just its start
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"  Welcome Bac").type);
+}
+
+static void test_unrecognised_frames()
+{
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("Z0091").type);
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, parse("\"Q0123").type);
+}
+
+static void test_only_given_length_is_read()
+{
+    // A zone frame at the start of a longer buffer
+    const char buffer[] = "\"Z0091\"Z0120";
+    CrestronFrame::FRAME frame = CrestronFrame::parse(buffer, 6);
+    CHECK_EQUAL(CrestronFrame::ZONE_UPDATE, frame.type);
+    CHECK_EQUAL(9, frame.zone);
+
+    CHECK_EQUAL(CrestronFrame::UNKNOWN, CrestronFrame::parse(buffer, 5).type);
+}
+
+static void test_apply_zone_state()
+{
+    const uint8_t active = CrestronFrame::ZONE_ACTIVE;
+    const uint8_t tamper = CrestronFrame::ZONE_TAMPER;
+    const uint8_t other = 1 << 5;
+
+    CHECK_EQUAL(other, CrestronFrame::applyZoneState(active | tamper | other, 0));
+    CHECK_EQUAL(active | other, CrestronFrame::applyZoneState(tamper | other, 1));
+    CHECK_EQUAL(tamper | other, CrestronFrame::applyZoneState(active | other, 2));
+
+    // Unknown states change nothing
+    CHECK_EQUAL(active | other, CrestronFrame::applyZoneState(active | other, 3));
+    CHECK_EQUAL(active, CrestronFrame::applyZoneState(active, '?' - '0'));
+}
+
+int main()
+{
+    RUN_TEST(test_zone_update);
+    RUN_TEST(test_zone_update_must_be_six_characters);
+    RUN_TEST(test_user_logins);
+    RUN_TEST(test_arming_updates);
+    RUN_TEST(test_astatus_replies);
+    RUN_TEST(test_keypad_screens);
+    RUN_TEST(test_unrecognised_frames);
+    RUN_TEST(test_only_given_length_is_read);
+    RUN_TEST(test_apply_zone_state);
+    return checkFailures();
+}
@@ -0,0 +1,251 @@
+#include "check.h"
+#include "HttpOta.h"
+#include "esp32/rom/miniz.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <random>
+#include <thread>
+
+// Answers one request on a loopback port with a canned response, then closes
+class HttpServer
+{
+public:
+    std::string request;
+
+    HttpServer(const std::string &response)
+    {
+        _listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        bind(_listener, (sockaddr *)&address, sizeof(address));
+        listen(_listener, 1);
+        getsockname(_listener, (sockaddr *)&address, &length);
+        _port = ntohs(address.sin_port);
+
+        _thread = std::thread([this, response]() { serve(response); });
+    }
+
+    ~HttpServer()
+    {
+        _thread.join();
+        close(_listener);
+    }
+
+    std::string url(const char *path)
+    {
+        char url[64];
+        snprintf(url, sizeof(url), "http://127.0.0.1:%u%s", _port, path);
+        return url;
+    }
+
+private:
+    int _listener;
+    uint16_t _port;
+    std::thread _thread;
+
+    void serve(const std::string &response)
+    {
+        int fd = accept(_listener, NULL, NULL);
+
+        char c;
+        while (request.find("\r\n\r\n") == std::string::npos && recv(fd, &c, 1, 0) == 1)
+            request += c;
+
+        for (size_t sent = 0; sent < response.size();)
+        {
+            ssize_t count = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+                break;
+            sent += count;
+        }
+        close(fd);
+    }
+};
+
+static std::string response(const std::string &body, long contentLength)
+{
+    std::string headers = "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n";
+    if (contentLength >= 0)
+        headers += "Content-Length: " + std::to_string(contentLength) + "\r\n";
+    return headers + "\r\n" + body;
+}
+
+static std::string response(const std::string &body) { return response(body, body.size()); }
+
+// Three dictionaries' worth, compressible but not trivially
+static std::string makeImage()
+{
+    std::mt19937 random(1);
+    std::string image;
+    while (image.size() < 3 * TINFL_LZ_DICT_SIZE + 1000)
+    {
+        if (random() % 4 == 0)
+            image += "TexecomMonitor firmware image ";
+        image += (char)('a' + random() % 16);
+    }
+    return image;
+}
+
+static std::string compress(const std::string &data)
+{
+    uLongf length = compressBound(data.size());
+    std::string compressed(length, '\0');
+    compress2((Bytef *)&compressed[0], &length, (const Bytef *)data.data(), data.size(), 9);
+    compressed.resize(length);
+    return compressed;
+}
+
+static std::string hex(const uint8_t *bytes, size_t length)
+{
+    std::string text;
+    char pair[3];
+    for (size_t i = 0; i < length; i++)
+    {
+        snprintf(pair, sizeof(pair), "%02x", bytes[i]);
+        text += pair;
+    }
+    return text;
+}
+
+static std::string sha256(const std::string &data)
+{
+    uint8_t digest[32];
+    EVP_Digest(data.data(), data.size(), digest, NULL, EVP_sha256(), NULL);
+    return hex(digest, sizeof(digest));
+}
+
+// What the person requesting the update does, see HttpOta.h
+static std::string sign(const std::string &url, const std::string &sha256, const char *key)
+{
+    std::string message = url + " " + sha256;
+    uint8_t hmac[32];
+    HMAC(EVP_sha256(), key, strlen(key), (const uint8_t *)message.data(), message.size(), hmac, NULL);
+    return hex(hmac, sizeof(hmac));
+}
+
+static const std::string image = makeImage();
+static const std::string compressed = compress(image);
+
+static void test_authorised_needs_the_ota_password()
+{
+    std::string url = "http://192.168.0.10:8000/firmware.bin.zz";
+    std::string digest = sha256(image);
+    std::string hmac = sign(url, digest, "otaPassword");
+
+    CHECK(HttpOta::authorised(url.c_str(), digest.c_str(), hmac.c_str(), "otaPassword"));
+
+    // Anything changed, or signed with anything else
+    CHECK(!HttpOta::authorised("http://192.168.0.66:8000/firmware.bin.zz", digest.c_str(), hmac.c_str(), "otaPassword"));
+    CHECK(!HttpOta::authorised(url.c_str(), sha256("other").c_str(), hmac.c_str(), "otaPassword"));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), hmac.c_str(), "otaPasswore"));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), digest.c_str(), "otaPassword"));
+
+    // Malformed signatures, and no password to check against
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), "", "otaPassword"));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), hmac.substr(0, 62).c_str(), "otaPassword"));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), (hmac + "00").c_str(), "otaPassword"));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), ("zz" + hmac.substr(2)).c_str(), "otaPassword"));
+    std::string unsigned_ = sign(url, digest, "");
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), unsigned_.c_str(), ""));
+    CHECK(!HttpOta::authorised(url.c_str(), digest.c_str(), unsigned_.c_str(), NULL));
+}
+
+static void test_run_inflates_and_installs_image()
+{
+    Update.reset();
+    HttpServer server(response(compressed));
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/firmware.bin.zz").c_str(), sha256(image).c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_OK, report.result);
+    CHECK_EQUAL(compressed.size(), report.downloadedBytes);
+    CHECK_EQUAL(image.size(), report.imageBytes);
+    CHECK(Update.image == image);
+    CHECK(Update.ended);
+    CHECK(!Update.aborted);
+    CHECK(server.request.rfind("GET /firmware.bin.zz HTTP/1.0\r\n", 0) == 0);
+}
+
+static void test_run_without_content_length()
+{
+    Update.reset();
+    HttpServer server(response(compressed, -1));
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/firmware.bin.zz").c_str(), sha256(image).c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_OK, report.result);
+    CHECK(Update.image == image);
+    CHECK(Update.ended);
+}
+
+static void test_hash_mismatch_aborts()
+{
+    Update.reset();
+    HttpServer server(response(compressed));
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/firmware.bin.zz").c_str(), sha256("another image").c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_HASH_MISMATCH, report.result);
+    CHECK_EQUAL(image.size(), report.imageBytes);
+    CHECK(!Update.ended);
+    CHECK(Update.aborted);
+}
+
+static void test_corrupt_stream_fails_inflate()
+{
+    Update.reset();
+    std::string corrupt = compressed;
+    for (size_t i = corrupt.size() / 2; i < corrupt.size() / 2 + 64; i++)
+        corrupt[i] ^= 0x55;
+    HttpServer server(response(corrupt));
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/firmware.bin.zz").c_str(), sha256(image).c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_INFLATE_FAILED, report.result);
+    CHECK(!Update.ended);
+    CHECK(Update.aborted);
+}
+
+static void test_truncated_download_fails()
+{
+    Update.reset();
+    HttpServer server(response(compressed.substr(0, compressed.size() / 2), compressed.size()));
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/firmware.bin.zz").c_str(), sha256(image).c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_DOWNLOAD_FAILED, report.result);
+    CHECK_EQUAL(compressed.size() / 2, report.downloadedBytes);
+    CHECK(!Update.ended);
+    CHECK(Update.aborted);
+}
+
+static void test_http_error_starts_nothing()
+{
+    Update.reset();
+    HttpServer server("HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+
+    HttpOta ota;
+    HttpOta::REPORT report = ota.run(server.url("/missing.zz").c_str(), sha256(image).c_str());
+
+    CHECK_EQUAL(HttpOta::OTA_HTTP_ERROR, report.result);
+    CHECK(!Update.begun);
+}
+
+int main()
+{
+    RUN_TEST(test_authorised_needs_the_ota_password);
+    RUN_TEST(test_run_inflates_and_installs_image);
+    RUN_TEST(test_run_without_content_length);
+    RUN_TEST(test_hash_mismatch_aborts);
+    RUN_TEST(test_corrupt_stream_fails_inflate);
+    RUN_TEST(test_truncated_download_fails);
+    RUN_TEST(test_http_error_starts_nothing);
+    return checkFailures();
+}
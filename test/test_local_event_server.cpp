@@ -0,0 +1,279 @@
+#include "check.h"
+#include "LocalEventServer.h"
+
+// Port 0, the fake WiFiServer picks a free loopback port
+static LocalEventServer server(0);
+static std::string state;
+
+static size_t writeState(char *buffer, size_t size)
+{
+    size_t length = state.size() < size ? state.size() : size - 1;
+    memcpy(buffer, state.data(), length);
+    return length;
+}
+
+// A browser or dashboard on the other end of a loopback socket. Waiting on
+// it keeps the server's loop turning, as the firmware's main loop would.
+class Peer
+{
+public:
+    std::string received;
+
+    Peer(int receiveBuffer = 0)
+    {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (receiveBuffer > 0)
+            setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(WiFiServer::lastPort);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connect(_fd, (sockaddr *)&address, sizeof(address));
+        server.loop();
+    }
+
+    ~Peer() { disconnect(); }
+
+    void disconnect()
+    {
+        if (_fd >= 0)
+            close(_fd);
+        _fd = -1;
+    }
+
+    void send(const std::string &text)
+    {
+        ::send(_fd, text.data(), text.size(), MSG_NOSIGNAL);
+    }
+
+    // Takes whatever has arrived without running the server
+    void drain()
+    {
+        char buffer[4096];
+        ssize_t count;
+        while ((count = recv(_fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0)
+            received.append(buffer, count);
+    }
+
+    // Everything that arrives in the next 20 ms
+    std::string receive()
+    {
+        for (int i = 0; i < 20; i++)
+        {
+            server.loop();
+            drain();
+            usleep(1000);
+        }
+        return received;
+    }
+
+    // Once the server has closed its end and it's all been read, giving a
+    // peer with a full window up to a second to get the rest
+    bool closed()
+    {
+        for (int i = 0; i < 50; i++)
+        {
+            receive();
+            char c;
+            if (recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool upgrade()
+    {
+        send("GET /events HTTP/1.1\r\nHost: texecom\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+        bool upgraded = receive().rfind("HTTP/1.1 101 ", 0) == 0;
+        received.clear();
+        return upgraded;
+    }
+
+private:
+    int _fd;
+};
+
+static std::string textFrame(const std::string &payload)
+{
+    std::string frame = "\x81";
+    if (payload.size() < 126)
+    {
+        frame += (char)payload.size();
+    }
+    else
+    {
+        frame += (char)126;
+        frame += (char)(payload.size() >> 8);
+        frame += (char)(payload.size() & 0xFF);
+    }
+    return frame + payload;
+}
+
+static void broadcast(const std::string &payload)
+{
+    server.broadcast(payload.data(), payload.size());
+}
+
+// Lets the server notice peers the last test closed
+static void reset()
+{
+    for (int i = 0; i < 20 && server.clientCount() > 0; i++)
+    {
+        server.loop();
+        usleep(1000);
+    }
+    state = "{\"panels\":[]}";
+}
+
+static void test_state_snapshot()
+{
+    reset();
+    Peer peer;
+    peer.send("GET /state HTTP/1.1\r\nHost: texecom\r\n\r\n");
+
+    CHECK(peer.closed());
+    CHECK(peer.received == "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 13\r\n"
+                           "Connection: close\r\n\r\n{\"panels\":[]}");
+}
+
+static void test_full_size_state_goes_in_one_send()
+{
+    reset();
+    state = "{\"panels\":[" + std::string(localServerStateSize - 14, ' ') + "]}";
+    Peer peer;
+    peer.send("GET /state HTTP/1.1\r\n\r\n");
+
+    CHECK(peer.closed());
+    std::string body = peer.received.substr(peer.received.find("\r\n\r\n") + 4);
+    CHECK(peer.received.find("Content-Length: 2047\r\n") != std::string::npos);
+    CHECK(body == state.substr(0, localServerStateSize - 1));
+}
+
+static void test_unknown_path_not_found()
+{
+    reset();
+    Peer peer;
+    peer.send("GET /zones HTTP/1.1\r\n\r\n");
+
+    CHECK(peer.closed());
+    CHECK(peer.received.rfind("HTTP/1.1 404 Not Found\r\n", 0) == 0);
+}
+
+static void test_websocket_handshake()
+{
+    reset();
+    Peer peer;
+    peer.send("GET /events HTTP/1.1\r\nHost: texecom\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+              "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+
+    // The example from RFC 6455
+    CHECK(peer.receive() == "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                            "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n");
+    CHECK_EQUAL(1, server.clientCount());
+
+    // No key, no upgrade
+    Peer keyless;
+    keyless.send("GET /events HTTP/1.1\r\nUpgrade: websocket\r\n\r\n");
+    CHECK(keyless.closed());
+    CHECK(keyless.received.rfind("HTTP/1.1 404 ", 0) == 0);
+    CHECK_EQUAL(1, server.clientCount());
+}
+
+static void test_broadcast_reaches_every_client()
+{
+    reset();
+    Peer peers[3];
+    for (Peer &peer : peers)
+        CHECK(peer.upgrade());
+    CHECK_EQUAL(3, server.clientCount());
+
+    std::string longer(200, 'z');
+    broadcast("{\"zone\":9}");
+    broadcast(longer);
+    broadcast(std::string(localServerMaxFrame + 1, 'x'));   // Too big, never sent
+
+    for (Peer &peer : peers)
+        CHECK(peer.receive() == textFrame("{\"zone\":9}") + textFrame(longer));
+}
+
+static void test_closed_client_is_freed()
+{
+    reset();
+    Peer staying, leaving;
+    CHECK(staying.upgrade());
+    CHECK(leaving.upgrade());
+    CHECK_EQUAL(2, server.clientCount());
+
+    leaving.disconnect();
+    staying.receive();
+    CHECK_EQUAL(1, server.clientCount());
+
+    broadcast("after");
+    CHECK(staying.receive() == textFrame("after"));
+}
+
+static void test_slow_client_dropped_without_holding_up_others()
+{
+    reset();
+    Peer fast;
+    Peer slow(1024);
+    CHECK(fast.upgrade());
+    CHECK(slow.upgrade());
+
+    // The slow client never reads, so its buffers fill and a send would block
+    std::string payload(localServerMaxFrame, 'e');
+    int sent = 0;
+    while (server.clientCount() == 2 && sent < 10000)
+    {
+        broadcast(payload);
+        sent++;
+        fast.drain();
+    }
+
+    CHECK_EQUAL(1, server.clientCount());
+    CHECK(sent < 10000);
+    CHECK(slow.closed());
+
+    // The one that kept up has every frame, whole
+    fast.receive();
+    CHECK_EQUAL(sent * textFrame(payload).size(), fast.received.size());
+}
+
+static void test_client_limit()
+{
+    reset();
+    Peer peers[localServerMaxClients];
+    for (Peer &peer : peers)
+        CHECK(peer.upgrade());
+    CHECK_EQUAL(localServerMaxClients, server.clientCount());
+
+    Peer refused;
+    CHECK(refused.closed());
+    CHECK(refused.received.rfind("HTTP/1.1 503 Service Unavailable\r\n", 0) == 0);
+    CHECK_EQUAL(localServerMaxClients, server.clientCount());
+
+    // A free slot is used again
+    peers[0].disconnect();
+    peers[1].receive();
+    Peer replacement;
+    CHECK(replacement.upgrade());
+    CHECK_EQUAL(localServerMaxClients, server.clientCount());
+}
+
+int main()
+{
+    WiFi.connected = true;
+    server.begin(writeState);
+
+    RUN_TEST(test_state_snapshot);
+    RUN_TEST(test_full_size_state_goes_in_one_send);
+    RUN_TEST(test_unknown_path_not_found);
+    RUN_TEST(test_websocket_handshake);
+    RUN_TEST(test_broadcast_reaches_every_client);
+    RUN_TEST(test_closed_client_is_freed);
+    RUN_TEST(test_slow_client_dropped_without_holding_up_others);
+    RUN_TEST(test_client_limit);
+    return checkFailures();
+}
@@ -0,0 +1,375 @@
+#include "check.h"
+#include "MqttReliablePublisher.h"
+
+typedef struct {
+    uint8_t header;
+    std::string topic;
+    uint16_t packetId;
+    std::string payload;
+} PUBLISH;
+
+// Splits what a broker was sent back into PUBLISH packets and clears it
+static std::vector<PUBLISH> takePackets(PubSubClient &broker)
+{
+    std::vector<PUBLISH> packets;
+    const std::vector<uint8_t> &w = broker.written;
+    size_t at = 0;
+
+    while (at < w.size())
+    {
+        PUBLISH packet;
+        packet.header = w[at++];
+
+        size_t remaining = w[at] & 127;
+        if (w[at++] & 128)
+            remaining += w[at++] * 128;
+        size_t end = at + remaining;
+
+        size_t topicLength = (w[at] << 8) | w[at + 1];
+        at += 2;
+        packet.topic.assign((const char *)&w[at], topicLength);
+        at += topicLength;
+        packet.packetId = (w[at] << 8) | w[at + 1];
+        at += 2;
+        packet.payload.assign((const char *)&w[at], end - at);
+        at = end;
+
+        packets.push_back(packet);
+    }
+
+    broker.written.clear();
+    return packets;
+}
+
+static bool publish(MqttReliablePublisher &publisher, const char *topic, const char *payload, bool retained = false)
+{
+    return publisher.publish(topic, (const uint8_t *)payload, strlen(payload), retained);
+}
+
+static void test_publish_encodes_qos1_packet()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    CHECK(publish(publisher, "home/security/alarm", "triggered", true));
+
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(1, sent.size());
+    CHECK_EQUAL(0x33, sent[0].header);  // PUBLISH, QoS 1, retained
+    CHECK(sent[0].topic == "home/security/alarm");
+    CHECK_EQUAL(1, sent[0].packetId);
+    CHECK(sent[0].payload == "triggered");
+    CHECK_EQUAL(1, publisher.queued());
+    CHECK_EQUAL(1, publisher.inFlight(0));
+}
+
+static void test_long_packet_uses_two_length_bytes()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    std::string payload(200, 'x');
+    CHECK(publish(publisher, "home/security/zone/9", payload.c_str()));
+
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(1, sent.size());
+    CHECK(sent[0].topic == "home/security/zone/9");
+    CHECK(sent[0].payload == payload);
+}
+
+static void test_pubAck_frees_slot()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    publish(publisher, "a", "1");
+    publish(publisher, "b", "2");
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(2, sent.size());
+
+    // Unknown ids are ignored
+    publisher.onPubAck(0, 99);
+    CHECK_EQUAL(2, publisher.queued());
+
+    // Out of order, the slot is only reclaimed once the head is acknowledged
+    publisher.onPubAck(0, sent[1].packetId);
+    CHECK_EQUAL(2, publisher.queued());
+    CHECK_EQUAL(1, publisher.inFlight(0));
+
+    publisher.onPubAck(0, sent[0].packetId);
+    CHECK_EQUAL(0, publisher.queued());
+    CHECK_EQUAL(0, publisher.inFlight(0));
+}
+
+static void test_pubAckCallback_reaches_its_broker()
+{
+    PubSubClient first, second;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&first);
+    uint8_t b = publisher.addClient(&second);
+
+    publish(publisher, "a", "1");
+    uint16_t id = takePackets(second)[0].packetId;
+
+    MqttReliablePublisher::pubAckCallback(publisher.ackContext(b), id);
+    CHECK_EQUAL(1, publisher.inFlight(0));
+    CHECK_EQUAL(0, publisher.inFlight(b));
+}
+
+static void test_window_limits_unacknowledged()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+    publisher.setWindow(2);
+
+    for (int i = 0; i < 4; i++)
+        publish(publisher, "home/security/zone/9", "active");
+
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(2, sent.size());
+    CHECK_EQUAL(2, publisher.inFlight(0));
+
+    publisher.onPubAck(0, sent[0].packetId);
+    publisher.loop();
+    std::vector<PUBLISH> next = takePackets(broker);
+    CHECK_EQUAL(1, next.size());
+    CHECK_EQUAL(sent[1].packetId + 1, next[0].packetId);
+    CHECK_EQUAL(2, publisher.inFlight(0));
+}
+
+static void test_window_is_clamped()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    publisher.setWindow(0);
+    publish(publisher, "a", "1");
+    publish(publisher, "a", "2");
+    CHECK_EQUAL(1, takePackets(broker).size());
+
+    publisher.setWindow(200);
+    publisher.loop();
+    for (int i = 0; i < MQTT_QOS1_MAX_WINDOW + 2; i++)
+        publish(publisher, "a", "3");
+    CHECK_EQUAL(MQTT_QOS1_MAX_WINDOW, publisher.inFlight(0));
+}
+
+static void test_retry_sets_dup()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+    publisher.setRetryInterval(1000);
+
+    publish(publisher, "home/security/alarm", "triggered");
+    uint16_t id = takePackets(broker)[0].packetId;
+
+    fakeAdvance(999);
+    publisher.loop();
+    CHECK_EQUAL(0, takePackets(broker).size());
+
+    fakeAdvance(1);
+    publisher.loop();
+    std::vector<PUBLISH> resent = takePackets(broker);
+    CHECK_EQUAL(1, resent.size());
+    CHECK_EQUAL(0x32 | 0x08, resent[0].header);
+    CHECK_EQUAL(id, resent[0].packetId);
+    CHECK(resent[0].payload == "triggered");
+    CHECK_EQUAL(1, publisher.retransmits(0));
+    CHECK_EQUAL(1, publisher.inFlight(0));
+
+    publisher.onPubAck(0, id);
+    fakeAdvance(5000);
+    publisher.loop();
+    CHECK_EQUAL(0, takePackets(broker).size());
+    CHECK_EQUAL(0, publisher.queued());
+}
+
+static void test_reconnect_resends_unacknowledged()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    publish(publisher, "a", "sent");
+    uint16_t id = takePackets(broker)[0].packetId;
+
+    broker.up = false;
+    publish(publisher, "b", "queued");
+    CHECK_EQUAL(0, broker.written.size());
+
+    broker.up = true;
+    publisher.onConnect(0);
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(2, sent.size());
+    CHECK_EQUAL(id, sent[0].packetId);
+    CHECK(sent[0].header & 0x08);
+    CHECK(sent[1].payload == "queued");
+    CHECK(!(sent[1].header & 0x08));
+}
+
+static void test_full_queue_drops_oldest()
+{
+    PubSubClient broker;
+    broker.up = false;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    char payload[8];
+    for (int i = 0; i < MQTT_QOS1_QUEUE_SIZE + 2; i++)
+    {
+        snprintf(payload, sizeof(payload), "%d", i);
+        CHECK(publish(publisher, "home/security/zone/9", payload));
+    }
+    CHECK_EQUAL(MQTT_QOS1_QUEUE_SIZE, publisher.queued());
+    CHECK_EQUAL(2, publisher.dropped(0));
+    CHECK_EQUAL(2, publisher.dropped());
+
+    // The newest made it in, in order
+    broker.up = true;
+    publisher.setWindow(MQTT_QOS1_MAX_WINDOW);
+    publisher.onConnect(0);
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(MQTT_QOS1_MAX_WINDOW, sent.size());
+    CHECK(sent[0].payload == "2");
+    CHECK(sent[1].payload == "3");
+}
+
+static void test_full_queue_replaces_retained_on_same_topic()
+{
+    PubSubClient broker;
+    broker.up = false;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    publish(publisher, "home/security/zone/9", "oldest");
+    publish(publisher, "home/security/alarm", "armed_away", true);
+    for (int i = 2; i < MQTT_QOS1_QUEUE_SIZE; i++)
+        publish(publisher, "home/security/zone/10", "filler");
+
+    publish(publisher, "home/security/alarm", "triggered", true);
+    CHECK_EQUAL(MQTT_QOS1_QUEUE_SIZE, publisher.queued());
+    CHECK_EQUAL(1, publisher.dropped(0));
+
+    broker.up = true;
+    publisher.setWindow(MQTT_QOS1_MAX_WINDOW);
+    publisher.onConnect(0);
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK(sent[0].payload == "oldest");
+    CHECK(sent[1].payload == "filler");
+
+    // Everything through, and the old alarm state never was
+    while (!sent.empty())
+    {
+        for (const PUBLISH &packet : sent)
+        {
+            CHECK(packet.payload != "armed_away");
+            publisher.onPubAck(0, packet.packetId);
+        }
+        publisher.loop();
+        if (sent.back().payload == "triggered")
+            break;
+        sent = takePackets(broker);
+    }
+    CHECK_EQUAL(0, publisher.queued());
+}
+
+static void test_too_large_is_rejected()
+{
+    PubSubClient broker;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+
+    std::string payload(MQTT_QOS1_MAX_PACKET, 'x');
+    CHECK(!publish(publisher, "home/security/zone/9", payload.c_str()));
+    CHECK_EQUAL(0, publisher.queued());
+    CHECK_EQUAL(0, publisher.dropped(0));
+    CHECK_EQUAL(1, publisher.dropped());
+}
+
+static void test_failed_write_is_retried()
+{
+    PubSubClient broker;
+    broker.writeLimit = 0;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&broker);
+    publisher.setRetryInterval(1000);
+
+    publish(publisher, "a", "1");
+    publish(publisher, "a", "2");
+
+    // Failed writes count as sent and go again on the retry timer
+    broker.writeLimit = SIZE_MAX;
+    publisher.loop();
+    CHECK_EQUAL(0, takePackets(broker).size());
+
+    fakeAdvance(1000);
+    publisher.loop();
+    std::vector<PUBLISH> sent = takePackets(broker);
+    CHECK_EQUAL(2, sent.size());
+    CHECK(sent[0].header & 0x08);
+}
+
+static void test_slot_kept_until_every_broker_acknowledges()
+{
+    PubSubClient first, second;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&first);
+    publisher.addClient(&second);
+
+    publish(publisher, "a", "1");
+    uint16_t id = takePackets(first)[0].packetId;
+    CHECK_EQUAL(id, takePackets(second)[0].packetId);
+
+    publisher.onPubAck(0, id);
+    CHECK_EQUAL(1, publisher.queued());
+    publisher.onPubAck(1, id);
+    CHECK_EQUAL(0, publisher.queued());
+}
+
+static void test_eviction_counts_only_brokers_still_waiting()
+{
+    PubSubClient first, second;
+    second.up = false;
+    MqttReliablePublisher publisher;
+    publisher.addClient(&first);
+    publisher.addClient(&second);
+    publisher.setWindow(MQTT_QOS1_MAX_WINDOW);
+
+    for (int i = 0; i < MQTT_QOS1_QUEUE_SIZE; i++)
+    {
+        publish(publisher, "a", "1");
+        for (const PUBLISH &packet : takePackets(first))
+            publisher.onPubAck(0, packet.packetId);
+    }
+    CHECK_EQUAL(MQTT_QOS1_QUEUE_SIZE, publisher.queued());
+
+    publish(publisher, "a", "2");
+    CHECK_EQUAL(0, publisher.dropped(0));
+    CHECK_EQUAL(1, publisher.dropped(1));
+    CHECK_EQUAL(1, publisher.inFlight(0));
+}
+
+int main()
+{
+    RUN_TEST(test_publish_encodes_qos1_packet);
+    RUN_TEST(test_long_packet_uses_two_length_bytes);
+    RUN_TEST(test_pubAck_frees_slot);
+    RUN_TEST(test_pubAckCallback_reaches_its_broker);
+    RUN_TEST(test_window_limits_unacknowledged);
+    RUN_TEST(test_window_is_clamped);
+    RUN_TEST(test_retry_sets_dup);
+    RUN_TEST(test_reconnect_resends_unacknowledged);
+    RUN_TEST(test_full_queue_drops_oldest);
+    RUN_TEST(test_full_queue_replaces_retained_on_same_topic);
+    RUN_TEST(test_too_large_is_rejected);
+    RUN_TEST(test_failed_write_is_retried);
+    RUN_TEST(test_slot_kept_until_every_broker_acknowledges);
+    RUN_TEST(test_eviction_counts_only_brokers_still_waiting);
+    return checkFailures();
+}
@@ -0,0 +1,182 @@
+#include "check.h"
+#include "MqttTopicRouter.h"
+
+typedef struct {
+    int calls;
+    std::string topic;
+    std::string payload;
+} ROUTE;
+
+static void handler(const char *topic, const uint8_t *payload, unsigned int length, void *context)
+{
+    ROUTE *route = (ROUTE *)context;
+    route->calls++;
+    route->topic = topic;
+    route->payload.assign((const char *)payload, length);
+}
+
+static uint8_t dispatch(MqttTopicRouter &router, const char *topic)
+{
+    return router.dispatch(topic, (const uint8_t *)"", 0);
+}
+
+static void test_exact_filters()
+{
+    MqttTopicRouter router;
+    ROUTE rules = {}, journal = {};
+    CHECK(router.add("home/security/rules", handler, &rules));
+    CHECK(router.add("home/security/journal/request", handler, &journal));
+
+    const char payload[] = "zone 9 active -> gpio 13 on";
+    CHECK_EQUAL(1, router.dispatch("home/security/rules", (const uint8_t *)payload, sizeof(payload) - 1));
+    CHECK_EQUAL(1, rules.calls);
+    CHECK(rules.topic == "home/security/rules");
+    CHECK(rules.payload == payload);
+
+    CHECK_EQUAL(1, dispatch(router, "home/security/journal/request"));
+    CHECK_EQUAL(1, journal.calls);
+
+    // Neither a prefix nor a longer topic matches
+    CHECK_EQUAL(0, dispatch(router, "home/security"));
+    CHECK_EQUAL(0, dispatch(router, "home/security/rules/more"));
+    CHECK_EQUAL(0, dispatch(router, "home/security/rule"));
+    CHECK_EQUAL(1, rules.calls);
+}
+
+static void test_plus_matches_one_level()
+{
+    MqttTopicRouter router;
+    ROUTE route = {};
+    router.add("home/+/rules", handler, &route);
+
+    CHECK_EQUAL(1, dispatch(router, "home/security/rules"));
+    CHECK_EQUAL(1, dispatch(router, "home/garage/rules"));
+    CHECK_EQUAL(1, dispatch(router, "home//rules"));
+    CHECK_EQUAL(0, dispatch(router, "home/rules"));
+    CHECK_EQUAL(0, dispatch(router, "home/a/b/rules"));
+    CHECK_EQUAL(0, dispatch(router, "home/security/rules/x"));
+    CHECK_EQUAL(3, route.calls);
+}
+
+static void test_hash_matches_the_rest()
+{
+    MqttTopicRouter router;
+    ROUTE home = {}, everything = {}, nested = {};
+    router.add("home/#", handler, &home);
+    router.add("#", handler, &everything);
+    router.add("a/+/#", handler, &nested);
+
+    // "home/#" also covers "home" itself
+    CHECK_EQUAL(2, dispatch(router, "home"));
+    CHECK_EQUAL(2, dispatch(router, "home/security"));
+    CHECK_EQUAL(2, dispatch(router, "home/security/zone/9"));
+    CHECK_EQUAL(3, home.calls);
+
+    CHECK_EQUAL(1, dispatch(router, "garage"));
+    CHECK_EQUAL(4, everything.calls);
+
+    CHECK_EQUAL(1, dispatch(router, "a"));
+    CHECK_EQUAL(2, dispatch(router, "a/b"));
+    CHECK_EQUAL(2, dispatch(router, "a/b/c/d"));
+    CHECK_EQUAL(2, nested.calls);
+}
+
+static void test_wildcards_skip_dollar_topics()
+{
+    MqttTopicRouter router;
+    ROUTE everything = {}, plus = {}, sys = {}, sysPlus = {};
+    router.add("#", handler, &everything);
+    router.add("+/broker/uptime", handler, &plus);
+    router.add("$SYS/#", handler, &sys);
+    router.add("$SYS/+/uptime", handler, &sysPlus);
+
+    CHECK_EQUAL(2, dispatch(router, "$SYS/broker/uptime"));
+    CHECK_EQUAL(0, everything.calls);
+    CHECK_EQUAL(0, plus.calls);
+    CHECK_EQUAL(1, sys.calls);
+    CHECK_EQUAL(1, sysPlus.calls);
+
+    // Only at the first level
+    CHECK_EQUAL(2, dispatch(router, "x/broker/uptime"));
+    CHECK_EQUAL(1, everything.calls);
+    CHECK_EQUAL(1, plus.calls);
+}
+
+static void test_overlapping_filters_all_called()
+{
+    MqttTopicRouter router;
+    ROUTE exact = {}, plus = {}, hash = {}, second = {};
+    router.add("home/security/rules", handler, &exact);
+    router.add("home/+/rules", handler, &plus);
+    router.add("home/#", handler, &hash);
+    router.add("home/security/rules", handler, &second);
+
+    CHECK_EQUAL(4, dispatch(router, "home/security/rules"));
+    CHECK_EQUAL(1, exact.calls);
+    CHECK_EQUAL(1, plus.calls);
+    CHECK_EQUAL(1, hash.calls);
+    CHECK_EQUAL(1, second.calls);
+}
+
+static void test_invalid_filters_rejected()
+{
+    MqttTopicRouter router;
+    ROUTE route = {};
+
+    CHECK(!router.add("bad/+x", handler, &route));
+    CHECK(!router.add("bad/x+", handler, &route));
+    CHECK(!router.add("x/#/y", handler, &route));
+    CHECK(!router.add("a#", handler, &route));
+    CHECK(router.add("+", handler, &route));
+    CHECK(router.add("+/+/#", handler, &route));
+}
+
+static void test_route_limit()
+{
+    MqttTopicRouter router;
+    ROUTE route = {};
+    char filter[16];
+
+    for (int i = 0; i < MQTT_ROUTER_MAX_ROUTES; i++)
+    {
+        snprintf(filter, sizeof(filter), "t/%d", i);
+        CHECK(router.add(filter, handler, &route));
+    }
+    CHECK(!router.add("t/full", handler, &route));
+
+    CHECK_EQUAL(1, dispatch(router, "t/0"));
+    CHECK_EQUAL(1, dispatch(router, "t/15"));
+    CHECK_EQUAL(0, dispatch(router, "t/full"));
+}
+
+static void test_subscribe_all_once_per_filter()
+{
+    MqttTopicRouter router;
+    ROUTE route = {};
+    router.add("home/security/rules", handler, &route);
+    router.add("ota/+/pull", handler, &route);
+    router.add("home/security/rules", handler, &route);
+
+    PubSubClient client;
+    router.subscribeAll(&client);
+    CHECK_EQUAL(2, client.subscribed.size());
+    CHECK(client.subscribed[0] == "home/security/rules");
+    CHECK(client.subscribed[1] == "ota/+/pull");
+
+    // And again after a reconnect
+    router.subscribeAll(&client);
+    CHECK_EQUAL(4, client.subscribed.size());
+}
+
+int main()
+{
+    RUN_TEST(test_exact_filters);
+    RUN_TEST(test_plus_matches_one_level);
+    RUN_TEST(test_hash_matches_the_rest);
+    RUN_TEST(test_wildcards_skip_dollar_topics);
+    RUN_TEST(test_overlapping_filters_all_called);
+    RUN_TEST(test_invalid_filters_rejected);
+    RUN_TEST(test_route_limit);
+    RUN_TEST(test_subscribe_all_once_per_filter);
+    return checkFailures();
+}
@@ -0,0 +1,346 @@
+#include "check.h"
+#include "RulesEngine.h"
+
+// setup() isn't called, so the GPIO outputs aren't polled and frames alone
+// drive the panel state
+static HardwareSerial panelSerial;
+static Texecom::CONFIG config = {
+    1, "home/security", &panelSerial, -1, -1, {30, 31, 32, 33, 34, 35, 36, 37}, 9, 16, 0};
+static Texecom panel(config);
+static Texecom otherPanel(config);
+
+static const uint8_t outputPins[] = {12, 13};
+static RulesEngine rules(&panel, outputPins, sizeof(outputPins));
+
+typedef struct {
+    std::string topic;
+    std::string payload;
+} MESSAGE;
+
+static std::vector<MESSAGE> published;
+
+static bool publish(const char *topic, const char *payload)
+{
+    published.push_back({topic, payload});
+    return true;
+}
+
+static bool compile(const char *text)
+{
+    return rules.compile(text, strlen(text));
+}
+
+// A frame from the panel, through its serial decoding
+static void receive(const char *frame)
+{
+    panelSerial.input += frame;
+    panelSerial.input += "\r\n";
+    while (panelSerial.available() > 0)
+        panel.loop();
+}
+
+static void zone(uint8_t number, char state)
+{
+    char frame[8];
+    snprintf(frame, sizeof(frame), "\"Z0%02d%c", number, state);
+    receive(frame);
+}
+
+static void runFor(uint32_t ms)
+{
+    uint64_t until = Scheduler::now() + ms;
+    while (Scheduler::now() < until)
+        scheduler.run(until - Scheduler::now());
+}
+
+static void reset()
+{
+    compile("");
+    receive("\"D0001");
+    for (uint8_t number = 9; number < 25; number++)
+        zone(number, '0');
+    published.clear();
+}
+
+static void test_compiles_rules_skipping_comments_and_blank_lines()
+{
+    CHECK(compile("# Front door\n"
+                  "zone 9 active when disarmed,armed_away -> publish home/alert Front door opened\r\n"
+                  "\n"
+                  "   \t\n"
+                  "  zone * tamper -> gpio 13 pulse 5000\n"
+                  "alarm disarmed -> gpio 12 off\n"
+                  "alarm triggered -> gpio 12 on"));
+    CHECK_EQUAL(4, rules.ruleCount());
+
+    CHECK(compile(""));
+    CHECK_EQUAL(0, rules.ruleCount());
+}
+
+static void test_bad_rule_keeps_previous_rules()
+{
+    CHECK(compile("alarm triggered -> gpio 12 on\nalarm disarmed -> gpio 12 off\n"));
+
+    const char *bad[] = {
+        "zone 9 active gpio 12 on",                         // No arrow
+        "door 9 active -> gpio 12 on",                      // Unknown trigger
+        "zone -> gpio 12 on",
+        "zone 0 active -> gpio 12 on",
+        "zone 256 active -> gpio 12 on",
+        "zone 9 open -> gpio 12 on",                        // Unknown edge
+        "zone 9 -> gpio 12 on",
+        "alarm armed -> gpio 12 on",                        // Unknown state
+        "alarm triggered until disarmed -> gpio 12 on",
+        "zone 9 active when -> gpio 12 on",
+        "zone 9 active when armed -> gpio 12 on",
+        "zone 9 active when armed_away,,exit extra -> gpio 12 on",
+        "zone 9 active ->",
+        "zone 9 active -> sound 12",                        // Unknown action
+        "zone 9 active -> publish",
+        "zone 9 active -> gpio 18 on",                      // Not an output pin
+        "zone 9 active -> gpio 30 on",                      // A panel input
+        "zone 9 active -> gpio 12",
+        "zone 9 active -> gpio 12 flash",
+        "zone 9 active -> gpio 12 pulse",
+        "zone 9 active -> gpio 12 pulse 0",
+        "zone 9 active -> gpio 12 pulse 65536",
+    };
+
+    for (const char *line : bad)
+    {
+        std::string text = std::string("alarm exit -> gpio 13 on\n") + line + "\n";
+        if (compile(text.c_str()))
+            printf("  accepted: %s\n", line);
+        CHECK_EQUAL(2, rules.ruleCount());
+    }
+}
+
+static void test_limits()
+{
+    std::string text;
+    for (int i = 0; i < rulesMaxRules; i++)
+        text += "zone 9 active -> gpio 12 on\n";
+    CHECK(compile(text.c_str()));
+    CHECK_EQUAL(rulesMaxRules, rules.ruleCount());
+
+    CHECK(!compile((text + "zone 9 active -> gpio 12 on\n").c_str()));
+    CHECK_EQUAL(rulesMaxRules, rules.ruleCount());
+
+    // The string pool, payloads are kept in full
+    std::string payload(300, 'x');
+    std::string strings;
+    for (int i = 0; i < 4; i++)
+        strings += "zone 9 active -> publish home/alert " + payload + "\n";
+    CHECK(!compile(strings.c_str()));
+
+    // And the source itself
+    std::string huge(2048, '#');
+    CHECK(!compile(huge.c_str()));
+    CHECK_EQUAL(rulesMaxRules, rules.ruleCount());
+}
+
+static void test_zone_rules_fire_on_edges()
+{
+    reset();
+    CHECK(compile("zone 9 active -> publish home/alert Front door opened\n"
+                  "zone 10 inactive -> publish home/closed\n"));
+
+    zone(9, '1');
+    CHECK_EQUAL(1, published.size());
+    CHECK(published[0].topic == "home/alert");
+    CHECK(published[0].payload == "Front door opened");
+
+    // Still active, or another zone, is not an edge
+    zone(9, '1');
+    zone(11, '1');
+    CHECK_EQUAL(1, published.size());
+
+    zone(10, '1');
+    CHECK_EQUAL(1, published.size());
+    zone(10, '0');
+    CHECK_EQUAL(2, published.size());
+    CHECK(published[1].topic == "home/closed");
+    CHECK(published[1].payload == "1");
+
+    zone(9, '0');
+    zone(9, '1');
+    CHECK_EQUAL(3, published.size());
+}
+
+static void test_when_limits_alarm_states()
+{
+    reset();
+    CHECK(compile("zone 9 active when armed_away,entry -> publish home/alert intruder\n"));
+
+    zone(9, '1');
+    zone(9, '0');
+    CHECK_EQUAL(0, published.size());
+
+    receive("\"Area FULL ARMED");
+    zone(9, '1');
+    zone(9, '0');
+    CHECK_EQUAL(1, published.size());
+
+    receive("\"E0001");
+    zone(9, '1');
+    zone(9, '0');
+    CHECK_EQUAL(2, published.size());
+
+    receive("\"Part Armed");
+    zone(9, '1');
+    CHECK_EQUAL(2, published.size());
+}
+
+static void test_any_zone_tamper_pulses_output()
+{
+    reset();
+    CHECK(compile("zone * tamper -> gpio 13 pulse 500\n"));
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+
+    uint32_t before = rules.firedCount();
+    zone(17, '2');
+    CHECK_EQUAL(before + 1, rules.firedCount());
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+
+    runFor(499);
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+    runFor(1);
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+}
+
+static void test_recompile_ends_pulses()
+{
+    reset();
+    CHECK(compile("zone 9 tamper -> gpio 13 pulse 5000\n"));
+    zone(9, '2');
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+
+    CHECK(compile("alarm triggered -> gpio 12 on\n"));
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+    runFor(6000);
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+}
+
+static void test_identical_recompile_keeps_latched_output()
+{
+    reset();
+    const char *text = "alarm triggered -> gpio 12 on\n"
+                       "alarm disarmed -> gpio 12 off\n"
+                       "zone 9 tamper -> gpio 13 pulse 5000\n";
+    CHECK(compile(text));
+
+    receive("\"L0001");
+    zone(9, '2');
+    CHECK_EQUAL(HIGH, fakePinLevels[12]);
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+
+    // The retained rules arrive again after an MQTT reconnect
+    CHECK(compile(text));
+    CHECK_EQUAL(HIGH, fakePinLevels[12]);
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+    runFor(5000);
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+
+    // A changed config keeps the levels of pins it still drives
+    CHECK(compile("alarm triggered -> gpio 12 on\n"
+                  "alarm disarmed -> gpio 12 off\n"));
+    CHECK_EQUAL(HIGH, fakePinLevels[12]);
+
+    receive("\"D0001");
+    CHECK_EQUAL(LOW, fakePinLevels[12]);
+}
+
+static void test_changed_recompile_lets_pulse_run_out()
+{
+    reset();
+    CHECK(compile("zone 9 tamper -> gpio 13 pulse 500\n"));
+    zone(9, '2');
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+
+    CHECK(compile("zone 10 tamper -> gpio 13 pulse 500\n"
+                  "zone 9 tamper -> gpio 13 pulse 500\n"));
+    CHECK_EQUAL(HIGH, fakePinLevels[13]);
+    runFor(500);
+    CHECK_EQUAL(LOW, fakePinLevels[13]);
+}
+
+static void test_alarm_rules_run_once_per_state()
+{
+    reset();
+    CHECK(compile("alarm triggered -> gpio 12 on\n"
+                  "alarm disarmed -> gpio 12 off\n"
+                  "alarm triggered -> publish home/alert triggered\n"));
+
+    receive("\"Area FULL ARMED");
+    CHECK_EQUAL(0, published.size());
+
+    receive("\"L0001");
+    CHECK_EQUAL(HIGH, fakePinLevels[12]);
+    CHECK_EQUAL(1, published.size());
+
+    // Only the flags changed, nothing new to react to
+    Texecom::ALARM_EVENT flagsOnly = {&panel, Texecom::TRIGGERED, Texecom::ALARM_FAULT, 0};
+    Texecom::alarmEvents.publish(flagsOnly);
+    CHECK_EQUAL(1, published.size());
+
+    receive("\"D0001");
+    CHECK_EQUAL(LOW, fakePinLevels[12]);
+}
+
+static void test_other_panels_ignored()
+{
+    reset();
+    CHECK(compile("zone 9 active -> publish home/alert\n"
+                  "alarm triggered -> publish home/alert\n"));
+
+    Texecom::ZONE_EVENT zoneEvent = {&otherPanel, 9, Texecom::ZONE_ACTIVE, 0};
+    Texecom::zoneEvents.publish(zoneEvent);
+    Texecom::ALARM_EVENT alarmEvent = {&otherPanel, Texecom::TRIGGERED, 0, 0};
+    Texecom::alarmEvents.publish(alarmEvent);
+    CHECK_EQUAL(0, published.size());
+
+    zone(9, '1');
+    CHECK_EQUAL(1, published.size());
+}
+
+static void ignoreAlarmEvent(const Texecom::ALARM_EVENT &event, void *context) {}
+
+static void test_begin_fails_without_room_on_the_buses()
+{
+    // Fill the alarm bus, the zone bus still has room
+    uint8_t alarmSubscribers = Texecom::alarmEvents.subscriberCount();
+    uint8_t zoneSubscribers = Texecom::zoneEvents.subscriberCount();
+    static int fillers[texecomMaxSubscribers];
+    for (uint8_t i = alarmSubscribers; i < texecomMaxSubscribers; i++)
+        CHECK(Texecom::alarmEvents.subscribe(ignoreAlarmEvent, &fillers[i]));
+
+    RulesEngine late(&panel, outputPins, sizeof(outputPins));
+    CHECK(!late.begin(publish));
+
+    // Not left half subscribed
+    CHECK_EQUAL(zoneSubscribers, Texecom::zoneEvents.subscriberCount());
+
+    for (uint8_t i = alarmSubscribers; i < texecomMaxSubscribers; i++)
+        Texecom::alarmEvents.unsubscribe(ignoreAlarmEvent, &fillers[i]);
+    CHECK_EQUAL(alarmSubscribers, Texecom::alarmEvents.subscriberCount());
+}
+
+int main()
+{
+    scheduler.begin();
+    CHECK(rules.begin(publish));
+
+    RUN_TEST(test_compiles_rules_skipping_comments_and_blank_lines);
+    RUN_TEST(test_bad_rule_keeps_previous_rules);
+    RUN_TEST(test_limits);
+    RUN_TEST(test_zone_rules_fire_on_edges);
+    RUN_TEST(test_when_limits_alarm_states);
+    RUN_TEST(test_any_zone_tamper_pulses_output);
+    RUN_TEST(test_recompile_ends_pulses);
+    RUN_TEST(test_identical_recompile_keeps_latched_output);
+    RUN_TEST(test_changed_recompile_lets_pulse_run_out);
+    RUN_TEST(test_alarm_rules_run_once_per_state);
+    RUN_TEST(test_other_panels_ignored);
+    RUN_TEST(test_begin_fails_without_room_on_the_buses);
+    return checkFailures();
+}
@@ -0,0 +1,205 @@
+#include "check.h"
+#include "Scheduler.h"
+
+typedef struct {
+    Timer timer;
+    uint64_t due;
+    uint64_t firedAt;
+    int count;
+} FIRING;
+
+static void fired(void *context)
+{
+    FIRING *firing = (FIRING *)context;
+    firing->firedAt = Scheduler::now();
+    firing->count++;
+}
+
+static void start(FIRING *firing, uint32_t delay)
+{
+    *firing = {};
+    firing->timer.setCallback(fired, firing);
+    firing->due = Scheduler::now() + delay;
+    firing->timer.start(delay);
+}
+
+static void runUntil(uint64_t until)
+{
+    while (Scheduler::now() < until)
+        scheduler.run(until - Scheduler::now());
+}
+
+// Lands the clock on the millisecond before a multiple of boundary
+static void moveToJustBefore(uint64_t boundary)
+{
+    runUntil((Scheduler::now() / boundary + 1) * boundary - 1);
+}
+
+static void checkFiredOnTime(const uint32_t *delays, size_t count)
+{
+    FIRING firings[16];
+    for (size_t i = 0; i < count; i++)
+        start(&firings[i], delays[i]);
+
+    runUntil(firings[count - 1].due + 1);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (firings[i].count != 1 || firings[i].firedAt != firings[i].due)
+            printf("  delay %u fired %d times, at %llu for %llu\n", delays[i], firings[i].count,
+                   (unsigned long long)firings[i].firedAt, (unsigned long long)firings[i].due);
+        CHECK_EQUAL(1, firings[i].count);
+        CHECK_EQUAL(firings[i].due, firings[i].firedAt);
+        CHECK(!firings[i].timer.isPending());
+    }
+}
+
+// Level 0 covers 256ms, level 1 16384ms, level 2 1048576ms, then the overflow list
+static const uint32_t levelDelays[] = {1, 5, 255, 256, 257, 1000, 16383, 16384, 16385,
+                                       50000, 1048575, 1048576, 1048577, 3000000};
+
+static void test_timers_fire_once_on_time_at_every_level()
+{
+    checkFiredOnTime(levelDelays, sizeof(levelDelays) / sizeof(levelDelays[0]));
+}
+
+static void test_timers_cascade_across_level_0_boundary()
+{
+    moveToJustBefore(256);
+    checkFiredOnTime(levelDelays, sizeof(levelDelays) / sizeof(levelDelays[0]));
+}
+
+static void test_timers_cascade_across_level_1_boundary()
+{
+    moveToJustBefore(16384);
+    checkFiredOnTime(levelDelays, sizeof(levelDelays) / sizeof(levelDelays[0]));
+}
+
+static void test_timers_cascade_across_level_2_boundary()
+{
+    moveToJustBefore(1048576);
+    checkFiredOnTime(levelDelays, sizeof(levelDelays) / sizeof(levelDelays[0]));
+}
+
+static void test_timer_due_now_fires_on_next_run()
+{
+    // The current millisecond has already been run, so it goes in the next
+    scheduler.run(0);
+    FIRING firing;
+    start(&firing, 0);
+
+    uint64_t before = Scheduler::now();
+    scheduler.run(1000);
+    CHECK_EQUAL(1, firing.count);
+    CHECK(Scheduler::now() - before <= 1);
+}
+
+static void test_periodic_timer_fires_every_period()
+{
+    FIRING firing = {};
+    firing.timer.setCallback(fired, &firing);
+    uint64_t started = Scheduler::now();
+    firing.timer.startPeriodic(100);
+
+    runUntil(started + 1000);
+    CHECK_EQUAL(10, firing.count);
+    CHECK_EQUAL(started + 1000, firing.firedAt);
+    CHECK(firing.timer.isPending());
+
+    firing.timer.stop();
+    runUntil(started + 2000);
+    CHECK_EQUAL(10, firing.count);
+}
+
+static void test_stopped_timer_never_fires()
+{
+    FIRING first, middle, last;
+    start(&first, 50);
+    start(&middle, 50);
+    start(&last, 50);
+
+    // Taken out of the middle of a slot, the others stay linked
+    middle.timer.stop();
+    CHECK(!middle.timer.isPending());
+
+    runUntil(first.due + 10);
+    CHECK_EQUAL(1, first.count);
+    CHECK_EQUAL(0, middle.count);
+    CHECK_EQUAL(1, last.count);
+}
+
+static void test_restart_moves_deadline()
+{
+    FIRING firing;
+    start(&firing, 20000);
+    firing.due = Scheduler::now() + 30;
+    firing.timer.start(30);
+
+    runUntil(Scheduler::now() + 25000);
+    CHECK_EQUAL(1, firing.count);
+    CHECK_EQUAL(firing.due, firing.firedAt);
+}
+
+static void test_run_sleeps_until_next_deadline()
+{
+    FIRING firing;
+    start(&firing, 30);
+
+    uint64_t before = Scheduler::now();
+    scheduler.run(1000);
+    CHECK_EQUAL(before + 30, Scheduler::now());
+    CHECK_EQUAL(1, firing.count);
+
+    // Nothing due, so only as long as maxIdle
+    before = Scheduler::now();
+    scheduler.run(20);
+    CHECK_EQUAL(before + 20, Scheduler::now());
+}
+
+static void test_wake_cuts_sleep_short()
+{
+    FIRING firing;
+    start(&firing, 500);
+
+    uint64_t before = Scheduler::now();
+    scheduler.wake();
+    scheduler.run(1000);
+    CHECK_EQUAL(before, Scheduler::now());
+    CHECK_EQUAL(0, firing.count);
+
+    firing.timer.stop();
+}
+
+class Counter {
+public:
+  int count = 0;
+  void tick() { count++; }
+};
+
+static void test_method_adapter_calls_member()
+{
+    Counter counter;
+    Timer timer(Timer::method<Counter, &Counter::tick>, &counter);
+    timer.start(10);
+
+    runUntil(Scheduler::now() + 10);
+    CHECK_EQUAL(1, counter.count);
+}
+
+int main()
+{
+    scheduler.begin();
+
+    RUN_TEST(test_timers_fire_once_on_time_at_every_level);
+    RUN_TEST(test_timers_cascade_across_level_0_boundary);
+    RUN_TEST(test_timers_cascade_across_level_1_boundary);
+    RUN_TEST(test_timers_cascade_across_level_2_boundary);
+    RUN_TEST(test_timer_due_now_fires_on_next_run);
+    RUN_TEST(test_periodic_timer_fires_every_period);
+    RUN_TEST(test_stopped_timer_never_fires);
+    RUN_TEST(test_restart_moves_deadline);
+    RUN_TEST(test_run_sleeps_until_next_deadline);
+    RUN_TEST(test_wake_cuts_sleep_short);
+    RUN_TEST(test_method_adapter_calls_member);
+    return checkFailures();
+}
@@ -0,0 +1,146 @@
+#include "check.h"
+#include "texecom.h"
+
+// The digi outputs are active low, the areaReady output included
+static const Texecom::DIGI_OUTPUT_PINS pins = {30, 31, 32, 33, 34, 35, 36, 37};
+
+static HardwareSerial panelSerial;
+static Texecom::CONFIG config = {1, "home/security", &panelSerial, -1, -1, pins, 9, 16, 0};
+static Texecom panel(config);
+
+static std::vector<Texecom::ALARM_EVENT> events;
+
+static void onAlarmEvent(const Texecom::ALARM_EVENT &event, void *context)
+{
+    events.push_back(event);
+}
+
+static void receive(const char *frame)
+{
+    panelSerial.input += frame;
+    panelSerial.input += "\r\n";
+    while (panelSerial.available() > 0)
+        panel.loop();
+}
+
+static void runFor(uint32_t ms)
+{
+    uint64_t until = Scheduler::now() + ms;
+    while (Scheduler::now() < until)
+        scheduler.run(until - Scheduler::now());
+}
+
+static void setPin(int pin, bool active)
+{
+    fakePinLevels[pin] = active ? LOW : HIGH;
+}
+
+// Disarmed, not ready, no faults, and both sources agreeing on it
+static void reset()
+{
+    for (int pin = 30; pin <= 37; pin++)
+        setPin(pin, false);
+    receive("\"D0001");
+    runFor(15000);
+    events.clear();
+}
+
+static void arm()
+{
+    receive("\"A0001");
+    runFor(300);
+    setPin(pins.fullArmed, true);
+    runFor(3000);
+    CHECK_EQUAL(Texecom::ARMED_AWAY, panel.getAlarmState());
+    events.clear();
+}
+
+static void test_pins_that_follow_the_keypad_agree()
+{
+    reset();
+    uint32_t disagreements = panel.getStateDisagreements();
+
+    receive("\"A0001");
+    CHECK_EQUAL(1, events.size());
+    CHECK_EQUAL(Texecom::ARMED_AWAY, events[0].state);
+
+    runFor(700);
+    setPin(pins.fullArmed, true);
+    runFor(3000);
+    CHECK_EQUAL(1, events.size());
+    CHECK_EQUAL(disagreements, panel.getStateDisagreements());
+    CHECK(panel.getFrameLeadMs() >= 700 && panel.getFrameLeadMs() <= 1700);
+}
+
+static void test_wrong_frame_corrected_while_pins_stay_put()
+{
+    reset();
+    arm();
+    uint32_t disagreements = panel.getStateDisagreements();
+
+    // A disarm the panel never did, the pins carry on saying armed
+    receive("\"D0001");
+    CHECK_EQUAL(1, events.size());
+    CHECK_EQUAL(Texecom::DISARMED, events[0].state);
+
+    runFor(15000);
+    CHECK_EQUAL(2, events.size());
+    CHECK_EQUAL(Texecom::ARMED_AWAY, events[1].state);
+    CHECK_EQUAL(Texecom::ARMED_AWAY, panel.getAlarmState());
+    CHECK_EQUAL(disagreements + 1, panel.getStateDisagreements());
+
+    // And only once
+    runFor(15000);
+    CHECK_EQUAL(2, events.size());
+}
+
+static void test_flag_change_during_pin_lag_keeps_keypad_state()
+{
+    reset();
+    arm();
+    uint32_t disagreements = panel.getStateDisagreements();
+
+    receive("\"D0001");
+    CHECK_EQUAL(1, events.size());
+    CHECK_EQUAL(Texecom::DISARMED, events[0].state);
+
+    // READY goes and settles before the arm output drops
+    runFor(200);
+    setPin(pins.areaReady, true);
+    runFor(2300);
+    setPin(pins.fullArmed, false);
+    runFor(3000);
+
+    for (const Texecom::ALARM_EVENT &event : events)
+        CHECK_EQUAL(Texecom::DISARMED, event.state);
+    CHECK_EQUAL(2, events.size());
+    CHECK_EQUAL(Texecom::ALARM_READY, events[1].flags);
+    CHECK_EQUAL(disagreements, panel.getStateDisagreements());
+}
+
+static void test_fault_flag_alone_publishes_current_state()
+{
+    reset();
+    arm();
+
+    setPin(pins.faultPresent, true);
+    runFor(3000);
+    CHECK_EQUAL(1, events.size());
+    CHECK_EQUAL(Texecom::ARMED_AWAY, events[0].state);
+    CHECK_EQUAL(Texecom::ALARM_FAULT, events[0].flags);
+}
+
+int main()
+{
+    scheduler.begin();
+    Texecom::alarmEvents.subscribe(onAlarmEvent);
+    for (int pin = 30; pin <= 37; pin++)
+        setPin(pin, false);
+    panel.setup();
+
+    RUN_TEST(test_pins_that_follow_the_keypad_agree);
+    RUN_TEST(test_wrong_frame_corrected_while_pins_stay_put);
+    RUN_TEST(test_flag_change_during_pin_lag_keeps_keypad_state);
+    RUN_TEST(test_fault_flag_alone_publishes_current_state);
+    return checkFailures();
+}
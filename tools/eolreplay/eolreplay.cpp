@@ -0,0 +1,221 @@
+// Copyright 2021 Kevin Cooper
+//
+// Replays recorded end-of-line zone samples through the firmware's
+// EolClassifier, so threshold and debounce changes can be checked against
+// real wiring before they are flashed.
+//
+// Input is CSV, one averaged ADC frame per line in millivolts with one column
+// per zone. An optional first column of timestamps is kept for the output
+// when --time is given. Lines starting with # and a non-numeric header line
+// are skipped. Each debounced state change is printed as
+//   <line or time>,<column>,<state>
+// where state is the ZONE_* bitfield the firmware would publish. An expected
+// transcript in the same format can be given with --expect, the exit status is
+// then non-zero if the replay differs from it.
+//
+// Build:
+//   g++ -std=c++17 -O2 -o eolreplay tools/eolreplay/eolreplay.cpp
+//
+// Examples:
+//   eolreplay samples.csv
+//   eolreplay --time --stable 5 --thresholds 500,1900,2650,3050 samples.csv
+//   eolreplay --time --expect samples.expected samples.csv
+
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/EolClassifier.h"
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: eolreplay [--time] [--stable N] [--thresholds short,healthy,active,open]\n"
+        "                 [--expect FILE] FILE\n");
+    exit(2);
+}
+
+static bool parseThresholds(const char *text, EolClassifier::THRESHOLDS *thresholds)
+{
+    unsigned values[4];
+    if (sscanf(text, "%u,%u,%u,%u", &values[0], &values[1], &values[2], &values[3]) != 4)
+        return false;
+    if (!(values[0] < values[1] && values[1] < values[2] && values[2] <= values[3]))
+        return false;
+
+    thresholds->shortBelow = values[0];
+    thresholds->healthyBelow = values[1];
+    thresholds->activeBelow = values[2];
+    thresholds->openAbove = values[3];
+    return true;
+}
+
+static std::vector<std::string> readLines(const char *path)
+{
+    std::vector<std::string> lines;
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        lines.push_back(line);
+    }
+
+    if (file != stdin)
+        fclose(file);
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    EolClassifier::THRESHOLDS thresholds = EolClassifier::defaultThresholds;
+    int stable = 3;
+    bool timeColumn = false;
+    const char *expectPath = NULL;
+
+    static const struct option options[] = {
+        {"time", no_argument, NULL, 't'},
+        {"stable", required_argument, NULL, 's'},
+        {"thresholds", required_argument, NULL, 'T'},
+        {"expect", required_argument, NULL, 'e'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "ts:T:e:", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 't':
+            timeColumn = true;
+            break;
+        case 's':
+            stable = atoi(optarg);
+            if (stable < 1 || stable > 255)
+                usage();
+            break;
+        case 'T':
+            if (!parseThresholds(optarg, &thresholds))
+            {
+                fprintf(stderr, "thresholds must be four increasing millivolt values\n");
+                return 2;
+            }
+            break;
+        case 'e':
+            expectPath = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc - 1)
+        usage();
+
+    std::vector<EolClassifier> classifiers;
+    std::vector<std::string> transcript;
+    unsigned frames = 0;
+    unsigned lineNumber = 0;
+
+    for (const std::string &line : readLines(argv[optind]))
+    {
+        lineNumber++;
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (true)
+        {
+            size_t comma = line.find(',', start);
+            fields.push_back(line.substr(start, comma == std::string::npos ? std::string::npos : comma - start));
+            if (comma == std::string::npos)
+                break;
+            start = comma + 1;
+        }
+
+        std::string label = std::to_string(lineNumber);
+        size_t first = 0;
+        if (timeColumn)
+        {
+            label = fields[0];
+            first = 1;
+        }
+
+        // A header line, only allowed before any data
+        char *end;
+        if (fields.size() <= first || (strtoul(fields[first].c_str(), &end, 10), *end != '\0'))
+        {
+            if (frames == 0)
+                continue;
+            fprintf(stderr, "line %u: not a sample frame\n", lineNumber);
+            return 1;
+        }
+
+        size_t zones = fields.size() - first;
+        if (classifiers.empty())
+            classifiers.assign(zones, EolClassifier(thresholds, stable));
+        else if (zones != classifiers.size())
+        {
+            fprintf(stderr, "line %u: %zu zones, expected %zu\n", lineNumber, zones, classifiers.size());
+            return 1;
+        }
+
+        for (size_t i = 0; i < zones; i++)
+        {
+            unsigned long millivolts = strtoul(fields[first + i].c_str(), &end, 10);
+            if (*end != '\0' || millivolts > 0xffff)
+            {
+                fprintf(stderr, "line %u: bad sample '%s'\n", lineNumber, fields[first + i].c_str());
+                return 1;
+            }
+
+            if (classifiers[i].update(millivolts))
+                transcript.push_back(label + "," + std::to_string(i) + "," + std::to_string(classifiers[i].state()));
+        }
+        frames++;
+    }
+
+    for (const std::string &change : transcript)
+        printf("%s\n", change.c_str());
+    fprintf(stderr, "%u frames, %zu zones, %zu changes\n", frames, classifiers.size(), transcript.size());
+
+    if (expectPath == NULL)
+        return 0;
+
+    std::vector<std::string> expected;
+    for (const std::string &line : readLines(expectPath))
+    {
+        if (!line.empty() && line[0] != '#')
+            expected.push_back(line);
+    }
+
+    size_t common = transcript.size() < expected.size() ? transcript.size() : expected.size();
+    for (size_t i = 0; i < common; i++)
+    {
+        if (transcript[i] != expected[i])
+        {
+            fprintf(stderr, "change %zu: got %s, expected %s\n", i + 1, transcript[i].c_str(), expected[i].c_str());
+            return 1;
+        }
+    }
+
+    if (transcript.size() != expected.size())
+    {
+        fprintf(stderr, "got %zu changes, expected %zu\n", transcript.size(), expected.size());
+        return 1;
+    }
+
+    fprintf(stderr, "matches %s\n", expectPath);
+    return 0;
+}
@@ -0,0 +1,893 @@
+// Copyright 2021 Kevin Cooper
+//
+// Summarises captured panel traffic through the firmware's own Crestron
+// frame parser (src/CrestronFrame.h), so a long capture tells the same story
+// the monitor would have published.
+//
+// Input is either the monitor's syslog as written by the collector, where
+// every frame it receives is logged on a line of its own, or a raw capture of
+// the serial bridge (nc monitor 2000 > capture.raw). A frame is taken from the
+// first " on a line to its end. Lines are dated from an RFC 3339 or BSD
+// syslog timestamp at their start, BSD ones are taken as UTC in --year. Raw
+// captures have no times, so only counts and changes are reported for them.
+// The firmware's "last message repeated N times" lines count as N more of
+// the frame before them.
+//
+// Files are memory mapped and cut into chunks on line boundaries, each chunk
+// is scanned by its own thread, and the results are folded together in file
+// order, so zone changes and time spent in each state carry across chunk
+// edges. With the files in the page cache the scan runs at memory speed,
+// several GB/s; from cold it goes as fast as the disk.
+//
+// The report on stdout has frame counts by type, and for every zone the
+// frames by reported state, how often it went active or tamper and how long
+// it spent that way, then the same for the alarm state the frames imply.
+// --timeline writes per-zone frame counts by state for each --bucket seconds,
+// --changes every zone change and --alarms every alarm state change, all CSV.
+// --match keeps only lines containing the given text, a device name or MAC
+// when several monitors log to one file.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -o logscan tools/logscan/logscan.cpp
+//
+// Examples:
+//   logscan /var/log/remote/texecom.log
+//   logscan --match TexecomMonitor --timeline zones.csv --bucket 900 texecom.log.*
+//   logscan --zone 12 --changes zone12.csv capture.raw
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../src/CrestronFrame.h"
+
+#define MAX_ZONES 1000              // Three digit zone numbers
+#define MIN_CHUNK (4 << 20)
+#define MAX_CHUNK (256 << 20)
+
+static const char *typeNames[CrestronFrame::TYPE_COUNT] = {
+    "unknown", "zone", "arm", "disarm", "entry", "arming", "intruder", "user_pin", "user_tag",
+    "reply_disarmed", "reply_armed", "screen_part_armed", "screen_full_armed", "screen_idle",
+    "screen_welcome_back", "question_arm", "question_part_arm", "question_night_arm",
+    "question_disarm", "screen_entry", "screen_exit"};
+
+// Indexed by zone flags, the last also counts frames with a state digit out of range
+static const char *zoneStateNames[4] = {"healthy", "active", "tamper", "other"};
+
+// Texecom::ALARM_STATE, named as RulesEngine does
+typedef enum {
+    DISARMED = 0,
+    ARMED_HOME,
+    ARMED_AWAY,
+    ENTRY,
+    EXIT,
+    TRIGGERED,
+    ALARM_STATES,
+    ARM = ALARM_STATES,             // "A0, arms into armMode unless already armed
+    MODE_AWAY,                      // Arm questions, set armMode
+    MODE_HOME,
+} ALARM_KIND;
+
+static const char *alarmStateNames[ALARM_STATES] = {"disarmed", "armed_home", "armed_away", "entry", "exit", "triggered"};
+
+typedef struct {
+    const char *match;
+    size_t matchLength;
+    int year;
+    int64_t bucket;
+    int zone;                       // -1 for all
+    bool timeline;
+    bool changes;
+} OPTIONS;
+
+static OPTIONS options = {NULL, 0, 0, 3600, -1, false, false};
+
+typedef struct {
+    uint64_t frames[4];             // By reported state
+    uint64_t entered[4];            // Changes into each state, by flags
+    int64_t seconds[4];             // Time in each state, dated lines only
+    bool seen;                      // A valid state was reported
+    uint8_t firstFlags;
+    uint8_t lastFlags;
+    int64_t firstAt;                // -1 when undated
+    int64_t accountedTo;            // seconds[lastFlags] is counted up to here
+} ZONE_STATS;
+
+typedef struct {
+    int64_t at;
+    uint16_t zone;
+    uint8_t flags;
+    bool first;                     // First report in its chunk, may not be a change
+} ZONE_CHANGE;
+
+typedef struct {
+    int64_t at;
+    uint8_t kind;
+} ALARM_EVENT;
+
+typedef std::array<uint64_t, 4> COUNTS;
+
+// What the line before a "last message repeated" was
+typedef enum {
+    TAIL_INHERIT,                   // Nothing yet, the previous chunk's tail
+    TAIL_OTHER,
+    TAIL_FRAME,
+} TAIL;
+
+struct Chunk {
+    const char *begin;
+    const char *end;
+
+    uint64_t lines = 0;
+    uint64_t frames = 0;
+    uint64_t repeats = 0;
+    uint64_t undated = 0;
+    uint64_t types[CrestronFrame::TYPE_COUNT] = {0};
+    std::vector<ZONE_STATS> zones;
+    int64_t firstTime = -1;
+    int64_t lastTime = -1;
+
+    TAIL tail = TAIL_INHERIT;
+    CrestronFrame::FRAME tailFrame = {};
+    uint64_t leadingRepeats = 0;
+
+    std::vector<ZONE_CHANGE> changes;
+    std::vector<ALARM_EVENT> alarms;
+    std::unordered_map<int64_t, COUNTS> buckets;   // bucket start * MAX_ZONES + zone
+
+    bool done = false;
+};
+
+static int64_t daysFromCivil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static bool digits(const char *p, int count, int *value)
+{
+    *value = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (p[i] < '0' || p[i] > '9')
+            return false;
+        *value = *value * 10 + (p[i] - '0');
+    }
+    return true;
+}
+
+// Seconds since the epoch from the start of a line, -1 when it has no time
+static int64_t parseTime(const char *p, const char *end)
+{
+    // RFC 5424 straight off the wire, "<14>1 "
+    if (p < end && *p == '<')
+    {
+        const char *close = (const char *)memchr(p, '>', std::min<size_t>(end - p, 5));
+        if (close == NULL)
+            return -1;
+        p = close + 1;
+        if (end - p >= 2 && p[0] == '1' && p[1] == ' ')
+            p += 2;
+    }
+
+    int year, month, day, hour, minute, second;
+
+    // RFC 3339, "2024-10-19T14:02:11.123+01:00"
+    if (end - p >= 19 && digits(p, 4, &year) && p[4] == '-' && digits(p + 5, 2, &month) && p[7] == '-' &&
+        digits(p + 8, 2, &day) && (p[10] == 'T' || p[10] == ' ') && digits(p + 11, 2, &hour) && p[13] == ':' &&
+        digits(p + 14, 2, &minute) && p[16] == ':' && digits(p + 17, 2, &second))
+    {
+        int64_t t = (daysFromCivil(year, month, day) * 24 + hour) * 3600 + minute * 60 + second;
+
+        const char *zone = p + 19;
+        if (zone < end && *zone == '.')
+        {
+            while (++zone < end && *zone >= '0' && *zone <= '9')
+                ;
+        }
+
+        int offsetHours, offsetMinutes;
+        if (end - zone >= 6 && (*zone == '+' || *zone == '-') && digits(zone + 1, 2, &offsetHours) &&
+            zone[3] == ':' && digits(zone + 4, 2, &offsetMinutes))
+        {
+            int64_t offset = (offsetHours * 60 + offsetMinutes) * 60;
+            t += *zone == '+' ? -offset : offset;
+        }
+        return t;
+    }
+
+    // BSD syslog, "Oct 19 14:02:11"
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (end - p >= 15 && p[3] == ' ' && p[6] == ' ' && digits(p + 7, 2, &hour) && p[9] == ':' &&
+        digits(p + 10, 2, &minute) && p[12] == ':' && digits(p + 13, 2, &second) &&
+        (digits(p + 4, 2, &day) || (p[4] == ' ' && digits(p + 5, 1, &day))))
+    {
+        for (month = 0; month < 12; month++)
+        {
+            if (memcmp(p, &months[month * 3], 3) == 0)
+                return (daysFromCivil(options.year, month + 1, day) * 24 + hour) * 3600 + minute * 60 + second;
+        }
+    }
+
+    return -1;
+}
+
+// Collectors can log slightly out of order, time never runs backwards here
+static int64_t elapsed(int64_t from, int64_t to)
+{
+    return to > from ? to - from : 0;
+}
+
+static void formatTime(int64_t t, char *text, size_t size)
+{
+    if (t < 0)
+    {
+        snprintf(text, size, "-");
+        return;
+    }
+
+    time_t seconds = t;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    strftime(text, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void countFrame(Chunk *chunk, const CrestronFrame::FRAME &frame, uint64_t count)
+{
+    chunk->frames += count;
+    chunk->types[frame.type] += count;
+
+    if (frame.type == CrestronFrame::ZONE_UPDATE && frame.zone < MAX_ZONES)
+        chunk->zones[frame.zone].frames[frame.zoneState < 3 ? frame.zoneState : 3] += count;
+}
+
+static void zoneFrame(Chunk *chunk, const CrestronFrame::FRAME &frame, int64_t t)
+{
+    if (frame.zone >= MAX_ZONES || frame.zoneState > 2 || (options.zone >= 0 && frame.zone != options.zone))
+        return;
+
+    ZONE_STATS *zone = &chunk->zones[frame.zone];
+    uint8_t flags = CrestronFrame::applyZoneState(zone->seen ? zone->lastFlags : 0, frame.zoneState);
+
+    if (options.timeline && t >= 0)
+        chunk->buckets[(t - t % options.bucket) * MAX_ZONES + frame.zone][flags]++;
+
+    if (!zone->seen)
+    {
+        zone->seen = true;
+        zone->firstFlags = zone->lastFlags = flags;
+        zone->firstAt = zone->accountedTo = t;
+        zone->entered[flags]++;
+        if (options.changes)
+            chunk->changes.push_back({t, frame.zone, flags, true});
+        return;
+    }
+
+    if (t >= 0)
+    {
+        if (zone->accountedTo >= 0)
+            zone->seconds[zone->lastFlags] += elapsed(zone->accountedTo, t);
+        zone->accountedTo = t;
+    }
+
+    if (flags == zone->lastFlags)
+        return;
+
+    zone->entered[flags]++;
+    zone->lastFlags = flags;
+    if (options.changes)
+        chunk->changes.push_back({t, frame.zone, flags, false});
+}
+
+static void alarmFrame(Chunk *chunk, const CrestronFrame::FRAME &frame, int64_t t)
+{
+    uint8_t kind;
+
+    // As Texecom::processCrestronMessage
+    switch (frame.type)
+    {
+    case CrestronFrame::ARM_UPDATE:
+        kind = ARM;
+        break;
+    case CrestronFrame::DISARM_UPDATE:
+        kind = DISARMED;
+        break;
+    case CrestronFrame::ENTRY_UPDATE:
+    case CrestronFrame::SCREEN_AREA_IN_ENTRY:
+        kind = ENTRY;
+        break;
+    case CrestronFrame::ARMING_UPDATE:
+    case CrestronFrame::SCREEN_AREA_IN_EXIT:
+        kind = EXIT;
+        break;
+    case CrestronFrame::INTRUDER_UPDATE:
+        kind = TRIGGERED;
+        break;
+    case CrestronFrame::SCREEN_ARMED_PART:
+        kind = ARMED_HOME;
+        break;
+    case CrestronFrame::SCREEN_ARMED_FULL:
+        kind = ARMED_AWAY;
+        break;
+    case CrestronFrame::QUESTION_ARM:
+        kind = MODE_AWAY;
+        break;
+    case CrestronFrame::QUESTION_PART_ARM:
+    case CrestronFrame::QUESTION_NIGHT_ARM:
+        kind = MODE_HOME;
+        break;
+    default:
+        return;
+    }
+
+    // Repeating an event never changes anything, the keypad screens repeat a lot
+    if (!chunk->alarms.empty() && chunk->alarms.back().kind == kind)
+        return;
+    chunk->alarms.push_back({t, kind});
+}
+
+static void scanLine(Chunk *chunk, const char *line, const char *end)
+{
+    if (end > line && end[-1] == '\r')
+        end--;
+
+    if (options.match != NULL && memmem(line, end - line, options.match, options.matchLength) == NULL)
+        return;
+
+    chunk->lines++;
+
+    // A frame runs from its " to the end of the line and has no other "
+    const char *quote = (const char *)memchr(line, '"', end - line);
+    bool isFrame = quote != NULL && memchr(quote + 1, '"', end - quote - 1) == NULL;
+
+    // The firmware logs an unknown frame twice, once on its own
+    static const char unknownPrefix[] = "command - ";
+    if (isFrame && quote - line >= (ptrdiff_t)sizeof(unknownPrefix) - 1 &&
+        memcmp(quote - sizeof(unknownPrefix) + 1, unknownPrefix, sizeof(unknownPrefix) - 1) == 0)
+        return;
+
+    uint64_t repeats = 0;
+    if (!isFrame)
+    {
+        static const char repeated[] = "last message repeated ";
+        const char *notice = (const char *)memmem(line, end - line, repeated, sizeof(repeated) - 1);
+        if (notice != NULL)
+            repeats = strtoull(notice + sizeof(repeated) - 1, NULL, 10);
+    }
+
+    if (repeats > 0)
+    {
+        chunk->repeats += repeats;
+        if (chunk->tail == TAIL_INHERIT)
+            chunk->leadingRepeats += repeats;
+        else if (chunk->tail == TAIL_FRAME)
+            countFrame(chunk, chunk->tailFrame, repeats);
+        return;
+    }
+
+    if (!isFrame)
+    {
+        chunk->tail = TAIL_OTHER;
+        return;
+    }
+
+    int64_t t = parseTime(line, quote);
+    if (t >= 0)
+    {
+        if (chunk->firstTime < 0)
+            chunk->firstTime = t;
+        chunk->lastTime = t;
+    }
+    else
+    {
+        // Untimed lines between timed ones belong with the last time seen
+        t = chunk->lastTime;
+        if (t < 0)
+            chunk->undated++;
+    }
+
+    CrestronFrame::FRAME frame = CrestronFrame::parse(quote, end - quote);
+    countFrame(chunk, frame, 1);
+    chunk->tail = TAIL_FRAME;
+    chunk->tailFrame = frame;
+
+    if (frame.type == CrestronFrame::ZONE_UPDATE)
+        zoneFrame(chunk, frame, t);
+    else
+        alarmFrame(chunk, frame, t);
+}
+
+static void scanChunk(Chunk *chunk)
+{
+    chunk->zones.assign(MAX_ZONES, ZONE_STATS{});
+
+    const char *line = chunk->begin;
+    while (line < chunk->end)
+    {
+        const char *newline = (const char *)memchr(line, '\n', chunk->end - line);
+        const char *end = newline != NULL ? newline : chunk->end;
+        scanLine(chunk, line, end);
+        line = end + 1;
+    }
+}
+
+// Everything folded together so far
+class Totals {
+public:
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+    uint64_t frames = 0;
+    uint64_t repeats = 0;
+    uint64_t undated = 0;
+    uint64_t types[CrestronFrame::TYPE_COUNT] = {0};
+    ZONE_STATS zones[MAX_ZONES] = {};
+    int64_t firstTime = -1;
+    int64_t lastTime = -1;
+
+    TAIL tail = TAIL_OTHER;
+    CrestronFrame::FRAME tailFrame = {};
+
+    int alarmState = -1;            // Unknown until a frame says
+    int armMode = ARMED_AWAY;       // Texecom::frameArmMode starts the same
+    int64_t alarmSince = -1;
+    uint64_t alarmEntered[ALARM_STATES] = {0};
+    int64_t alarmSeconds[ALARM_STATES] = {0};
+
+    std::map<int64_t, COUNTS> buckets;
+    FILE *changesFile = NULL;
+    FILE *alarmsFile = NULL;
+
+    void fold(Chunk *chunk);
+    void finish();
+
+private:
+    void foldZone(uint16_t index, const ZONE_STATS &next);
+    void alarmEvent(const ALARM_EVENT &event);
+};
+
+void Totals::fold(Chunk *chunk)
+{
+    // Repeats at the start of the chunk belong to the line before it
+    if (chunk->leadingRepeats > 0 && tail == TAIL_FRAME)
+    {
+        frames += chunk->leadingRepeats;
+        types[tailFrame.type] += chunk->leadingRepeats;
+        if (tailFrame.type == CrestronFrame::ZONE_UPDATE && tailFrame.zone < MAX_ZONES)
+            zones[tailFrame.zone].frames[tailFrame.zoneState < 3 ? tailFrame.zoneState : 3] += chunk->leadingRepeats;
+    }
+    if (chunk->tail != TAIL_INHERIT)
+    {
+        tail = chunk->tail;
+        tailFrame = chunk->tailFrame;
+    }
+
+    lines += chunk->lines;
+    frames += chunk->frames;
+    repeats += chunk->repeats;
+    undated += chunk->undated;
+    for (int i = 0; i < CrestronFrame::TYPE_COUNT; i++)
+        types[i] += chunk->types[i];
+
+    if (firstTime < 0)
+        firstTime = chunk->firstTime;
+    if (chunk->lastTime >= 0)
+        lastTime = chunk->lastTime;
+
+    // Changes first, the zones still hold the state before this chunk
+    if (changesFile != NULL)
+    {
+        for (const ZONE_CHANGE &change : chunk->changes)
+        {
+            const ZONE_STATS &zone = zones[change.zone];
+            if (change.first && zone.seen && zone.lastFlags == change.flags)
+                continue;
+
+            char at[32];
+            formatTime(change.at, at, sizeof(at));
+            fprintf(changesFile, "%s,%u,%s\n", at, change.zone, zoneStateNames[change.flags]);
+        }
+    }
+
+    for (uint16_t i = 0; i < MAX_ZONES; i++)
+        foldZone(i, chunk->zones[i]);
+
+    for (const ALARM_EVENT &event : chunk->alarms)
+        alarmEvent(event);
+
+    for (const auto &bucket : chunk->buckets)
+    {
+        COUNTS &counts = buckets[bucket.first];
+        for (int i = 0; i < 4; i++)
+            counts[i] += bucket.second[i];
+    }
+}
+
+void Totals::foldZone(uint16_t index, const ZONE_STATS &next)
+{
+    ZONE_STATS *zone = &zones[index];
+
+    for (int i = 0; i < 4; i++)
+        zone->frames[i] += next.frames[i];
+
+    if (!next.seen)
+        return;
+
+    if (!zone->seen)
+    {
+        uint64_t frames[4];
+        memcpy(frames, zone->frames, sizeof(frames));
+        *zone = next;
+        memcpy(zone->frames, frames, sizeof(frames));
+        return;
+    }
+
+    // The state before the chunk held until its first report, which only
+    // counts as entering a state if it differs
+    if (next.firstAt >= 0 && zone->accountedTo >= 0)
+        zone->seconds[zone->lastFlags] += elapsed(zone->accountedTo, next.firstAt);
+    if (next.firstFlags == zone->lastFlags)
+        zone->entered[next.firstFlags]--;
+
+    for (int i = 0; i < 4; i++)
+    {
+        zone->entered[i] += next.entered[i];
+        zone->seconds[i] += next.seconds[i];
+    }
+    zone->lastFlags = next.lastFlags;
+    if (next.accountedTo >= 0)
+        zone->accountedTo = next.accountedTo;
+}
+
+// Follows Texecom::processCrestronMessage and updateFrameAlarmState
+void Totals::alarmEvent(const ALARM_EVENT &event)
+{
+    int state = event.kind;
+
+    if (event.kind == MODE_AWAY || event.kind == MODE_HOME)
+    {
+        armMode = event.kind == MODE_AWAY ? ARMED_AWAY : ARMED_HOME;
+        return;
+    }
+    if (event.kind == ARM)
+    {
+        if (alarmState == ARMED_AWAY || alarmState == ARMED_HOME)
+            return;
+        state = armMode;
+    }
+    if (state == alarmState)
+        return;
+
+    if (alarmState >= 0 && event.at >= 0 && alarmSince >= 0)
+        alarmSeconds[alarmState] += elapsed(alarmSince, event.at);
+    alarmState = state;
+    alarmSince = event.at;
+    alarmEntered[state]++;
+
+    if (alarmsFile != NULL)
+    {
+        char at[32];
+        formatTime(event.at, at, sizeof(at));
+        fprintf(alarmsFile, "%s,%s\n", at, alarmStateNames[state]);
+    }
+}
+
+// The last states held until the end of the log
+void Totals::finish()
+{
+    if (lastTime < 0)
+        return;
+
+    for (ZONE_STATS &zone : zones)
+    {
+        if (zone.seen && zone.accountedTo >= 0)
+            zone.seconds[zone.lastFlags] += elapsed(zone.accountedTo, lastTime);
+    }
+
+    if (alarmState >= 0 && alarmSince >= 0)
+        alarmSeconds[alarmState] += elapsed(alarmSince, lastTime);
+}
+
+static void formatDuration(bool dated, int64_t seconds, char *text, size_t size)
+{
+    if (dated)
+        snprintf(text, size, "%.1fh", seconds / 3600.0);
+    else
+        snprintf(text, size, "-");
+}
+
+static void report(const Totals &totals, size_t files, double elapsed, unsigned threads)
+{
+    bool dated = totals.lastTime >= 0;
+    char first[32], last[32];
+    formatTime(totals.firstTime, first, sizeof(first));
+    formatTime(totals.lastTime, last, sizeof(last));
+
+    printf("%zu files, %.2f GB, %llu lines in %.2fs, %.2f GB/s on %u threads\n", files, totals.bytes / 1e9,
+           (unsigned long long)totals.lines, elapsed, totals.bytes / 1e9 / elapsed, threads);
+    printf("%llu frames, %llu unknown, %llu folded repeats, %llu undated\n", (unsigned long long)totals.frames,
+           (unsigned long long)totals.types[CrestronFrame::UNKNOWN], (unsigned long long)totals.repeats,
+           (unsigned long long)totals.undated);
+    printf("%s to %s\n\n", first, last);
+
+    printf("%-20s %14s\n", "frame", "count");
+    for (int i = 0; i < CrestronFrame::TYPE_COUNT; i++)
+    {
+        if (totals.types[i] > 0)
+            printf("%-20s %14llu\n", typeNames[i], (unsigned long long)totals.types[i]);
+    }
+
+    printf("\n%4s %12s %12s %12s %12s %8s %12s %10s %12s %12s\n", "zone", "frames", "healthy", "active", "tamper",
+           "other", "activations", "tampers", "active_time", "tamper_time");
+    for (int i = 0; i < MAX_ZONES; i++)
+    {
+        const ZONE_STATS &zone = totals.zones[i];
+        uint64_t frames = zone.frames[0] + zone.frames[1] + zone.frames[2] + zone.frames[3];
+        if (frames == 0 || (options.zone >= 0 && i != options.zone))
+            continue;
+
+        char active[16], tamper[16];
+        formatDuration(dated, zone.seconds[CrestronFrame::ZONE_ACTIVE], active, sizeof(active));
+        formatDuration(dated, zone.seconds[CrestronFrame::ZONE_TAMPER], tamper, sizeof(tamper));
+        printf("%4d %12llu %12llu %12llu %12llu %8llu %12llu %10llu %12s %12s\n", i, (unsigned long long)frames,
+               (unsigned long long)zone.frames[0], (unsigned long long)zone.frames[1],
+               (unsigned long long)zone.frames[2], (unsigned long long)zone.frames[3],
+               (unsigned long long)zone.entered[CrestronFrame::ZONE_ACTIVE],
+               (unsigned long long)zone.entered[CrestronFrame::ZONE_TAMPER], active, tamper);
+    }
+
+    printf("\n%-12s %10s %12s\n", "alarm", "entered", "time");
+    for (int i = 0; i < ALARM_STATES; i++)
+    {
+        char time[16];
+        formatDuration(dated, totals.alarmSeconds[i], time, sizeof(time));
+        printf("%-12s %10llu %12s\n", alarmStateNames[i], (unsigned long long)totals.alarmEntered[i], time);
+    }
+}
+
+static void writeTimeline(const Totals &totals, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    fprintf(file, "time,zone,healthy,active,tamper\n");
+    for (const auto &bucket : totals.buckets)
+    {
+        char at[32];
+        formatTime(bucket.first / MAX_ZONES, at, sizeof(at));
+        fprintf(file, "%s,%lld,%llu,%llu,%llu\n", at, (long long)(bucket.first % MAX_ZONES),
+                (unsigned long long)bucket.second[0], (unsigned long long)bucket.second[1],
+                (unsigned long long)bucket.second[2]);
+    }
+    fclose(file);
+}
+
+static FILE *openCsv(const char *path, const char *header)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fprintf(file, "%s\n", header);
+    return file;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: logscan [options] FILE...\n"
+        "  --match TEXT       only lines containing TEXT\n"
+        "  --zone N           only zone N\n"
+        "  --year N           year for BSD syslog timestamps (this year)\n"
+        "  --timeline FILE    per-zone frame counts by state for each bucket, CSV\n"
+        "  --bucket N         timeline bucket in seconds (3600)\n"
+        "  --changes FILE     every zone state change, CSV\n"
+        "  --alarms FILE      every alarm state change, CSV\n"
+        "  --threads N        scanning threads (all cores)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *timelinePath = NULL;
+    const char *changesPath = NULL;
+    const char *alarmsPath = NULL;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    options.year = tm.tm_year + 1900;
+
+    static const struct option longOptions[] = {
+        {"match", required_argument, NULL, 'm'},
+        {"zone", required_argument, NULL, 'z'},
+        {"year", required_argument, NULL, 'y'},
+        {"timeline", required_argument, NULL, 't'},
+        {"bucket", required_argument, NULL, 'b'},
+        {"changes", required_argument, NULL, 'c'},
+        {"alarms", required_argument, NULL, 'a'},
+        {"threads", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "m:z:y:t:b:c:a:j:", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'm':
+            options.match = optarg;
+            options.matchLength = strlen(optarg);
+            break;
+        case 'z':
+            options.zone = atoi(optarg);
+            if (options.zone < 0 || options.zone >= MAX_ZONES)
+                usage();
+            break;
+        case 'y':
+            options.year = atoi(optarg);
+            break;
+        case 't':
+            timelinePath = optarg;
+            options.timeline = true;
+            break;
+        case 'b':
+            options.bucket = atoll(optarg);
+            if (options.bucket < 1)
+                usage();
+            break;
+        case 'c':
+            changesPath = optarg;
+            options.changes = true;
+            break;
+        case 'a':
+            alarmsPath = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind >= argc)
+        usage();
+
+    Totals totals;
+    std::vector<std::unique_ptr<Chunk>> chunks;
+
+    for (int i = optind; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+
+        size_t size = st.st_size;
+        totals.bytes += size;
+        if (size == 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        // Left mapped until exit
+        const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+
+        // Enough chunks per thread to even out, cut after a newline
+        size_t chunkSize = std::min<size_t>(std::max<size_t>(size / (threads * 8), MIN_CHUNK), MAX_CHUNK);
+        const char *end = data + size;
+        for (const char *begin = data; begin < end;)
+        {
+            const char *cut = begin + std::min<size_t>(chunkSize, end - begin);
+            if (cut < end)
+            {
+                const char *newline = (const char *)memchr(cut, '\n', end - cut);
+                cut = newline != NULL ? newline + 1 : end;
+            }
+
+            chunks.emplace_back(new Chunk());
+            chunks.back()->begin = begin;
+            chunks.back()->end = cut;
+            begin = cut;
+        }
+    }
+
+    if (changesPath != NULL)
+        totals.changesFile = openCsv(changesPath, "time,zone,state");
+    if (alarmsPath != NULL)
+        totals.alarmsFile = openCsv(alarmsPath, "time,state");
+
+    auto started = std::chrono::steady_clock::now();
+
+    // Chunks are handed out in order and folded in order as they finish, so
+    // only the few being scanned are held at once
+    std::atomic<size_t> nextChunk(0);
+    std::mutex doneMutex;
+    std::condition_variable doneChanged;
+    std::vector<std::thread> workers;
+
+    threads = std::min<size_t>(threads, std::max<size_t>(chunks.size(), 1));
+    for (unsigned i = 0; i < threads; i++)
+    {
+        workers.emplace_back([&]() {
+            size_t index;
+            while ((index = nextChunk++) < chunks.size())
+            {
+                Chunk *chunk = chunks[index].get();
+                scanChunk(chunk);
+
+                std::lock_guard<std::mutex> lock(doneMutex);
+                chunk->done = true;
+                doneChanged.notify_all();
+            }
+        });
+    }
+
+    for (std::unique_ptr<Chunk> &chunk : chunks)
+    {
+        {
+            std::unique_lock<std::mutex> lock(doneMutex);
+            doneChanged.wait(lock, [&]() { return chunk->done; });
+        }
+        totals.fold(chunk.get());
+        chunk.reset();
+    }
+
+    for (std::thread &worker : workers)
+        worker.join();
+    totals.finish();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    if (totals.changesFile != NULL)
+        fclose(totals.changesFile);
+    if (totals.alarmsFile != NULL)
+        fclose(totals.alarmsFile);
+    if (timelinePath != NULL)
+        writeTimeline(totals, timelinePath);
+
+    report(totals, argc - optind, elapsed, threads);
+    return 0;
+}
@@ -0,0 +1,986 @@
+// Copyright 2021 Kevin Cooper
+//
+// MQTT load harness that plays a fleet of TexecomMonitors against one broker.
+//
+// Every simulated device follows the firmware's publishing path: zone changes
+// as retained QoS 1 JSON on <prefix>/zone/NNN through the firmware's own
+// MqttReliablePublisher with a window of 4, the QoS 0 status, panel and zone statistics metrics on their own timers, the
+// journal, OTA and rules subscriptions on connect, the 15s keepalive and the
+// 10s retry after a failed connect. Devices boot by publishing every zone,
+// as the firmware does on the first frame from the panel.
+//
+// A separate subscriber listens to all zone topics and times each message
+// from the moment the simulated panel changed to its arrival, so the latency
+// includes time spent queued on the device. The payload carries that moment
+// so an arrival matches its change even after the publisher has replaced
+// queued ones, and the changes it replaced count as superseded, not lost. Part way through each run all
+// devices lose power together: their sockets are abandoned without a FIN, the
+// queues are lost, and they boot again after a jittered delay. Convergence is
+// the time from the cut until every device is connected with nothing left to
+// acknowledge.
+//
+// Each --devices step is a separate run, printed as one row, so the point
+// where the broker or the design stops keeping up shows as the count grows.
+//
+// MqttReliablePublisher is linked in through the host test fakes, with its
+// PubSubClient writes moved onto the socket and millis() following the real
+// clock, so the dropped and resent columns are its own counters. The rest of
+// the firmware is mirrored, keep the constants below in step with
+// StandardFeatures.h. The host test build in test/ builds it too.
+//
+// Build:
+//   g++ -std=c++17 -O2 -DESP32 -Itest/fakes -Isrc -o mqttfleet tools/mqttfleet/mqttfleet.cpp test/fakes/fakes.cpp src/Logging.cpp
+//
+// Examples:
+//   mosquitto -p 1883 &
+//   mqttfleet --devices 10,50,100,250,500 --duration 60 --rate 0.5
+//   mqttfleet --host 192.168.0.1 --username u --password p --devices 200 --powercut 0
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "MqttReliablePublisher.h"
+
+// Mirrors of the firmware's constants
+static const uint8_t window = 4;                // StandardFeatures _mqttInflightWindow
+static const uint64_t reconnectInterval = 10000; // mqttReconnectInterval
+static const uint64_t connectTimeout = 15000;   // PubSubClient socket timeout
+static const uint16_t keepAlive = 15;           // PubSubClient keepalive, seconds
+static const uint64_t statusInterval = 30000;   // metricsInterval
+static const uint64_t panelMetricsInterval = 60000;
+static const uint64_t zoneStatisticsInterval = 300000;
+static const uint64_t zoneHoldOff = 2000;       // mainPanel.zoneHoldOff
+static const int zoneCount = 11;
+static const int firstZone = 9;
+
+typedef struct {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1883;
+    const char *username = NULL;
+    const char *password = NULL;
+    std::vector<int> steps = {10};
+    double duration = 60;       // Seconds per step
+    double powercut = -1;       // Seconds into the step, negative for half way, 0 for none
+    double rate = 0.5;          // Zone changes per device per second
+    uint64_t bootMs = 3000;     // Boot and WiFi association before the first connect
+    uint64_t bootJitterMs = 2000;
+} OPTIONS;
+
+static OPTIONS options;
+
+static uint64_t nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t nowMs() { return nowUs() / 1000; }
+
+// Moves the fakes' clock, behind the publisher's millis(), up to the real one
+static void syncClock() { fakeTime = nowUs(); }
+
+// MQTT 3.1.1 encoding, only what the firmware uses
+
+static void putLength(std::vector<uint8_t> &packet, size_t length)
+{
+    do
+    {
+        uint8_t byte = length % 128;
+        length /= 128;
+        if (length > 0)
+            byte |= 128;
+        packet.push_back(byte);
+    } while (length > 0);
+}
+
+static void putString(std::vector<uint8_t> &body, const std::string &text)
+{
+    body.push_back(text.size() >> 8);
+    body.push_back(text.size() & 0xFF);
+    body.insert(body.end(), text.begin(), text.end());
+}
+
+static std::vector<uint8_t> makePacket(uint8_t header, const std::vector<uint8_t> &body)
+{
+    std::vector<uint8_t> packet = {header};
+    putLength(packet, body.size());
+    packet.insert(packet.end(), body.begin(), body.end());
+    return packet;
+}
+
+static std::vector<uint8_t> connectPacket(const std::string &clientId)
+{
+    std::vector<uint8_t> body;
+    putString(body, "MQTT");
+    body.push_back(4);
+    uint8_t flags = 0x02;   // Clean session, as PubSubClient
+    if (options.username != NULL)
+        flags |= 0x80;
+    if (options.password != NULL)
+        flags |= 0x40;
+    body.push_back(flags);
+    body.push_back(keepAlive >> 8);
+    body.push_back(keepAlive & 0xFF);
+    putString(body, clientId);
+    if (options.username != NULL)
+        putString(body, options.username);
+    if (options.password != NULL)
+        putString(body, options.password);
+    return makePacket(0x10, body);
+}
+
+static std::vector<uint8_t> publishPacket(const std::string &topic, const std::string &payload,
+                                          bool qos1, bool retained, uint16_t packetId)
+{
+    std::vector<uint8_t> body;
+    putString(body, topic);
+    if (qos1)
+    {
+        body.push_back(packetId >> 8);
+        body.push_back(packetId & 0xFF);
+    }
+    body.insert(body.end(), payload.begin(), payload.end());
+    return makePacket(0x30 | (qos1 ? 0x02 : 0) | (retained ? 0x01 : 0), body);
+}
+
+static std::vector<uint8_t> subscribePacket(uint16_t packetId, const std::string &topic)
+{
+    std::vector<uint8_t> body = {(uint8_t)(packetId >> 8), (uint8_t)(packetId & 0xFF)};
+    putString(body, topic);
+    body.push_back(0);
+    return makePacket(0x82, body);
+}
+
+// Takes one complete packet off the front of buffer, false if there isn't one yet
+static bool takePacket(std::vector<uint8_t> &buffer, uint8_t *header, std::vector<uint8_t> *body)
+{
+    size_t length = 0;
+    size_t position = 1;
+    int shift = 0;
+
+    while (true)
+    {
+        if (position >= buffer.size() || position > 4)
+            return false;
+        uint8_t byte = buffer[position++];
+        length |= (size_t)(byte & 127) << shift;
+        shift += 7;
+        if ((byte & 128) == 0)
+            break;
+    }
+
+    if (buffer.size() < position + length)
+        return false;
+
+    *header = buffer[0];
+    body->assign(buffer.begin() + position, buffer.begin() + position + length);
+    buffer.erase(buffer.begin(), buffer.begin() + position + length);
+    return true;
+}
+
+// A non-blocking broker connection with its own output buffer
+
+typedef enum {
+    CONN_DOWN = 0,
+    CONN_TCP = 1,       // Waiting for the TCP connect
+    CONN_CONNACK = 2,   // CONNECT sent
+    CONN_UP = 3,
+} CONN_STATE;
+
+typedef struct {
+    int fd = -1;
+    CONN_STATE state = CONN_DOWN;
+    std::vector<uint8_t> in;
+    std::vector<uint8_t> out;
+    uint64_t startedAt = 0;
+    uint64_t lastSentAt = 0;
+} CONNECTION;
+
+static bool startConnect(CONNECTION *connection)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host, &address.sin_addr);
+
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return false;
+    }
+
+    connection->fd = fd;
+    connection->state = CONN_TCP;
+    connection->in.clear();
+    connection->out.clear();
+    connection->startedAt = nowMs();
+    return true;
+}
+
+static bool flushOut(CONNECTION *connection)
+{
+    while (!connection->out.empty())
+    {
+        ssize_t sent = send(connection->fd, connection->out.data(), connection->out.size(), MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        connection->out.erase(connection->out.begin(), connection->out.begin() + sent);
+    }
+    return true;
+}
+
+static bool writePacket(CONNECTION *connection, const std::vector<uint8_t> &packet)
+{
+    connection->out.insert(connection->out.end(), packet.begin(), packet.end());
+    connection->lastSentAt = nowMs();
+    return flushOut(connection);
+}
+
+// Reads whatever is waiting, false once the connection has gone
+static bool readIn(CONNECTION *connection)
+{
+    uint8_t buffer[4096];
+    while (true)
+    {
+        ssize_t received = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (received > 0)
+        {
+            connection->in.insert(connection->in.end(), buffer, buffer + received);
+            continue;
+        }
+        if (received == 0)
+            return false;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+static void closeConnection(CONNECTION *connection)
+{
+    if (connection->fd >= 0)
+        close(connection->fd);
+    connection->fd = -1;
+    connection->state = CONN_DOWN;
+}
+
+// Results for one step
+
+typedef struct {
+    std::vector<uint32_t> latencyUs;
+    uint64_t queued = 0;
+    uint64_t acked = 0;
+    uint64_t dropped = 0;       // MqttReliablePublisher::dropped()
+    uint64_t retransmits = 0;   // MqttReliablePublisher::retransmits()
+    uint64_t superseded = 0;    // Changes a later one on the same zone overtook
+    uint64_t metrics = 0;
+    uint64_t bytes = 0;
+    uint64_t connects = 0;
+    uint64_t connectFailures = 0;
+    uint64_t unmatched = 0;     // Deliveries with no change waiting, e.g. duplicates
+    int64_t convergenceMs = -1;
+} RESULTS;
+
+static RESULTS results;
+
+// When each change still on its way to the subscriber was made, by topic
+static std::map<std::string, std::deque<uint64_t>> inTransit;
+
+class Device {
+public:
+    Device(int index, std::mt19937 &random) : random(random)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "fleet%04d", index);
+        this->name = name;
+        prefix = std::string("loadtest/") + name;
+        powerOn(nowMs());
+    }
+
+    ~Device() { collect(); }
+
+    void powerOn(uint64_t now)
+    {
+        // The queue is in RAM, a new publisher is what the device boots with
+        collect();
+        publisher.reset(new MqttReliablePublisher());
+        publisher->addClient(&client);
+        publisher->setWindow(window);
+        client.up = false;
+        client.written.clear();
+
+        zones.assign(zoneCount, 0);
+        zonePublishedAt.assign(zoneCount, 0);
+        std::uniform_int_distribution<uint64_t> jitter(0, options.bootJitterMs);
+        bootAt = now + options.bootMs + jitter(random);
+        reconnectAt = bootAt;
+        bootPublishPending = true;
+        nextStatus = bootAt + statusInterval;
+        nextPanelMetrics = bootAt + panelMetricsInterval;
+        nextZoneStatistics = bootAt + zoneStatisticsInterval;
+        scheduleZoneChange(bootAt);
+    }
+
+    // Abandons the socket without closing it, as the power going would
+    void powerCut(std::vector<int> *abandoned)
+    {
+        if (connection.fd >= 0)
+            abandoned->push_back(connection.fd);
+        connection.fd = -1;
+        connection.state = CONN_DOWN;
+        client.up = false;
+        powerOn(nowMs());
+    }
+
+    bool converged() { return connection.state == CONN_UP && publisher->queued() == 0 && !bootPublishPending; }
+
+    void shutdown()
+    {
+        if (connection.state == CONN_UP)
+        {
+            writePacket(&connection, {0xE0, 0x00});
+        }
+        closeConnection(&connection);
+    }
+
+    short pollEvents()
+    {
+        if (connection.fd < 0)
+            return 0;
+        if (connection.state == CONN_TCP || !connection.out.empty())
+            return POLLIN | POLLOUT;
+        return POLLIN;
+    }
+
+    int fd() { return connection.fd; }
+
+    void onPoll(short revents, uint64_t now)
+    {
+        if (revents & (POLLERR | POLLHUP))
+        {
+            dropped(now);
+            return;
+        }
+
+        if (connection.state == CONN_TCP && (revents & POLLOUT))
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0)
+            {
+                dropped(now);
+                return;
+            }
+            connection.state = CONN_CONNACK;
+            writePacket(&connection, connectPacket(name));
+        }
+
+        if ((revents & POLLOUT) && !flushOut(&connection))
+        {
+            dropped(now);
+            return;
+        }
+
+        if ((revents & POLLIN) && !readIn(&connection))
+        {
+            dropped(now);
+            return;
+        }
+
+        uint8_t header;
+        std::vector<uint8_t> body;
+        while (connection.fd >= 0 && takePacket(connection.in, &header, &body))
+            handlePacket(header, body, now);
+    }
+
+    void tick(uint64_t now)
+    {
+        if (connection.state == CONN_DOWN && now >= reconnectAt && now >= bootAt)
+        {
+            results.connects++;
+            if (!startConnect(&connection))
+                failed(now);
+        }
+        else if ((connection.state == CONN_TCP || connection.state == CONN_CONNACK) &&
+                 now - connection.startedAt >= connectTimeout)
+        {
+            failed(now);
+        }
+
+        if (now < bootAt)
+            return;
+
+        // The panel keeps going whether or not MQTT is up
+        if (bootPublishPending)
+        {
+            bootPublishPending = false;
+            for (int i = 0; i < zoneCount; i++)
+                publishZone(i, now);
+        }
+
+        while (now >= nextZoneChange)
+        {
+            int zone = std::uniform_int_distribution<int>(0, zoneCount - 1)(random);
+            // Changes inside the hold-off only move the trailing edge, call it one event
+            if (now - zonePublishedAt[zone] >= zoneHoldOff)
+            {
+                zones[zone] ^= 1;
+                publishZone(zone, now);
+            }
+            scheduleZoneChange(nextZoneChange);
+        }
+
+        if (connection.state != CONN_UP)
+            return;
+
+        if (now >= nextStatus)
+        {
+            nextStatus += statusInterval;
+            publishMetric("telegraf/particle", statusLine(now));
+        }
+        if (now >= nextPanelMetrics)
+        {
+            nextPanelMetrics += panelMetricsInterval;
+            publishMetric("telegraf/particle", panelLines());
+        }
+        if (now >= nextZoneStatistics)
+        {
+            nextZoneStatistics += zoneStatisticsInterval;
+            publishMetric(prefix + "/statistics/zones", zoneStatistics());
+        }
+
+        publisher->loop();
+        drain();
+
+        if (now - connection.lastSentAt >= keepAlive * 1000ULL)
+            writePacket(&connection, {0xC0, 0x00});
+    }
+
+private:
+    std::mt19937 &random;
+    std::string name;
+    std::string prefix;
+    CONNECTION connection;
+    PubSubClient client;    // Only collects what the publisher writes, see drain()
+    std::unique_ptr<MqttReliablePublisher> publisher;
+    std::vector<uint8_t> zones;
+    std::vector<uint64_t> zonePublishedAt;
+    bool bootPublishPending = false;
+    uint64_t bootAt = 0;
+    uint64_t reconnectAt = 0;
+    uint64_t nextZoneChange = 0;
+    uint64_t nextStatus = 0;
+    uint64_t nextPanelMetrics = 0;
+    uint64_t nextZoneStatistics = 0;
+
+    void scheduleZoneChange(uint64_t from)
+    {
+        if (options.rate <= 0)
+        {
+            nextZoneChange = UINT64_MAX;
+            return;
+        }
+        std::exponential_distribution<double> gap(options.rate);
+        nextZoneChange = from + 1 + (uint64_t)(gap(random) * 1000);
+    }
+
+    void failed(uint64_t now)
+    {
+        results.connectFailures++;
+        closeConnection(&connection);
+        client.up = false;
+        reconnectAt = now + reconnectInterval;
+    }
+
+    // Adds the counters of the publisher about to be lost to the results
+    void collect()
+    {
+        if (publisher)
+        {
+            results.dropped += publisher->dropped();
+            results.retransmits += publisher->retransmits();
+        }
+    }
+
+    // Moves what the publisher wrote to its PubSubClient onto the socket
+    void drain()
+    {
+        if (client.written.empty())
+            return;
+        results.bytes += client.written.size();
+        writePacket(&connection, client.written);
+        client.written.clear();
+    }
+
+    // A drop on an established connection is retried straight away
+    void dropped(uint64_t now)
+    {
+        if (connection.state != CONN_UP)
+        {
+            failed(now);
+            return;
+        }
+        closeConnection(&connection);
+        client.up = false;
+        reconnectAt = now;
+    }
+
+    void handlePacket(uint8_t header, const std::vector<uint8_t> &body, uint64_t now)
+    {
+        switch (header >> 4)
+        {
+        case 2:     // CONNACK
+            if (body.size() < 2 || body[1] != 0)
+            {
+                failed(now);
+                return;
+            }
+            connection.state = CONN_UP;
+            client.up = true;
+            writePacket(&connection, subscribePacket(1, "home/security/journal/request"));
+            writePacket(&connection, subscribePacket(2, "ota/" + name + "/pull"));
+            writePacket(&connection, subscribePacket(3, prefix + "/rules"));
+
+            // Clean session, so everything unacknowledged goes again
+            publisher->onConnect(0);
+            drain();
+            break;
+
+        case 4:     // PUBACK
+            if (body.size() >= 2)
+            {
+                // Only an acknowledgement of something in flight frees a slot
+                uint8_t inFlight = publisher->inFlight(0);
+                publisher->onPubAck(0, (body[0] << 8) | body[1]);
+                if (publisher->inFlight(0) < inFlight)
+                    results.acked++;
+                publisher->loop();
+                drain();
+            }
+            break;
+
+        default:    // SUBACK, PINGRESP and anything retained on our topics
+            break;
+        }
+    }
+
+    void publishZone(int zone, uint64_t now)
+    {
+        char topic[64];
+        snprintf(topic, sizeof(topic), "%s/zone/%03d", prefix.c_str(), firstZone + zone);
+        uint64_t changedAt = nowUs();
+        char payload[96];
+        snprintf(payload, sizeof(payload), "{\"active\":%d,\"tamper\":0,\"fault\":0,\"alarmed\":0,\"at\":%llu}",
+                 zones[zone], (unsigned long long)changedAt);
+        zonePublishedAt[zone] = now;
+
+        results.queued++;
+        inTransit[topic].push_back(changedAt);
+        publisher->publish(topic, (const uint8_t *)payload, strlen(payload), true);
+        drain();
+    }
+
+    void publishMetric(const std::string &topic, const std::string &payload)
+    {
+        std::vector<uint8_t> packet = publishPacket(topic, payload, false, false, 0);
+        results.metrics++;
+        results.bytes += packet.size();
+        writePacket(&connection, packet);
+    }
+
+    std::string statusLine(uint64_t now)
+    {
+        char line[400];
+        snprintf(line, sizeof(line),
+            "status,device=%s uptime=%lu,resetReason=1,firmware=\"v5.1.4\",appVersion=\"loadtest\",memUsed=120000,memTotal=320000,"
+            "qos1Queued=%u,qos1Retransmits=%u,qos1Dropped=%u,tcpSegments=0,bytesPerSegment=0",
+            name.c_str(), (unsigned long)(now / 1000), publisher->queued(), publisher->retransmits(), publisher->dropped());
+        return line;
+    }
+
+    std::string panelLines()
+    {
+        std::string lines;
+        char line[200];
+        snprintf(line, sizeof(line),
+            "panel,device=%s,panel=0 frameStateUpdates=0,stateDisagreements=0,frameLeadMs=0,bridgeClients=0,bridgeDroppedBytes=0\n",
+            name.c_str());
+        lines += line;
+        for (int i = 0; i < zoneCount; i++)
+        {
+            snprintf(line, sizeof(line), "zone,device=%s,panel=0,zone=%03d suppressed=0\n", name.c_str(), firstZone + i);
+            lines += line;
+        }
+        return lines;
+    }
+
+    // About the size ZoneStatistics::write() produces
+    std::string zoneStatistics()
+    {
+        std::string json = "{\"zones\":{";
+        for (int i = 0; i < zoneCount; i++)
+        {
+            char zone[320];
+            snprintf(zone, sizeof(zone),
+                "%s\"%03d\":{\"activations\":0,\"activeMs\":0,\"longestMs\":0,\"tampers\":0,"
+                "\"byHour\":[0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]}",
+                i > 0 ? "," : "", firstZone + i);
+            json += zone;
+        }
+        return json + "}}";
+    }
+};
+
+// Listens to every device's zone topics and matches arrivals to changes
+
+class Subscriber {
+public:
+    bool begin()
+    {
+        if (!startConnect(&connection))
+            return false;
+
+        uint64_t deadline = nowMs() + 5000;
+        while (nowMs() < deadline)
+        {
+            pollOnce(100);
+            if (subscribed)
+            {
+                // Let anything retained from an earlier run arrive and be ignored
+                uint64_t settle = nowMs() + 500;
+                while (nowMs() < settle)
+                    pollOnce(50);
+                draining = false;
+                return true;
+            }
+            if (connection.state == CONN_DOWN)
+                return false;
+        }
+        return false;
+    }
+
+    void pollOnce(int timeout)
+    {
+        pollfd p = {connection.fd, pollEvents(), 0};
+        if (poll(&p, 1, timeout) > 0)
+            onPoll(p.revents);
+    }
+
+    short pollEvents()
+    {
+        if (connection.state == CONN_TCP || !connection.out.empty())
+            return POLLIN | POLLOUT;
+        return POLLIN;
+    }
+
+    int fd() { return connection.fd; }
+
+    void onPoll(short revents)
+    {
+        if (revents & (POLLERR | POLLHUP))
+        {
+            fprintf(stderr, "subscriber lost its connection\n");
+            exit(1);
+        }
+
+        if (connection.state == CONN_TCP && (revents & POLLOUT))
+        {
+            connection.state = CONN_CONNACK;
+            writePacket(&connection, connectPacket("fleet-subscriber"));
+        }
+
+        if (revents & POLLOUT)
+            flushOut(&connection);
+
+        if ((revents & POLLIN) && !readIn(&connection))
+        {
+            fprintf(stderr, "subscriber lost its connection\n");
+            exit(1);
+        }
+
+        uint8_t header;
+        std::vector<uint8_t> body;
+        while (takePacket(connection.in, &header, &body))
+        {
+            switch (header >> 4)
+            {
+            case 2:
+                if (body.size() < 2 || body[1] != 0)
+                {
+                    fprintf(stderr, "subscriber refused by broker: %d\n", body.size() >= 2 ? body[1] : -1);
+                    exit(1);
+                }
+                connection.state = CONN_UP;
+                writePacket(&connection, subscribePacket(1, "loadtest/+/zone/+"));
+                break;
+
+            case 3:
+                onPublish(body);
+                break;
+
+            case 9:
+                subscribed = true;
+                break;
+            }
+        }
+    }
+
+    void tick(uint64_t now)
+    {
+        if (connection.state == CONN_UP && now - connection.lastSentAt >= keepAlive * 1000ULL)
+            writePacket(&connection, {0xC0, 0x00});
+    }
+
+private:
+    CONNECTION connection;
+    bool subscribed = false;
+    bool draining = true;
+
+    void onPublish(const std::vector<uint8_t> &body)
+    {
+        if (draining || body.size() < 2)
+            return;
+
+        size_t topicLength = (body[0] << 8) | body[1];
+        if (body.size() < 2 + topicLength)
+            return;
+        std::string topic(body.begin() + 2, body.begin() + 2 + topicLength);
+
+        std::string payload(body.begin() + 2 + topicLength, body.end());
+        size_t at = payload.find("\"at\":");
+        auto waiting = inTransit.find(topic);
+        if (at == std::string::npos || waiting == inTransit.end())
+        {
+            results.unmatched++;
+            return;
+        }
+
+        // Delivery is in order, so changes before this one that are still
+        // waiting were replaced in the queue and never will arrive
+        uint64_t changedAt = strtoull(payload.c_str() + at + 5, NULL, 10);
+        std::deque<uint64_t> &changes = waiting->second;
+        auto change = std::find(changes.begin(), changes.end(), changedAt);
+        if (change == changes.end())
+        {
+            results.unmatched++;
+            return;
+        }
+
+        results.superseded += change - changes.begin();
+        results.latencyUs.push_back(nowUs() - changedAt);
+        changes.erase(changes.begin(), change + 1);
+    }
+};
+
+static double percentile(std::vector<uint32_t> &values, double fraction)
+{
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, (size_t)(fraction * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1000.0;
+}
+
+static void runStep(int deviceCount, std::mt19937 &random)
+{
+    results = RESULTS();
+    inTransit.clear();
+
+    Subscriber subscriber;
+    if (!subscriber.begin())
+    {
+        fprintf(stderr, "can't subscribe on %s:%u\n", options.host, options.port);
+        exit(1);
+    }
+
+    std::vector<Device *> devices;
+    for (int i = 0; i < deviceCount; i++)
+        devices.push_back(new Device(i, random));
+
+    uint64_t start = nowMs();
+    uint64_t end = start + (uint64_t)(options.duration * 1000);
+    double cutAfter = options.powercut < 0 ? options.duration / 2 : options.powercut;
+    uint64_t cutAt = cutAfter > 0 ? start + (uint64_t)(cutAfter * 1000) : 0;
+    bool cut = false;
+    std::vector<int> abandoned;
+    std::vector<pollfd> fds;
+
+    while (nowMs() < end)
+    {
+        syncClock();
+        uint64_t now = nowMs();
+
+        if (cutAt != 0 && !cut && now >= cutAt)
+        {
+            cut = true;
+            for (Device *device : devices)
+                device->powerCut(&abandoned);
+        }
+
+        for (Device *device : devices)
+            device->tick(now);
+        subscriber.tick(now);
+
+        if (cut && results.convergenceMs < 0 &&
+            std::all_of(devices.begin(), devices.end(), [](Device *d) { return d->converged(); }))
+            results.convergenceMs = now - cutAt;
+
+        fds.clear();
+        fds.push_back({subscriber.fd(), subscriber.pollEvents(), 0});
+        for (Device *device : devices)
+            fds.push_back({device->fd(), device->pollEvents(), 0});
+
+        if (poll(fds.data(), fds.size(), 2) <= 0)
+            continue;
+
+        syncClock();
+        now = nowMs();
+        if (fds[0].revents)
+            subscriber.onPoll(fds[0].revents);
+        for (size_t i = 0; i < devices.size(); i++)
+        {
+            if (fds[i + 1].revents && fds[i + 1].fd == devices[i]->fd())
+                devices[i]->onPoll(fds[i + 1].revents, now);
+        }
+    }
+
+    // Give the last deliveries a moment before counting what never arrived
+    uint64_t settle = nowMs() + 1000;
+    while (nowMs() < settle)
+        subscriber.pollOnce(50);
+
+    uint64_t lost = 0;
+    for (auto &waiting : inTransit)
+        lost += waiting.second.size();
+
+    for (Device *device : devices)
+    {
+        device->shutdown();
+        delete device;
+    }
+    for (int fd : abandoned)
+        close(fd);
+
+    double seconds = options.duration;
+    printf("%7d %9.1f %9lu %7lu %7lu %10lu %7lu %8.1f %8.1f %8.1f %8.1f %8lu %8lu %9.2f ",
+        deviceCount,
+        results.acked / seconds,
+        (unsigned long)results.acked,
+        (unsigned long)results.dropped,
+        (unsigned long)results.retransmits,
+        (unsigned long)results.superseded,
+        (unsigned long)lost,
+        percentile(results.latencyUs, 0.50),
+        percentile(results.latencyUs, 0.95),
+        percentile(results.latencyUs, 0.99),
+        results.latencyUs.empty() ? 0.0 : *std::max_element(results.latencyUs.begin(), results.latencyUs.end()) / 1000.0,
+        (unsigned long)results.connects,
+        (unsigned long)results.connectFailures,
+        results.bytes / seconds / 1024);
+
+    if (!cut)
+        printf("%11s\n", "-");
+    else if (results.convergenceMs < 0)
+        printf("%11s\n", "never");
+    else
+        printf("%11ld\n", (long)results.convergenceMs);
+    fflush(stdout);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: mqttfleet [--host ADDR] [--port N] [--username U] [--password P]\n"
+        "                 [--devices N[,N...]] [--duration S] [--rate CHANGES_PER_S]\n"
+        "                 [--powercut S] [--boot-ms MS] [--boot-jitter-ms MS]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOptions[] = {
+        {"host", required_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"username", required_argument, NULL, 'u'},
+        {"password", required_argument, NULL, 'P'},
+        {"devices", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"powercut", required_argument, NULL, 'c'},
+        {"boot-ms", required_argument, NULL, 'b'},
+        {"boot-jitter-ms", required_argument, NULL, 'j'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "h:p:u:P:n:d:r:c:b:j:", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = atoi(optarg); break;
+        case 'u': options.username = optarg; break;
+        case 'P': options.password = optarg; break;
+        case 'd': options.duration = atof(optarg); break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'c': options.powercut = atof(optarg); break;
+        case 'b': options.bootMs = strtoull(optarg, NULL, 10); break;
+        case 'j': options.bootJitterMs = strtoull(optarg, NULL, 10); break;
+        case 'n':
+            options.steps.clear();
+            for (char *step = strtok(optarg, ","); step != NULL; step = strtok(NULL, ","))
+                options.steps.push_back(atoi(step));
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc || options.steps.empty() || options.duration <= 0)
+        usage();
+
+    // Every device and the subscriber need a descriptor, plus the abandoned ones
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("%7s %9s %9s %7s %7s %10s %7s %8s %8s %8s %8s %8s %8s %9s %11s\n",
+        "devices", "acked/s", "acked", "dropped", "resent", "superseded", "lost",
+        "p50ms", "p95ms", "p99ms", "maxms", "connects", "failed", "KB/s", "convergeMs");
+
+    std::mt19937 random(1);
+    for (int step : options.steps)
+        runStep(step, random);
+
+    return 0;
+}
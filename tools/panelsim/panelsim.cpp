@@ -0,0 +1,649 @@
+// Copyright 2021 Kevin Cooper
+//
+// Virtual Texecom panel for load testing TexecomMonitor.
+//
+// Emits Crestron frames the way a panel does (zone updates, user logins,
+// arm/disarm notifications, keypad screen text and ASTATUS replies) at a
+// scripted rate, either on a pseudo-terminal or a real serial device at the
+// panel's 19200 8N2. The eight digi outputs can be driven through the Linux
+// GPIO character device so the firmware's pin path sees the same story.
+//
+// When --syslog is given the simulator also listens for the monitor's own
+// syslog, which logs every frame it receives, and reports how many of the
+// frames it sent came back. Running the ramp scenario that way shows how many
+// frames per second the firmware sustains before it starts losing them.
+// Syslog is UDP, so a small loss can come from the network rather than the
+// firmware; look for the knee rather than the absolute numbers. The firmware
+// rate limits its frame logging (see logAllowed() in processMessage), so
+// raise that limit before ramping past it.
+//
+// Build:
+//   g++ -std=c++17 -O2 -pthread -o panelsim tools/panelsim/panelsim.cpp
+//
+// Examples:
+//   panelsim --scenario steady --rate 20                     # prints the pty to attach to
+//   panelsim --device /dev/ttyUSB0 --scenario storm --duration 30 --syslog 514
+//   panelsim --device /dev/ttyUSB0 --scenario ramp --rate 10 --step 10 --syslog 514
+//   panelsim --device /dev/ttyUSB0 --scenario arming --gpiochip /dev/gpiochip0 --lines 5,6,13,19,26,16,20,21
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/gpio.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+// Same order as Texecom::DIGI_OUTPUT_PINS. All are active low.
+enum {
+    PIN_FULL_ARMED = 0,
+    PIN_PART_ARMED,
+    PIN_EXIT,
+    PIN_ENTRY,
+    PIN_TRIGGERED,
+    PIN_ARM_FAILED,
+    PIN_FAULT_PRESENT,
+    PIN_AREA_READY,
+    PIN_COUNT
+};
+
+static const char *pinNames[PIN_COUNT] = {"fullArmed", "partArmed", "exit", "entry",
+                                          "triggered", "armFailed", "faultPresent", "areaReady"};
+
+// Keypad text the firmware recognises, see texecom.h
+static const char *screenIdle = "\"  The Cooper's  ";
+static const char *screenArmedFull = "\"Area FULL ARMED ";
+static const char *screenArmedPart = "\"Part Armed      ";
+static const char *screenAreaInExit = "\"Area in Exit > 30";
+static const char *screenAreaInEntry = "\"Area in Entry 30";
+static const char *screenQuestionArm = "\"Do you want to  Arm System?";
+static const char *screenWelcomeBack = "\"  Welcome Back  ";
+
+static std::atomic<bool> running(true);
+
+struct Options {
+    std::string device;
+    std::string scenario = "steady";
+    double rate = 10;          // Frames per second
+    double step = 0;           // Ramp increment per stage
+    int stageSeconds = 10;
+    int duration = 0;          // Seconds, 0 runs until interrupted
+    int firstZone = 9;
+    int zoneCount = 11;
+    int syslogPort = 0;
+    std::string gpiochip;
+    std::vector<int> lines;
+    unsigned seed = 1;
+};
+
+class Pins {
+public:
+    bool open(const std::string &chip, const std::vector<int> &lines)
+    {
+        if (chip.empty())
+            return true;
+
+        if (lines.size() != PIN_COUNT)
+        {
+            fprintf(stderr, "--lines needs %d GPIO offsets\n", PIN_COUNT);
+            return false;
+        }
+
+        int chipFd = ::open(chip.c_str(), O_RDWR);
+        if (chipFd < 0)
+        {
+            perror(chip.c_str());
+            return false;
+        }
+
+        struct gpiohandle_request request = {};
+        for (int i = 0; i < PIN_COUNT; i++)
+        {
+            request.lineoffsets[i] = lines[i];
+            request.default_values[i] = values[i];
+        }
+        request.lines = PIN_COUNT;
+        request.flags = GPIOHANDLE_REQUEST_OUTPUT;
+        strcpy(request.consumer_label, "panelsim");
+
+        int result = ioctl(chipFd, GPIO_GET_LINEHANDLE_IOCTL, &request);
+        ::close(chipFd);
+        if (result < 0)
+        {
+            perror("GPIO_GET_LINEHANDLE_IOCTL");
+            return false;
+        }
+
+        fd = request.fd;
+        return true;
+    }
+
+    // active drives the output low, as the panel does
+    void set(int pin, bool active)
+    {
+        values[pin] = active ? 0 : 1;
+        printf("pin %s %s\n", pinNames[pin], active ? "active" : "inactive");
+
+        if (fd < 0)
+            return;
+
+        struct gpiohandle_data data = {};
+        for (int i = 0; i < PIN_COUNT; i++)
+            data.values[i] = values[i];
+        if (ioctl(fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0)
+            perror("GPIOHANDLE_SET_LINE_VALUES_IOCTL");
+    }
+
+    void clearArmState()
+    {
+        for (int pin : {PIN_FULL_ARMED, PIN_PART_ARMED, PIN_EXIT, PIN_ENTRY, PIN_TRIGGERED})
+            if (values[pin] == 0)
+                set(pin, false);
+    }
+
+private:
+    int fd = -1;
+    uint8_t values[PIN_COUNT] = {1, 1, 1, 1, 1, 1, 1, 0}; // Disarmed and ready
+};
+
+// Counts the frames sent and the ones the monitor logged back over syslog
+class Tally {
+public:
+    void sent(const std::string &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sentCount[frame]++;
+        totalSent++;
+    }
+
+    void logged(const std::string &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sentCount.find(frame);
+        if (it != sentCount.end() && loggedCount[frame] < it->second)
+        {
+            loggedCount[frame]++;
+            totalLogged++;
+        }
+    }
+
+    void snapshot(uint64_t *sent, uint64_t *logged)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        *sent = totalSent;
+        *logged = totalLogged;
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::string, uint64_t> sentCount;
+    std::map<std::string, uint64_t> loggedCount;
+    uint64_t totalSent = 0;
+    uint64_t totalLogged = 0;
+};
+
+static Tally tally;
+static bool trackSyslog = false;
+
+// The monitor logs each frame as its own syslog message, the text after
+// the RFC 5424 header is the frame itself
+static void syslogListener(int port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("syslog bind");
+        exit(1);
+    }
+
+    struct timeval timeout = {0, 200000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char packet[1024];
+    while (running)
+    {
+        ssize_t length = recv(fd, packet, sizeof(packet) - 1, 0);
+        if (length <= 0)
+            continue;
+        packet[length] = '\0';
+
+        // <pri>1 - mac app - - - message
+        char *message = packet;
+        for (int dashes = 0; *message != '\0' && dashes < 4; message++)
+        {
+            if (message[0] == '-' && message[1] == ' ')
+                dashes++;
+        }
+        if (*message == ' ')
+            message++;
+
+        size_t messageLength = strlen(message);
+        while (messageLength > 0 && (message[messageLength-1] == '\n' || message[messageLength-1] == '\r'))
+            message[--messageLength] = '\0';
+
+        if (message[0] == '"')
+            tally.logged(message);
+    }
+
+    close(fd);
+}
+
+class Panel {
+public:
+    Panel(int fd, Pins &pins, const Options &options) : fd(fd), pins(pins), options(options), random(options.seed) {}
+
+    void send(const std::string &frame)
+    {
+        std::string bytes = frame + "\r\n";
+        writeAll(bytes.data(), bytes.size());
+        if (trackSyslog)
+            tally.sent(frame);
+    }
+
+    // Bytes exactly as given, for malformed traffic
+    void sendRaw(const std::string &bytes)
+    {
+        writeAll(bytes.data(), bytes.size());
+    }
+
+    std::string zoneFrame(int zone, int state)
+    {
+        char frame[8];
+        snprintf(frame, sizeof(frame), "\"Z0%02d%d", zone % 100, state);
+        return frame;
+    }
+
+    std::string eventFrame(char type, int detail)
+    {
+        char frame[8];
+        snprintf(frame, sizeof(frame), "\"%c0%03d", type, detail % 1000);
+        return frame;
+    }
+
+    int randomZone()
+    {
+        return options.firstZone + random() % options.zoneCount;
+    }
+
+    // Zones toggle between healthy and active, now and then a tamper
+    std::string randomZoneFrame()
+    {
+        int zone = randomZone();
+        int state = random() % 20 == 0 ? 2 : (zoneActive[zone] ? 0 : 1);
+        zoneActive[zone] = state == 1;
+        return zoneFrame(zone, state);
+    }
+
+    std::string randomFrame()
+    {
+        switch (random() % 10)
+        {
+        case 0:
+            return eventFrame(random() % 2 ? 'U' : 'T', random() % 4 * 10);
+        case 1:
+            return random() % 2 ? screenIdle : screenWelcomeBack;
+        case 2:
+            return random() % 2 ? "\"N000" : "\"Y000";
+        default:
+            return randomZoneFrame();
+        }
+    }
+
+    std::string malformedFrame()
+    {
+        switch (random() % 5)
+        {
+        case 0: // Truncated, no CRLF, left for the firmware's message timeout
+            return "\"Z0";
+        case 1: // Longer than the firmware's 100 byte buffer
+            return std::string(140, 'X') + "\r\n";
+        case 2: // CR without LF
+            return "\"Z0111\r";
+        case 3: // Unknown command
+            return "\"Q0123\r\n";
+        default: // Line noise
+        {
+            std::string noise;
+            for (int i = 0; i < 12; i++)
+                noise += (char)(random() % 256);
+            return noise + "\r\n";
+        }
+        }
+    }
+
+    void sleepFor(double seconds)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+
+    // A user arms, full or part, the exit time runs out, they come back and disarm
+    void armingCycle(double exitSeconds)
+    {
+        int user = random() % 4;
+        send(eventFrame('U', user * 10));
+        send(screenWelcomeBack);
+        send(screenQuestionArm);
+        send(eventFrame('X', 1));
+        send(screenAreaInExit);
+        pins.set(PIN_EXIT, true);
+        sleepFor(exitSeconds);
+
+        bool part = random() % 2 == 0;
+        send(eventFrame('A', 1));
+        send(part ? screenArmedPart : screenArmedFull);
+        pins.set(PIN_EXIT, false);
+        pins.set(part ? PIN_PART_ARMED : PIN_FULL_ARMED, true);
+        sleepFor(exitSeconds);
+
+        send(zoneFrame(options.firstZone, 1));
+        send(eventFrame('E', 1));
+        send(screenAreaInEntry);
+        pins.set(PIN_ENTRY, true);
+        sleepFor(exitSeconds / 2);
+
+        send(eventFrame('U', user * 10));
+        send(eventFrame('D', 1));
+        send(screenIdle);
+        send(zoneFrame(options.firstZone, 0));
+        pins.clearArmState();
+        sleepFor(exitSeconds);
+    }
+
+private:
+    int fd;
+    Pins &pins;
+    const Options &options;
+    std::mt19937 random;
+    std::map<int, bool> zoneActive;
+
+    void writeAll(const char *data, size_t length)
+    {
+        while (length > 0 && running)
+        {
+            ssize_t written = write(fd, data, length);
+            if (written < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                {
+                    usleep(1000);
+                    continue;
+                }
+                perror("write");
+                running = false;
+                return;
+            }
+            data += written;
+            length -= written;
+        }
+    }
+};
+
+static int openDevice(const std::string &device)
+{
+    int fd;
+
+    if (device.empty())
+    {
+        fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0)
+        {
+            perror("posix_openpt");
+            return -1;
+        }
+        printf("Panel on %s\n", ptsname(fd));
+    }
+    else
+    {
+        fd = open(device.c_str(), O_RDWR | O_NOCTTY);
+        if (fd < 0)
+        {
+            perror(device.c_str());
+            return -1;
+        }
+    }
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) == 0)
+    {
+        cfmakeraw(&tty);
+        cfsetispeed(&tty, B19200);
+        cfsetospeed(&tty, B19200);
+        tty.c_cflag |= CSTOPB | CLOCAL | CREAD; // 8N2
+        tcsetattr(fd, TCSANOW, &tty);
+    }
+
+    return fd;
+}
+
+static void report(double seconds, double rate)
+{
+    if (!trackSyslog)
+        return;
+
+    uint64_t sent, logged;
+    tally.snapshot(&sent, &logged);
+    printf("%8.1fs rate %7.1f/s sent %8llu logged %8llu lost %6.2f%%\n",
+        seconds, rate, (unsigned long long)sent, (unsigned long long)logged,
+        sent > 0 ? 100.0 * (sent - logged) / sent : 0.0);
+    fflush(stdout);
+}
+
+// Sends frames from next() at rate per second until the stage ends
+static void paced(Panel &panel, double rate, double seconds, std::string (Panel::*next)())
+{
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration<double>(1.0 / rate);
+    auto due = start;
+
+    while (running)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (seconds > 0 && now - start >= std::chrono::duration<double>(seconds))
+            break;
+
+        if (now < due)
+        {
+            std::this_thread::sleep_until(due);
+            continue;
+        }
+
+        panel.send((panel.*next)());
+        due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: panelsim [options]\n"
+        "  --device PATH       serial device, a pty is created when omitted\n"
+        "  --scenario NAME     steady | storm | ramp | arming | malformed (steady)\n"
+        "  --rate N            frames per second, starting rate for ramp (10)\n"
+        "  --step N            ramp increment per stage (rate)\n"
+        "  --stage N           seconds per ramp stage (10)\n"
+        "  --duration N        seconds to run, 0 for ever (0)\n"
+        "  --zones FIRST,COUNT zone range the monitor watches (9,11)\n"
+        "  --syslog PORT       count frames the monitor logs back on this UDP port\n"
+        "  --gpiochip PATH     drive the digi outputs on this GPIO chip\n"
+        "  --lines A,B,...     eight line offsets, in DIGI_OUTPUT_PINS order\n"
+        "  --seed N            random seed (1)\n");
+}
+
+static std::vector<int> parseList(const char *text)
+{
+    std::vector<int> values;
+    for (const char *p = text; *p != '\0';)
+    {
+        values.push_back(atoi(p));
+        p = strchr(p, ',');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return values;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    static struct option longOptions[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"scenario", required_argument, NULL, 's'},
+        {"rate", required_argument, NULL, 'r'},
+        {"step", required_argument, NULL, 'p'},
+        {"stage", required_argument, NULL, 'g'},
+        {"duration", required_argument, NULL, 't'},
+        {"zones", required_argument, NULL, 'z'},
+        {"syslog", required_argument, NULL, 'l'},
+        {"gpiochip", required_argument, NULL, 'c'},
+        {"lines", required_argument, NULL, 'n'},
+        {"seed", required_argument, NULL, 'e'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'd': options.device = optarg; break;
+        case 's': options.scenario = optarg; break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'p': options.step = atof(optarg); break;
+        case 'g': options.stageSeconds = atoi(optarg); break;
+        case 't': options.duration = atoi(optarg); break;
+        case 'z':
+        {
+            std::vector<int> zones = parseList(optarg);
+            if (zones.size() == 2)
+            {
+                options.firstZone = zones[0];
+                options.zoneCount = zones[1];
+            }
+            break;
+        }
+        case 'l': options.syslogPort = atoi(optarg); break;
+        case 'c': options.gpiochip = optarg; break;
+        case 'n': options.lines = parseList(optarg); break;
+        case 'e': options.seed = strtoul(optarg, NULL, 10); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (options.rate <= 0 || options.zoneCount <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    signal(SIGINT, [](int) { running = false; });
+    signal(SIGTERM, [](int) { running = false; });
+
+    Pins pins;
+    if (!pins.open(options.gpiochip, options.lines))
+        return 1;
+
+    int fd = openDevice(options.device);
+    if (fd < 0)
+        return 1;
+
+    std::thread listener;
+    if (options.syslogPort > 0)
+    {
+        trackSyslog = true;
+        listener = std::thread(syslogListener, options.syslogPort);
+    }
+
+    Panel panel(fd, pins, options);
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+    auto finished = [&]() { return !running || (options.duration > 0 && elapsed() >= options.duration); };
+    double reportInterval = options.stageSeconds;
+
+    if (options.scenario == "steady" || options.scenario == "storm")
+    {
+        // A storm is every zone flapping as fast as the rate allows, with
+        // none of the other traffic in between
+        auto next = options.scenario == "storm" ? &Panel::randomZoneFrame : &Panel::randomFrame;
+        while (!finished())
+        {
+            paced(panel, options.rate, reportInterval, next);
+            report(elapsed(), options.rate);
+        }
+    }
+    else if (options.scenario == "ramp")
+    {
+        double step = options.step > 0 ? options.step : options.rate;
+        for (double rate = options.rate; !finished(); rate += step)
+        {
+            paced(panel, rate, options.stageSeconds, &Panel::randomZoneFrame);
+            // Let the last of the stage's syslog arrive before reporting
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            report(elapsed(), rate);
+        }
+    }
+    else if (options.scenario == "arming")
+    {
+        // Burst arming, the exit and entry times shrink with the rate
+        double exitSeconds = 10.0 / options.rate;
+        while (!finished())
+        {
+            panel.armingCycle(exitSeconds);
+            report(elapsed(), options.rate);
+        }
+    }
+    else if (options.scenario == "malformed")
+    {
+        // Bad frames mixed with good ones. A truncated frame can take the next
+        // good one with it, but the firmware should resync straight after
+        while (!finished())
+        {
+            for (int i = 0; i < options.rate && running; i++)
+            {
+                if (i % 2 == 0)
+                    panel.sendRaw(panel.malformedFrame());
+                else
+                    panel.send(panel.randomZoneFrame());
+                std::this_thread::sleep_for(std::chrono::duration<double>(1.0 / options.rate));
+            }
+            report(elapsed(), options.rate);
+        }
+    }
+    else
+    {
+        usage();
+        return 1;
+    }
+
+    running = false;
+    if (listener.joinable())
+        listener.join();
+
+    report(elapsed(), options.rate);
+    close(fd);
+    return 0;
+}